@@ -0,0 +1,89 @@
+#!/bin/bash
+set -eu
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_RANK" -eq 0 ]; then
+	if [ "$MPIH_SIZE" -lt 2 ]; then
+		echo "error: this MPI script must be run with at least 2 processes" >&2
+		exit 1
+	fi
+	if [ $# -lt 1 ]; then
+		echo "Usage: $(basename $0) <size> [<idle_secs>]" >&2
+		echo "Example: $(basename $0) 64M 2" >&2
+		echo >&2
+		echo "Compare memory use at 256 ranks per node with:" >&2
+		echo "   mpirun -np 256 --oversubscribe mpih run $(basename $0) 64M" >&2
+		echo "   mpirun -np 256 --oversubscribe mpih run --low-footprint $(basename $0) 64M" >&2
+		exit 1
+	fi
+fi
+
+size=$1; shift
+idle_secs=${1:-2}
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+daemon_pid=$(cat $MPIH_PIDFILE)
+
+# field of the daemon's /proc/<pid>/status (e.g. VmHWM in kB)
+daemon_status() {
+	awk -v field="$1:" '$1 == field {print $2}' /proc/$daemon_pid/status
+}
+
+test_data() {
+	dd if=/dev/zero count=1 bs=$size 2>/dev/null
+}
+
+#------------------------------------------------------------
+# benchmark
+#------------------------------------------------------------
+
+# Each rank streams <size> bytes to the next rank in a ring.
+# Before the data arrives, each receiving daemon waits on
+# an idle MPI request for <idle_secs> seconds; we count the
+# daemon's wakeups (context switches) in the meantime.
+dest_rank=$((($MPIH_RANK + 1) % $MPIH_SIZE))
+src_rank=$((($MPIH_RANK + $MPIH_SIZE - 1) % $MPIH_SIZE))
+
+mpih recv $src_rank >/dev/null &
+recv_pid=$!
+sleep 0.5
+switches_before=$(daemon_status voluntary_ctxt_switches)
+sleep $idle_secs
+switches_after=$(daemon_status voluntary_ctxt_switches)
+wakeups=$(( (switches_after - switches_before) / idle_secs ))
+
+test_data | mpih send $dest_rank
+wait $recv_pid
+
+# peak and current resident memory of our daemon (kB)
+stats="$MPIH_RANK $(daemon_status VmHWM) $(daemon_status VmRSS) $wakeups"
+
+if [ $MPIH_RANK -ne 0 ]; then
+	echo "$stats" | mpih send --tag 1 0
+	exit 0
+fi
+
+{
+	echo "$stats"
+	for ((rank = 1; rank < $MPIH_SIZE; ++rank)); do
+		mpih recv --tag 1 $rank
+	done
+} | awk -v ranks=$MPIH_SIZE '
+	{
+		hwm += $2; rss += $3; wakeups += $4
+		if ($2 > max_hwm) max_hwm = $2
+	}
+	END {
+		printf "ranks:                     %d\n", ranks
+		printf "mean daemon peak RSS:      %.0f kB\n", hwm / NR
+		printf "max daemon peak RSS:       %d kB\n", max_hwm
+		printf "mean daemon RSS at end:    %.0f kB\n", rss / NR
+		printf "total daemon peak RSS:     %.1f MB\n", hwm / 1024
+		printf "mean idle wakeups/sec:     %.0f\n", wakeups / NR
+	}'
@@ -0,0 +1,105 @@
+/*
+ * Measure the per-command overhead of the daemon, for text
+ * header lines and binary requests (see IO/BinaryHeader.h).
+ * Sends <iterations> RANK requests of each kind over one
+ * connection, waiting for each reply before the next:
+ *
+ *    mpirun -np 1 mpih run header-bench [<iterations>]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include "IO/BinaryHeader.h"
+#include "IO/SocketUtil.h"
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+
+static void write_all(int s, const char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(s, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void read_all(int s, char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(s, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "error: lost connection to daemon\n");
+			exit(EXIT_FAILURE);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** Average round trip of a text RANK request (microseconds) */
+static double bench_text(int s, long iterations)
+{
+	double start = now_us();
+	for (long i = 0; i < iterations; ++i) {
+		write_all(s, "RANK\n", 5);
+		// reply is "<rank>\n"
+		char c;
+		do
+			read_all(s, &c, 1);
+		while (c != '\n');
+	}
+	return (now_us() - start) / iterations;
+}
+
+/** Average round trip of a binary RANK request (microseconds) */
+static double bench_binary(int s, long iterations)
+{
+	BinaryRequest request;
+	request.opcode = OP_RANK;
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+
+	double start = now_us();
+	for (long i = 0; i < iterations; ++i) {
+		write_all(s, buf, sizeof(buf));
+		char reply[BINARY_REPLY_SIZE];
+		read_all(s, reply, sizeof(reply));
+	}
+	return (now_us() - start) / iterations;
+}
+
+int main(int argc, char** argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 100000;
+	const char* socketPath = getenv("MPIH_SOCKET");
+	if (socketPath == NULL || iterations <= 0) {
+		fprintf(stderr, "Usage: mpih run %s [<iterations>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int s = UnixSocket::connect(socketPath);
+	// warm up
+	bench_text(s, iterations / 10 + 1);
+	bench_binary(s, iterations / 10 + 1);
+
+	printf("iterations: %ld\n", iterations);
+	printf("text RANK: %.2f us/request\n", bench_text(s, iterations));
+	printf("binary RANK: %.2f us/request\n", bench_binary(s, iterations));
+	close(s);
+	return 0;
+}
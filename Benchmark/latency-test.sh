@@ -0,0 +1,59 @@
+#!/bin/bash
+set -eu
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_RANK" -eq 0 ]; then
+	if [ "$MPIH_SIZE" -ne 2 ]; then
+		echo "error: this MPI script must be run with exactly 2 processes" >&2
+		exit 1
+	fi
+	if [ $# -lt 1 ]; then
+		echo "Usage: $(basename $0) <iterations> [<size>]" >&2
+		echo "Example: $(basename $0) 100 1k" >&2
+		echo >&2
+		echo "Compare transports with:" >&2
+		echo "   mpirun -np 2 mpih run --transport p2p $(basename $0) 100" >&2
+		echo "   mpirun -np 2 mpih run --transport rma $(basename $0) 100" >&2
+		exit 1
+	fi
+fi
+
+iterations=$1; shift
+size=${1:-64}
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+test_data() {
+	dd if=/dev/zero count=1 bs=$size 2>/dev/null
+}
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+echo "rank $MPIH_RANK log: $MPIH_LOG"
+
+# ping-pong messages between ranks 0 and 1; each round
+# trip is two complete streams (connect, data, EOF)
+peer=$((1 - $MPIH_RANK))
+start=$(now_us)
+for i in $(seq $iterations); do
+	if [ $MPIH_RANK -eq 0 ]; then
+		test_data | mpih send $peer
+		mpih recv $peer >/dev/null
+	else
+		mpih recv $peer >/dev/null
+		test_data | mpih send $peer
+	fi
+done
+end=$(now_us)
+
+if [ $MPIH_RANK -eq 0 ]; then
+	echo "message size: $size bytes"
+	echo "avg round trip: $((($end - $start) / $iterations)) us"
+fi
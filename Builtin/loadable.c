@@ -0,0 +1,56 @@
+/*
+ * Glue between bash and the mpih builtin (see
+ * Builtin/mpih_builtin.cc). Load it into a shell with:
+ *
+ *    enable -f libmpih_builtin.so mpih
+ *
+ * after which 'mpih <command> ...' runs inside the shell
+ * instead of in a new process.
+ */
+#include "loadables.h"
+#include <stdlib.h>
+
+extern int mpih_builtin_main(int argc, char** argv);
+
+int mpih_builtin(WORD_LIST* list)
+{
+	int argc = 1;
+	WORD_LIST* l;
+	for (l = list; l != NULL; l = l->next)
+		++argc;
+
+	char** argv = (char**)malloc((argc + 1) * sizeof(char*));
+	if (argv == NULL) {
+		builtin_error("out of memory");
+		return EXECUTION_FAILURE;
+	}
+	argv[0] = (char*)"mpih";
+	int i = 1;
+	for (l = list; l != NULL; l = l->next)
+		argv[i++] = l->word->word;
+	argv[argc] = NULL;
+
+	int status = mpih_builtin_main(argc, argv);
+	free(argv);
+	return status;
+}
+
+char* mpih_doc[] = {
+	"Run an mpih command inside the shell.",
+	"",
+	"Takes the same arguments as the mpih executable. 'rank' and",
+	"'size' are answered from a cache, and plain 'send <rank>' and",
+	"'recv <rank>' (with an optional --tag) go over one daemon",
+	"connection that the shell keeps open. Other commands run in",
+	"a forked copy of the shell, without executing mpih.",
+	(char*)NULL
+};
+
+struct builtin mpih_struct = {
+	"mpih",
+	mpih_builtin,
+	BUILTIN_ENABLED,
+	mpih_doc,
+	"mpih [options] <command> [args]",
+	0
+};
@@ -0,0 +1,332 @@
+/*
+ * The mpih bash builtin (see Builtin/loadable.c).
+ *
+ * In 'mpih run' scripts, every 'mpih' call normally forks
+ * and executes the mpih binary, and connects to the daemon
+ * from scratch. The builtin instead answers the common
+ * calls inside the shell:
+ *
+ *    mpih rank, mpih size       cached after the first query
+ *    mpih send [-t N] <rank>    one stream each, over a
+ *    mpih recv [-t N] <rank>    multiplexed daemon connection
+ *                               that the shell keeps open
+ *
+ * Everything else runs the regular command in a forked copy
+ * of the shell (which still saves executing mpih). Unlike
+ * the commands, the in-shell paths must never exit().
+ */
+#include "config.h"
+#include "Command/commands.h"
+#include "Command/client/mux.h"
+#include "IO/BinaryHeader.h"
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+namespace builtin {
+
+	/** multiplexed daemon connection (NULL until needed) */
+	static MuxClient* mux = NULL;
+	/** process that opened 'mux' (subshells need their own) */
+	static pid_t muxOwner = -1;
+	/** daemon socket that 'mux', 'rank' and 'size' belong to */
+	static std::string socketPath;
+	/** cached replies to RANK and SIZE (-1 if not known yet) */
+	static int rank = -1;
+	static int size = -1;
+
+}
+
+/** Current daemon socket, from the environment */
+static std::string builtin_socket_path()
+{
+	const char* path = getenv(MPIH_SOCKET);
+	return path != NULL ? path : "";
+}
+
+/** Forget the daemon connection and cached replies */
+static void builtin_reset(const std::string& socketPath)
+{
+	// (in a subshell, this only closes our copy of the socket)
+	delete builtin::mux;
+	builtin::mux = NULL;
+	builtin::muxOwner = -1;
+	builtin::rank = builtin::size = -1;
+	builtin::socketPath = socketPath;
+}
+
+/** Multiplexed connection to the daemon, or NULL on error */
+static MuxClient* builtin_mux(const std::string& socketPath)
+{
+	if (socketPath != builtin::socketPath ||
+		builtin::muxOwner != getpid())
+		builtin_reset(socketPath);
+	if (builtin::mux == NULL) {
+		MuxClient* mux = new MuxClient();
+		if (!mux->connect(socketPath)) {
+			delete mux;
+			return NULL;
+		}
+		builtin::mux = mux;
+		builtin::muxOwner = getpid();
+	}
+	return builtin::mux;
+}
+
+/** Ask the daemon for a value (RANK/SIZE) over a new connection */
+static bool builtin_query(const std::string& socketPath,
+	HeaderOpcode opcode, int& value)
+{
+	struct sockaddr_un remote;
+	if (socketPath.size() >= sizeof(remote.sun_path))
+		return false;
+	int s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (s < 0) {
+		perror("socket");
+		return false;
+	}
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	strcpy(remote.sun_path, socketPath.c_str());
+
+	BinaryRequest request;
+	request.opcode = opcode;
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+
+	char reply[BINARY_REPLY_SIZE];
+	size_t len = 0;
+	bool ok = connect(s, (struct sockaddr*)&remote, sizeof(remote)) == 0 &&
+		write(s, buf, sizeof(buf)) == (ssize_t)sizeof(buf);
+	while (ok && len < sizeof(reply)) {
+		ssize_t n = read(s, reply + len, sizeof(reply) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		ok = n > 0;
+		len += ok ? n : 0;
+	}
+	close(s);
+
+	HeaderReply code;
+	int32_t result;
+	if (!ok || !decode_binary_reply(reply, code, result) ||
+		code != REPLY_VALUE) {
+		fprintf(stderr, "mpih: error querying daemon\n");
+		return false;
+	}
+	value = result;
+	return true;
+}
+
+/**
+ * Parse 'send|recv [-t N|--tag N|--tag=N] <rank>'.
+ * @return false for anything else (e.g. other options)
+ */
+static bool builtin_stream_args(int argc, char** argv, int& rank,
+	int& tag)
+{
+	tag = 0;
+	int i = 2;
+	for (; i < argc - 1; i += 2) {
+		std::string option = argv[i];
+		std::istringstream value;
+		if (option.compare(0, 6, "--tag=") == 0) {
+			value.str(option.substr(6));
+			--i;
+		} else if (option == "-t" || option == "--tag") {
+			value.str(argv[i + 1]);
+		} else {
+			return false;
+		}
+		value >> tag;
+		if (value.fail() || !value.eof())
+			return false;
+	}
+	if (i != argc - 1)
+		return false;
+	std::istringstream value(argv[i]);
+	value >> rank;
+	return !value.fail() && value.eof();
+}
+
+/** Handle frames that the daemon has already sent, without blocking */
+static bool builtin_poll(MuxClient& mux, int socket)
+{
+	struct pollfd pfd = { socket, POLLIN, 0 };
+	while (poll(&pfd, 1, 0) > 0)
+		if (!mux.readFrame())
+			return false;
+	return true;
+}
+
+/** 'mpih send': stream STDIN to 'rank' over the shell's connection */
+static int builtin_send(const std::string& socketPath, int rank, int tag)
+{
+	MuxClient* mux = builtin_mux(socketPath);
+	if (mux == NULL)
+		return EXIT_FAILURE;
+
+	std::ostringstream header;
+	header << "SEND " << rank;
+	if (tag != 0)
+		header << " TAG " << tag;
+	uint32_t id = mux->open(header.str());
+
+	std::vector<char> buf(MUX_MAX_PAYLOAD);
+	bool ok = id != 0;
+	while (ok) {
+		ssize_t n = read(STDIN_FILENO, buf.data(), buf.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			perror("mpih send");
+		if (n <= 0) {
+			ok = n == 0 && mux->end(id);
+			break;
+		}
+		ok = mux->write(id, buf.data(), n);
+	}
+
+	/*
+	 * Like 'mpih send', we don't wait for the daemon to finish
+	 * the stream; its END arrives later, along with credit
+	 * for other streams, and the stream is released then.
+	 */
+	if (ok)
+		mux->detach(id);
+	if (!ok || !builtin_poll(*mux, mux->fd())) {
+		builtin_reset(socketPath);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/** 'mpih recv': stream data from 'rank' to STDOUT */
+static int builtin_recv(const std::string& socketPath, int rank, int tag)
+{
+	MuxClient* mux = builtin_mux(socketPath);
+	if (mux == NULL)
+		return EXIT_FAILURE;
+
+	std::ostringstream header;
+	header << "RECV " << rank;
+	if (tag != 0)
+		header << " TAG " << tag;
+	uint32_t id = mux->open(header.str());
+	bool ok = id != 0;
+	if (ok)
+		mux->setOutput(id, STDOUT_FILENO);
+	while (ok && !mux->ended(id))
+		ok = mux->readFrame();
+	if (!ok) {
+		builtin_reset(socketPath);
+		return EXIT_FAILURE;
+	}
+	mux->release(id);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Leave a forked copy of the shell: flush our output, but
+ * skip the shell's exit handlers and static destructors,
+ * which belong to the parent shell (also called by exit(),
+ * through on_exit())
+ */
+static void child_exit(int status, void*)
+{
+	fflush(NULL);
+	_exit(status);
+}
+
+/**
+ * Run the regular command in a forked copy of the shell,
+ * where it may exit() as it pleases.
+ */
+static int builtin_fork(int argc, char** argv)
+{
+	fflush(stdout);
+	fflush(stderr);
+
+	// keep the shell from reaping our child before we do
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &old);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		return EXIT_FAILURE;
+	}
+	if (pid == 0) {
+		// undo the shell's signal handling, as exec would
+		static const int SIGNALS[] = { SIGINT, SIGQUIT, SIGTERM,
+			SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+		for (size_t i = 0; i < ARRAY_SIZE(SIGNALS); ++i)
+			signal(SIGNALS[i], SIG_DFL);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		optind = 0;
+		on_exit(child_exit, NULL);
+		child_exit(mpih_main(argc, argv), NULL);
+	}
+
+	int status;
+	pid_t result;
+	while ((result = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	if (result < 0) {
+		perror("waitpid");
+		return EXIT_FAILURE;
+	}
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+extern "C" int mpih_builtin_main(int argc, char** argv)
+{
+	std::string socketPath = builtin_socket_path();
+	std::string command = argc > 1 ? argv[1] : "";
+
+	if (socketPath.empty())
+		return builtin_fork(argc, argv);
+	if (socketPath != builtin::socketPath)
+		builtin_reset(socketPath);
+
+	int* cached = command == "rank" ? &builtin::rank :
+		command == "size" ? &builtin::size : NULL;
+	if (cached != NULL && argc == 2) {
+		if (*cached < 0 && !builtin_query(socketPath,
+			command == "rank" ? OP_RANK : OP_SIZE, *cached))
+			return EXIT_FAILURE;
+		printf("%d\n", *cached);
+		fflush(stdout);
+		return EXIT_SUCCESS;
+	}
+
+	// (leave bad ranks to the regular commands to report)
+	int rank, tag;
+	if ((command == "send" || command == "recv") &&
+		builtin_stream_args(argc, argv, rank, tag) && rank >= 0 &&
+		(builtin::size >= 0 || builtin_query(socketPath, OP_SIZE,
+			builtin::size)) && rank < builtin::size) {
+		fflush(stdout);
+		return command == "send" ?
+			builtin_send(socketPath, rank, tag) :
+			builtin_recv(socketPath, rank, tag);
+	}
+
+	return builtin_fork(argc, argv);
+}
@@ -0,0 +1,187 @@
+#ifndef _CLIENT_FD_COPIER_H_
+#define _CLIENT_FD_COPIER_H_
+
+#include <algorithm>
+#include <vector>
+#include <cassert>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+/** Max bytes moved by a single FdCopier::copy() */
+static const size_t FD_COPY_SIZE = 1 * 1024 * 1024;
+
+/**
+ * Moves data from one file descriptor to another, without
+ * copying it through user space where the kernel lets us:
+ *
+ * - sendfile() from a regular file
+ * - splice() to or from a pipe
+ * - splice() through a private pipe, from a socket to a
+ *   regular file
+ * - read()/write() for anything else (e.g. terminals)
+ *
+ * 'out' may be non-blocking (pipes are always treated as
+ * non-blocking when they are the output): copy() then holds
+ * on to data that couldn't be written yet, and returns
+ * EAGAIN until it has been.
+ */
+class FdCopier
+{
+public:
+
+	enum Method {
+		READ_WRITE = 0,
+		SENDFILE,
+		SPLICE,
+		SPLICE_VIA_PIPE
+	};
+
+	FdCopier(int in, int out) :
+		m_in(in), m_out(out), m_spliceFlags(SPLICE_F_MOVE),
+		m_pending(0), m_offset(0)
+	{
+		m_pipe[0] = m_pipe[1] = -1;
+		m_method = chooseMethod(in, out);
+		/* don't block on a full output pipe (or our own pipe) */
+		struct stat st;
+		if (m_method == SPLICE_VIA_PIPE ||
+			(fstat(out, &st) == 0 && S_ISFIFO(st.st_mode)))
+			m_spliceFlags |= SPLICE_F_NONBLOCK;
+		if (m_method == SPLICE_VIA_PIPE &&
+			pipe2(m_pipe, O_CLOEXEC) < 0)
+			m_method = READ_WRITE;
+		if (m_method == SPLICE_VIA_PIPE)
+			fcntl(m_pipe[1], F_SETPIPE_SZ, FD_COPY_SIZE);
+	}
+
+	~FdCopier()
+	{
+		if (m_pipe[0] >= 0)
+			close(m_pipe[0]);
+		if (m_pipe[1] >= 0)
+			close(m_pipe[1]);
+	}
+
+	Method method() const
+	{
+		return m_method;
+	}
+
+	/**
+	 * Move up to 'len' bytes from 'in' to 'out'.
+	 *
+	 * @return bytes moved; 0 at EOF of 'in' (once all data
+	 * has been written); or -1 with errno set (EAGAIN if
+	 * 'out' is full, or 'in' has nothing to read)
+	 */
+	ssize_t copy(size_t len = FD_COPY_SIZE)
+	{
+		/* finish writing data from an earlier call first */
+		if (m_pending > 0)
+			return flush();
+
+		ssize_t n = -1;
+		switch (m_method) {
+		  case SENDFILE:
+			n = sendfile(m_out, m_in, NULL, len);
+			break;
+		  case SPLICE:
+			n = splice(m_in, NULL, m_out, NULL, len, m_spliceFlags);
+			break;
+		  case SPLICE_VIA_PIPE:
+			n = splice(m_in, NULL, m_pipe[1], NULL, len, m_spliceFlags);
+			if (n > 0) {
+				m_pending = n;
+				return flush();
+			}
+			break;
+		  case READ_WRITE:
+			if (m_buffer.empty())
+				m_buffer.resize(FD_COPY_SIZE);
+			n = read(m_in, &m_buffer[0],
+				std::min(len, m_buffer.size()));
+			if (n > 0) {
+				m_pending = n;
+				m_offset = 0;
+				return flush();
+			}
+			break;
+		}
+
+		/* not supported for this pair of files after all */
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+			m_method != READ_WRITE) {
+			m_method = READ_WRITE;
+			return copy(len);
+		}
+		return n;
+	}
+
+private:
+
+	static Method chooseMethod(int in, int out)
+	{
+		struct stat inStat, outStat;
+		if (fstat(in, &inStat) < 0 || fstat(out, &outStat) < 0)
+			return READ_WRITE;
+		if (S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode))
+			return SPLICE;
+		if (S_ISREG(inStat.st_mode))
+			return SENDFILE;
+		if (S_ISSOCK(inStat.st_mode) && S_ISREG(outStat.st_mode))
+			return SPLICE_VIA_PIPE;
+		return READ_WRITE;
+	}
+
+	/**
+	 * Write out data that has been read but not written.
+	 *
+	 * @return bytes written, or -1 with errno set
+	 */
+	ssize_t flush()
+	{
+		size_t total = 0;
+		while (m_pending > 0) {
+			ssize_t n;
+			if (m_method == SPLICE_VIA_PIPE)
+				n = splice(m_pipe[0], NULL, m_out, NULL, m_pending,
+					m_spliceFlags);
+			else
+				n = write(m_out, &m_buffer[m_offset], m_pending);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				if (total > 0 && errno == EAGAIN)
+					break;
+				return -1;
+			}
+			m_pending -= n;
+			m_offset += n;
+			total += n;
+		}
+		return total;
+	}
+
+	/* disable copy constructor and assignment operator */
+	FdCopier(const FdCopier&);
+	void operator=(const FdCopier&);
+
+	int m_in;
+	int m_out;
+	Method m_method;
+	/** flags for splice() */
+	unsigned m_spliceFlags;
+	/** private pipe for SPLICE_VIA_PIPE */
+	int m_pipe[2];
+	/** buffer for READ_WRITE */
+	std::vector<char> m_buffer;
+	/** bytes read (or spliced into m_pipe) but not written */
+	size_t m_pending;
+	/** position of pending data in m_buffer */
+	size_t m_offset;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _CLIENT_BATCH_H_
+#define _CLIENT_BATCH_H_
+
+#include <string>
+#include <sstream>
+#include <cerrno>
+#include <cstdint>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * 'mpih send-batch' sends many files over a single stream
+ * per destination rank. Each file is framed as a header
+ * line followed by the file data:
+ *
+ *    <size> <name>\n
+ *    <size bytes of data>
+ *
+ * and 'mpih recv-batch' splits the stream back into files.
+ * The stream ends after the last file.
+ */
+
+/** max length of a frame header line, including newline (bytes) */
+static const size_t BATCH_MAX_HEADER_SIZE = 4096;
+
+/** Build the frame header for a file of 'size' bytes */
+static inline std::string batch_header(uint64_t size,
+	const std::string& name)
+{
+	std::ostringstream header;
+	header << size << ' ' << name << '\n';
+	return header.str();
+}
+
+/**
+ * Return true if 'name' is safe to create under the
+ * output directory of 'mpih recv-batch': a relative path
+ * without '..' components, newlines or NULs.
+ */
+static inline bool valid_batch_name(const std::string& name)
+{
+	if (name.empty() || name[0] == '/' ||
+		name.find_first_of(std::string("\n\0", 2)) != std::string::npos)
+		return false;
+	std::istringstream components(name);
+	std::string component;
+	while (std::getline(components, component, '/'))
+		if (component == "..")
+			return false;
+	return name[name.size() - 1] != '/';
+}
+
+/**
+ * Create the directories leading up to 'path' (like
+ * 'mkdir -p $(dirname path)').
+ *
+ * @return false on error (with errno set)
+ */
+static inline bool make_parent_dirs(const std::string& path)
+{
+	for (size_t pos = path.find('/', 1); pos != std::string::npos;
+		pos = path.find('/', pos + 1)) {
+		std::string dir = path.substr(0, pos);
+		if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST)
+			return false;
+	}
+	return true;
+}
+
+#endif
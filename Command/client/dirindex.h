@@ -0,0 +1,315 @@
+#ifndef _CLIENT_DIRINDEX_H_
+#define _CLIENT_DIRINDEX_H_
+
+#include "Command/client/batch.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * 'mpih send-dir' sends a directory tree as one stream
+ * (lane 0) plus, for large files, up to MAX_STRIPES - 1
+ * striped streams (lanes 1..N-1) on the same tag:
+ *
+ *    lane 0:    <index length: u64> <index> <packed data>
+ *    lane 1..:  one stream per chunk of a large file
+ *
+ * The index lists every directory, file and symlink of the
+ * tree, parents before children. The packed data is the
+ * contents of all small files, back to back, in index
+ * order. Large files are split into DIR_CHUNK_SIZE chunks,
+ * dealt out to lanes 1..N-1 in index order, and each chunk
+ * is written by the receiver's daemon at its own offset.
+ * Both sides work out the same lane assignment from the
+ * index, so the chunks need no framing of their own.
+ *
+ * All integers in the index are little-endian:
+ *
+ *    "MPIHDIR1" <lanes: u32> <entries: u32> <entry>...
+ *
+ *    entry:  <type: u8> <mode: u32> <size: u64>
+ *            <mtime sec: i64> <mtime nsec: u32>
+ *            <name length: u16> <name>
+ *            [<target length: u16> <target>]  (symlinks)
+ */
+
+/** first bytes of a directory index */
+static const char DIR_INDEX_MAGIC[] = "MPIHDIR1";
+
+/** files at least this big are sent in chunks (bytes) */
+static const uint64_t DIR_LARGE_FILE_SIZE = 4 * 1024 * 1024;
+
+/** size of the chunks of a large file (bytes) */
+static const uint64_t DIR_CHUNK_SIZE = 16 * 1024 * 1024;
+
+/** max size of an encoded index that we accept (bytes) */
+static const uint64_t DIR_MAX_INDEX_SIZE = 1024 * 1024 * 1024;
+
+enum DirEntryType {
+	DIR_ENTRY_DIR = 'd',
+	DIR_ENTRY_FILE = 'f',
+	DIR_ENTRY_LINK = 'l'
+};
+
+/** A directory, file or symlink of the tree */
+struct DirEntry
+{
+	/** one of DirEntryType */
+	char type;
+	/** permission bits */
+	uint32_t mode;
+	/** size of a file (0 otherwise) */
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	/** path relative to the top of the tree */
+	std::string name;
+	/** target of a symlink */
+	std::string target;
+
+	DirEntry() : type(DIR_ENTRY_FILE), mode(0), size(0),
+		mtime_sec(0), mtime_nsec(0) {}
+};
+
+struct DirIndex
+{
+	/** number of streams the transfer uses (1..MAX_STRIPES) */
+	uint32_t lanes;
+	std::vector<DirEntry> entries;
+
+	DirIndex() : lanes(1) {}
+};
+
+/** Part of a large file that goes over one lane */
+struct DirChunk
+{
+	/** position of the file in DirIndex::entries */
+	size_t entry;
+	uint64_t offset;
+	uint64_t length;
+};
+
+/**
+ * Return true if the data of file 'entry' goes in the
+ * packed data of lane 0, rather than in chunks.
+ */
+static inline bool dir_entry_packed(const DirIndex& index,
+	const DirEntry& entry)
+{
+	return entry.type == DIR_ENTRY_FILE &&
+		(index.lanes < 2 || entry.size < DIR_LARGE_FILE_SIZE);
+}
+
+/**
+ * Deal out the chunks of the large files to lanes 1..N-1,
+ * in index order.
+ *
+ * @return the chunks of each lane (none for lane 0)
+ */
+static inline std::vector<std::vector<DirChunk> >
+dir_chunks(const DirIndex& index)
+{
+	std::vector<std::vector<DirChunk> > lanes(index.lanes);
+	size_t next = 0;
+	for (size_t i = 0; i < index.entries.size(); ++i) {
+		const DirEntry& entry = index.entries[i];
+		if (entry.type != DIR_ENTRY_FILE || dir_entry_packed(index, entry))
+			continue;
+		for (uint64_t offset = 0; offset < entry.size;
+			offset += DIR_CHUNK_SIZE) {
+			DirChunk chunk;
+			chunk.entry = i;
+			chunk.offset = offset;
+			chunk.length = std::min(DIR_CHUNK_SIZE, entry.size - offset);
+			lanes[1 + next++ % (index.lanes - 1)].push_back(chunk);
+		}
+	}
+	return lanes;
+}
+
+static inline void put_le(std::string& out, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		out += (char)(value >> (8 * i));
+}
+
+/** Encode 'index' for sending (see above) */
+static inline std::string encode_dir_index(const DirIndex& index)
+{
+	std::string out(DIR_INDEX_MAGIC, sizeof(DIR_INDEX_MAGIC) - 1);
+	put_le(out, index.lanes, 4);
+	put_le(out, index.entries.size(), 4);
+	for (size_t i = 0; i < index.entries.size(); ++i) {
+		const DirEntry& entry = index.entries[i];
+		put_le(out, (unsigned char)entry.type, 1);
+		put_le(out, entry.mode, 4);
+		put_le(out, entry.size, 8);
+		put_le(out, entry.mtime_sec, 8);
+		put_le(out, entry.mtime_nsec, 4);
+		put_le(out, entry.name.size(), 2);
+		out += entry.name;
+		if (entry.type == DIR_ENTRY_LINK) {
+			put_le(out, entry.target.size(), 2);
+			out += entry.target;
+		}
+	}
+	return out;
+}
+
+/** Reads the fields of an encoded index */
+class DirIndexDecoder
+{
+public:
+
+	DirIndexDecoder(const std::string& data, size_t pos = 0) :
+		m_data(data), m_pos(pos) {}
+
+	/** @return false if there are fewer than 'bytes' bytes left */
+	bool get(uint64_t& value, int bytes)
+	{
+		if (m_data.size() - m_pos < (size_t)bytes)
+			return false;
+		value = 0;
+		for (int i = 0; i < bytes; ++i)
+			value |= (uint64_t)(unsigned char)m_data[m_pos++] << (8 * i);
+		return true;
+	}
+
+	/** Read a string preceded by its u16 length */
+	bool get(std::string& value)
+	{
+		uint64_t len;
+		if (!get(len, 2) || m_data.size() - m_pos < len)
+			return false;
+		value.assign(m_data, m_pos, len);
+		m_pos += len;
+		return true;
+	}
+
+	bool done() const
+	{
+		return m_pos == m_data.size();
+	}
+
+private:
+
+	const std::string& m_data;
+	size_t m_pos;
+};
+
+/**
+ * Decode an index built by encode_dir_index(), checking
+ * that each entry is safe to create under the output
+ * directory.
+ *
+ * @return false if 'data' is not a valid index
+ */
+static inline bool decode_dir_index(const std::string& data,
+	DirIndex& index, size_t maxLanes)
+{
+	size_t magicSize = sizeof(DIR_INDEX_MAGIC) - 1;
+	if (data.compare(0, magicSize, DIR_INDEX_MAGIC) != 0)
+		return false;
+	DirIndexDecoder decoder(data, magicSize);
+	uint64_t lanes, count;
+	if (!decoder.get(lanes, 4) || !decoder.get(count, 4) ||
+		lanes < 1 || lanes > maxLanes)
+		return false;
+	index.lanes = lanes;
+	index.entries.clear();
+	for (uint64_t i = 0; i < count; ++i) {
+		DirEntry entry;
+		uint64_t type, mode, sec, nsec;
+		if (!decoder.get(type, 1) || !decoder.get(mode, 4) ||
+			!decoder.get(entry.size, 8) || !decoder.get(sec, 8) ||
+			!decoder.get(nsec, 4) || !decoder.get(entry.name))
+			return false;
+		if (type != DIR_ENTRY_DIR && type != DIR_ENTRY_FILE &&
+			type != DIR_ENTRY_LINK)
+			return false;
+		entry.type = type;
+		entry.mode = mode & 07777;
+		entry.mtime_sec = sec;
+		entry.mtime_nsec = nsec;
+		if (entry.type == DIR_ENTRY_LINK && !decoder.get(entry.target))
+			return false;
+		if (entry.type != DIR_ENTRY_FILE)
+			entry.size = 0;
+		if (!valid_batch_name(entry.name))
+			return false;
+		index.entries.push_back(entry);
+	}
+	return decoder.done();
+}
+
+/**
+ * Add the contents of directory 'top'/'dir' to 'index',
+ * parents before children, in name order. Anything other
+ * than directories, regular files and symlinks is skipped.
+ *
+ * @return false on error (with errno set)
+ */
+static inline bool walk_dir(const std::string& top, const std::string& dir,
+	DirIndex& index)
+{
+	std::string path = dir.empty() ? top : top + "/" + dir;
+	DIR* d = opendir(path.c_str());
+	if (d == NULL)
+		return false;
+	std::vector<std::string> names;
+	for (struct dirent* ent; (ent = readdir(d)) != NULL;) {
+		if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+			names.push_back(ent->d_name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	for (size_t i = 0; i < names.size(); ++i) {
+		DirEntry entry;
+		entry.name = dir.empty() ? names[i] : dir + "/" + names[i];
+		std::string entryPath = top + "/" + entry.name;
+		struct stat st;
+		if (lstat(entryPath.c_str(), &st) < 0)
+			return false;
+		entry.mode = st.st_mode & 07777;
+		entry.mtime_sec = st.st_mtim.tv_sec;
+		entry.mtime_nsec = st.st_mtim.tv_nsec;
+		if (S_ISDIR(st.st_mode)) {
+			entry.type = DIR_ENTRY_DIR;
+		} else if (S_ISREG(st.st_mode)) {
+			entry.type = DIR_ENTRY_FILE;
+			entry.size = st.st_size;
+		} else if (S_ISLNK(st.st_mode)) {
+			entry.type = DIR_ENTRY_LINK;
+			std::vector<char> target(st.st_size + 1);
+			ssize_t n = readlink(entryPath.c_str(), &target[0],
+				target.size());
+			if (n < 0)
+				return false;
+			entry.target.assign(&target[0], n);
+		} else {
+			fprintf(stderr, "warning: skipping `%s' (not a file, "
+				"directory or symlink)\n", entryPath.c_str());
+			continue;
+		}
+		if (entry.name.size() > UINT16_MAX ||
+			entry.target.size() > UINT16_MAX) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		index.entries.push_back(entry);
+		if (entry.type == DIR_ENTRY_DIR &&
+			!walk_dir(top, entry.name, index))
+			return false;
+	}
+	return true;
+}
+
+#endif
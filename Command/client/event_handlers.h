@@ -1,11 +1,23 @@
 #ifndef _CLIENT_EVENT_HANDLERS_H_
 #define _CLIENT_EVENT_HANDLERS_H_
 
+#include "IO/BinaryHeader.h"
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <cassert>
 
+/** Queue a binary request for 'opcode' (see IO/BinaryHeader.h) */
+static inline void
+send_binary_request(struct bufferevent* bev, HeaderOpcode opcode)
+{
+	BinaryRequest request;
+	request.opcode = opcode;
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+	evbuffer_add(bufferevent_get_output(bev), buf, sizeof(buf));
+}
+
 static inline void
 client_read_handler(struct bufferevent *bev, void *arg)
 {
@@ -42,6 +54,27 @@ integer_read_handler(struct bufferevent *bev, void *arg)
 	struct event_base *base = bufferevent_get_base(bev);
 	struct evbuffer* input = bufferevent_get_input(bev);
 
+	// reply to a binary request
+	unsigned char first;
+	if (evbuffer_copyout(input, &first, 1) == 1 &&
+		first == BINARY_HEADER_MAGIC) {
+		char reply[BINARY_REPLY_SIZE];
+		if (evbuffer_get_length(input) < sizeof(reply))
+			return;
+		evbuffer_remove(input, reply, sizeof(reply));
+		HeaderReply code;
+		int32_t value;
+		decode_binary_reply(reply, code, value);
+		if (code != REPLY_VALUE) {
+			fprintf(stderr, "error: expected integer response "
+				"but received reply code %d\n", code);
+			exit(EXIT_FAILURE);
+		}
+		returnVal = value;
+		event_base_loopexit(base, NULL);
+		return;
+	}
+
 	size_t origLen = evbuffer_get_length(input);
 	char* line = evbuffer_readln(input, NULL, EVBUFFER_EOL_LF);
 
@@ -0,0 +1,146 @@
+#ifndef _CLIENT_HANDOFF_H_
+#define _CLIENT_HANDOFF_H_
+
+#include "Options/CommonOptions.h"
+#include "IO/SocketUtil.h"
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace opt {
+	/**
+	 * -S,--via-socket: stream data through the daemon
+	 * socket, rather than handing our input/output file
+	 * descriptor to the daemon
+	 */
+	static int viaSocket;
+}
+
+/**
+ * Return true if the daemon can do I/O on 'fd' directly.
+ * We only offer regular files and pipes: a terminal
+ * belongs to our session rather than the daemon's, and
+ * the daemon would have to make a socket non-blocking
+ * for everyone that shares it.
+ */
+static inline bool can_hand_off(int fd)
+{
+	if (opt::viaSocket)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return false;
+	return S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode);
+}
+
+/** Write all of 'data' to blocking socket 's' (or die) */
+static inline void write_all(int s, const std::string& data)
+{
+	size_t pos = 0;
+	while (pos < data.size()) {
+		ssize_t n = write(s, data.data() + pos, data.size() - pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		pos += n;
+	}
+}
+
+/** Read a newline-terminated reply from the daemon (or die) */
+static inline std::string read_reply(int s)
+{
+	const size_t MAX_LINE_SIZE = 256;
+	std::string line;
+	char c;
+	while (line.size() < MAX_LINE_SIZE) {
+		ssize_t n = read(s, &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "error: lost connection to daemon\n");
+			exit(EXIT_FAILURE);
+		}
+		if (c == '\n')
+			return line;
+		line += c;
+	}
+	fprintf(stderr, "response line exceeded max length "
+		"(%lu bytes)\n", MAX_LINE_SIZE);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Send a SEND/RECV 'header' (without its trailing newline)
+ * with header option 'option' appended, offering to hand
+ * the 'count' descriptors in 'fds' to the daemon. The
+ * daemon answers 'option' to accept, then "OK" once it has
+ * the descriptors, or "NO<option>" to refuse.
+ *
+ * @return true if the daemon took the descriptors; false
+ * if the data must go through the socket (the header has
+ * been sent either way)
+ */
+static inline bool offer_fds(int s, const std::string& header,
+	const std::string& option, const int* fds, int count)
+{
+	write_all(s, header + " " + option + "\n");
+
+	std::string reply = read_reply(s);
+	if (reply == option) {
+		if (!UnixSocket::send_fds(s, fds, count)) {
+			perror("sendmsg");
+			exit(EXIT_FAILURE);
+		}
+		reply = read_reply(s);
+	}
+	if (reply == "OK")
+		return true;
+	if (reply != "NO" + option) {
+		fprintf(stderr, "error: unexpected response from daemon: "
+			"'%s'\n", reply.c_str());
+		exit(EXIT_FAILURE);
+	}
+	return false;
+}
+
+/**
+ * Offer to hand over 'fd', so that the daemon can
+ * read/write the stream data itself, rather than us
+ * copying it through the socket (see offer_fds()).
+ */
+static inline bool hand_off_fd(int s, const std::string& header, int fd)
+{
+	if (offer_fds(s, header, "FD", &fd, 1))
+		return true;
+	if (opt::verbose)
+		fprintf(stderr, "daemon can't use our file descriptor; "
+			"streaming through socket\n");
+	return false;
+}
+
+/**
+ * Block until the daemon closes the connection, which
+ * it does when it has read all of our input (SEND), or
+ * written all of the stream data (RECV). A regular file
+ * that the daemon sends straight from the page cache
+ * counts as read once all of it has been sent.
+ */
+static inline void wait_for_daemon(int s)
+{
+	char buffer[256];
+	ssize_t n;
+	while ((n = read(s, buffer, sizeof(buffer))) != 0) {
+		if (n < 0 && errno != EINTR) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef _CLIENT_MUX_H_
+#define _CLIENT_MUX_H_
+
+#include "IO/MuxProtocol.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/**
+ * Client side of a multiplexed daemon connection ("MUX"),
+ * which carries many SEND/RECV/... streams over one socket
+ * (see IO/MuxProtocol.h).
+ *
+ * All calls block. Since the client may be a long-lived
+ * process (e.g. a shell with the mpih builtin loaded),
+ * errors are reported rather than fatal: a call that
+ * returns false has printed an error, and the connection
+ * is unusable afterwards.
+ */
+class MuxClient
+{
+public:
+
+	MuxClient() : m_socket(-1), m_nextStream(1) {}
+
+	~MuxClient()
+	{
+		if (m_socket >= 0)
+			close(m_socket);
+	}
+
+	/** Connect to the daemon and start multiplexing */
+	bool connect(const std::string& socketPath)
+	{
+		struct sockaddr_un remote;
+		if (socketPath.size() >= sizeof(remote.sun_path)) {
+			fprintf(stderr, "error: socket path too long\n");
+			return false;
+		}
+		m_socket = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (m_socket < 0) {
+			perror("socket");
+			return false;
+		}
+		memset(&remote, 0, sizeof(remote));
+		remote.sun_family = AF_UNIX;
+		strcpy(remote.sun_path, socketPath.c_str());
+		if (::connect(m_socket, (struct sockaddr*)&remote,
+			sizeof(remote)) < 0) {
+			perror("connect");
+			return false;
+		}
+		if (!writeAll("MUX\n", 4))
+			return false;
+		char reply[3];
+		if (!readAll(reply, sizeof(reply)))
+			return false;
+		if (memcmp(reply, "OK\n", sizeof(reply)) != 0) {
+			fprintf(stderr, "error: daemon refused multiplexed "
+				"connection\n");
+			return false;
+		}
+		return true;
+	}
+
+	/** The socket connected to the daemon */
+	int fd() const
+	{
+		return m_socket;
+	}
+
+	/**
+	 * Open a stream and send its 'header' line (e.g. "SEND 1").
+	 * @return the stream number, or 0 on error
+	 */
+	uint32_t open(const std::string& header)
+	{
+		uint32_t id = m_nextStream++;
+		StreamState& s = m_streams[id];
+		s.credit = MUX_WINDOW;
+		s.ended = false;
+		s.output = -1;
+		s.detached = false;
+		std::string line = header + "\n";
+		if (!writeFrame(MUX_OPEN, id, NULL, 0) ||
+			!write(id, line.data(), line.size()))
+			return 0;
+		return id;
+	}
+
+	/**
+	 * Write DATA received on stream 'id' to file descriptor
+	 * 'fd' (by default, it is discarded)
+	 */
+	void setOutput(uint32_t id, int fd)
+	{
+		m_streams[id].output = fd;
+	}
+
+	/** DATA we may send on stream 'id' before we block (bytes) */
+	uint64_t credit(uint32_t id)
+	{
+		return m_streams[id].credit;
+	}
+
+	/**
+	 * Send DATA on stream 'id', waiting for credit as needed
+	 * (in which case frames for other streams are handled)
+	 */
+	bool write(uint32_t id, const char* data, size_t len)
+	{
+		while (len > 0) {
+			while (m_streams[id].credit == 0)
+				if (!readFrame())
+					return false;
+			size_t n = std::min(len, (size_t)std::min(
+				m_streams[id].credit, (uint64_t)MUX_MAX_PAYLOAD));
+			if (!writeFrame(MUX_DATA, id, data, n))
+				return false;
+			m_streams[id].credit -= n;
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	/** Tell the daemon that no more DATA follows on stream 'id' */
+	bool end(uint32_t id)
+	{
+		return writeFrame(MUX_END, id, NULL, 0);
+	}
+
+	/**
+	 * True once the daemon has finished with stream 'id'
+	 * (or it has been released)
+	 */
+	bool ended(uint32_t id)
+	{
+		std::map<uint32_t, StreamState>::iterator it =
+			m_streams.find(id);
+		return it == m_streams.end() || it->second.ended;
+	}
+
+	/** Forget stream 'id', once the daemon has ended it */
+	void release(uint32_t id)
+	{
+		m_streams.erase(id);
+	}
+
+	/**
+	 * Forget stream 'id' as soon as the daemon ends it,
+	 * without waiting for that here (e.g. for SEND, whose
+	 * END may only arrive during a later call)
+	 */
+	void detach(uint32_t id)
+	{
+		std::map<uint32_t, StreamState>::iterator it =
+			m_streams.find(id);
+		if (it == m_streams.end())
+			return;
+		if (it->second.ended)
+			m_streams.erase(it);
+		else
+			it->second.detached = true;
+	}
+
+	/**
+	 * Wait for the next frame from the daemon, and handle it.
+	 * DATA goes to the output of its stream, and is credited
+	 * back to the daemon. Frames for streams that we have
+	 * forgotten are dropped.
+	 */
+	bool readFrame()
+	{
+		char header[MUX_HEADER_SIZE];
+		if (!readAll(header, sizeof(header)))
+			return false;
+		MuxFrameHeader frame = decode_mux_header(header);
+		if (frame.length > MUX_MAX_PAYLOAD) {
+			fprintf(stderr, "error: invalid frame from daemon\n");
+			return false;
+		}
+		m_payload.resize(frame.length);
+		if (!readAll(m_payload.data(), m_payload.size()))
+			return false;
+
+		std::map<uint32_t, StreamState>::iterator it =
+			m_streams.find(frame.stream);
+		if (it == m_streams.end())
+			return true;
+		StreamState& s = it->second;
+		switch (frame.type) {
+		  case MUX_CREDIT:
+			if (frame.length == 4)
+				s.credit += get_mux_u32(m_payload.data());
+			break;
+		  case MUX_END:
+			if (s.detached)
+				m_streams.erase(it);
+			else
+				s.ended = true;
+			break;
+		  case MUX_DATA: {
+			if (s.output >= 0 && !writeOutput(s.output,
+				m_payload.data(), m_payload.size()))
+				return false;
+			char credit[4];
+			put_mux_u32(credit, frame.length);
+			return writeFrame(MUX_CREDIT, frame.stream, credit,
+				sizeof(credit));
+		  }
+		}
+		return true;
+	}
+
+private:
+
+	struct StreamState
+	{
+		/** DATA we may still send (bytes) */
+		uint64_t credit;
+		/** true once the daemon has sent END */
+		bool ended;
+		/** where DATA from the daemon goes (-1: discard) */
+		int output;
+		/** forget the stream at END (see detach()) */
+		bool detached;
+	};
+
+	bool writeFrame(MuxFrameType type, uint32_t id,
+		const char* payload, size_t len)
+	{
+		char header[MUX_HEADER_SIZE];
+		encode_mux_header(header, type, id, len);
+		struct iovec iov[2] = {
+			{ header, sizeof(header) },
+			{ (void*)payload, len }
+		};
+		struct iovec* vec = iov;
+		int count = len > 0 ? 2 : 1;
+		while (count > 0) {
+			ssize_t n = writev(m_socket, vec, count);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror("write");
+				return false;
+			}
+			while (count > 0 && (size_t)n >= vec->iov_len) {
+				n -= vec->iov_len;
+				++vec;
+				--count;
+			}
+			if (count > 0) {
+				vec->iov_base = (char*)vec->iov_base + n;
+				vec->iov_len -= n;
+			}
+		}
+		return true;
+	}
+
+	bool writeAll(const char* data, size_t len)
+	{
+		return writeOutput(m_socket, data, len);
+	}
+
+	static bool writeOutput(int fd, const char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = ::write(fd, data, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror("write");
+				return false;
+			}
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	bool readAll(char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = read(m_socket, data, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				fprintf(stderr, "error: lost connection to daemon\n");
+				return false;
+			}
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	/* disable copy constructor and assignment operator */
+	MuxClient(const MuxClient&);
+	void operator=(const MuxClient&);
+
+	int m_socket;
+	uint32_t m_nextStream;
+	std::map<uint32_t, StreamState> m_streams;
+	/** payload of the last frame read */
+	std::vector<char> m_payload;
+};
+
+#endif
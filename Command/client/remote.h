@@ -0,0 +1,74 @@
+#ifndef _CLIENT_REMOTE_H_
+#define _CLIENT_REMOTE_H_
+
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cerrno>
+#include <unistd.h>
+
+/** Interval between checks for a port file (microseconds) */
+static const useconds_t PORT_FILE_POLL_INTERVAL = 100000;
+
+/**
+ * Read a reply line from blocking socket 's' (without the
+ * newline).
+ *
+ * @return false if the daemon closed the socket first
+ */
+static inline bool read_reply_line(int s, std::string& line)
+{
+	line.clear();
+	for (;;) {
+		char c;
+		ssize_t n = read(s, &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		if (c == '\n')
+			return true;
+		line += c;
+	}
+}
+
+/**
+ * Send 'request' (ACCEPT or CONNECT) to the daemon, and
+ * wait until it has connected us to the other job. If
+ * the daemon opened the MPI port (rank 0 of ACCEPT),
+ * 'publish' is called with the port name first.
+ *
+ * @return the number of ranks in the other job
+ */
+static inline int join_remote_job(const std::string& request,
+	void (*publish)(const std::string& port))
+{
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
+	write_all(socket, request + "\n");
+
+	std::string line;
+	bool ok = read_reply_line(socket, line);
+	if (ok && line.compare(0, 5, "PORT ") == 0) {
+		assert(publish != NULL);
+		publish(line.substr(5));
+		ok = read_reply_line(socket, line);
+	}
+	close(socket);
+
+	char* end = NULL;
+	long size = ok ? strtol(line.c_str(), &end, 10) : 0;
+	if (!ok || end == line.c_str() || *end != '\0' || size <= 0) {
+		std::cerr << "error: daemon could not connect to the "
+			"other job (see daemon log)" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return (int)size;
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef _CLIENT_SHM_H_
+#define _CLIENT_SHM_H_
+
+#include "Options/CommonOptions.h"
+#include "IO/ShmRing.h"
+#include "Command/client/handoff.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+
+/**
+ * Size of the shared-memory ring (bytes). The daemon
+ * receives whole MPI chunks into the ring, so this must
+ * be at least MPI_MAX_CHUNK_SIZE; twice that lets us fill
+ * one chunk while the daemon sends another.
+ */
+static const size_t SHM_RING_SIZE = 8 * 1024 * 1024;
+
+/**
+ * Create a shared-memory ring and offer it to the daemon
+ * for the data of the stream described by 'header' (see
+ * offer_fds()).
+ *
+ * @return the ring, or NULL if the data must go through
+ * the socket (the header has been sent either way)
+ */
+static inline ShmRing* hand_off_ring(int s, const std::string& header)
+{
+	ShmRing* ring = ShmRing::create(SHM_RING_SIZE);
+	if (ring == NULL) {
+		perror("shared-memory ring");
+		exit(EXIT_FAILURE);
+	}
+	if (offer_fds(s, header, "SHM", ring->fds(), ShmRing::NUM_FDS))
+		return ring;
+	if (opt::verbose)
+		fprintf(stderr, "daemon can't use a shared-memory ring; "
+			"streaming through socket\n");
+	delete ring;
+	return NULL;
+}
+
+/**
+ * Sleep until 'bell' is rung, or the daemon closes
+ * socket 's'.
+ *
+ * @return false if the daemon has closed the socket
+ */
+static inline bool wait_for_bell(int bell, int s)
+{
+	struct pollfd fds[2];
+	fds[0].fd = bell;
+	fds[0].events = POLLIN;
+	fds[1].fd = s;
+	fds[1].events = POLLIN;
+	while (poll(fds, 2, -1) < 0) {
+		if (errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (fds[0].revents & POLLIN)
+		ShmRing::clearBell(bell);
+	return fds[1].revents == 0;
+}
+
+/**
+ * Read each of 'files' (in order) straight into the ring,
+ * until EOF.
+ */
+static inline void shm_send(ShmRing& ring, int s,
+	const std::vector<int>& files)
+{
+	for (size_t i = 0; i < files.size(); ++i) {
+		while (true) {
+			if (!ring.armWriter(1)) {
+				if (!wait_for_bell(ring.writerBell(), s)) {
+					fprintf(stderr, "error: lost connection "
+						"to daemon\n");
+					exit(EXIT_FAILURE);
+				}
+				continue;
+			}
+			ssize_t n = read(files[i], ring.writePtr(),
+				ring.writable());
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+			if (n == 0)
+				break;
+			if (opt::verbose >= 3)
+				fprintf(stderr, "published %ld bytes to ring\n",
+					(long)n);
+			ring.publish(n);
+		}
+	}
+}
+
+/**
+ * Write data from the ring to 'fd' until the daemon
+ * closes socket 's' (end of stream) and the ring is empty.
+ */
+static inline void shm_recv(ShmRing& ring, int s, int fd)
+{
+	bool eof = false;
+	while (true) {
+		size_t len = ring.readable();
+		if (len > 0) {
+			ssize_t n = write(fd, ring.readPtr(), len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+			ring.release(n);
+			continue;
+		}
+		/* the daemon publishes all data before closing */
+		if (eof)
+			return;
+		if (!ring.armReader())
+			eof = !wait_for_bell(ring.readerBell(), s);
+	}
+}
+
+#endif
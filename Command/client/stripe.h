@@ -0,0 +1,146 @@
+#ifndef _CLIENT_STRIPE_H_
+#define _CLIENT_STRIPE_H_
+
+#include "Options/CommonOptions.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace opt {
+	/**
+	 * -P,--parallel: number of stripes to split a file
+	 * into, each sent as a separate stream (1 for a plain
+	 * stream)
+	 */
+	static int parallel = 1;
+}
+
+/** max stripes per transfer (must match the daemon's MPI_MAX_STRIPES) */
+static const int MAX_STRIPES = 16;
+
+/** stripes start at multiples of this file offset (bytes) */
+static const uint64_t STRIPE_ALIGNMENT = 1024 * 1024;
+
+/**
+ * Get the part of a file of 'size' bytes that goes in
+ * stripe 'i' of 'n'. Trailing stripes may be empty.
+ */
+static inline void stripe_range(uint64_t size, int n, int i,
+	uint64_t& offset, uint64_t& len)
+{
+	uint64_t stripe = (size + n - 1) / n;
+	stripe = (stripe + STRIPE_ALIGNMENT - 1) / STRIPE_ALIGNMENT
+		* STRIPE_ALIGNMENT;
+	offset = std::min(size, stripe * i);
+	len = std::min(size - offset, stripe);
+}
+
+/**
+ * Hand the 'len' bytes at 'offset' of regular file 'fd'
+ * to the daemon, as stripe 'stripe' of the transfer with
+ * SEND header 'header'.
+ *
+ * @return the connection to the daemon, which it closes
+ * once the stripe has been sent
+ */
+static inline int send_stripe(int fd, const std::string& header,
+	int stripe, uint64_t offset, uint64_t len)
+{
+	std::ostringstream options;
+	options << header << " STRIPE " << stripe << " RANGE "
+		<< offset << " " << len;
+	int s = UnixSocket::connect(opt::socketPath.c_str());
+	if (!offer_fds(s, options.str(), "FD", &fd, 1)) {
+		fprintf(stderr, "error: daemon can't send file ranges\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt::verbose >= 2)
+		fprintf(stderr, "sending stripe %d (%lu bytes at "
+			"offset %lu)\n", stripe, (unsigned long)len,
+			(unsigned long)offset);
+	return s;
+}
+
+/**
+ * Hand regular file 'fd' to the daemon, to write stripe
+ * 'stripe' of the transfer with RECV header 'header' into
+ * it (at the file offset given by the sender).
+ *
+ * @return the connection to the daemon, which it closes
+ * once the stripe has been written
+ */
+static inline int recv_stripe(int fd, const std::string& header,
+	int stripe)
+{
+	std::ostringstream options;
+	options << header << " STRIPE " << stripe;
+	int s = UnixSocket::connect(opt::socketPath.c_str());
+	if (!offer_fds(s, options.str(), "FD", &fd, 1)) {
+		fprintf(stderr, "error: daemon can't write file ranges\n");
+		exit(EXIT_FAILURE);
+	}
+	return s;
+}
+
+/**
+ * Hand regular file 'fd' to the daemon in opt::parallel
+ * stripes, over one daemon connection per stripe. Each
+ * stripe goes out as its own stream, which the daemon
+ * sends straight from the page cache, so the stripes are
+ * read and sent concurrently. 'header' is the SEND header
+ * of the transfer.
+ *
+ * Unless 'detach' is set, we wait until all stripes have
+ * been sent.
+ */
+static inline void send_striped(int fd, const std::string& header,
+	bool detach)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<int> sockets;
+	for (int i = 0; i < opt::parallel; ++i) {
+		uint64_t offset, len;
+		stripe_range(st.st_size, opt::parallel, i, offset, len);
+		sockets.push_back(send_stripe(fd, header, i, offset, len));
+	}
+
+	for (size_t i = 0; i < sockets.size(); ++i) {
+		if (!detach)
+			wait_for_daemon(sockets[i]);
+		close(sockets[i]);
+	}
+}
+
+/**
+ * Receive the opt::parallel stripes of a transfer into
+ * regular file 'fd', over one daemon connection per
+ * stripe. The daemon writes each stripe at the file
+ * offset given by the sender, as it arrives. 'header' is
+ * the RECV header of the transfer.
+ */
+static inline void recv_striped(int fd, const std::string& header)
+{
+	std::vector<int> sockets;
+	for (int i = 0; i < opt::parallel; ++i)
+		sockets.push_back(recv_stripe(fd, header, i));
+
+	for (size_t i = 0; i < sockets.size(); ++i) {
+		wait_for_daemon(sockets[i]);
+		close(sockets[i]);
+	}
+}
+
+#endif
@@ -1,19 +1,32 @@
 #ifndef _COMMANDS_H_
 #define _COMMANDS_H_
 
+#include "Command/connect_port.h"
 #include "Command/finalize.h"
 #include "Command/help.h"
 #include "Command/init.h"
+#include "Command/mkfifo.h"
+#include "Command/open_port.h"
 #include "Command/rank.h"
 #include "Command/recv.h"
+#include "Command/recv_batch.h"
+#include "Command/recv_dir.h"
 #include "Command/run.h"
 #include "Command/send.h"
+#include "Command/send_batch.h"
+#include "Command/send_dir.h"
 #include "Command/size.h"
 #include "Command/version.h"
+#include "Command/wait.h"
 #include "Macro/Array.h"
+#include "Options/CommonOptions.h"
+#include "Env/env.h"
 #include "IO/IOUtil.h"
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <cstring>
+#include <getopt.h>
 
 struct cmd_struct {
 	const char* name;
@@ -21,18 +34,26 @@ struct cmd_struct {
 };
 
 static struct cmd_struct cmd_map[] = {
+	{ "connect-port", &cmd_connect_port },
 	{ "finalize", &cmd_finalize },
 	{ "help", &cmd_help },
 	{ "--help", &cmd_help },
 	{ "-h", &cmd_help },
 	{ "init", &cmd_init },
+	{ "mkfifo", &cmd_mkfifo },
+	{ "open-port", &cmd_open_port },
 	{ "rank", &cmd_rank },
 	{ "recv", &cmd_recv },
+	{ "recv-batch", &cmd_recv_batch },
+	{ "recv-dir", &cmd_recv_dir },
 	{ "run", &cmd_run },
 	{ "send", &cmd_send },
+	{ "send-batch", &cmd_send_batch },
+	{ "send-dir", &cmd_send_dir },
 	{ "size", &cmd_size },
 	{ "--version", &cmd_version },
-	{ "version", &cmd_version }
+	{ "version", &cmd_version },
+	{ "wait", &cmd_wait }
 };
 
 int invoke_cmd(const char* cmd, int argc, char** argv)
@@ -45,4 +66,61 @@ int invoke_cmd(const char* cmd, int argc, char** argv)
 	die(USAGE_MESSAGE);
 }
 
+static const char main_shortopts[] = "+hs:v";
+
+static const struct option main_longopts[] = {
+	{ "help",     no_argument, NULL, 'h' },
+	{ "socket",   required_argument, NULL, 's' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * Parse the main options and run the command, as the
+ * 'mpih' executable (and the mpih builtin, in a child
+ * process) does
+ */
+static inline int mpih_main(int argc, char** argv)
+{
+	if (getenv(MPIH_SOCKET))
+		opt::socketPath = getenv(MPIH_SOCKET);
+
+	for (int c; (c = getopt_long(argc, argv,
+		main_shortopts, main_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(USAGE_MESSAGE);
+		  case 'h':
+			arg >> opt::help; break;
+		  case 's':
+			arg >> opt::socketPath; break;
+		  case 'v':
+			opt::verbose++; break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpih: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::string command;
+	if (argc - optind > 0)
+		command = argv[optind++];
+
+	if (opt::socketPath.empty() &&
+		command != "version" &&
+		command != "--version" &&
+		command != "help" &&
+		!opt::help &&
+		command != "run")
+	{
+		std::cerr << "error: no socket path specified\n";
+		die(USAGE_MESSAGE);
+	}
+
+	return invoke_cmd(command.c_str(), argc, argv);
+}
+
 #endif
@@ -0,0 +1,116 @@
+#ifndef _CONNECT_PORT_H_
+#define _CONNECT_PORT_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "Command/client/remote.h"
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char CONNECT_PORT_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] connect-port (<port>|--file <path>)\n"
+"\n"
+"Description:\n"
+"\n"
+"   Connect this MPI job to another one that is waiting\n"
+"   in '" PROGRAM_NAME " open-port', given the name of the MPI\n"
+"   port that it opened. With --file, wait until the\n"
+"   other job has written the port name to <path>.\n"
+"\n"
+"   Every rank of the job must run this command. Once\n"
+"   the jobs are connected, each rank prints the number\n"
+"   of ranks in the other job, and '" PROGRAM_NAME " send\n"
+"   --remote' and '" PROGRAM_NAME " recv --remote' address\n"
+"   them. See '" PROGRAM_NAME " help open-port'.\n"
+"\n"
+"Options:\n"
+"\n"
+"   -f,--file PATH     read the port name from PATH\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n";
+
+static const char connect_port_shortopts[] = "f:hv";
+
+static const struct option connect_port_longopts[] = {
+	{ "file",     required_argument, NULL, 'f' },
+	{ "help",     no_argument, NULL, 'h' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * Wait for 'mpih open-port' in the other job to write its
+ * port name to 'path', and return it
+ */
+static inline std::string read_port_file(const std::string& path)
+{
+	struct stat st;
+	while (stat(path.c_str(), &st) < 0) {
+		if (errno != ENOENT) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		usleep(PORT_FILE_POLL_INTERVAL);
+	}
+
+	std::string port;
+	std::ifstream in(path.c_str());
+	if (!std::getline(in, port) || port.empty()) {
+		std::cerr << "error: no MPI port name in '" << path
+			<< "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return port;
+}
+
+int cmd_connect_port(int argc, char** argv)
+{
+	for (int c; (c = getopt_long(argc, argv,
+		connect_port_shortopts, connect_port_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(CONNECT_PORT_USAGE_MESSAGE);
+		  case 'f':
+			arg >> opt::portFile;
+			break;
+		  case 'h':
+			std::cout << CONNECT_PORT_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi connect-port: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(CONNECT_PORT_USAGE_MESSAGE);
+		}
+	}
+
+	if (argc - optind != (opt::portFile.empty() ? 1 : 0)) {
+		std::cerr << "error: expected either a <port> argument "
+			"or --file" << std::endl;
+		die(CONNECT_PORT_USAGE_MESSAGE);
+	}
+	std::string port = opt::portFile.empty() ? argv[optind] :
+		read_port_file(opt::portFile);
+
+	if (opt::verbose)
+		std::cerr << "connecting to MPI port '" << port << "'"
+			<< std::endl;
+
+	std::cout << join_remote_job("CONNECT " + port, NULL)
+		<< std::endl;
+
+	return 0;
+}
+
+#endif
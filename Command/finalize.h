@@ -58,7 +58,7 @@ static inline void finalize()
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
 	// send command to 'mpi init' daemon
-	evbuffer_add_printf(bufferevent_get_output(bev), "FINALIZE\n");
+	send_binary_request(bev, OP_FINALIZE);
 
 	event_base_dispatch(base);
 	event_base_free(base);
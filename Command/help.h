@@ -24,14 +24,22 @@ static const char USAGE_MESSAGE[] =
 "\n"
 "The available commands are:\n"
 "\n"
+"   connect-port connect to a job that ran open-port\n"
 "   finalize  shutdown current MPI rank (stops daemon)\n"
 "   help      show usage for specific commands\n"
 "   init      initialize current MPI rank (starts daemon)\n"
+"   mkfifo    create a named pipe that streams to/from a rank\n"
+"   open-port wait for another job to connect to this one\n"
 "   rank      print rank of current MPI process\n"
 "   recv      stream data from another MPI rank\n"
+"   recv-batch receive files sent with send-batch\n"
+"   recv-dir  receive a directory tree sent with send-dir\n"
 "   run       set up environment and run a user script\n"
 "   send      stream data to another MPI rank\n"
+"   send-batch send many files to other MPI ranks\n"
+"   send-dir  send a directory tree to another MPI rank\n"
 "   size      print number of ranks in current MPI job\n"
+"   wait      wait for detached sends to complete\n"
 "\n"
 "See '" PROGRAM_NAME " help <command>' for help on specific commands.\n";
 
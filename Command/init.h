@@ -7,6 +7,8 @@
 #include "Command/init/Connection.h"
 #include "Command/init/mpi.h"
 #include "Command/init/event_handlers.h"
+#include "Command/init/MuxSession.h"
+#include "Command/init/FdReserve.h"
 #include "IO/IOUtil.h"
 #include "IO/SocketUtil.h"
 #include "Env/env.h"
@@ -21,6 +23,7 @@
 #include <event2/bufferevent.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 static const char INIT_USAGE_MESSAGE[] =
 "Usage: " PROGRAM_NAME " [--socket <path>] init [options]\n"
@@ -42,32 +45,92 @@ static const char INIT_USAGE_MESSAGE[] =
 "\n"
 "Options:\n"
 "\n"
+"   -b,--backlog N       max number of clients waiting to\n"
+"                        connect (capped by the kernel at\n"
+"                        net.core.somaxconn) [SOMAXCONN]\n"
+"   -d,--spool-dir DIR   spill data for slow 'mpih recv'\n"
+"                        clients to temp files in DIR,\n"
+"                        rather than holding it in memory\n"
 "   -f,--foreground      run daemon in the foreground\n"
 "   -l,--log PATH        log file [/dev/null]\n"
+"   -L,--no-local-copy   send streams between ranks on the\n"
+"                        same node through MPI too (by\n"
+"                        default, the daemon copies them\n"
+"                        from the sending client's pipe or\n"
+"                        file straight into the receiving\n"
+"                        client's, when both clients hand\n"
+"                        theirs over)\n"
+"   -m,--low-footprint   use less memory per connection, for\n"
+"                        nodes that run many ranks: buffer\n"
+"                        at most 256K per stream direction,\n"
+"                        map 4M of a file at a time, and\n"
+"                        poll idle MPI requests less often\n"
+"                        (trades some throughput and latency)\n"
 "   -p,--pid-file PATH   file containing PID of daemon;\n"
 "                        existence of this file indicates\n"
 "                        that the daemon is running and is\n"
 "                        ready to accept commands from\n"
 "                        clients\n"
+"   -R,--ring-size N     size of per-peer ring buffers for\n"
+"                        '--transport rma'; N may have a\n"
+"                        K, M, or G suffix [2M]\n"
 "   -s,--socket PATH     communicate over Unix socket\n"
-"                        at PATH\n";
+"                        at PATH\n"
+"   -t,--transport T     how to move data between daemons:\n"
+"                        'p2p' (MPI_Isend/MPI_Irecv) or\n"
+"                        'rma' (MPI_Put to ring buffers in\n"
+"                        an MPI window) [p2p]. All ranks\n"
+"                        must use the same transport.\n"
+"   -U,--io-uring        do client socket I/O with io_uring\n"
+"                        (Linux 6.4+; falls back to libevent\n"
+"                        if unavailable)\n";
 
 namespace opt {
 	static int foreground;
 	static std::string pidPath;
+	/**
+	 * pipe to write "<rank> <size>\n" to once we are ready
+	 * for requests, for 'mpih run' (-1 if none)
+	 */
+	static int readyFd = -1;
+	/** -b,--backlog: see UnixSocket::listen() */
+	static int listenBacklog = SOMAXCONN;
 }
 
-static const char init_shortopts[] = "fhl:p:v";
+static const char init_shortopts[] = "b:d:fhl:Lmp:R:t:Uv";
 
 static const struct option init_longopts[] = {
+	{ "backlog",  required_argument, NULL, 'b' },
+	{ "spool-dir", required_argument, NULL, 'd' },
 	{ "foreground", no_argument, NULL, 'f' },
 	{ "help",     no_argument, NULL, 'h' },
 	{ "log",      required_argument, NULL, 'l' },
+	{ "no-local-copy", no_argument, NULL, 'L' },
+	{ "low-footprint", no_argument, NULL, 'm' },
 	{ "pid-file", required_argument, NULL, 'p' },
+	{ "ring-size", required_argument, NULL, 'R' },
+	{ "transport", required_argument, NULL, 't' },
+	{ "io-uring", no_argument, NULL, 'U' },
 	{ "verbose",  no_argument, NULL, 'v' },
 	{ NULL, 0, NULL, 0 }
 };
 
+/**
+ * Close all file descriptors from 'first' up, with one
+ * close_range() call where the kernel has it (Linux 5.9+),
+ * rather than one close() per possible descriptor, which
+ * is slow when the descriptor limit is high.
+ */
+static inline void close_fds_from(int first)
+{
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, first, ~0U, 0) == 0)
+		return;
+#endif
+	for (int i = getdtablesize(); i >= first; --i)
+		close(i);
+}
+
 /**
  * Run the current process in the background.
  *
@@ -115,12 +178,17 @@ static inline void run_in_background()
 	if (pid > 0)
 		exit(EXIT_SUCCESS);
 
-	// close all open file descriptors
-	for (int i=getdtablesize(); i >= 0; --i)
-		close(i);
+	// close all open file descriptors (except the readiness pipe)
+	if (opt::readyFd < 0) {
+		close_fds_from(0);
+	} else {
+		for (int i = 0; i < opt::readyFd; ++i)
+			close(i);
+		close_fds_from(opt::readyFd + 1);
+	}
 }
 
-static inline void create_pid_file(evutil_socket_t, short, void*)
+static inline void create_pid_file()
 {
 	assert(!opt::pidPath.empty());
 	std::ofstream pid_file(opt::pidPath.c_str());
@@ -133,31 +201,71 @@ static inline void create_pid_file(evutil_socket_t, short, void*)
 	pid_file.close();
 }
 
+/**
+ * Tell whoever started us that we are running and ready
+ * for requests: create the PID file, and/or write our rank
+ * and the job size to the readiness pipe (see opt::readyFd).
+ */
+static inline void signal_ready(evutil_socket_t, short, void*)
+{
+	if (!opt::pidPath.empty())
+		create_pid_file();
+	if (opt::readyFd < 0)
+		return;
+	std::ostringstream ready;
+	ready << mpi::rank << " " << mpi::numProc << "\n";
+	const std::string& msg = ready.str();
+	if (write(opt::readyFd, msg.data(), msg.size()) != (ssize_t)msg.size())
+		fprintf(g_log, "error writing to readiness pipe: %s\n",
+			strerror(errno));
+	close(opt::readyFd);
+	opt::readyFd = -1;
+}
+
 static inline void server_loop(const char* socketPath)
 {
+	/*
+	 * A client that goes away mid-stream (e.g. the reader
+	 * of a pipe handed over by 'mpih recv') should give
+	 * us a write error, not kill the daemon.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
 	// create Unix domain socket that listens for connections
-	evutil_socket_t listener = UnixSocket::listen(socketPath, false);
+	evutil_socket_t listener = UnixSocket::listen(socketPath, false,
+		opt::listenBacklog);
 
 	// main state object for libevent
 	struct event_base* base = event_base_new();
 	assert(base != NULL);
 
+	// one timer drives the RMA transport for all connections
+	if (opt::transport == TRANSPORT_RMA)
+		init_rma_progress(base);
+
+	// hold back descriptors for the clients we accept
+	FdReserve::getInstance().fill();
+
 	// register handler for new connections
-	struct event* listener_event = event_new(base, listener,
-		EV_READ|EV_PERSIST, init_accept_handler, (void*)base);
-	assert(listener_event != NULL);
-
-	int result = event_add(listener_event, NULL);
-	assert(result == 0);
-
-	// event to create a PID file at startup.  This file acts
-	// as a signal to clients that the daemon is running and
-	// ready for requests.
-	struct event* pid_file_event = NULL;
-	if (!opt::pidPath.empty()) {
-		pid_file_event = event_new(base, -1, 0, create_pid_file, NULL);
-		assert(pid_file_event != NULL);
-		event_active(pid_file_event, 0, 0);
+	IOURingReactor& reactor = IOURingReactor::getInstance();
+	if (opt::ioUring && reactor.init(base)) {
+		reactor.listen(listener, init_new_connection);
+	} else {
+		g_listener_event = event_new(base, listener,
+			EV_READ|EV_PERSIST, init_accept_handler, (void*)base);
+		assert(g_listener_event != NULL);
+		int result = event_add(g_listener_event, NULL);
+		assert(result == 0);
+	}
+
+	// event to create a PID file and/or write to the readiness
+	// pipe at startup.  These act as a signal to clients that
+	// the daemon is running and ready for requests.
+	struct event* ready_event = NULL;
+	if (!opt::pidPath.empty() || opt::readyFd >= 0) {
+		ready_event = event_new(base, -1, 0, signal_ready, NULL);
+		assert(ready_event != NULL);
+		event_active(ready_event, 0, 0);
 	}
 
 	if (opt::verbose)
@@ -167,9 +275,15 @@ static inline void server_loop(const char* socketPath)
 	event_base_dispatch(base);
 
 	// cleanup
-	event_free(listener_event);
-	if (pid_file_event != NULL)
-		event_free(pid_file_event);
+	if (g_listener_event != NULL)
+		event_free(g_listener_event);
+	reactor.shutdown();
+	if (g_send_scheduler_event != NULL)
+		event_free(g_send_scheduler_event);
+	if (g_rma_progress_event != NULL)
+		event_free(g_rma_progress_event);
+	if (ready_event != NULL)
+		event_free(ready_event);
 	event_base_free(base);
 }
 
@@ -182,6 +296,14 @@ static inline int cmd_init(int argc, char** argv)
 		switch (c) {
 		  case '?':
 			die(INIT_USAGE_MESSAGE);
+		  case 'b':
+			arg >> opt::listenBacklog;
+			if (opt::listenBacklog <= 0)
+				arg.setstate(std::ios::failbit);
+			break;
+		  case 'd':
+			arg >> opt::spoolDir;
+			break;
 		  case 'f':
 			opt::foreground = 1;
 			break;
@@ -191,9 +313,33 @@ static inline int cmd_init(int argc, char** argv)
 		  case 'l':
 			arg >> opt::logPath;
 			break;
+		  case 'L':
+			opt::noLocalCopy = 1;
+			break;
+		  case 'm':
+			opt::lowFootprint = 1;
+			break;
 		  case 'p':
 			arg >> opt::pidPath;
 			break;
+		  case 'R': {
+			std::string size;
+			arg >> size;
+			if (!parse_size(size, opt::rmaRingSize) ||
+				opt::rmaRingSize < RMA_MIN_RING_SIZE)
+				arg.setstate(std::ios::failbit);
+			break;
+		  }
+		  case 't': {
+			std::string transport;
+			arg >> transport;
+			if (!parse_transport(transport, opt::transport))
+				arg.setstate(std::ios::failbit);
+			break;
+		  }
+		  case 'U':
+			opt::ioUring = 1;
+			break;
 		  case 'v':
 			opt::verbose++;
 			break;
@@ -221,17 +367,37 @@ static inline int cmd_init(int argc, char** argv)
 	if (!opt::foreground)
 		run_in_background();
 
+	init_low_footprint();
+
 	// initialize MPI
 	MPI_Init(&argc, &argv);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpi::numProc);
 	MPI_Comm_rank(MPI_COMM_WORLD, &mpi::rank);
+	int* tagUB;
+	int haveTagUB;
+	MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tagUB, &haveTagUB);
+	if (haveTagUB)
+		mpi::tagUB = *tagUB;
 
-	// start connection handling loop on Unix socket
 	init_log();
+
+	// find the ranks on our node, for same-node copies
+	init_local_peers();
+
+	// create ring buffers for one-sided transfers
+	if (opt::transport == TRANSPORT_RMA)
+		RMATransport::getInstance().init(MPI_COMM_WORLD,
+			opt::rmaRingSize);
+
+	// start connection handling loop on Unix socket
 	server_loop(opt::socketPath.c_str());
-	close_log();
 
-	// shutdown MPI
+	// shutdown MPI (which waits for the remote job to finalize too)
+	if (mpi::remoteComm != MPI_COMM_NULL)
+		MPI_Comm_disconnect(&mpi::remoteComm);
+	RMATransport::getInstance().finalize();
+	MPI_Comm_free(&mpi::localComm);
+	close_log();
 	MPI_Finalize();
 
 	return 0;
@@ -2,44 +2,157 @@
 #define _CONNECTION_H_
 
 #include "Command/init/log.h"
+#include "Command/init/footprint.h"
 #include "Command/init/MPIChannel.h"
+#include "Command/init/Spool.h"
+#include "Command/init/SendScheduler.h"
+#include "Command/init/RMATransport.h"
+#include "Command/init/IOURingReactor.h"
+#include "Command/init/FilePump.h"
+#include "Command/init/MappedFile.h"
+#include "Command/init/FileSink.h"
+#include "Command/init/LocalCopy.h"
+#include "IO/ShmRing.h"
 #include <mpi.h>
+#include <string>
 #include <vector>
 #include <algorithm>
 #include <cassert>
 #include <cstdarg>
+#include <cstring>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /** polling interval for status of MPI send/recv */
 static const int MPI_POLL_INTERVAL = 200;
 
+/**
+ * Interval before the next poll of an MPI request that
+ * has been polled 'idle_polls' times in a row without
+ * progress (microseconds). In low-footprint mode, this
+ * backs off, so that streams waiting for a peer rank
+ * don't keep waking us up.
+ */
+static inline size_t mpi_poll_interval(unsigned idle_polls)
+{
+	if (!opt::lowFootprint)
+		return MPI_POLL_INTERVAL;
+	size_t interval = (size_t)MPI_POLL_INTERVAL <<
+		std::min(idle_polls, 8u);
+	return std::min(interval, LOW_FOOTPRINT_MAX_POLL_INTERVAL);
+}
+
+/**
+ * Input from an 'mpih send' client is batched into MPI
+ * messages of at least this size (bytes), unless
+ * the client has closed the connection.
+ */
+#define SEND_LOW_WATERMARK (1*1024*1024)
+
+/**
+ * Chunk size that announces the total size of a stream,
+ * and the file offset it starts at. These follow as a
+ * separate message (2 x MPI_UINT64_T). The sender only
+ * announces the size when it knows it up front, e.g. when
+ * it is sending a mapped file.
+ */
+static const int STREAM_SIZE_MARKER = -1;
+
+/**
+ * Chunk size that offers the receiver a same-node copy:
+ * the sender is on the same node, and reads the sending
+ * client's data from a pipe or file. The receiver answers
+ * on mpi::localComm (see LocalCopyReply) with the pipe or
+ * file of the receiving client, if it has one, and the
+ * sender then copies the data into it directly, bypassing MPI
+ * (see LocalCopy). Otherwise, the stream goes through
+ * MPI as usual.
+ */
+static const int LOCAL_COPY_MARKER = -2;
+
+/**
+ * Chunk size that aborts a stream: the sender can't read
+ * the rest of its input (e.g. a mapped file that has been
+ * truncated). Like EOF, nothing follows it, but the
+ * receiver fails the stream rather than ending it.
+ */
+static const int STREAM_ERROR_MARKER = -3;
+
+/**
+ * Fields of the receiver's answer to a LOCAL_COPY_MARKER
+ * (MPI_UINT64_T each): the PID of the receiving daemon (0
+ * to decline), the descriptor in that daemon that holds
+ * the receiving client's output, and the file offset to
+ * write at and O_APPEND flag of the output (regular files).
+ */
+enum LocalCopyReply {
+	LOCAL_PID = 0,
+	LOCAL_FD,
+	LOCAL_OFFSET,
+	LOCAL_APPEND,
+	LOCAL_REPLY_SIZE
+};
+
+/**
+ * How a same-node copy ended, as the sender reports it to
+ * the receiver (first field of Connection::local_done)
+ */
+enum LocalCopyResult {
+	/** the copy never started; the data follows through MPI */
+	LOCAL_NOT_COPIED = 0,
+	LOCAL_COPIED,
+	/** the copy stopped part way; the stream has failed */
+	LOCAL_COPY_FAILED
+};
+
 // forward declarations
 class Connection;
+struct MuxStream;
+static inline void mux_stream_closed(MuxStream& stream);
 static inline void update_mpi_status(
 	evutil_socket_t socket, short event, void* arg);
 static inline void do_next_mpi_send(Connection& connection);
 static inline void close_connection(Connection& connection);
+static inline void mpi_start_send(Connection& connection);
 static inline void mpi_send_chunk_size(Connection& connection);
 static inline void mpi_send_chunk(Connection& connection);
 static inline void mpi_recv_chunk(Connection& connection);
 static inline void mpi_recv_chunk_size(Connection& connection);
+static inline void mpi_recv_stream_size(Connection& connection);
+static inline void mpi_send_stream_error(Connection& connection);
+static inline void mpi_offer_local_copy(Connection& connection);
+static inline void mpi_answer_local_copy(Connection& connection);
+static inline void start_local_copy(Connection& connection);
 static inline bool mpi_ops_pending();
+static inline bool detached_sends_pending();
+static inline void run_send_scheduler(struct event_base* base);
 
 enum ConnectionState {
 	READING_HEADER=0,
+	WAITING_FOR_FD,
 	WAITING_FOR_MPI_CHANNEL,
+	WAITING_FOR_SEND_SLOT,
 	MPI_READY_TO_RECV_CHUNK_SIZE,
 	MPI_RECVING_CHUNK_SIZE,
+	MPI_RECVING_STREAM_SIZE,
 	MPI_READY_TO_RECV_CHUNK,
 	MPI_RECVING_CHUNK,
+	MPI_SENDING_STREAM_SIZE,
 	MPI_READY_TO_SEND_CHUNK_SIZE,
 	MPI_SENDING_CHUNK_SIZE,
 	MPI_READY_TO_SEND_CHUNK,
 	MPI_SENDING_CHUNK,
 	MPI_SENDING_EOF,
+	MPI_SENDING_LOCAL_OFFER,
+	LOCAL_COPYING,
+	MPI_SENDING_LOCAL_DONE,
+	MPI_SENDING_LOCAL_REPLY,
+	MPI_WAITING_FOR_LOCAL_COPY,
 	MPI_FINALIZE,
+	WAITING_FOR_DETACHED_SENDS,
 	FLUSHING_SOCKET,
 	DONE,
 	CLOSED
@@ -53,14 +166,85 @@ struct Connection {
 	int rank;
 	/** socket (connects to local client) */
 	evutil_socket_t socket;
-	/** socket buffer (managed by libevent) */
+	/**
+	 * buffer for stream data (managed by libevent). This is
+	 * the client socket, unless the client has handed us a
+	 * file descriptor to read/write the data directly.
+	 */
 	struct bufferevent* bev;
+	/**
+	 * client socket, when 'bev' is doing I/O on a file
+	 * descriptor handed over by the client (NULL otherwise)
+	 */
+	struct bufferevent* control;
+	/**
+	 * logical stream of a multiplexed client connection
+	 * that this connection serves ("MUX"); 'bev' is then
+	 * one end of a bufferevent pair, and 'socket' is -1.
+	 * NULL for a client connection of its own.
+	 */
+	MuxStream* mux;
+	/**
+	 * true if the client's last request was binary (see
+	 * IO/BinaryHeader.h), so that we reply in binary
+	 */
+	bool binary;
+	/** moves data to/from a regular file handed over by the client */
+	FilePump* pump;
+	/**
+	 * shared-memory ring that carries the stream data
+	 * instead of 'bev' ("SHM" header option); NULL otherwise
+	 */
+	ShmRing* ring;
+	/** fires when the client rings our doorbell on 'ring' */
+	struct event* doorbell;
+	/**
+	 * regular file handed over by an 'mpih send' client,
+	 * which we send straight from the page cache (NULL
+	 * otherwise)
+	 */
+	MappedFile* mapped;
+	/**
+	 * regular file handed over by an 'mpih recv' client,
+	 * which we write received chunks to directly (NULL
+	 * otherwise)
+	 */
+	FileSink* sink;
+	/**
+	 * size of the stream and file offset of its first byte,
+	 * if the sender announced them (see STREAM_SIZE_MARKER)
+	 */
+	uint64_t stream_extent[2];
+	/**
+	 * part of the client's file to send ("RANGE <offset>
+	 * <length>"), for one stripe of 'mpih send --parallel';
+	 * range_offset is -1 to send from the file offset to EOF
+	 */
+	off_t range_offset;
+	uint64_t range_length;
+	/**
+	 * true for one stripe of a striped transfer ("STRIPE
+	 * <n>"). For RECV, the data is written at the file
+	 * offset announced by the sender.
+	 */
+	bool striped;
+	/**
+	 * named pipe that we created for the stream data, for
+	 * 'mpih mkfifo' ("FIFO <path>"); removed when we close
+	 * the connection (empty otherwise)
+	 */
+	std::string fifo_path;
 	/** length of MPI send/recv buffer */
 	int chunk_size;
 	/** chunk number we are currently sending/recving */
 	size_t chunk_index;
 	/** buffer for non-blocking MPI send/recv */
 	char* chunk_buffer;
+	/**
+	 * true if 'chunk_buffer' points into 'ring' or 'mapped'
+	 * (not malloc'd)
+	 */
+	bool chunk_borrowed;
 	/** bytes successfully transferred for current send/recv */
 	size_t bytes_transferred;
 	/** ID for checking state of asynchronous send/recv */
@@ -71,6 +255,9 @@ struct Connection {
 	bool eof;
 	/** timeout event (libevent) */
 	struct event* next_event;
+	/** state at the last poll_mpi(), and polls since it changed */
+	ConnectionState polled_state;
+	unsigned idle_polls;
 	/**
 	  * The "MPI channel" used by a MPI SEND/RECV stream.
 	  * Each MPI channel consists of a transfer direction
@@ -79,6 +266,41 @@ struct Connection {
 	MPIChannel channel;
 	/** true when we are holding an MPI channel */
 	bool holding_mpi_channel;
+	/**
+	 * true when the SendScheduler has given us permission
+	 * to send the next data chunk
+	 */
+	bool holding_send_slot;
+	/**
+	 * true for 'mpih send --detach': the daemon accepts
+	 * all input from the client without applying
+	 * backpressure, and completes the send after the
+	 * client has exited
+	 */
+	bool detached;
+	/**
+	 * overflow storage for stream data that can't be
+	 * held in memory (NULL until needed). For SEND streams
+	 * this holds input from a detached client; for RECV
+	 * streams it holds data that the client has not
+	 * consumed yet.
+	 */
+	Spool* spool;
+	/**
+	 * true if the peer rank is on our node, and the stream
+	 * may bypass MPI (see LOCAL_COPY_MARKER)
+	 */
+	bool local_peer;
+	/** receiver's answer to our same-node copy offer */
+	uint64_t local_reply[LOCAL_REPLY_SIZE];
+	/**
+	 * end of a same-node copy, from the sender: how it
+	 * ended (LocalCopyResult), and the number of bytes
+	 * copied
+	 */
+	uint64_t local_done[2];
+	/** same-node copy in progress (SEND; NULL otherwise) */
+	LocalCopy* copy;
 
 	Connection() :
 		connection_id(next_connection_id),
@@ -86,17 +308,39 @@ struct Connection {
 		rank(0),
 		socket(-1),
 		bev(NULL),
+		control(NULL),
+		mux(NULL),
+		binary(false),
+		pump(NULL),
+		ring(NULL),
+		doorbell(NULL),
+		mapped(NULL),
+		sink(NULL),
+		range_offset(-1),
+		range_length(0),
+		striped(false),
 		chunk_size(0),
 		chunk_index(0),
 		chunk_buffer(NULL),
+		chunk_borrowed(false),
 		bytes_transferred(0),
 		eof(false),
 		next_event(NULL),
-		holding_mpi_channel(false)
+		polled_state(READING_HEADER),
+		idle_polls(0),
+		holding_mpi_channel(false),
+		holding_send_slot(false),
+		detached(false),
+		spool(NULL),
+		local_peer(false),
+		copy(NULL)
 	{
 		next_connection_id = (next_connection_id + 1) % SIZE_MAX;
 		memset(&chunk_size_request_id, 0, sizeof(MPI_Request));
 		memset(&chunk_request_id, 0, sizeof(MPI_Request));
+		memset(stream_extent, 0, sizeof(stream_extent));
+		memset(local_reply, 0, sizeof(local_reply));
+		memset(local_done, 0, sizeof(local_done));
 	}
 
 	~Connection()
@@ -112,9 +356,16 @@ struct Connection {
 
 	void clear_mpi_state()
 	{
-		if (chunk_buffer != NULL)
+		/* withdraw unfinished RMA transfers that use our buffers */
+		if (opt::transport == TRANSPORT_RMA) {
+			RMATransport& rma = RMATransport::getInstance();
+			rma.cancel(chunk_size_request_id);
+			rma.cancel(chunk_request_id);
+		}
+		if (chunk_buffer != NULL && !chunk_borrowed)
 			free(chunk_buffer);
 		chunk_buffer = NULL;
+		chunk_borrowed = false;
 		chunk_size = 0;
 		memset(&chunk_size_request_id, 0, sizeof(MPI_Request));
 		memset(&chunk_request_id, 0, sizeof(MPI_Request));
@@ -126,6 +377,11 @@ struct Connection {
 		state = READING_HEADER;
 		rank = 0;
 		eof = false;
+		detached = false;
+		range_offset = -1;
+		range_length = 0;
+		striped = false;
+		local_peer = false;
 	}
 
 	void close()
@@ -141,16 +397,85 @@ struct Connection {
 				channel);
 			holding_mpi_channel = false;
 		}
+		/* give up our place in the send queue */
+		SendScheduler::getInstance().removeStream(connection_id);
+		holding_send_slot = false;
+		if (bev != NULL) {
+			/* a mapping/sink may finish right after we said OK */
+			if (mapped != NULL || sink != NULL)
+				flush_reply(bev);
+			IOURingReactor::getInstance().detach(bev);
+			bufferevent_free(bev);
+		}
+		bev = NULL;
+		/* let the client know we are done with the stream */
+		if (mux != NULL)
+			mux_stream_closed(*mux);
+		mux = NULL;
+		if (pump != NULL)
+			delete pump;
+		pump = NULL;
+		if (doorbell != NULL)
+			event_free(doorbell);
+		doorbell = NULL;
+		if (ring != NULL)
+			delete ring;
+		ring = NULL;
+		if (mapped != NULL)
+			delete mapped;
+		mapped = NULL;
+		if (sink != NULL)
+			delete sink;
+		sink = NULL;
+		if (!fifo_path.empty())
+			unlink(fifo_path.c_str());
+		fifo_path.clear();
+		release_control();
 		if (socket != -1)
 			evutil_closesocket(socket);
 		socket = -1;
-		if (bev != NULL)
-			bufferevent_free(bev);
-		bev = NULL;
+		if (spool != NULL)
+			delete spool;
+		spool = NULL;
+		if (copy != NULL)
+			delete copy;
+		copy = NULL;
 		eof = true;
 		state = CLOSED;
 	}
 
+	/**
+	 * Close the client socket of a connection that does
+	 * its I/O on a file descriptor handed over by the
+	 * client. For SEND streams, this tells the client that
+	 * we have read all of its input.
+	 */
+	void release_control()
+	{
+		if (control == NULL)
+			return;
+		flush_reply(control);
+		bufferevent_free(control);
+		control = NULL;
+		if (socket != -1)
+			evutil_closesocket(socket);
+		socket = -1;
+	}
+
+	/**
+	 * Write out our last reply to the client (e.g. "OK"),
+	 * which would be lost if 'client' was freed with the
+	 * reply still queued
+	 */
+	void flush_reply(struct bufferevent* client)
+	{
+		struct evbuffer* output = bufferevent_get_output(client);
+		if (evbuffer_get_length(output) > 0) {
+			evbuffer_unfreeze(output, 1);
+			evbuffer_write(output, socket);
+		}
+	}
+
 	void printState()
 	{
 		printf("connection state:\n");
@@ -171,13 +496,21 @@ struct Connection {
 			case MPI_READY_TO_RECV_CHUNK_SIZE:
 			case MPI_READY_TO_RECV_CHUNK:
 			case MPI_RECVING_CHUNK_SIZE:
+			case MPI_RECVING_STREAM_SIZE:
 			case MPI_RECVING_CHUNK:
+			case MPI_SENDING_STREAM_SIZE:
 			case MPI_READY_TO_SEND_CHUNK_SIZE:
 			case MPI_READY_TO_SEND_CHUNK:
 			case MPI_SENDING_CHUNK_SIZE:
 			case MPI_SENDING_CHUNK:
 			case MPI_SENDING_EOF:
+			case MPI_SENDING_LOCAL_OFFER:
+			case LOCAL_COPYING:
+			case MPI_SENDING_LOCAL_DONE:
+			case MPI_SENDING_LOCAL_REPLY:
+			case MPI_WAITING_FOR_LOCAL_COPY:
 			case WAITING_FOR_MPI_CHANNEL:
+			case WAITING_FOR_SEND_SLOT:
 				return true;
 			default:
 				return false;
@@ -190,16 +523,24 @@ struct Connection {
 		switch (state) {
 		case READING_HEADER:
 			s = "READING_HEADER"; break;
+		case WAITING_FOR_FD:
+			s = "WAITING_FOR_FD"; break;
 		case WAITING_FOR_MPI_CHANNEL:
 			s = "WAITING_FOR_MPI_CHANNEL"; break;
+		case WAITING_FOR_SEND_SLOT:
+			s = "WAITING_FOR_SEND_SLOT"; break;
 		case MPI_READY_TO_RECV_CHUNK_SIZE:
 			s = "MPI_READY_TO_RECV_CHUNK_SIZE"; break;
 		case MPI_RECVING_CHUNK_SIZE:
 			s = "MPI_RECVING_CHUNK_SIZE"; break;
+		case MPI_RECVING_STREAM_SIZE:
+			s = "MPI_RECVING_STREAM_SIZE"; break;
 		case MPI_READY_TO_RECV_CHUNK:
 			s = "MPI_READY_TO_RECV_CHUNK"; break;
 		case MPI_RECVING_CHUNK:
 			s = "MPI_RECVING_CHUNK"; break;
+		case MPI_SENDING_STREAM_SIZE:
+			s = "MPI_SENDING_STREAM_SIZE"; break;
 		case MPI_READY_TO_SEND_CHUNK_SIZE:
 			s = "MPI_READY_TO_SEND_CHUNK_SIZE"; break;
 		case MPI_SENDING_CHUNK_SIZE:
@@ -210,8 +551,20 @@ struct Connection {
 			s = "MPI_SENDING_CHUNK"; break;
 		case MPI_SENDING_EOF:
 			s = "MPI_SENDING_EOF"; break;
+		case MPI_SENDING_LOCAL_OFFER:
+			s = "MPI_SENDING_LOCAL_OFFER"; break;
+		case LOCAL_COPYING:
+			s = "LOCAL_COPYING"; break;
+		case MPI_SENDING_LOCAL_DONE:
+			s = "MPI_SENDING_LOCAL_DONE"; break;
+		case MPI_SENDING_LOCAL_REPLY:
+			s = "MPI_SENDING_LOCAL_REPLY"; break;
+		case MPI_WAITING_FOR_LOCAL_COPY:
+			s = "MPI_WAITING_FOR_LOCAL_COPY"; break;
 		case MPI_FINALIZE:
 			s = "MPI_FINALIZE"; break;
+		case WAITING_FOR_DETACHED_SENDS:
+			s = "WAITING_FOR_DETACHED_SENDS"; break;
 		case FLUSHING_SOCKET:
 			s = "FLUSHING_SOCKET"; break;
 		case DONE:
@@ -243,31 +596,192 @@ struct Connection {
 		return evbuffer_get_length(getOutputBuffer());
 	}
 
+	/**
+	 * Received data that has not yet been written to the
+	 * client socket, including any data in the spool.
+	 */
+	size_t bytesPending()
+	{
+		return bytesQueued() + (spool != NULL ? spool->size() : 0);
+	}
+
+	/**
+	 * Queue received data for writing to the client socket.
+	 * If the client is not keeping up, the data is spilled
+	 * to the spool instead, and replayed by
+	 * refill_from_spool() as the socket drains.
+	 */
+	void queue_output(const char* data, size_t len)
+	{
+		bool spooling = spool != NULL && !spool->empty();
+		if (!spooling && !opt::spoolDir.empty()
+			&& bytesQueued() + len > buffer_limit(SPOOL_THRESHOLD)) {
+			if (spool == NULL) {
+				spool = new Spool(opt::spoolDir, connection_id);
+				/* invoke write callback while there is still
+				 * data queued, to keep the socket busy */
+				bufferevent_setwatermark(bev, EV_WRITE,
+					SPOOL_READ_SIZE, 0);
+			}
+			if (opt::verbose >= 2)
+				log_f(connection_id, "client is not keeping up, "
+					"spooling data to disk");
+			spooling = true;
+		}
+		if (spooling)
+			spool->append(data, len);
+		else
+			evbuffer_add(getOutputBuffer(), data, len);
+	}
+
+	/**
+	 * Move data from the spool to the client socket, until
+	 * the amount of data queued in memory reaches
+	 * SPOOL_THRESHOLD.
+	 */
+	void refill_from_spool()
+	{
+		assert(spool != NULL);
+		struct evbuffer* output = getOutputBuffer();
+		while (!spool->empty() &&
+			evbuffer_get_length(output) < buffer_limit(SPOOL_THRESHOLD))
+			spool->read(output, SPOOL_READ_SIZE);
+		if (opt::verbose >= 3)
+			log_f(connection_id, "%lu bytes remaining in spool",
+				spool->size());
+	}
+
 	size_t bytesReady()
 	{
+		if (ring != NULL)
+			return ring->readable();
+		if (mapped != NULL)
+			return mapped->readable();
 		assert(bev != NULL);
 		struct evbuffer* input = bufferevent_get_input(bev);
 		assert(input != NULL);
 		return evbuffer_get_length(input);
 	}
 
+	/**
+	 * Input data from the client that has not been sent
+	 * yet, including any data in the spool.
+	 */
+	size_t bytesToSend()
+	{
+		return bytesReady() + (spool != NULL ? spool->size() : 0);
+	}
+
+	/**
+	 * Return true if there is input to send. When reading
+	 * from a shared-memory ring, we wait for a batch of
+	 * SEND_LOW_WATERMARK bytes (as libevent does for the
+	 * socket), and ask the client to ring our doorbell
+	 * when it is there.
+	 */
+	bool inputReady()
+	{
+		if (ring != NULL)
+			return ring->armReader(std::min(
+				buffer_limit(SEND_LOW_WATERMARK), ring->size()));
+		return bytesToSend() > 0;
+	}
+
+	/**
+	 * Spill input from a detached client to the spool,
+	 * once more than SPOOL_THRESHOLD bytes are waiting
+	 * to be sent. (Not needed when we are reading from
+	 * a regular file, which is as good as a spool.)
+	 */
+	void spool_input()
+	{
+		assert(detached);
+		if (opt::spoolDir.empty() || pump != NULL || mapped != NULL)
+			return;
+		bool spooling = spool != NULL && !spool->empty();
+		if (!spooling && bytesReady() <= buffer_limit(SPOOL_THRESHOLD))
+			return;
+		if (spool == NULL)
+			spool = new Spool(opt::spoolDir, connection_id);
+		if (opt::verbose >= 3 && !spooling)
+			log_f(connection_id, "spooling input from detached "
+				"client to disk");
+		spool->append(bufferevent_get_input(bev));
+	}
+
+	/**
+	 * Remove the next 'len' bytes of input data from the
+	 * spool and/or the socket buffer, and copy them
+	 * to 'dest'.
+	 */
+	void remove_input(char* dest, size_t len)
+	{
+		assert(len <= bytesToSend());
+		struct evbuffer* input = bufferevent_get_input(bev);
+		assert(input != NULL);
+		if (spool != NULL && !spool->empty()) {
+			/* preserve ordering of spooled and unspooled input */
+			spool->append(input);
+			size_t n = spool->read(dest, len);
+			assert(n == len);
+		} else {
+			int n = evbuffer_remove(input, dest, len);
+			assert(n >= 0 && (size_t)n == len);
+		}
+	}
+
+	/**
+	 * The pipe that 'bev' reads/writes directly (a pipe
+	 * handed over by the client, or the named pipe of a
+	 * FIFO stream), or -1 if it doesn't
+	 */
+	int pipe_fd()
+	{
+		if (bev == NULL || pump != NULL || ring != NULL ||
+			mux != NULL)
+			return -1;
+		int fd = bufferevent_getfd(bev);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode))
+			return -1;
+		return fd;
+	}
+
 	void schedule_event(event_callback_fn callback,
 		size_t microseconds)
 	{
+		assert(bev != NULL);
+		assert(callback != NULL);
+		struct timeval time;
+		time.tv_sec = microseconds / 1000000;
+		time.tv_usec = microseconds % 1000000;
+
+		/* (reuse the timer, rather than allocate one per poll) */
+		if (next_event != NULL && event_get_fd(next_event) == -1 &&
+			event_get_callback(next_event) == callback) {
+			event_add(next_event, &time);
+			return;
+		}
 		if (next_event != NULL)
 			event_free(next_event);
 
-		assert(bev != NULL);
-		assert(callback != NULL);
 		struct event_base* base = bufferevent_get_base(bev);
 		assert(base != NULL);
-		struct timeval time;
-		time.tv_sec = 0;
-		time.tv_usec = microseconds;
 		next_event = event_new(base, -1, 0, callback, this);
 		event_add(next_event, &time);
 	}
 
+	/**
+	 * Check on our pending MPI requests again after a while
+	 * (see mpi_poll_interval()).
+	 */
+	void poll_mpi()
+	{
+		idle_polls = state == polled_state ? idle_polls + 1 : 0;
+		polled_state = state;
+		schedule_event(update_mpi_status, mpi_poll_interval(idle_polls));
+	}
+
 	/**
 	 * Callback to update state when we are waiting
 	 * for an MPI channel in order to do a SEND/RECV.
@@ -278,15 +792,13 @@ struct Connection {
 		ChannelRequestResult result = manager.requestChannel(
 			connection_id, channel);
 		if (result == QUEUED) {
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
 			return;
 		}
 		assert(result == GRANTED);
 		holding_mpi_channel = true;
 		if (channel.m_xferDir == SEND) {
-			state = MPI_READY_TO_SEND_CHUNK_SIZE;
-			if (bytesReady() > 0)
-				mpi_send_chunk_size(*this);
+			mpi_start_send(*this);
 		} else {
 			assert(channel.m_xferDir == RECV);
 			state = MPI_READY_TO_RECV_CHUNK_SIZE;
@@ -308,7 +820,7 @@ struct Connection {
 			if (opt::verbose >= 3)
 				log_f(connection_id, "waiting for pending MPI "
 						"transfers to complete");
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
 			return;
 		}
 
@@ -319,6 +831,55 @@ struct Connection {
 		event_base_loopexit(getBase(), NULL);
 	}
 
+	/**
+	 * Callback to update state of 'mpih wait' command.
+	 * Close the connection (which signals the client)
+	 * once all detached sends have completed.
+	 */
+	void update_wait_state()
+	{
+		assert(state == WAITING_FOR_DETACHED_SENDS);
+
+		if (::detached_sends_pending()) {
+			poll_mpi();
+			return;
+		}
+
+		if (opt::verbose)
+			log_f(connection_id, "detached sends complete");
+
+		close_connection(*this);
+	}
+
+	/**
+	 * Callback to update state when announcing the size
+	 * of a SEND stream to the remote rank.
+	 */
+	void update_mpi_send_stream_size_state()
+	{
+		assert(state == MPI_SENDING_STREAM_SIZE);
+
+		MPI_Status status;
+		int completed, size_completed;
+		MPI_Test(&chunk_size_request_id, &completed, &status);
+		MPI_Test(&chunk_request_id, &size_completed, &status);
+
+		if (opt::verbose >= 3)
+			log_f(connection_id, "%s: stream size to rank %d",
+				completed && size_completed ? "send completed" :
+				"waiting on send", rank);
+
+		if (!completed || !size_completed) {
+			poll_mpi();
+			return;
+		}
+
+		clear_mpi_state();
+		state = MPI_READY_TO_SEND_CHUNK_SIZE;
+		if (eof || inputReady())
+			mpi_send_chunk_size(*this);
+	}
+
 	/**
 	 * Callback to update state of 'mpih send' command.
 	 */
@@ -337,7 +898,7 @@ struct Connection {
 		}
 
 		if (!completed) {
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
 			return;
 		}
 
@@ -360,7 +921,7 @@ struct Connection {
 		}
 
 		if (!completed) {
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
 			return;
 		}
 
@@ -369,10 +930,29 @@ struct Connection {
 		if (opt::verbose)
 			log_f(connection_id, "sent %lu bytes to rank %d so far",
 				bytes_transferred, rank);
+		/* let the client reuse the ring space we sent from */
+		if (chunk_borrowed && ring != NULL)
+			ring->release(chunk_size);
+		bool failed = chunk_borrowed && mapped != NULL &&
+			!mapped->release(chunk_size);
+		if (failed)
+			log_f(connection_id, "error reading client file (after "
+				"%lu bytes): %s", bytes_transferred, strerror(errno));
 		clear_mpi_state();
+
+		/* let the next stream in line have our send slot */
+		assert(holding_send_slot);
+		SendScheduler::getInstance().complete(connection_id);
+		holding_send_slot = false;
+		run_send_scheduler(getBase());
+
+		if (failed) {
+			mpi_send_stream_error(*this);
+			return;
+		}
 		state = MPI_READY_TO_SEND_CHUNK_SIZE;
 		chunk_index++;
-		if (eof || bytesReady() > 0)
+		if (eof || inputReady())
 			mpi_send_chunk_size(*this);
 	}
 
@@ -402,7 +982,7 @@ struct Connection {
 				log_f(connection_id, "closing connection from mpi handler");
 			close_connection(*this);
 		} else {
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
 		}
 	}
 
@@ -424,6 +1004,24 @@ struct Connection {
 					chunk_index, rank);
 		}
 
+		if (completed && chunk_size == STREAM_SIZE_MARKER) {
+			mpi_recv_stream_size(*this);
+			return;
+		}
+
+		if (completed && chunk_size == LOCAL_COPY_MARKER) {
+			mpi_answer_local_copy(*this);
+			return;
+		}
+
+		if (completed && chunk_size == STREAM_ERROR_MARKER) {
+			log_f(connection_id, "error: rank %d could not send the "
+				"rest of the stream (after %lu bytes)", rank,
+				bytes_transferred);
+			close_connection(*this);
+			return;
+		}
+
 		if (completed) {
 			chunk_index++;
 			int count;
@@ -433,7 +1031,7 @@ struct Connection {
 				if (opt::verbose)
 					log_f(connection_id, "received EOF from rank %d", rank);
 				state = FLUSHING_SOCKET;
-				if (bytesQueued() == 0)
+				if (bytesPending() == 0)
 					close_connection(*this);
 			}
 			else {
@@ -447,7 +1045,44 @@ struct Connection {
 		}
 
 		if (!completed)
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
+	}
+
+	/**
+	 * Callback to update state when receiving the
+	 * announced size of the stream
+	 */
+	void update_mpi_recv_stream_size_state()
+	{
+		assert(state == MPI_RECVING_STREAM_SIZE);
+
+		MPI_Status status;
+		int completed;
+		MPI_Test(&chunk_request_id, &completed, &status);
+
+		if (opt::verbose >= 3)
+			log_f(connection_id, "%s: stream size from rank %d",
+				completed ? "recv completed" : "waiting on recv", rank);
+
+		if (!completed) {
+			poll_mpi();
+			return;
+		}
+
+		if (opt::verbose >= 2)
+			log_f(connection_id, "rank %d is sending %lu bytes "
+				"(from file offset %lu)", rank, stream_extent[0],
+				stream_extent[1]);
+		if (sink != NULL && striped)
+			sink->seek(stream_extent[1]);
+		if (sink != NULL && !sink->preallocate(stream_extent[0]) &&
+			opt::verbose >= 2)
+			log_f(connection_id, "can't preallocate client file: %s",
+				strerror(errno));
+
+		clear_mpi_state();
+		state = MPI_READY_TO_RECV_CHUNK_SIZE;
+		mpi_recv_chunk_size(*this);
 	}
 
 	/** Callback to update state when receiving data chunk */
@@ -474,10 +1109,22 @@ struct Connection {
 				log_f(connection_id, "received %lu bytes from rank %d so far",
 					bytes_transferred, rank);
 			}
-			// copy recv'd data from MPI buffer to Unix socket
 			assert(chunk_size > 0);
-			evbuffer_add(getOutputBuffer(), chunk_buffer,
-				chunk_size);
+			if (chunk_borrowed) {
+				// data is already in place; hand it to the client
+				ring->publish(chunk_size);
+			} else if (sink != NULL) {
+				// write straight to the client's file
+				if (!sink->write(chunk_buffer, chunk_size)) {
+					log_f(connection_id, "error writing client "
+						"file: %s", strerror(errno));
+					close_connection(*this);
+					return;
+				}
+			} else {
+				// copy recv'd data from MPI buffer to Unix socket
+				queue_output(chunk_buffer, chunk_size);
+			}
 			// clear MPI buffer and other state
 			clear_mpi_state();
 			// post receive for size of next chunk
@@ -485,7 +1132,137 @@ struct Connection {
 			mpi_recv_chunk_size(*this);
 		}
 		if (!completed)
-			schedule_event(update_mpi_status, MPI_POLL_INTERVAL);
+			poll_mpi();
+	}
+
+	/**
+	 * Callback to update state when we have offered the
+	 * receiver a same-node copy (SEND), and are waiting
+	 * for its answer.
+	 */
+	void update_mpi_send_local_offer_state()
+	{
+		assert(state == MPI_SENDING_LOCAL_OFFER);
+
+		MPI_Status status;
+		int sent, answered;
+		MPI_Test(&chunk_size_request_id, &sent, &status);
+		MPI_Test(&chunk_request_id, &answered, &status);
+
+		if (opt::verbose >= 3)
+			log_f(connection_id, "%s: same-node copy offer to rank %d",
+				sent && answered ? "answer received" :
+				"waiting on answer", rank);
+
+		if (!sent || !answered) {
+			poll_mpi();
+			return;
+		}
+
+		clear_mpi_state();
+		if (local_reply[LOCAL_PID] == 0) {
+			if (opt::verbose >= 2)
+				log_f(connection_id, "rank %d declined a same-node "
+					"copy; sending through MPI", rank);
+			local_peer = false;
+			mpi_start_send(*this);
+			return;
+		}
+		start_local_copy(*this);
+	}
+
+	/**
+	 * Callback to update state when telling the receiver
+	 * that a same-node copy has ended (SEND).
+	 */
+	void update_mpi_send_local_done_state()
+	{
+		assert(state == MPI_SENDING_LOCAL_DONE);
+
+		MPI_Status status;
+		int completed;
+		MPI_Test(&chunk_request_id, &completed, &status);
+
+		if (!completed) {
+			poll_mpi();
+			return;
+		}
+
+		clear_mpi_state();
+		if (local_done[0] != LOCAL_NOT_COPIED) {
+			close_connection(*this);
+			return;
+		}
+		/* we couldn't start the copy after all */
+		local_peer = false;
+		mpi_start_send(*this);
+	}
+
+	/**
+	 * Callback to update state when we have declined a
+	 * same-node copy (RECV), and the data follows through
+	 * MPI once the sender has our answer.
+	 */
+	void update_mpi_send_local_reply_state()
+	{
+		assert(state == MPI_SENDING_LOCAL_REPLY);
+
+		MPI_Status status;
+		int completed;
+		MPI_Test(&chunk_size_request_id, &completed, &status);
+
+		if (!completed) {
+			poll_mpi();
+			return;
+		}
+
+		clear_mpi_state();
+		state = MPI_READY_TO_RECV_CHUNK_SIZE;
+		mpi_recv_chunk_size(*this);
+	}
+
+	/**
+	 * Callback to update state while the sender copies
+	 * the stream into our client's output (RECV).
+	 */
+	void update_mpi_local_copy_state()
+	{
+		assert(state == MPI_WAITING_FOR_LOCAL_COPY);
+
+		MPI_Status status;
+		int answered, done;
+		MPI_Test(&chunk_size_request_id, &answered, &status);
+		MPI_Test(&chunk_request_id, &done, &status);
+
+		if (!answered || !done) {
+			poll_mpi();
+			return;
+		}
+
+		clear_mpi_state();
+		if (local_done[0] == LOCAL_NOT_COPIED) {
+			/* the sender couldn't open our client's output */
+			state = MPI_READY_TO_RECV_CHUNK_SIZE;
+			mpi_recv_chunk_size(*this);
+			return;
+		}
+
+		bytes_transferred = local_done[1];
+		if (local_done[0] == LOCAL_COPY_FAILED) {
+			log_f(connection_id, "error: rank %d failed to copy the "
+				"stream to the client on the same node (after %lu "
+				"bytes)", rank, bytes_transferred);
+			close_connection(*this);
+			return;
+		}
+		if (opt::verbose)
+			log_f(connection_id, "rank %d copied %lu bytes to the "
+				"client on the same node", rank, bytes_transferred);
+
+		/* (leave the client's file offset after the data) */
+		if (sink != NULL)
+			sink->skip(bytes_transferred);
+		close_connection(*this);
 	}
 
 private:
@@ -508,6 +1285,14 @@ close_connection(Connection& connection)
 	if (opt::verbose)
 		log_f(connection.id(), "closing connection");
 
+	/*
+	 * If the connection was holding a send slot (e.g. the
+	 * client went away mid-transfer), pass it on.
+	 */
+	struct event_base* base = NULL;
+	if (connection.holding_send_slot)
+		base = connection.getBase();
+
 	connection.close();
 
 	ConnectionList::iterator it = std::find(
@@ -517,6 +1302,21 @@ close_connection(Connection& connection)
 	assert(it != g_connections.end());
 	delete *it;
 	g_connections.erase(it);
+
+	if (base != NULL)
+		run_send_scheduler(base);
+}
+
+static inline Connection*
+find_connection(size_t connectionID)
+{
+	ConnectionList::iterator it = g_connections.begin();
+	for (; it != g_connections.end(); ++it) {
+		assert(*it != NULL);
+		if ((*it)->id() == connectionID)
+			return *it;
+	}
+	return NULL;
 }
 
 static inline void
@@ -541,4 +1341,19 @@ static inline bool mpi_ops_pending()
 	return false;
 }
 
+/**
+ * Return true if any 'mpih send --detach' streams
+ * have not completed yet.
+ */
+static inline bool detached_sends_pending()
+{
+	ConnectionList::iterator it = g_connections.begin();
+	for (; it != g_connections.end(); ++it) {
+		assert(*it != NULL);
+		if ((*it)->detached)
+			return true;
+	}
+	return false;
+}
+
 #endif
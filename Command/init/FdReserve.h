@@ -0,0 +1,85 @@
+#ifndef _FD_RESERVE_H_
+#define _FD_RESERVE_H_
+
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Number of file descriptors that the daemon keeps in
+ * reserve (see FdReserve)
+ */
+static const int FD_HEADROOM = 32;
+
+/**
+ * A singleton class that holds FD_HEADROOM descriptors
+ * (of /dev/null) in reserve, so that the daemon can tell
+ * when it is running low on descriptors without probing
+ * for free ones.
+ *
+ * While we hold the reserve, an accept() that fails with
+ * EMFILE means that we are down to our reserve, and we
+ * give it up, so that the streams we are already serving
+ * have descriptors to work with. A client's descriptor is
+ * lost if recvmsg() has no free slot for it, so we only
+ * ask for one while we hold the reserve, and close as
+ * many reserved descriptors as we are about to receive.
+ *
+ * The reserve is either full or empty: fill() takes all
+ * of it back, or none.
+ */
+class FdReserve
+{
+public:
+
+	static FdReserve& getInstance()
+	{
+		static FdReserve instance;
+		return instance;
+	}
+
+	/**
+	 * Take back the whole reserve, if there are enough
+	 * free descriptors.
+	 *
+	 * @return true if we hold the full reserve
+	 */
+	bool fill()
+	{
+		while (m_fds.size() < (size_t)FD_HEADROOM) {
+			int fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+			if (fd < 0) {
+				release();
+				return false;
+			}
+			m_fds.push_back(fd);
+		}
+		return true;
+	}
+
+	/**
+	 * Close 'count' reserved descriptors (or all of them,
+	 * if negative), so that we can open as many
+	 */
+	void release(int count = -1)
+	{
+		while (count-- != 0 && !m_fds.empty()) {
+			close(m_fds.back());
+			m_fds.pop_back();
+		}
+	}
+
+private:
+
+	FdReserve() {}
+	~FdReserve() { release(); }
+
+	/* disable copy constructor and assignment operator */
+	FdReserve(const FdReserve&);
+	void operator=(const FdReserve&);
+
+	/** reserved descriptors */
+	std::vector<int> m_fds;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef _FILE_PUMP_H_
+#define _FILE_PUMP_H_
+
+#include "Command/init/log.h"
+#include "Command/init/footprint.h"
+#include "Command/init/MPIChannel.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+/**
+ * Max bytes to read from a file per read() call, and
+ * the amount of file data kept queued ahead of the
+ * connection (bytes).
+ */
+static const size_t FILE_PUMP_READ_SIZE = 1 * 1024 * 1024;
+
+/**
+ * Moves stream data between a regular file, handed to
+ * the daemon by an 'mpih send' or 'mpih recv' client,
+ * and a Connection.
+ *
+ * Regular files can't be watched with epoll, so we can't
+ * just wrap them in a socket bufferevent. Instead, the
+ * Connection gets one end of a bufferevent pair, and the
+ * pump reads/writes the file on the other end whenever
+ * the Connection drains/fills its buffers. Data moves
+ * between the two ends without being copied.
+ */
+class FilePump
+{
+public:
+
+	/**
+	 * @param fd file to read (dir == SEND) or write
+	 * (dir == RECV); closed when the pump is deleted
+	 */
+	FilePump(struct event_base* base, int fd, XferDir dir) :
+		m_fd(fd), m_dir(dir), m_eof(false)
+	{
+		assert(base != NULL);
+		assert(fd >= 0);
+		/* deferred, so that fill() doesn't recurse */
+		struct bufferevent* pair[2];
+		int result = bufferevent_pair_new(base,
+			BEV_OPT_DEFER_CALLBACKS, pair);
+		assert(result == 0);
+		m_bev = pair[0];
+		m_pump = pair[1];
+
+		if (dir == SEND) {
+			bufferevent_setcb(m_pump, NULL, pump_write_handler,
+				NULL, this);
+			bufferevent_enable(m_pump, EV_WRITE);
+			fill();
+		} else {
+			bufferevent_setcb(m_pump, pump_read_handler, NULL,
+				NULL, this);
+			bufferevent_enable(m_pump, EV_READ);
+		}
+	}
+
+	/**
+	 * Close the file. The Connection end of the pair
+	 * must already have been freed.
+	 */
+	~FilePump()
+	{
+		if (m_dir == RECV)
+			drain();
+		bufferevent_free(m_pump);
+		if (close(m_fd) < 0)
+			perror("close");
+	}
+
+	/** The Connection's end of the pair */
+	struct bufferevent* bev()
+	{
+		return m_bev;
+	}
+
+private:
+
+	/**
+	 * Read the next block of the file. Once we have
+	 * reached the end of the file and the Connection has
+	 * taken all of the data, signal EOF to the Connection.
+	 */
+	void fill()
+	{
+		struct evbuffer* output = bufferevent_get_output(m_pump);
+		size_t readSize = buffer_limit(FILE_PUMP_READ_SIZE);
+		if (!m_eof && evbuffer_get_length(output) < readSize) {
+			/* (evbuffer_read() reads at most 4K per call) */
+			struct evbuffer_iovec vec[2];
+			int count = evbuffer_reserve_space(output,
+				readSize, vec, 2);
+			assert(count > 0);
+			ssize_t n = readv(m_fd, (struct iovec*)vec, count);
+			if (n < 0)
+				fprintf(g_log, "error reading client file: %s\n",
+					strerror(errno));
+			m_eof = n <= 0;
+			size_t remaining = n > 0 ? n : 0;
+			for (int i = 0; i < count; ++i) {
+				vec[i].iov_len = std::min(remaining, vec[i].iov_len);
+				remaining -= vec[i].iov_len;
+			}
+			evbuffer_commit_space(output, vec, count);
+		}
+		if (m_eof && evbuffer_get_length(output) == 0) {
+			bufferevent_disable(m_pump, EV_WRITE);
+			bufferevent_trigger_event(m_bev,
+				BEV_EVENT_EOF|BEV_EVENT_READING, 0);
+		}
+	}
+
+	/** Write all data received from the Connection to the file */
+	void drain()
+	{
+		struct evbuffer* input = bufferevent_get_input(m_pump);
+		while (evbuffer_get_length(input) > 0) {
+			int n = evbuffer_write(input, m_fd);
+			if (n < 0) {
+				fprintf(g_log, "error writing client file: %s\n",
+					strerror(errno));
+				evbuffer_drain(input, evbuffer_get_length(input));
+				return;
+			}
+		}
+	}
+
+	static void pump_write_handler(struct bufferevent*, void* arg)
+	{
+		assert(arg != NULL);
+		((FilePump*)arg)->fill();
+	}
+
+	static void pump_read_handler(struct bufferevent*, void* arg)
+	{
+		assert(arg != NULL);
+		((FilePump*)arg)->drain();
+	}
+
+	/* disable copy constructor and assignment operator */
+	FilePump(const FilePump&);
+	void operator=(const FilePump&);
+
+	/** file handed over by the client */
+	int m_fd;
+	/** SEND: read from file, RECV: write to file */
+	XferDir m_dir;
+	/** true once we have read to the end of the file */
+	bool m_eof;
+	/** Connection's end of the bufferevent pair */
+	struct bufferevent* m_bev;
+	/** our end of the bufferevent pair */
+	struct bufferevent* m_pump;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef _FILE_SINK_H_
+#define _FILE_SINK_H_
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Output of a RECV stream written straight to a regular
+ * file handed over by an 'mpih recv' client: each MPI
+ * chunk goes to the file with one large pwrite(), at the
+ * file's current offset, rather than through a
+ * bufferevent.
+ *
+ * If the sender announces the size of the stream, the
+ * space is allocated up front, so that the file system
+ * can lay the file out contiguously.
+ */
+class FileSink
+{
+public:
+
+	/**
+	 * Start writing to 'fd' at its current offset (or at
+	 * the end of the file, if it was opened for appending).
+	 * Takes ownership of 'fd' if successful.
+	 *
+	 * @return NULL if 'fd' is not a regular file (with
+	 * errno set)
+	 */
+	static FileSink* open(int fd)
+	{
+		struct stat st;
+		if (fstat(fd, &st) < 0)
+			return NULL;
+		if (!S_ISREG(st.st_mode)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		int flags = fcntl(fd, F_GETFL);
+		off_t offset = (flags >= 0 && (flags & O_APPEND)) ?
+			st.st_size : lseek(fd, 0, SEEK_CUR);
+		if (offset < 0)
+			return NULL;
+		return new FileSink(fd, offset);
+	}
+
+	/**
+	 * Close the file. Unless we have been told where to
+	 * write with seek(), the file offset is left after the
+	 * data we have written, as if we had write()n it.
+	 */
+	~FileSink()
+	{
+		if (m_moveOffset)
+			lseek(m_fd, m_offset, SEEK_SET);
+		close(m_fd);
+	}
+
+	/**
+	 * Write the following data at file offset 'offset' (for
+	 * one stripe of a striped transfer). The file offset
+	 * of the descriptor is then left alone.
+	 */
+	void seek(off_t offset)
+	{
+		m_offset = offset;
+		m_moveOffset = false;
+	}
+
+	/**
+	 * Allocate disk space for the next 'len' bytes. This
+	 * is only a hint: the size of the file is unchanged,
+	 * and failure (e.g. no support from the file system)
+	 * is harmless.
+	 *
+	 * @return false if the space could not be allocated
+	 * (with errno set)
+	 */
+	bool preallocate(uint64_t len)
+	{
+		if (len == 0)
+			return true;
+		return fallocate(m_fd, FALLOC_FL_KEEP_SIZE, m_offset, len) == 0;
+	}
+
+	/**
+	 * Write all of 'data' at the current offset, and start
+	 * writeback of it, so that dirty pages don't pile up
+	 * in the page cache.
+	 *
+	 * @return false on error (with errno set)
+	 */
+	bool write(const char* data, size_t len)
+	{
+		off_t start = m_offset;
+		while (len > 0) {
+			ssize_t n = pwrite(m_fd, data, len, m_offset);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				return false;
+			data += n;
+			len -= n;
+			m_offset += n;
+		}
+		sync_file_range(m_fd, start, m_offset - start,
+			SYNC_FILE_RANGE_WRITE);
+		return true;
+	}
+
+	/** offset of the next write */
+	off_t offset() const
+	{
+		return m_offset;
+	}
+
+	/** the file descriptor (owned by us) */
+	int fd() const
+	{
+		return m_fd;
+	}
+
+	/**
+	 * Skip the next 'len' bytes, which have been written by
+	 * other means (see LocalCopy)
+	 */
+	void skip(uint64_t len)
+	{
+		m_offset += len;
+	}
+
+private:
+
+	FileSink(int fd, off_t offset) :
+		m_fd(fd), m_moveOffset(true), m_offset(offset) {}
+
+	/* disable copy constructor and assignment operator */
+	FileSink(const FileSink&);
+	void operator=(const FileSink&);
+
+	/** file handed over by the client */
+	int m_fd;
+	/** true if we leave the file offset after the data we wrote */
+	bool m_moveOffset;
+	/** offset of the next write */
+	off_t m_offset;
+};
+
+#endif
@@ -0,0 +1,923 @@
+#ifndef _IO_URING_REACTOR_H_
+#define _IO_URING_REACTOR_H_
+
+#include "config.h"
+#include "Command/init/log.h"
+#include "Command/init/FdReserve.h"
+#include "Options/CommonOptions.h"
+#include "IO/SocketUtil.h"
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+namespace opt {
+	/** -U,--io-uring: do client socket I/O with io_uring */
+	static int ioUring;
+}
+
+/** called for each client socket accepted by the reactor */
+typedef void (*URingAcceptCallback)(struct event_base* base,
+	evutil_socket_t fd);
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+/*
+ * Kernel-allocated buffer rings (Linux 6.4) are missing
+ * from older kernel headers, where the flags field of
+ * io_uring_buf_reg is still called 'pad'.
+ */
+#ifndef IORING_OFF_PBUF_RING
+#define IORING_OFF_PBUF_RING 0x80000000ULL
+#define IORING_OFF_PBUF_SHIFT 16
+#define URING_PBUF_RING_MMAP 1
+#define URING_BUF_REG_FLAGS pad
+#else
+#define URING_PBUF_RING_MMAP IOU_PBUF_RING_MMAP
+#define URING_BUF_REG_FLAGS flags
+#endif
+
+/** size of io_uring submission queue */
+static const unsigned URING_QUEUE_DEPTH = 256;
+
+/** number of provided buffers for receiving (power of 2) */
+static const unsigned URING_RECV_BUFFERS = 256;
+
+/** size of each provided receive buffer (bytes) */
+static const size_t URING_RECV_BUFFER_SIZE = 64 * 1024;
+
+/**
+ * Once fewer than this many receive buffers are free,
+ * received data is copied out of the buffer rather than
+ * referenced, so that idle clients can't starve others.
+ */
+static const unsigned URING_MIN_FREE_BUFFERS = URING_RECV_BUFFERS / 4;
+
+/** max bytes to write to a client socket per sendmsg */
+static const size_t URING_MAX_SEND = 1024 * 1024;
+
+/** max buffer segments per sendmsg */
+static const int URING_MAX_IOVECS = 64;
+
+/** Reactor state for one client socket */
+struct URingSocket
+{
+	/**
+	 * the client socket; once detached, our own duplicate
+	 * of it (-1 if none), since the caller closes theirs
+	 */
+	evutil_socket_t fd;
+	/** libevent-facing side of the socket (NULL once detached) */
+	struct bufferevent* bev;
+	/** output data handed to the kernel */
+	struct evbuffer* sending;
+	struct iovec iov[URING_MAX_IOVECS];
+	struct msghdr msg;
+	/** number of submitted operations that have not completed */
+	unsigned inflight;
+	/** true while a multishot recv is armed */
+	bool receiving;
+	/** true while a cancel of the recv is in flight */
+	bool cancelling;
+	/** true while a sendmsg is in flight */
+	bool sendPending;
+	/** true once the client has closed its end */
+	bool eof;
+};
+
+/**
+ * A singleton class that performs client socket I/O for
+ * the 'mpih init' daemon with io_uring ('mpih init
+ * --io-uring'), in place of libevent's socket
+ * bufferevents.
+ *
+ * Each client still gets a bufferevent, so the Connection
+ * state machine and event handlers work unchanged, but
+ * the bufferevent has no socket of its own. Instead:
+ *
+ * - a multishot accept on the listening socket creates
+ *   connections
+ * - a multishot recv per client receives data into a ring
+ *   of provided buffers registered with the kernel; full
+ *   buffers are attached to the bufferevent's input
+ *   without copying, and handed back to the kernel when
+ *   libevent releases them
+ * - output is written with one sendmsg per
+ *   URING_MAX_SEND bytes, straight from the bufferevent's
+ *   output chains
+ *
+ * Callbacks are fired with bufferevent_trigger(), which
+ * applies the usual watermarks; the recv is cancelled
+ * while input is above the high watermark.
+ *
+ * Completions are signalled on an eventfd watched by the
+ * libevent loop, and submissions are batched into one
+ * io_uring_enter() per pass of the loop.
+ */
+class IOURingReactor
+{
+public:
+
+	static IOURingReactor& getInstance()
+	{
+		static IOURingReactor instance;
+		return instance;
+	}
+
+	/** true if init() succeeded */
+	bool active() const
+	{
+		return m_ringFd >= 0;
+	}
+
+	/**
+	 * Set up the ring. On failure (e.g. old kernel),
+	 * logs the reason and returns false, so that the
+	 * caller can fall back to libevent.
+	 */
+	bool init(struct event_base* base)
+	{
+		assert(base != NULL);
+		assert(m_ringFd < 0);
+		m_base = base;
+
+		/* kernel-allocated buffer rings appeared in Linux 6.4 */
+		struct utsname name;
+		int major = 0, minor = 0;
+		if (uname(&name) == 0)
+			sscanf(name.release, "%d.%d", &major, &minor);
+		if (major < 6 || (major == 6 && minor < 4)) {
+			fprintf(g_log, "io_uring reactor requires Linux 6.4 or "
+				"newer (running %s); using libevent\n", name.release);
+			return false;
+		}
+
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+		if (fd < 0) {
+			fprintf(g_log, "io_uring_setup: %s; using libevent\n",
+				strerror(errno));
+			return false;
+		}
+		m_ringFd = fd;
+		if (!mapRings(params) || !registerBuffers() ||
+			!registerEventfd()) {
+			shutdown();
+			return false;
+		}
+
+		m_eventfdEvent = event_new(base, m_eventfd, EV_READ|EV_PERSIST,
+			eventfd_handler, this);
+		assert(m_eventfdEvent != NULL);
+		int result = event_add(m_eventfdEvent, NULL);
+		assert(result == 0);
+
+		m_submitEvent = event_new(base, -1, 0, submit_handler, this);
+		assert(m_submitEvent != NULL);
+		m_rearmEvent = event_new(base, -1, 0, rearm_handler, this);
+		assert(m_rearmEvent != NULL);
+
+		if (opt::verbose)
+			fprintf(g_log, "using io_uring reactor for client "
+				"sockets\n");
+		return true;
+	}
+
+	/** Release the ring and log I/O statistics */
+	void shutdown()
+	{
+		if (m_ringFd < 0)
+			return;
+		if (opt::verbose && m_eventfdEvent != NULL)
+			fprintf(g_log, "io_uring reactor: received %lu bytes, "
+				"sent %lu bytes, %lu syscalls\n", m_bytesReceived,
+				m_bytesSent, m_syscalls);
+		if (m_eventfdEvent != NULL)
+			event_free(m_eventfdEvent);
+		if (m_submitEvent != NULL)
+			event_free(m_submitEvent);
+		if (m_rearmEvent != NULL)
+			event_free(m_rearmEvent);
+		m_eventfdEvent = m_submitEvent = m_rearmEvent = NULL;
+		/* closing the ring cancels all outstanding requests */
+		close(m_ringFd);
+		m_ringFd = -1;
+		if (m_eventfd >= 0)
+			close(m_eventfd);
+		m_eventfd = -1;
+		/* buffers may still be referenced by evbuffers; leave them */
+	}
+
+	/**
+	 * Accept clients on 'listener' with a multishot accept,
+	 * passing each new socket to 'callback'.
+	 */
+	void listen(evutil_socket_t listener, URingAcceptCallback callback)
+	{
+		assert(active());
+		m_listener = listener;
+		m_acceptCallback = callback;
+		armAccept();
+	}
+
+	/**
+	 * Create a bufferevent for client socket 'fd', whose
+	 * I/O is done by the reactor.
+	 */
+	struct bufferevent* newBufferevent(struct event_base* base,
+		evutil_socket_t fd)
+	{
+		assert(active());
+		/* no fd: libevent must not touch the socket itself */
+		struct bufferevent* bev = bufferevent_socket_new(base, -1, 0);
+		assert(bev != NULL);
+
+		URingSocket* sock = new URingSocket;
+		memset(sock, 0, sizeof(URingSocket));
+		sock->fd = fd;
+		sock->bev = bev;
+		sock->sending = evbuffer_new();
+		assert(sock->sending != NULL);
+		m_sockets[bev] = sock;
+
+		evbuffer_add_cb(bufferevent_get_input(bev),
+			input_buffer_cb, sock);
+		evbuffer_add_cb(bufferevent_get_output(bev),
+			output_buffer_cb, sock);
+
+		armRecv(sock);
+		return bev;
+	}
+
+	/**
+	 * Stop doing I/O for 'bev', which is about to be freed.
+	 * Output already handed to the kernel is still sent.
+	 * Does nothing if 'bev' is not managed by the reactor.
+	 */
+	void detach(struct bufferevent* bev)
+	{
+		SocketMap::iterator it = m_sockets.find(bev);
+		if (it == m_sockets.end())
+			return;
+		URingSocket* sock = it->second;
+		m_sockets.erase(it);
+		evbuffer_remove_cb(bufferevent_get_input(bev),
+			input_buffer_cb, sock);
+		evbuffer_remove_cb(bufferevent_get_output(bev),
+			output_buffer_cb, sock);
+		sock->bev = NULL;
+		m_starved.erase(std::remove(m_starved.begin(),
+			m_starved.end(), sock), m_starved.end());
+		if (sock->receiving)
+			cancelRecv(sock);
+		/*
+		 * the caller closes the socket next, and its number
+		 * may be reused by the next accept(), so the rest of
+		 * the output goes out on a duplicate of our own
+		 */
+		if (sock->sendPending || evbuffer_get_length(sock->sending) > 0) {
+			sock->fd = fcntl(sock->fd, F_DUPFD_CLOEXEC, 0);
+			if (sock->fd < 0) {
+				fprintf(g_log, "can't finish sending to closed client: "
+					"%s\n", strerror(errno));
+				evbuffer_drain(sock->sending,
+					evbuffer_get_length(sock->sending));
+			}
+		} else {
+			sock->fd = -1;
+		}
+		/* (the kernel holds its own reference for queued requests) */
+		submit();
+		maybeFree(sock);
+	}
+
+private:
+
+	typedef std::unordered_map<struct bufferevent*, URingSocket*>
+		SocketMap;
+
+	/** kinds of requests, stored in low bits of user_data */
+	enum { OP_ACCEPT=1, OP_RECV, OP_SEND, OP_CANCEL, OP_MASK=7 };
+
+	IOURingReactor() : m_base(NULL), m_ringFd(-1), m_eventfd(-1),
+		m_sqRing(NULL), m_sqRingSize(0), m_cqRing(NULL),
+		m_cqRingSize(0), m_sqes(NULL), m_sqesSize(0),
+		m_bufRing(NULL), m_buffers(NULL), m_freeBuffers(0),
+		m_listener(-1), m_acceptCallback(NULL), m_toSubmit(0),
+		m_current(NULL), m_eventfdEvent(NULL), m_submitEvent(NULL),
+		m_rearmEvent(NULL), m_bytesReceived(0), m_bytesSent(0),
+		m_syscalls(0) {}
+
+	/*
+	 * disable copy constructor and assignment operator
+	 * to prevent copies of the singleton instance
+	 */
+	IOURingReactor(IOURingReactor const&);
+	void operator=(IOURingReactor const&);
+
+	bool mapRings(const struct io_uring_params& params)
+	{
+		m_sqRingSize = params.sq_off.array +
+			params.sq_entries * sizeof(unsigned);
+		m_cqRingSize = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+		bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMmap)
+			m_sqRingSize = m_cqRingSize =
+				std::max(m_sqRingSize, m_cqRingSize);
+
+		m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+		if (m_sqRing == MAP_FAILED) {
+			fprintf(g_log, "mmap io_uring: %s\n", strerror(errno));
+			m_sqRing = NULL;
+			return false;
+		}
+		if (singleMmap) {
+			m_cqRing = m_sqRing;
+		} else {
+			m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+			if (m_cqRing == MAP_FAILED) {
+				fprintf(g_log, "mmap io_uring: %s\n", strerror(errno));
+				m_cqRing = NULL;
+				return false;
+			}
+		}
+		m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		m_sqes = (struct io_uring_sqe*)mmap(NULL, m_sqesSize,
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_ringFd,
+			IORING_OFF_SQES);
+		if (m_sqes == MAP_FAILED) {
+			fprintf(g_log, "mmap io_uring: %s\n", strerror(errno));
+			m_sqes = NULL;
+			return false;
+		}
+
+		char* sq = (char*)m_sqRing;
+		m_sqHead = (unsigned*)(sq + params.sq_off.head);
+		m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+		m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		m_sqEntries = params.sq_entries;
+		m_sqArray = (unsigned*)(sq + params.sq_off.array);
+
+		char* cq = (char*)m_cqRing;
+		m_cqHead = (unsigned*)(cq + params.cq_off.head);
+		m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+		m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+		return true;
+	}
+
+	/**
+	 * Register the ring of provided buffers for recv. The
+	 * ring itself is allocated by the kernel and mapped
+	 * through the ring fd.
+	 */
+	bool registerBuffers()
+	{
+		m_buffers = (char*)mmap(NULL,
+			URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE,
+			PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+		if (m_buffers == MAP_FAILED) {
+			fprintf(g_log, "mmap io_uring buffers: %s\n",
+				strerror(errno));
+			m_buffers = NULL;
+			return false;
+		}
+
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_entries = URING_RECV_BUFFERS;
+		reg.bgid = 0;
+		reg.URING_BUF_REG_FLAGS = URING_PBUF_RING_MMAP;
+		if (syscall(__NR_io_uring_register, m_ringFd,
+			IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			fprintf(g_log, "io_uring provided buffers: %s; "
+				"using libevent\n", strerror(errno));
+			return false;
+		}
+
+		size_t ringSize = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+		m_bufRing = (struct io_uring_buf_ring*)mmap(NULL, ringSize,
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_ringFd,
+			IORING_OFF_PBUF_RING |
+			((uint64_t)reg.bgid << IORING_OFF_PBUF_SHIFT));
+		if (m_bufRing == MAP_FAILED) {
+			fprintf(g_log, "mmap io_uring buffer ring: %s\n",
+				strerror(errno));
+			m_bufRing = NULL;
+			return false;
+		}
+
+		for (unsigned i = 0; i < URING_RECV_BUFFERS; ++i)
+			returnBuffer(i);
+		return true;
+	}
+
+	bool registerEventfd()
+	{
+		m_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (m_eventfd < 0) {
+			fprintf(g_log, "eventfd: %s\n", strerror(errno));
+			return false;
+		}
+		if (syscall(__NR_io_uring_register, m_ringFd,
+			IORING_REGISTER_EVENTFD, &m_eventfd, 1) < 0) {
+			fprintf(g_log, "io_uring eventfd: %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	/** Get a blank submission queue entry */
+	struct io_uring_sqe* getSqe()
+	{
+		unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		if (*m_sqTail - head >= m_sqEntries) {
+			submit();
+			head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+			assert(*m_sqTail - head < m_sqEntries);
+		}
+		unsigned index = *m_sqTail & m_sqMask;
+		struct io_uring_sqe* sqe = &m_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		m_sqArray[index] = index;
+		return sqe;
+	}
+
+	/** Queue an entry filled in after getSqe() */
+	void pushSqe()
+	{
+		__atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+		m_toSubmit++;
+		/* submit everything queued during this pass of the loop */
+		if (m_submitEvent != NULL)
+			event_active(m_submitEvent, 0, 0);
+	}
+
+	void submit()
+	{
+		while (m_toSubmit > 0) {
+			int n = syscall(__NR_io_uring_enter, m_ringFd,
+				m_toSubmit, 0, 0, NULL, 0);
+			m_syscalls++;
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN ||
+					errno == EBUSY)
+					continue;
+				perror("io_uring_enter");
+				exit(EXIT_FAILURE);
+			}
+			m_toSubmit -= n;
+		}
+	}
+
+	static uint64_t userData(void* ptr, unsigned op)
+	{
+		assert(((uintptr_t)ptr & OP_MASK) == 0);
+		return (uint64_t)(uintptr_t)ptr | op;
+	}
+
+	void armAccept()
+	{
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = m_listener;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = userData(NULL, OP_ACCEPT);
+		pushSqe();
+	}
+
+	void armRecv(URingSocket* sock)
+	{
+		assert(!sock->receiving);
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sock->fd;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->user_data = userData(sock, OP_RECV);
+		pushSqe();
+		sock->receiving = true;
+		sock->inflight++;
+	}
+
+	void cancelRecv(URingSocket* sock)
+	{
+		if (sock->cancelling)
+			return;
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = userData(sock, OP_RECV);
+		sqe->user_data = userData(sock, OP_CANCEL);
+		pushSqe();
+		sock->cancelling = true;
+		sock->inflight++;
+	}
+
+	/** true if we should be receiving on 'sock' right now */
+	bool wantRecv(URingSocket* sock)
+	{
+		if (sock->bev == NULL || sock->eof || sock->receiving)
+			return false;
+		size_t low, high;
+		bufferevent_getwatermark(sock->bev, EV_READ, &low, &high);
+		return high == 0 || evbuffer_get_length(
+			bufferevent_get_input(sock->bev)) < high;
+	}
+
+	/**
+	 * Write the next batch of output to the socket, unless
+	 * a write is already in progress.
+	 */
+	void startSend(URingSocket* sock)
+	{
+		if (sock->sendPending)
+			return;
+		if (evbuffer_get_length(sock->sending) == 0 &&
+			sock->bev != NULL) {
+			struct evbuffer* output = bufferevent_get_output(sock->bev);
+			size_t len = std::min(evbuffer_get_length(output),
+				URING_MAX_SEND);
+			/* moves chains, doesn't copy */
+			evbuffer_unfreeze(output, 1);
+			evbuffer_remove_buffer(output, sock->sending, len);
+			evbuffer_freeze(output, 1);
+		}
+		if (evbuffer_get_length(sock->sending) == 0 || sock->fd < 0)
+			return;
+		int count = evbuffer_peek(sock->sending, -1, NULL,
+			(struct evbuffer_iovec*)sock->iov, URING_MAX_IOVECS);
+		assert(count > 0);
+		memset(&sock->msg, 0, sizeof(sock->msg));
+		sock->msg.msg_iov = sock->iov;
+		sock->msg.msg_iovlen = std::min(count, URING_MAX_IOVECS);
+
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock->fd;
+		sqe->addr = (uint64_t)(uintptr_t)&sock->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = userData(sock, OP_SEND);
+		pushSqe();
+		sock->sendPending = true;
+		sock->inflight++;
+	}
+
+	/** Give receive buffer 'bid' back to the kernel */
+	void returnBuffer(unsigned bid)
+	{
+		unsigned short tail = m_bufRing->tail;
+		/*
+		 * index the ring as a plain array: in C++, the kernel
+		 * header's flexible array member 'bufs' is misplaced
+		 * by an empty struct
+		 */
+		struct io_uring_buf* buf = (struct io_uring_buf*)m_bufRing
+			+ (tail & (URING_RECV_BUFFERS - 1));
+		buf->addr = (uint64_t)(uintptr_t)(m_buffers +
+			bid * URING_RECV_BUFFER_SIZE);
+		buf->len = URING_RECV_BUFFER_SIZE;
+		buf->bid = bid;
+		__atomic_store_n(&m_bufRing->tail, (unsigned short)(tail + 1),
+			__ATOMIC_RELEASE);
+		m_freeBuffers++;
+		if (!m_starved.empty() && m_rearmEvent != NULL)
+			event_active(m_rearmEvent, 0, 0);
+	}
+
+	static void release_buffer_cb(const void*, size_t, void* arg)
+	{
+		IOURingReactor& reactor = getInstance();
+		if (reactor.active())
+			reactor.returnBuffer((unsigned)(uintptr_t)arg);
+	}
+
+	static void rearm_accept_cb(evutil_socket_t, short, void*)
+	{
+		IOURingReactor& reactor = getInstance();
+		if (!reactor.active())
+			return;
+		if (!FdReserve::getInstance().fill()) {
+			struct timeval delay = { 0, ACCEPT_BACKOFF };
+			event_base_once(reactor.m_base, -1, EV_TIMEOUT,
+				rearm_accept_cb, NULL, &delay);
+			return;
+		}
+		reactor.armAccept();
+	}
+
+	void handleAccept(const struct io_uring_cqe& cqe)
+	{
+		if (cqe.res < 0 && !(cqe.flags & IORING_CQE_F_MORE) &&
+			UnixSocket::out_of_resources(-cqe.res)) {
+			/* leave clients in the backlog for a while */
+			FdReserve::getInstance().release();
+			fprintf(g_log, "accept: %s; pausing for %ld ms\n",
+				strerror(-cqe.res), ACCEPT_BACKOFF / 1000);
+			struct timeval delay = { 0, ACCEPT_BACKOFF };
+			event_base_once(m_base, -1, EV_TIMEOUT, rearm_accept_cb,
+				NULL, &delay);
+			return;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			armAccept();
+		if (cqe.res < 0) {
+			fprintf(g_log, "accept: %s\n", strerror(-cqe.res));
+			return;
+		}
+		assert(m_acceptCallback != NULL);
+		m_acceptCallback(m_base, cqe.res);
+	}
+
+	void handleRecv(URingSocket* sock, const struct io_uring_cqe& cqe)
+	{
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			sock->receiving = false;
+			sock->inflight--;
+		}
+
+		if (cqe.res > 0) {
+			assert(cqe.flags & IORING_CQE_F_BUFFER);
+			unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			char* data = m_buffers + bid * URING_RECV_BUFFER_SIZE;
+			assert(m_freeBuffers > 0);
+			m_freeBuffers--;
+			m_bytesReceived += cqe.res;
+			if (sock->bev == NULL) {
+				returnBuffer(bid);
+				return;
+			}
+			struct evbuffer* input = bufferevent_get_input(sock->bev);
+			/* libevent freezes the end of a socket's input buffer */
+			evbuffer_unfreeze(input, 0);
+			if (m_freeBuffers < URING_MIN_FREE_BUFFERS) {
+				evbuffer_add(input, data, cqe.res);
+				returnBuffer(bid);
+			} else {
+				evbuffer_add_reference(input, data, cqe.res,
+					release_buffer_cb, (void*)(uintptr_t)bid);
+			}
+			evbuffer_freeze(input, 0);
+			/* apply backpressure */
+			size_t low, high;
+			bufferevent_getwatermark(sock->bev, EV_READ, &low, &high);
+			if (sock->receiving && high > 0 &&
+				evbuffer_get_length(input) >= high)
+				cancelRecv(sock);
+			else if (wantRecv(sock))
+				armRecv(sock);
+			bufferevent_trigger(sock->bev, EV_READ, 0);
+			return;
+		}
+
+		if (cqe.res == 0) {
+			sock->eof = true;
+			if (sock->bev != NULL)
+				bufferevent_trigger_event(sock->bev,
+					BEV_EVENT_EOF|BEV_EVENT_READING, 0);
+		} else if (cqe.res == -ENOBUFS) {
+			/*
+			 * wait for buffers to be returned (unless they
+			 * already were, earlier in this batch of completions)
+			 */
+			if (sock->bev != NULL) {
+				m_starved.push_back(sock);
+				if (m_freeBuffers > 0 && m_rearmEvent != NULL)
+					event_active(m_rearmEvent, 0, 0);
+			}
+		} else if (cqe.res == -ECANCELED) {
+			if (wantRecv(sock))
+				armRecv(sock);
+		} else if (sock->bev != NULL) {
+			errno = -cqe.res;
+			bufferevent_trigger_event(sock->bev,
+				BEV_EVENT_ERROR|BEV_EVENT_READING, 0);
+		}
+	}
+
+	void handleSend(URingSocket* sock, const struct io_uring_cqe& cqe)
+	{
+		sock->sendPending = false;
+		sock->inflight--;
+		if (cqe.res < 0) {
+			if (sock->bev != NULL) {
+				errno = -cqe.res;
+				bufferevent_trigger_event(sock->bev,
+					BEV_EVENT_ERROR|BEV_EVENT_WRITING, 0);
+			}
+			return;
+		}
+		evbuffer_drain(sock->sending, cqe.res);
+		m_bytesSent += cqe.res;
+		/* after detach, we still finish what was handed to us */
+		startSend(sock);
+		if (sock->bev != NULL)
+			bufferevent_trigger(sock->bev, EV_WRITE, 0);
+	}
+
+	/** Free a detached socket once the kernel is done with it */
+	void maybeFree(URingSocket* sock)
+	{
+		if (sock->bev != NULL || sock->inflight > 0 ||
+			sock == m_current)
+			return;
+		if (sock->fd >= 0)
+			close(sock->fd);
+		evbuffer_free(sock->sending);
+		delete sock;
+	}
+
+	/** Process all available completions */
+	void reap()
+	{
+		while (true) {
+			unsigned head = *m_cqHead;
+			unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+			if (head == tail)
+				break;
+			struct io_uring_cqe cqe = m_cqes[head & m_cqMask];
+			__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+
+			unsigned op = cqe.user_data & OP_MASK;
+			URingSocket* sock = (URingSocket*)(uintptr_t)
+				(cqe.user_data & ~(uint64_t)OP_MASK);
+			if (op == OP_ACCEPT) {
+				handleAccept(cqe);
+				continue;
+			}
+			assert(sock != NULL);
+			m_current = sock;
+			if (op == OP_RECV) {
+				handleRecv(sock, cqe);
+			} else if (op == OP_SEND) {
+				handleSend(sock, cqe);
+			} else {
+				assert(op == OP_CANCEL);
+				sock->cancelling = false;
+				sock->inflight--;
+			}
+			m_current = NULL;
+			maybeFree(sock);
+		}
+	}
+
+	static void eventfd_handler(evutil_socket_t fd, short, void* arg)
+	{
+		IOURingReactor& reactor = *(IOURingReactor*)arg;
+		uint64_t count;
+		if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			perror("read eventfd");
+		reactor.m_syscalls++;
+		reactor.reap();
+	}
+
+	static void submit_handler(evutil_socket_t, short, void* arg)
+	{
+		((IOURingReactor*)arg)->submit();
+	}
+
+	/** Restart receives that ran out of buffers */
+	static void rearm_handler(evutil_socket_t, short, void* arg)
+	{
+		IOURingReactor& reactor = *(IOURingReactor*)arg;
+		std::deque<URingSocket*> starved;
+		starved.swap(reactor.m_starved);
+		for (size_t i = 0; i < starved.size(); ++i) {
+			if (reactor.wantRecv(starved[i]))
+				reactor.armRecv(starved[i]);
+		}
+	}
+
+	static void input_buffer_cb(struct evbuffer*,
+		const struct evbuffer_cb_info* info, void* arg)
+	{
+		/* resume receiving once input drops below high watermark */
+		URingSocket* sock = (URingSocket*)arg;
+		if (info->n_deleted > 0 && !sock->cancelling &&
+			getInstance().wantRecv(sock))
+			getInstance().armRecv(sock);
+	}
+
+	static void output_buffer_cb(struct evbuffer*,
+		const struct evbuffer_cb_info* info, void* arg)
+	{
+		if (info->n_added > 0)
+			getInstance().startSend((URingSocket*)arg);
+	}
+
+
+	struct event_base* m_base;
+	/** io_uring file descriptor (-1 if inactive) */
+	int m_ringFd;
+	/** signalled by the kernel when completions are posted */
+	int m_eventfd;
+
+	/* shared ring memory */
+	void* m_sqRing;
+	size_t m_sqRingSize;
+	void* m_cqRing;
+	size_t m_cqRingSize;
+	struct io_uring_sqe* m_sqes;
+	size_t m_sqesSize;
+	unsigned* m_sqHead;
+	unsigned* m_sqTail;
+	unsigned m_sqMask;
+	unsigned m_sqEntries;
+	unsigned* m_sqArray;
+	unsigned* m_cqHead;
+	unsigned* m_cqTail;
+	unsigned m_cqMask;
+	struct io_uring_cqe* m_cqes;
+	struct io_uring_buf_ring* m_bufRing;
+
+	/** memory for provided receive buffers */
+	char* m_buffers;
+	/** number of receive buffers owned by the kernel */
+	unsigned m_freeBuffers;
+
+	evutil_socket_t m_listener;
+	URingAcceptCallback m_acceptCallback;
+	/** entries queued but not yet submitted */
+	unsigned m_toSubmit;
+	/** socket whose completion is being processed */
+	URingSocket* m_current;
+
+	/** sockets managed by the reactor, keyed by bufferevent */
+	SocketMap m_sockets;
+	/** sockets whose recv stopped for lack of buffers */
+	std::deque<URingSocket*> m_starved;
+
+	struct event* m_eventfdEvent;
+	struct event* m_submitEvent;
+	struct event* m_rearmEvent;
+
+	/* statistics */
+	uint64_t m_bytesReceived;
+	uint64_t m_bytesSent;
+	uint64_t m_syscalls;
+};
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+/** Stand-in for platforms without io_uring */
+class IOURingReactor
+{
+public:
+
+	static IOURingReactor& getInstance()
+	{
+		static IOURingReactor instance;
+		return instance;
+	}
+
+	bool active() const { return false; }
+
+	bool init(struct event_base*)
+	{
+		fprintf(g_log, "mpih was built without io_uring support; "
+			"using libevent\n");
+		return false;
+	}
+
+	void shutdown() {}
+
+	void listen(evutil_socket_t, URingAcceptCallback)
+	{
+		assert(false);
+	}
+
+	struct bufferevent* newBufferevent(struct event_base*,
+		evutil_socket_t)
+	{
+		assert(false);
+		return NULL;
+	}
+
+	void detach(struct bufferevent*) {}
+};
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef _LOCAL_COPY_H_
+#define _LOCAL_COPY_H_
+
+#include "Command/client/FdCopier.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+namespace opt {
+	/**
+	 * -L,--no-local-copy: send streams between ranks on the
+	 * same node through MPI, like all other streams
+	 */
+	static int noLocalCopy;
+}
+
+/**
+ * Min size of a file to copy between ranks on the same
+ * node (bytes); MPI sends smaller files without waiting
+ * for the receiver
+ */
+static const uint64_t LOCAL_COPY_MIN_SIZE = 1024 * 1024;
+
+/**
+ * Max number of FdCopier::copy() calls per callback, so
+ * that a long copy between regular files (which never
+ * has to wait) doesn't starve other connections.
+ */
+static const int LOCAL_COPY_BATCH = 16;
+
+/**
+ * Copies the data of a same-node stream from the sending
+ * client's file descriptor straight into the receiving
+ * client's (see LOCAL_COPY_MARKER), with sendfile() or
+ * splice() where the kernel allows (see FdCopier). The
+ * data never passes through a socket, MPI, or our own
+ * memory.
+ *
+ * Pipes must have been opened in non-blocking mode; we
+ * wait for them to become readable/writable with libevent.
+ * Data that the daemon has already read from 'in' (the
+ * head) is written out first.
+ */
+class LocalCopy
+{
+public:
+
+	/** Called once the copy has finished (see error()) */
+	typedef void (*DoneCallback)(void* arg);
+
+	/**
+	 * @param in, out descriptors to copy between; both are
+	 * closed when the copy is deleted
+	 * @param head data read from 'in' before the copy
+	 * (moved out of the buffer), or NULL
+	 * @param limit max bytes to copy (including the head)
+	 */
+	LocalCopy(struct event_base* base, int in, int out,
+		struct evbuffer* head, uint64_t limit, DoneCallback done,
+		void* arg) :
+		m_in(in), m_out(out), m_copier(in, out), m_done(done),
+		m_arg(arg), m_head(evbuffer_new()), m_limit(limit),
+		m_bytes(0), m_error(0),
+		m_readEvent(NULL), m_writeEvent(NULL)
+	{
+		assert(base != NULL);
+		assert(done != NULL);
+		assert(m_head != NULL);
+		if (head != NULL)
+			evbuffer_add_buffer(m_head, head);
+		struct stat st;
+		if (fstat(in, &st) == 0 && S_ISFIFO(st.st_mode))
+			m_readEvent = event_new(base, in, EV_READ, on_ready, this);
+		if (fstat(out, &st) == 0 && S_ISFIFO(st.st_mode))
+			m_writeEvent = event_new(base, out, EV_WRITE, on_ready,
+				this);
+		m_nextEvent = event_new(base, -1, 0, on_ready, this);
+		assert(m_nextEvent != NULL);
+	}
+
+	~LocalCopy()
+	{
+		if (m_readEvent != NULL)
+			event_free(m_readEvent);
+		if (m_writeEvent != NULL)
+			event_free(m_writeEvent);
+		event_free(m_nextEvent);
+		evbuffer_free(m_head);
+		close(m_in);
+		close(m_out);
+	}
+
+	/** Start copying (from the event loop) */
+	void start()
+	{
+		event_active(m_nextEvent, 0, 0);
+	}
+
+	/** bytes copied so far */
+	uint64_t bytesCopied() const
+	{
+		return m_bytes;
+	}
+
+	/** errno of a failed read/write (0 if none) */
+	int error() const
+	{
+		return m_error;
+	}
+
+private:
+
+	/**
+	 * Copy until we have to wait for a pipe, or have
+	 * done a batch, or have reached EOF of 'in' (or the
+	 * limit).
+	 */
+	void run()
+	{
+		for (int i = 0; i < LOCAL_COPY_BATCH; ++i) {
+			bool head = evbuffer_get_length(m_head) > 0;
+			ssize_t n = 0;
+			if (head)
+				n = evbuffer_write(m_head, m_out);
+			else if (m_bytes < m_limit)
+				n = m_copier.copy(std::min((uint64_t)FD_COPY_SIZE,
+					m_limit - m_bytes));
+			if (n > 0) {
+				m_bytes += n;
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && errno == EAGAIN) {
+				wait(head);
+				return;
+			}
+			/* EOF or error (the callback may delete us) */
+			m_error = n < 0 ? errno : 0;
+			m_done(m_arg);
+			return;
+		}
+		/* let other connections have a turn */
+		event_active(m_nextEvent, 0, 0);
+	}
+
+	/**
+	 * Wait for whichever pipe is holding us up (only 'out'
+	 * while we are writing the head)
+	 */
+	void wait(bool head)
+	{
+		struct event* readEvent = head ? NULL : m_readEvent;
+		if (readEvent != NULL)
+			event_add(readEvent, NULL);
+		if (m_writeEvent != NULL)
+			event_add(m_writeEvent, NULL);
+		if (readEvent == NULL && m_writeEvent == NULL) {
+			/* (nothing to watch; try again shortly) */
+			struct timeval time = { 0, 1000 };
+			event_add(m_nextEvent, &time);
+		}
+	}
+
+	static void on_ready(evutil_socket_t, short, void* arg)
+	{
+		assert(arg != NULL);
+		LocalCopy& copy = *(LocalCopy*)arg;
+		if (copy.m_readEvent != NULL)
+			event_del(copy.m_readEvent);
+		if (copy.m_writeEvent != NULL)
+			event_del(copy.m_writeEvent);
+		copy.run();
+	}
+
+	/* disable copy constructor and assignment operator */
+	LocalCopy(const LocalCopy&);
+	void operator=(const LocalCopy&);
+
+	int m_in;
+	int m_out;
+	FdCopier m_copier;
+	DoneCallback m_done;
+	void* m_arg;
+	/** data to write before copying from 'in' */
+	struct evbuffer* m_head;
+	/** max bytes to copy */
+	uint64_t m_limit;
+	/** bytes copied so far */
+	uint64_t m_bytes;
+	/** errno of a failed copy (0 if none) */
+	int m_error;
+	/** fire when 'in'/'out' is a pipe that is ready (or NULL) */
+	struct event* m_readEvent;
+	struct event* m_writeEvent;
+	/** fires when we yield to other connections */
+	struct event* m_nextEvent;
+};
+
+#endif
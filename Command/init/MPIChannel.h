@@ -20,24 +20,27 @@ enum XferDir { NONE, SEND, RECV };
  * 3. an MPI tag (used in MPI to distinguish different
  * types of messages exchanged between the same pair of
  * MPI ranks)
+ * 4. whether the peer rank belongs to our own job, or
+ * to the job we are connected to (see 'mpih open-port')
  */
 class MPIChannel
 {
 public:
 
 	MPIChannel() : m_xferDir(NONE), m_peerRank(-1),
-		m_mpiTag(-1) {}
+		m_mpiTag(-1), m_remote(false) {}
 
 	MPIChannel(XferDir xferDir, int peerRank,
-		int mpiTag) : m_xferDir(xferDir),
-		m_peerRank(peerRank), m_mpiTag(mpiTag)
+		int mpiTag, bool remote = false) : m_xferDir(xferDir),
+		m_peerRank(peerRank), m_mpiTag(mpiTag), m_remote(remote)
 	{ }
 
 	bool operator==(const MPIChannel& channel) const
 	{
 		return channel.m_xferDir == m_xferDir &&
 			channel.m_peerRank == m_peerRank &&
-			channel.m_mpiTag == m_mpiTag;
+			channel.m_mpiTag == m_mpiTag &&
+			channel.m_remote == m_remote;
 	}
 
 	std::string str() const
@@ -51,7 +54,10 @@ public:
 			s << "RECV";
 		}
 		s << "," << m_peerRank << ","
-			<< m_mpiTag << ")";
+			<< m_mpiTag;
+		if (m_remote)
+			s << ",REMOTE";
+		s << ")";
 		assert(s);
 		return s.str();
 	}
@@ -59,6 +65,8 @@ public:
 	XferDir m_xferDir;
 	int m_peerRank;
 	int m_mpiTag;
+	/** true if m_peerRank is a rank of the remote job */
+	bool m_remote;
 };
 
 namespace std {
@@ -72,7 +80,8 @@ namespace std {
 			using std::string;
 			return ((hash<int>()((int)k.m_xferDir)
 				^ (hash<int>()(k.m_peerRank) << 1)) >> 1)
-				^ (hash<int>()(k.m_mpiTag) << 1);
+				^ (hash<int>()(k.m_mpiTag) << 1)
+				^ (hash<bool>()(k.m_remote) << 2);
 		}
 	};
 }
@@ -0,0 +1,244 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Size of the part of the file that is mapped at any
+ * one time (bytes). Must be a multiple of the page size.
+ */
+static const size_t MAPPED_FILE_WINDOW = 64 * 1024 * 1024;
+
+/**
+ * Input of a SEND stream read straight from the page cache:
+ * a regular file handed over by an 'mpih send' client,
+ * mapped into memory one window at a time, so that MPI
+ * chunks can be sent from the mapping without copying.
+ *
+ * Reading starts at the current offset of the file
+ * descriptor, and ends at the size the file had when it
+ * was mapped, unless a range of the file is given. If the
+ * file is truncated while it is being sent, release()
+ * fails before any more of it is read, rather than
+ * raising SIGBUS (as for any mapping) on the pages that
+ * are gone. A chunk that is already being sent when the
+ * file is truncated can still raise SIGBUS.
+ */
+class MappedFile
+{
+public:
+
+	/**
+	 * Map the first window of 'fd'. Takes ownership of
+	 * 'fd' if successful.
+	 *
+	 * @param start if non-negative, read the 'len' bytes
+	 * at 'start' (or up to EOF), rather than reading from
+	 * the file offset to EOF; the file offset is not used
+	 * or moved
+	 * @return NULL if 'fd' can't be mapped (with errno set)
+	 */
+	static MappedFile* open(int fd, size_t window = MAPPED_FILE_WINDOW,
+		off_t start = -1, uint64_t len = 0)
+	{
+		assert(window > 0 && window % pageSize() == 0);
+		struct stat st;
+		if (fstat(fd, &st) < 0)
+			return NULL;
+		if (!S_ISREG(st.st_mode)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		off_t offset = start >= 0 ? start : lseek(fd, 0, SEEK_CUR);
+		if (offset < 0)
+			return NULL;
+		off_t end = std::max(st.st_size, offset);
+		if (start >= 0 && len < (uint64_t)(end - offset))
+			end = offset + len;
+		MappedFile* file = new MappedFile(fd, window, end, offset);
+		file->m_moveOffset = start < 0;
+		if (!file->map()) {
+			int saved = errno;
+			file->m_fd = -1;
+			delete file;
+			errno = saved;
+			return NULL;
+		}
+		return file;
+	}
+
+	/**
+	 * Unmap and close the file. Unless we were reading a
+	 * given range, the file offset is left after the data
+	 * we have sent, as if we had read() it.
+	 */
+	~MappedFile()
+	{
+		unmap();
+		if (m_fd >= 0) {
+			if (m_moveOffset)
+				lseek(m_fd, m_offset, SEEK_SET);
+			close(m_fd);
+		}
+	}
+
+	/**
+	 * Bytes that can be sent from readPtr(). Chunks don't
+	 * cross the end of the current window.
+	 */
+	size_t readable() const
+	{
+		return m_windowEnd - m_offset;
+	}
+
+	/** start of the readable bytes */
+	const char* readPtr() const
+	{
+		return m_window + (m_offset - m_windowStart);
+	}
+
+	/** Bytes of the file that have not been released */
+	size_t remaining() const
+	{
+		return m_size - m_offset;
+	}
+
+	/** file offset of the first readable byte */
+	off_t offset() const
+	{
+		return m_offset;
+	}
+
+	/** the file descriptor (owned by us) */
+	int fd() const
+	{
+		return m_fd;
+	}
+
+	/**
+	 * Skip the next 'len' bytes, which have been sent by
+	 * other means (see LocalCopy), without mapping them.
+	 */
+	void skip(uint64_t len)
+	{
+		assert(len <= remaining());
+		unmap();
+		m_offset += len;
+		m_windowStart = m_windowEnd = m_offset;
+	}
+
+	/**
+	 * Finish with the first 'len' readable bytes, and map
+	 * the next window once the current one is used up.
+	 *
+	 * @return false if the file has been truncated, or the
+	 * next window can't be mapped (with errno set); no more
+	 * data is readable after that
+	 */
+	bool release(size_t len)
+	{
+		assert(len <= readable());
+		m_offset += len;
+		if (remaining() == 0)
+			return true;
+		if (!truncated()) {
+			if (readable() > 0)
+				return true;
+			unmap();
+			if (map())
+				return true;
+		}
+		/* give up on the rest of the file */
+		int saved = errno;
+		unmap();
+		m_size = m_offset;
+		m_windowStart = m_windowEnd = m_offset;
+		errno = saved;
+		return false;
+	}
+
+private:
+
+	MappedFile(int fd, size_t window, off_t size, off_t offset) :
+		m_fd(fd), m_moveOffset(true), m_windowSize(window),
+		m_size(size), m_offset(offset), m_window(NULL),
+		m_windowStart(offset), m_windowEnd(offset) {}
+
+	static size_t pageSize()
+	{
+		return sysconf(_SC_PAGESIZE);
+	}
+
+	/**
+	 * @return true if the file no longer holds all of the
+	 * data we have yet to send (with errno set)
+	 */
+	bool truncated() const
+	{
+		struct stat st;
+		if (fstat(m_fd, &st) < 0)
+			return true;
+		if (st.st_size >= m_size)
+			return false;
+		errno = ENODATA;
+		return true;
+	}
+
+	/**
+	 * Map the window that starts at m_offset (rounded down
+	 * to a page boundary), and ask the kernel to read it
+	 * ahead.
+	 */
+	bool map()
+	{
+		if (remaining() == 0)
+			return true;
+		off_t start = m_offset - m_offset % pageSize();
+		size_t len = std::min((off_t)m_windowSize, m_size - start);
+		void* window = mmap(NULL, len, PROT_READ, MAP_SHARED, m_fd,
+			start);
+		if (window == MAP_FAILED)
+			return false;
+		madvise(window, len, MADV_SEQUENTIAL);
+		madvise(window, len, MADV_WILLNEED);
+		m_window = (char*)window;
+		m_windowStart = start;
+		m_windowEnd = start + len;
+		return true;
+	}
+
+	void unmap()
+	{
+		if (m_window != NULL)
+			munmap(m_window, m_windowEnd - m_windowStart);
+		m_window = NULL;
+	}
+
+	/* disable copy constructor and assignment operator */
+	MappedFile(const MappedFile&);
+	void operator=(const MappedFile&);
+
+	/** file handed over by the client */
+	int m_fd;
+	/** true if we leave the file offset after the data we sent */
+	bool m_moveOffset;
+	/** max size of a mapping (bytes) */
+	size_t m_windowSize;
+	/** end of the data to send (file offset) */
+	off_t m_size;
+	/** start of the readable data (file offset) */
+	off_t m_offset;
+	/** current mapping (NULL if none) */
+	char* m_window;
+	/** file offsets covered by 'm_window' */
+	off_t m_windowStart;
+	off_t m_windowEnd;
+};
+
+#endif
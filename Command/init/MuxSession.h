@@ -0,0 +1,407 @@
+#ifndef _MUX_SESSION_H_
+#define _MUX_SESSION_H_
+
+#include "Command/init/log.h"
+#include "Command/init/Connection.h"
+#include "Command/init/event_handlers.h"
+#include "IO/MuxProtocol.h"
+#include <map>
+#include <algorithm>
+#include <cassert>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+/**
+ * Max frames queued for a multiplexed client before we
+ * stop moving stream output into frames (bytes)
+ */
+static const size_t MUX_SOCKET_HIGH_WATERMARK = 1 * 1024 * 1024;
+
+class MuxSession;
+
+/**
+ * One logical stream of a multiplexed client connection.
+ * The stream's Connection does its I/O on one end of a
+ * bufferevent pair, as it would on a client socket; the
+ * session moves data between the other end ('end') and
+ * frames on the client socket.
+ */
+struct MuxStream
+{
+	/** stream number chosen by the client */
+	uint32_t id;
+	MuxSession* session;
+	/** our end of the bufferevent pair */
+	struct bufferevent* end;
+	/** Connection serving the stream (NULL once closed) */
+	Connection* connection;
+	/** DATA we may still send to the client (bytes) */
+	uint64_t credit;
+	/** DATA the client may still send to us (bytes) */
+	uint64_t clientCredit;
+	/** client DATA taken by the Connection since our last CREDIT */
+	uint64_t consumed;
+	/** true once the client has sent END */
+	bool clientEnded;
+	/** true once the Connection has been told about END */
+	bool eofSent;
+};
+
+/**
+ * A client connection that started with a "MUX" header,
+ * and now carries many SEND/RECV/... streams as frames
+ * (see IO/MuxProtocol.h). Each stream gets a Connection
+ * of its own, so that streams queue for MPI channels and
+ * send slots independently, exactly like separate client
+ * connections would.
+ */
+class MuxSession
+{
+public:
+
+	MuxSession(struct bufferevent* bev, evutil_socket_t socket,
+		size_t connectionID) :
+		m_bev(bev), m_socket(socket), m_id(connectionID)
+	{
+		bufferevent_setcb(bev, session_read_handler,
+			session_write_handler, session_event_handler, this);
+		bufferevent_setwatermark(bev, EV_READ, 0, 0);
+		bufferevent_setwatermark(bev, EV_WRITE,
+			MUX_SOCKET_HIGH_WATERMARK / 2, 0);
+		bufferevent_enable(bev, EV_READ|EV_WRITE);
+	}
+
+	/** Handle all complete frames received from the client */
+	void readFrames()
+	{
+		struct evbuffer* input = bufferevent_get_input(m_bev);
+		while (evbuffer_get_length(input) >= MUX_HEADER_SIZE) {
+			char buf[MUX_HEADER_SIZE];
+			evbuffer_copyout(input, buf, MUX_HEADER_SIZE);
+			MuxFrameHeader header = decode_mux_header(buf);
+			if (header.length > MUX_MAX_PAYLOAD) {
+				log_f(m_id, "error: multiplexed frame exceeds "
+					"max size (%u bytes)", MUX_MAX_PAYLOAD);
+				teardown();
+				return;
+			}
+			if (evbuffer_get_length(input) <
+				MUX_HEADER_SIZE + header.length)
+				return;
+			evbuffer_drain(input, MUX_HEADER_SIZE);
+			if (!handleFrame(header)) {
+				teardown();
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Move output of stream 's' into DATA frames, as far as
+	 * its credit allows. Once its Connection has closed and
+	 * all of its output has been sent, end the stream.
+	 */
+	void pump(MuxStream& s)
+	{
+		struct evbuffer* input = bufferevent_get_input(s.end);
+		struct evbuffer* output = bufferevent_get_output(m_bev);
+		while (s.credit > 0 && evbuffer_get_length(input) > 0 &&
+			evbuffer_get_length(output) < MUX_SOCKET_HIGH_WATERMARK)
+			sendData(s, input);
+		if (s.connection == NULL && evbuffer_get_length(input) == 0) {
+			sendFrame(MUX_END, s.id, NULL, 0);
+			m_streams.erase(s.id);
+			freeStream(s);
+		}
+	}
+
+	/** Give each stream a turn at the client socket */
+	void pumpAll()
+	{
+		for (StreamMap::iterator it = m_streams.begin();
+			it != m_streams.end();) {
+			MuxStream& s = *(it++)->second;
+			pump(s);
+		}
+	}
+
+	/** Tell the Connection of stream 's' that the client is done */
+	void deliverEOF(MuxStream& s)
+	{
+		if (!s.clientEnded || s.eofSent ||
+			evbuffer_get_length(bufferevent_get_output(s.end)) > 0)
+			return;
+		s.eofSent = true;
+		struct bufferevent* partner = bufferevent_pair_get_partner(s.end);
+		if (partner != NULL)
+			bufferevent_trigger_event(partner,
+				BEV_EVENT_EOF|BEV_EVENT_READING, 0);
+	}
+
+	/** Credit the client for DATA taken by the Connection */
+	void grantCredit(MuxStream& s)
+	{
+		if (s.consumed < MUX_WINDOW / 4)
+			return;
+		char payload[4];
+		put_mux_u32(payload, (uint32_t)s.consumed);
+		sendFrame(MUX_CREDIT, s.id, payload, sizeof(payload));
+		s.clientCredit += s.consumed;
+		s.consumed = 0;
+	}
+
+	/**
+	 * Close the session, e.g. after the client has gone away.
+	 * SEND streams that are underway get EOF and finish
+	 * sending the input they have; other streams are closed.
+	 */
+	void teardown()
+	{
+		if (opt::verbose)
+			log_f(m_id, "closing multiplexed connection");
+		for (StreamMap::iterator it = m_streams.begin();
+			it != m_streams.end(); ++it) {
+			MuxStream& s = *it->second;
+			Connection* connection = s.connection;
+			if (connection != NULL) {
+				connection->mux = NULL;
+				if (connection->channel.m_xferDir == RECV)
+					close_connection(*connection);
+				else
+					bufferevent_flush(s.end, EV_WRITE, BEV_FINISHED);
+			}
+			freeStream(s);
+		}
+		m_streams.clear();
+		IOURingReactor::getInstance().detach(m_bev);
+		bufferevent_free(m_bev);
+		if (m_socket != -1)
+			evutil_closesocket(m_socket);
+		delete this;
+	}
+
+private:
+
+	typedef std::map<uint32_t, MuxStream*> StreamMap;
+
+	/** @return false on a protocol error */
+	bool handleFrame(const MuxFrameHeader& header)
+	{
+		struct evbuffer* input = bufferevent_get_input(m_bev);
+		StreamMap::iterator it = m_streams.find(header.stream);
+		MuxStream* s = it != m_streams.end() ? it->second : NULL;
+
+		switch (header.type) {
+		  case MUX_OPEN:
+			if (s != NULL || header.length != 0) {
+				log_f(m_id, "error: invalid OPEN of multiplexed "
+					"stream %u", header.stream);
+				return false;
+			}
+			openStream(header.stream);
+			return true;
+		  case MUX_DATA:
+			if (s == NULL || s->clientEnded) {
+				// the stream was closed; nobody wants the data
+				evbuffer_drain(input, header.length);
+				return true;
+			}
+			if (header.length > s->clientCredit) {
+				log_f(m_id, "error: client exceeded credit on "
+					"multiplexed stream %u", header.stream);
+				return false;
+			}
+			s->clientCredit -= header.length;
+			evbuffer_remove_buffer(input,
+				bufferevent_get_output(s->end), header.length);
+			return true;
+		  case MUX_END:
+			evbuffer_drain(input, header.length);
+			if (s != NULL) {
+				s->clientEnded = true;
+				deliverEOF(*s);
+			}
+			return true;
+		  case MUX_CREDIT:
+			if (header.length != 4) {
+				log_f(m_id, "error: malformed CREDIT frame");
+				return false;
+			}
+			char payload[4];
+			evbuffer_remove(input, payload, sizeof(payload));
+			if (s != NULL) {
+				s->credit += get_mux_u32(payload);
+				pump(*s);
+			}
+			return true;
+		  default:
+			log_f(m_id, "error: unknown multiplexed frame type %u",
+				header.type);
+			return false;
+		}
+	}
+
+	void openStream(uint32_t id)
+	{
+		struct event_base* base = bufferevent_get_base(m_bev);
+		struct bufferevent* pair[2];
+		int result = bufferevent_pair_new(base,
+			BEV_OPT_DEFER_CALLBACKS, pair);
+		assert(result == 0);
+
+		MuxStream* s = new MuxStream();
+		s->id = id;
+		s->session = this;
+		s->end = pair[0];
+		s->credit = MUX_WINDOW;
+		s->clientCredit = MUX_WINDOW;
+		s->consumed = 0;
+		s->clientEnded = false;
+		s->eofSent = false;
+		m_streams[id] = s;
+
+		bufferevent_setcb(s->end, stream_read_handler,
+			stream_write_handler, NULL, s);
+		bufferevent_setwatermark(s->end, EV_READ, 0, MUX_WINDOW);
+		bufferevent_enable(s->end, EV_READ|EV_WRITE);
+		evbuffer_add_cb(bufferevent_get_output(s->end),
+			stream_output_cb, s);
+
+		s->connection = add_connection(pair[1], -1);
+		s->connection->mux = s;
+		if (opt::verbose)
+			log_f(s->connection->id(), "opened multiplexed stream %u "
+				"of connection %lu", id, m_id);
+	}
+
+	void freeStream(MuxStream& s)
+	{
+		evbuffer_remove_cb(bufferevent_get_output(s.end),
+			stream_output_cb, &s);
+		bufferevent_free(s.end);
+		delete &s;
+	}
+
+	/** Send one DATA frame with output of stream 's' */
+	void sendData(MuxStream& s, struct evbuffer* input)
+	{
+		size_t len = std::min(evbuffer_get_length(input),
+			(size_t)std::min(s.credit, (uint64_t)MUX_MAX_PAYLOAD));
+		char header[MUX_HEADER_SIZE];
+		encode_mux_header(header, MUX_DATA, s.id, len);
+		struct evbuffer* output = bufferevent_get_output(m_bev);
+		evbuffer_add(output, header, sizeof(header));
+		evbuffer_remove_buffer(input, output, len);
+		s.credit -= len;
+	}
+
+	void sendFrame(MuxFrameType type, uint32_t stream,
+		const char* payload, uint32_t len)
+	{
+		char header[MUX_HEADER_SIZE];
+		encode_mux_header(header, type, stream, len);
+		struct evbuffer* output = bufferevent_get_output(m_bev);
+		evbuffer_add(output, header, sizeof(header));
+		if (len > 0)
+			evbuffer_add(output, payload, len);
+	}
+
+	static void session_read_handler(struct bufferevent*, void* arg)
+	{
+		assert(arg != NULL);
+		((MuxSession*)arg)->readFrames();
+	}
+
+	static void session_write_handler(struct bufferevent*, void* arg)
+	{
+		assert(arg != NULL);
+		((MuxSession*)arg)->pumpAll();
+	}
+
+	static void session_event_handler(struct bufferevent*,
+		short error, void* arg)
+	{
+		assert(arg != NULL);
+		MuxSession& session = *(MuxSession*)arg;
+		if (error & BEV_EVENT_ERROR)
+			perror("libevent");
+		else if (opt::verbose >= 2)
+			log_f(session.m_id, "read EOF from client");
+		session.teardown();
+	}
+
+	/** The Connection of a stream has queued output */
+	static void stream_read_handler(struct bufferevent*, void* arg)
+	{
+		assert(arg != NULL);
+		MuxStream& s = *(MuxStream*)arg;
+		s.session->pump(s);
+	}
+
+	/** The Connection of a stream has taken all client DATA */
+	static void stream_write_handler(struct bufferevent*, void* arg)
+	{
+		assert(arg != NULL);
+		MuxStream& s = *(MuxStream*)arg;
+		s.session->deliverEOF(s);
+	}
+
+	/** Count client DATA taken by the Connection of a stream */
+	static void stream_output_cb(struct evbuffer*,
+		const struct evbuffer_cb_info* info, void* arg)
+	{
+		assert(arg != NULL);
+		MuxStream& s = *(MuxStream*)arg;
+		if (info->n_deleted == 0)
+			return;
+		s.consumed += info->n_deleted;
+		s.session->grantCredit(s);
+	}
+
+	/* disable copy constructor and assignment operator */
+	MuxSession(const MuxSession&);
+	void operator=(const MuxSession&);
+
+	/** client socket */
+	struct bufferevent* m_bev;
+	evutil_socket_t m_socket;
+	/** ID of the connection that sent "MUX" (for logging) */
+	size_t m_id;
+	/** open streams, by stream number */
+	StreamMap m_streams;
+};
+
+/**
+ * Called when the Connection of 'stream' closes; its
+ * remaining output still goes to the client.
+ */
+static inline void mux_stream_closed(MuxStream& stream)
+{
+	stream.connection = NULL;
+	stream.session->pump(stream);
+}
+
+/**
+ * Turn the client connection that sent "MUX" into a
+ * MuxSession, which takes over its socket.
+ */
+static inline void start_mux_session(Connection& connection)
+{
+	if (opt::verbose)
+		log_f(connection.id(), "starting multiplexed connection");
+
+	MuxSession* session = new MuxSession(connection.bev,
+		connection.socket, connection.id());
+	send_reply(connection, REPLY_OK);
+
+	// the session now owns the socket
+	connection.bev = NULL;
+	connection.socket = -1;
+	close_connection(connection);
+
+	// frames may have arrived along with the header
+	session->readFrames();
+}
+
+#endif
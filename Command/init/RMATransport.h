@@ -0,0 +1,644 @@
+#ifndef _RMA_TRANSPORT_H_
+#define _RMA_TRANSPORT_H_
+
+#include "Command/init/log.h"
+#include "Command/init/Spool.h"
+#include "Options/CommonOptions.h"
+#include <mpi.h>
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+#include <event2/buffer.h>
+
+/** Methods for moving stream data between daemons */
+enum Transport {
+	/** two-sided messages (MPI_Isend/MPI_Irecv) */
+	TRANSPORT_P2P=0,
+	/** one-sided writes to ring buffers (MPI_Put) */
+	TRANSPORT_RMA
+};
+
+namespace opt {
+	/** -t,--transport: MPI transport for stream data */
+	static int transport = TRANSPORT_P2P;
+	/** -R,--ring-size: size of per-peer RMA ring buffers */
+	static uint64_t rmaRingSize = 2 * 1024 * 1024;
+}
+
+/** min size for RMA ring buffers (bytes) */
+static const uint64_t RMA_MIN_RING_SIZE = 64 * 1024;
+
+/** bytes reserved for the control words of each peer */
+static const MPI_Aint RMA_CONTROL_SIZE = 64;
+/** offset of ring tail pointer within control block */
+static const MPI_Aint RMA_TAIL_OFFSET = 0;
+/** offset of ring head pointer within control block */
+static const MPI_Aint RMA_HEAD_OFFSET = 8;
+
+/** alignment of records in ring buffers (bytes) */
+static const size_t RMA_RECORD_ALIGN = 8;
+
+/**
+ * Parse the name of a transport ("p2p" or "rma").
+ * @return false if the name is not recognized
+ */
+static inline bool parse_transport(const std::string& name,
+	int& transport)
+{
+	if (name == "p2p")
+		transport = TRANSPORT_P2P;
+	else if (name == "rma")
+		transport = TRANSPORT_RMA;
+	else
+		return false;
+	return true;
+}
+
+/** Header of each message written to a ring buffer */
+struct RMARecordHeader
+{
+	/** MPI tag of message */
+	int32_t tag;
+	/** length of message payload (bytes) */
+	uint32_t len;
+};
+
+/** A send or receive posted to the RMA transport */
+struct RMAOp
+{
+	/** destination rank (send) or source rank (recv) */
+	int rank;
+	int tag;
+	char* buf;
+	/** message length (send) or buffer capacity (recv) */
+	size_t len;
+	/** generalized request handed back to the caller */
+	MPI_Request request;
+};
+
+/*
+ * Callbacks for generalized MPI requests. These let
+ * callers use MPI_Test/MPI_Get_count on RMA transfers,
+ * exactly as for MPI_Isend/MPI_Irecv.
+ */
+
+static inline int rma_query_fn(void* extra_state, MPI_Status* status)
+{
+	assert(extra_state != NULL);
+	RMAOp& op = *(RMAOp*)extra_state;
+	MPI_Status_set_elements(status, MPI_BYTE, (int)op.len);
+	MPI_Status_set_cancelled(status, 0);
+	status->MPI_SOURCE = op.rank;
+	status->MPI_TAG = op.tag;
+	return MPI_SUCCESS;
+}
+
+static inline int rma_free_fn(void* extra_state)
+{
+	delete (RMAOp*)extra_state;
+	return MPI_SUCCESS;
+}
+
+static inline int rma_cancel_fn(void*, int)
+{
+	return MPI_SUCCESS;
+}
+
+/**
+ * Messages that have arrived from a peer but have not
+ * been matched by a receive yet. Overflow is spilled to
+ * a spool file, as for slow 'mpih recv' clients.
+ */
+class RMAInbox
+{
+public:
+
+	RMAInbox(int rank, int tag) : m_rank(rank), m_tag(tag),
+		m_buffer(evbuffer_new()), m_spool(NULL)
+	{
+		assert(m_buffer != NULL);
+	}
+
+	~RMAInbox()
+	{
+		evbuffer_free(m_buffer);
+		if (m_spool != NULL)
+			delete m_spool;
+	}
+
+	bool empty() const
+	{
+		return m_lengths.empty();
+	}
+
+	/** Length of the oldest message */
+	size_t front() const
+	{
+		assert(!empty());
+		return m_lengths.front();
+	}
+
+	/**
+	 * Append the next piece of a message. Call
+	 * endMessage() after the last piece.
+	 */
+	void append(const char* data, size_t len)
+	{
+		bool spooling = m_spool != NULL && !m_spool->empty();
+		if (!spooling && !opt::spoolDir.empty() &&
+			evbuffer_get_length(m_buffer) + len > SPOOL_THRESHOLD) {
+			if (m_spool == NULL) {
+				std::ostringstream name;
+				name << "rma." << m_rank << "." << m_tag;
+				assert(name);
+				m_spool = new Spool(opt::spoolDir, name.str());
+			}
+			spooling = true;
+		}
+		if (spooling)
+			m_spool->append(data, len);
+		else
+			evbuffer_add(m_buffer, data, len);
+	}
+
+	void endMessage(size_t len)
+	{
+		m_lengths.push_back(len);
+	}
+
+	/** Remove the oldest message, copying it to 'dest' */
+	void pop(char* dest)
+	{
+		size_t len = front();
+		m_lengths.pop_front();
+		/* older data is in memory, newer data in the spool */
+		int n = evbuffer_remove(m_buffer, dest, len);
+		assert(n >= 0 && (size_t)n <= len);
+		if ((size_t)n < len) {
+			assert(m_spool != NULL);
+			size_t m = m_spool->read(dest + n, len - n);
+			assert(n + m == len);
+		}
+	}
+
+private:
+
+	RMAInbox(const RMAInbox&);
+	void operator=(const RMAInbox&);
+
+	int m_rank;
+	int m_tag;
+	std::deque<size_t> m_lengths;
+	struct evbuffer* m_buffer;
+	Spool* m_spool;
+};
+
+/**
+ * A singleton class that moves messages between daemons
+ * with one-sided MPI operations, as an alternative to
+ * MPI_Isend/MPI_Irecv ('mpih init --transport rma').
+ *
+ * Each daemon exposes an MPI window containing one ring
+ * buffer per peer rank. A sender appends messages to
+ * its ring in the receiver's window with MPI_Put, then
+ * advances the ring's tail pointer (also in the receiver's
+ * window). The receiver copies messages out of the ring
+ * and advances the head pointer, which lives in the
+ * sender's window. Both sides therefore poll only their
+ * own memory, and there is no per-message handshake.
+ *
+ * All ranks hold a passive-target lock on the window for
+ * the life of the daemon (MPI_Win_lock_all), and use
+ * MPI_Win_flush to complete operations.
+ *
+ * Window layout (N = number of ranks):
+ *
+ *    [control block for rank 0] ... [control block for rank N-1]
+ *    [ring for rank 0] ... [ring for rank N-1]
+ *
+ * The control block for peer P holds the tail of the ring
+ * that P writes into (written by P), and the head of the
+ * ring that we write into in P's window (also written
+ * by P).
+ *
+ * Each message is written as an RMARecordHeader, followed
+ * by the payload, padded to RMA_RECORD_ALIGN bytes.
+ * Messages are matched to receives by source rank and tag,
+ * in order of arrival. Messages that arrive before a
+ * matching receive is posted are parked in an RMAInbox,
+ * so that one stream can't block the ring for others.
+ */
+class RMATransport
+{
+public:
+
+	static RMATransport& getInstance()
+	{
+		static RMATransport instance;
+		return instance;
+	}
+
+	/** Create the window (collective over 'comm') */
+	void init(MPI_Comm comm, size_t ringSize)
+	{
+		assert(m_win == MPI_WIN_NULL);
+		assert(ringSize >= RMA_MIN_RING_SIZE);
+
+		m_comm = comm;
+		MPI_Comm_rank(comm, &m_rank);
+		MPI_Comm_size(comm, &m_numProc);
+		m_ringSize = ringSize - ringSize % RMA_RECORD_ALIGN;
+
+		MPI_Aint winSize = m_numProc * (RMA_CONTROL_SIZE + m_ringSize);
+		MPI_Win_allocate(winSize, 1, MPI_INFO_NULL, comm,
+			&m_base, &m_win);
+		memset(m_base, 0, winSize);
+
+		MPI_Win_lock_all(MPI_MODE_NOCHECK, m_win);
+		MPI_Win_sync(m_win);
+		/* don't let peers write to us before we've zeroed the window */
+		MPI_Barrier(comm);
+
+		m_sendTail.assign(m_numProc, 0);
+		m_recvHead.assign(m_numProc, 0);
+		m_sends.resize(m_numProc);
+
+		if (opt::verbose)
+			fprintf(g_log, "using RMA transport (%lu byte ring "
+				"per peer)\n", m_ringSize);
+	}
+
+	/** Free the window (collective) */
+	void finalize()
+	{
+		if (m_win == MPI_WIN_NULL)
+			return;
+		MPI_Win_unlock_all(m_win);
+		MPI_Win_free(&m_win);
+		for (InboxMap::iterator it = m_inboxes.begin();
+			it != m_inboxes.end(); ++it)
+			delete it->second;
+		m_inboxes.clear();
+	}
+
+	/** Largest message that may be sent */
+	size_t maxMessageSize() const
+	{
+		return m_ringSize / 2 - sizeof(RMARecordHeader);
+	}
+
+	/** Post a send; counterpart of MPI_Isend */
+	void isend(void* buf, int count, MPI_Datatype type,
+		int rank, int tag, MPI_Request* request)
+	{
+		assert(rank >= 0 && rank < m_numProc);
+		RMAOp* op = newOp(buf, count, type, rank, tag, request);
+		if (op->len > maxMessageSize()) {
+			fprintf(g_log, "error: %lu byte message exceeds max "
+				"size of %lu for RMA transport\n", op->len, maxMessageSize());
+			exit(EXIT_FAILURE);
+		}
+		m_sends[rank].push_back(op);
+	}
+
+	/** Post a receive; counterpart of MPI_Irecv */
+	void irecv(void* buf, int count, MPI_Datatype type,
+		int rank, int tag, MPI_Request* request)
+	{
+		assert(rank >= 0 && rank < m_numProc);
+		m_recvs.push_back(newOp(buf, count, type, rank, tag, request));
+	}
+
+	/**
+	 * Withdraw a send/recv that has not completed, e.g.
+	 * because its client went away. Does nothing if
+	 * 'request' is not a pending RMA request.
+	 */
+	void cancel(MPI_Request& request)
+	{
+		for (size_t i = 0; i < m_sends.size(); ++i) {
+			if (removeOp(m_sends[i], request))
+				return;
+		}
+		removeOp(m_recvs, request);
+	}
+
+	/**
+	 * Write queued sends to peer rings, and match newly
+	 * arrived messages to posted receives. Completed
+	 * requests are signalled through MPI_Grequest_complete.
+	 *
+	 * @return true if any messages were sent or received
+	 */
+	bool progress()
+	{
+		if (m_win == MPI_WIN_NULL)
+			return false;
+		/* make peers' writes to our window visible to local loads */
+		MPI_Win_sync(m_win);
+		bool moved = false;
+		for (int rank = 0; rank < m_numProc; ++rank) {
+			if (!m_sends[rank].empty() && flushSends(rank))
+				moved = true;
+		}
+		for (int rank = 0; rank < m_numProc; ++rank) {
+			if (drainRing(rank))
+				moved = true;
+		}
+		matchInboxes();
+		return moved;
+	}
+
+	/** true if any sends or receives have not completed */
+	bool pending() const
+	{
+		if (!m_recvs.empty())
+			return true;
+		for (size_t i = 0; i < m_sends.size(); ++i) {
+			if (!m_sends[i].empty())
+				return true;
+		}
+		return false;
+	}
+
+private:
+
+	typedef std::deque<RMAOp*> OpQueue;
+	typedef std::pair<int, int> InboxKey;
+	typedef std::map<InboxKey, RMAInbox*> InboxMap;
+
+	RMATransport() : m_comm(MPI_COMM_NULL), m_rank(0),
+		m_numProc(0), m_ringSize(0), m_base(NULL),
+		m_win(MPI_WIN_NULL) {}
+
+	/*
+	 * disable copy constructor and assignment operator
+	 * to prevent copies of the singleton instance
+	 */
+	RMATransport(RMATransport const&);
+	void operator=(RMATransport const&);
+
+	RMAOp* newOp(void* buf, int count, MPI_Datatype type,
+		int rank, int tag, MPI_Request* request)
+	{
+		int typeSize;
+		MPI_Type_size(type, &typeSize);
+		RMAOp* op = new RMAOp;
+		op->rank = rank;
+		op->tag = tag;
+		op->buf = (char*)buf;
+		op->len = (size_t)count * typeSize;
+		MPI_Grequest_start(rma_query_fn, rma_free_fn,
+			rma_cancel_fn, op, &op->request);
+		*request = op->request;
+		return op;
+	}
+
+	bool removeOp(OpQueue& queue, MPI_Request& request)
+	{
+		for (OpQueue::iterator it = queue.begin();
+			it != queue.end(); ++it) {
+			if ((*it)->request != request)
+				continue;
+			queue.erase(it);
+			MPI_Grequest_complete(request);
+			MPI_Request_free(&request);
+			return true;
+		}
+		return false;
+	}
+
+	/** Offset of control block for 'rank' within a window */
+	MPI_Aint controlOffset(int rank) const
+	{
+		return rank * RMA_CONTROL_SIZE;
+	}
+
+	/** Offset of ring written by 'rank' within a window */
+	MPI_Aint ringOffset(int rank) const
+	{
+		return m_numProc * RMA_CONTROL_SIZE + rank * m_ringSize;
+	}
+
+	static size_t recordSize(size_t len)
+	{
+		size_t size = sizeof(RMARecordHeader) + len;
+		return (size + RMA_RECORD_ALIGN - 1) / RMA_RECORD_ALIGN
+			* RMA_RECORD_ALIGN;
+	}
+
+	/**
+	 * Read a control word in our own window, as of the
+	 * last MPI_Win_sync (see progress()). Peers write
+	 * control words atomically, so an aligned load sees
+	 * either the old or the new value.
+	 */
+	uint64_t readControl(int rank, MPI_Aint field) const
+	{
+		const uint64_t* word = (const uint64_t*)
+			((const char*)m_base + controlOffset(rank) + field);
+		return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+	}
+
+	/** Atomically write a control word in a peer's window */
+	void writeControl(int rank, MPI_Aint field, uint64_t value)
+	{
+		MPI_Accumulate(&value, 1, MPI_UINT64_T, rank,
+			controlOffset(m_rank) + field, 1, MPI_UINT64_T,
+			MPI_REPLACE, m_win);
+		MPI_Win_flush(rank, m_win);
+	}
+
+	/** Write 'len' bytes at position 'pos' of our ring at 'rank' */
+	void putRing(int rank, uint64_t pos, const char* data, size_t len)
+	{
+		size_t offset = pos % m_ringSize;
+		size_t first = std::min(len, m_ringSize - offset);
+		MPI_Put(data, first, MPI_BYTE, rank,
+			ringOffset(m_rank) + offset, first, MPI_BYTE, m_win);
+		if (first < len)
+			MPI_Put(data + first, len - first, MPI_BYTE, rank,
+				ringOffset(m_rank), len - first, MPI_BYTE, m_win);
+	}
+
+	/** Copy 'len' bytes at position 'pos' of ring from 'rank' */
+	void readRing(int rank, uint64_t pos, char* dest, size_t len)
+	{
+		const char* ring = (const char*)m_base + ringOffset(rank);
+		size_t offset = pos % m_ringSize;
+		size_t first = std::min(len, m_ringSize - offset);
+		memcpy(dest, ring + offset, first);
+		if (first < len)
+			memcpy(dest + first, ring, len - first);
+	}
+
+	/**
+	 * Write as many queued sends to 'rank' as will fit
+	 *
+	 * @return true if any were written
+	 */
+	bool flushSends(int rank)
+	{
+		OpQueue& queue = m_sends[rank];
+		uint64_t head = readControl(rank, RMA_HEAD_OFFSET);
+		uint64_t& tail = m_sendTail[rank];
+		assert(tail - head <= m_ringSize);
+
+		/* headers must stay put until MPI_Win_flush */
+		std::deque<RMARecordHeader> headers;
+		OpQueue sent;
+		while (!queue.empty()) {
+			RMAOp* op = queue.front();
+			size_t size = recordSize(op->len);
+			if (tail - head + size > m_ringSize)
+				break;
+			RMARecordHeader header;
+			header.tag = op->tag;
+			header.len = op->len;
+			headers.push_back(header);
+			putRing(rank, tail, (const char*)&headers.back(),
+				sizeof(RMARecordHeader));
+			putRing(rank, tail + sizeof(RMARecordHeader),
+				op->buf, op->len);
+			tail += size;
+			queue.pop_front();
+			sent.push_back(op);
+		}
+		if (sent.empty())
+			return false;
+
+		/* data must land before the receiver sees the new tail */
+		MPI_Win_flush(rank, m_win);
+		writeControl(rank, RMA_TAIL_OFFSET, tail);
+
+		if (opt::verbose >= 3)
+			fprintf(g_log, "wrote %lu messages to RMA ring at "
+				"rank %d\n",
+				sent.size(), rank);
+
+		for (OpQueue::iterator it = sent.begin(); it != sent.end(); ++it)
+			MPI_Grequest_complete((*it)->request);
+		return true;
+	}
+
+	/**
+	 * Take all new messages out of the ring from 'rank'
+	 * (the sender wrote them before the tail we read, so
+	 * the MPI_Win_sync in progress() made them visible too)
+	 *
+	 * @return true if there were any
+	 */
+	bool drainRing(int rank)
+	{
+		uint64_t tail = readControl(rank, RMA_TAIL_OFFSET);
+		uint64_t& head = m_recvHead[rank];
+		if (head == tail)
+			return false;
+		assert(tail - head <= m_ringSize);
+
+		while (head < tail) {
+			RMARecordHeader header;
+			readRing(rank, head, (char*)&header, sizeof(header));
+			deliver(rank, header.tag, head + sizeof(header), header.len);
+			head += recordSize(header.len);
+		}
+		assert(head == tail);
+
+		/* hand the space back to the sender */
+		writeControl(rank, RMA_HEAD_OFFSET, head);
+		return true;
+	}
+
+	/**
+	 * Copy a message from the ring to a matching
+	 * receive, or park it in an inbox if there isn't one.
+	 */
+	void deliver(int rank, int tag, uint64_t pos, size_t len)
+	{
+		InboxMap::iterator inbox = m_inboxes.find(InboxKey(rank, tag));
+		if (inbox == m_inboxes.end() || inbox->second->empty()) {
+			for (OpQueue::iterator it = m_recvs.begin();
+				it != m_recvs.end(); ++it) {
+				RMAOp* op = *it;
+				if (op->rank != rank || op->tag != tag)
+					continue;
+				checkLength(*op, len);
+				readRing(rank, pos, op->buf, len);
+				op->len = len;
+				m_recvs.erase(it);
+				MPI_Grequest_complete(op->request);
+				return;
+			}
+		}
+		if (inbox == m_inboxes.end()) {
+			inbox = m_inboxes.insert(InboxMap::value_type(
+				InboxKey(rank, tag), new RMAInbox(rank, tag))).first;
+		}
+		if (opt::verbose >= 3)
+			fprintf(g_log, "no receive posted for %lu byte "
+				"message from rank %d (tag %d), buffering\n", len, rank, tag);
+		size_t offset = pos % m_ringSize;
+		size_t first = std::min(len, m_ringSize - offset);
+		const char* ring = (const char*)m_base + ringOffset(rank);
+		inbox->second->append(ring + offset, first);
+		if (first < len)
+			inbox->second->append(ring, len - first);
+		inbox->second->endMessage(len);
+	}
+
+	/** Complete posted receives from buffered messages */
+	void matchInboxes()
+	{
+		OpQueue::iterator it = m_recvs.begin();
+		while (it != m_recvs.end()) {
+			RMAOp* op = *it;
+			InboxMap::iterator inbox = m_inboxes.find(
+				InboxKey(op->rank, op->tag));
+			if (inbox == m_inboxes.end() || inbox->second->empty()) {
+				++it;
+				continue;
+			}
+			checkLength(*op, inbox->second->front());
+			op->len = inbox->second->front();
+			inbox->second->pop(op->buf);
+			it = m_recvs.erase(it);
+			MPI_Grequest_complete(op->request);
+		}
+	}
+
+	static void checkLength(const RMAOp& op, size_t len)
+	{
+		if (len <= op.len)
+			return;
+		fprintf(g_log, "error: %lu byte message from rank %d "
+			"(tag %d) exceeds %lu byte receive buffer\n", len, op.rank,
+			op.tag, op.len);
+		exit(EXIT_FAILURE);
+	}
+
+	MPI_Comm m_comm;
+	int m_rank;
+	int m_numProc;
+	/** size of each ring buffer (bytes) */
+	size_t m_ringSize;
+	/** local memory of window */
+	void* m_base;
+	MPI_Win m_win;
+	/** total bytes we have written to each peer's ring */
+	std::vector<uint64_t> m_sendTail;
+	/** total bytes we have consumed from each peer's ring */
+	std::vector<uint64_t> m_recvHead;
+	/** queued sends, per destination rank */
+	std::vector<OpQueue> m_sends;
+	/** posted receives, in posting order */
+	OpQueue m_recvs;
+	/** messages waiting for a matching receive */
+	InboxMap m_inboxes;
+};
+
+#endif
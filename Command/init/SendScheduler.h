@@ -0,0 +1,307 @@
+#ifndef _SEND_SCHEDULER_H_
+#define _SEND_SCHEDULER_H_
+
+#include "Command/init/log.h"
+#include "Options/CommonOptions.h"
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <cassert>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Priority classes for SEND streams. Under contention,
+ * each class receives a share of the MPI send slots
+ * proportional to its weight (see PRIORITY_WEIGHTS).
+ */
+enum SendPriority { PRIORITY_LOW=0, PRIORITY_NORMAL, PRIORITY_HIGH };
+
+static const unsigned NUM_PRIORITIES = 3;
+
+/** relative weights of SendPriority classes */
+static const double PRIORITY_WEIGHTS[NUM_PRIORITIES] = { 1, 4, 16 };
+
+/** max number of data chunks in flight over MPI at any time */
+static const unsigned MAX_SEND_SLOTS = 4;
+
+/**
+ * Bucket size for rate-limited streams, in seconds
+ * worth of data at the stream's rate.
+ */
+static const double RATE_BURST_SECONDS = 0.1;
+
+/** min bucket size for rate-limited streams (bytes) */
+static const uint64_t MIN_RATE_BURST = 4096;
+
+/** current time in seconds, from a monotonic clock */
+static inline double monotonic_time()
+{
+	struct timespec t;
+	int result = clock_gettime(CLOCK_MONOTONIC, &t);
+	assert(result == 0);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * A singleton class that decides which SEND stream may
+ * post its next data chunk to MPI.
+ *
+ * Without a scheduler, every connection posts its next
+ * chunk as soon as its input is ready, and a bulk
+ * transfer can easily crowd out a small, latency-sensitive
+ * message. The scheduler limits the number of chunks in
+ * flight to MAX_SEND_SLOTS and hands out free slots using
+ * weighted fair queueing (start-time fair queueing, to be
+ * precise): each chunk request is stamped with a virtual
+ * finish time of
+ *
+ *    max(virtual time, stream's last finish time)
+ *        + chunk size / priority weight
+ *
+ * and the request with the earliest finish time goes next.
+ * Small messages and high priority streams therefore
+ * overtake queued bulk data.
+ *
+ * Streams may also have a rate cap (bytes/sec), enforced
+ * with a token bucket. A stream that has exceeded its rate
+ * is passed over until its bucket refills.
+ */
+class SendScheduler
+{
+public:
+
+	static SendScheduler& getInstance()
+	{
+		static SendScheduler instance;
+		return instance;
+	}
+
+	/**
+	 * Register a SEND stream.
+	 * @param rate max bytes/sec, or 0 for unlimited
+	 */
+	void addStream(size_t connectionID, SendPriority priority,
+		uint64_t rate, double now)
+	{
+		assert(priority < NUM_PRIORITIES);
+		Stream& stream = m_streams[connectionID];
+		stream.priority = priority;
+		stream.rate = rate;
+		stream.tokens = burstSize(stream);
+		stream.lastRefill = now;
+		stream.lastFinish = m_virtualTime;
+		stream.queued = false;
+		stream.sending = false;
+	}
+
+	/** Unregister a stream, releasing its slot (if any) */
+	void removeStream(size_t connectionID)
+	{
+		StreamMap::iterator it = m_streams.find(connectionID);
+		if (it == m_streams.end())
+			return;
+		if (it->second.sending) {
+			assert(m_slotsInUse > 0);
+			m_slotsInUse--;
+		}
+		m_streams.erase(it);
+		m_queue.erase(std::remove(m_queue.begin(), m_queue.end(),
+			connectionID), m_queue.end());
+	}
+
+	bool hasStream(size_t connectionID) const
+	{
+		return m_streams.find(connectionID) != m_streams.end();
+	}
+
+	/**
+	 * Max size of the next chunk for a stream. For rate
+	 * limited streams this is the bucket size, so that
+	 * data goes out in steady increments rather than
+	 * large bursts.
+	 */
+	uint64_t maxChunkSize(size_t connectionID,
+		uint64_t defaultSize) const
+	{
+		const Stream& stream = getStream(connectionID);
+		if (stream.rate == 0)
+			return defaultSize;
+		return std::min(defaultSize, burstSize(stream));
+	}
+
+	/** Queue a request to send a chunk of 'bytes' bytes */
+	void enqueue(size_t connectionID, uint64_t bytes)
+	{
+		Stream& stream = getStream(connectionID);
+		assert(!stream.queued && !stream.sending);
+		double weight = PRIORITY_WEIGHTS[stream.priority];
+		stream.start = std::max(m_virtualTime, stream.lastFinish);
+		stream.finish = stream.start + bytes / weight;
+		stream.bytes = bytes;
+		stream.queued = true;
+		m_queue.push_back(connectionID);
+		if (opt::verbose >= 3)
+			log_f(connectionID, "queued chunk of %lu bytes for MPI "
+				"send slot (priority %d)", bytes, stream.priority);
+	}
+
+	/**
+	 * Grant a send slot to the queued request with the
+	 * earliest virtual finish time, among streams that are
+	 * within their rate limits.
+	 *
+	 * @return true if a slot was granted, with the ID of
+	 * the lucky connection in 'connectionID'
+	 */
+	bool dispatch(size_t& connectionID, double now)
+	{
+		if (m_slotsInUse >= MAX_SEND_SLOTS)
+			return false;
+
+		ConnectionQueue::iterator best = m_queue.end();
+		for (ConnectionQueue::iterator it = m_queue.begin();
+			it != m_queue.end(); ++it) {
+			Stream& stream = getStream(*it);
+			refill(stream, now);
+			if (stream.rate > 0 && stream.tokens < 0)
+				continue;
+			if (best == m_queue.end() ||
+				stream.finish < getStream(*best).finish)
+				best = it;
+		}
+		if (best == m_queue.end())
+			return false;
+
+		connectionID = *best;
+		m_queue.erase(best);
+
+		Stream& stream = getStream(connectionID);
+		stream.queued = false;
+		stream.sending = true;
+		stream.lastFinish = stream.finish;
+		if (stream.rate > 0)
+			stream.tokens -= stream.bytes;
+		m_virtualTime = stream.start;
+		m_slotsInUse++;
+
+		if (opt::verbose >= 3)
+			log_f(connectionID, "granted MPI send slot "
+				"(%u/%u in use)", m_slotsInUse, MAX_SEND_SLOTS);
+		return true;
+	}
+
+	/** Release the slot held by a stream */
+	void complete(size_t connectionID)
+	{
+		Stream& stream = getStream(connectionID);
+		assert(stream.sending);
+		assert(m_slotsInUse > 0);
+		stream.sending = false;
+		m_slotsInUse--;
+	}
+
+	/**
+	 * Seconds until the next queued request that is
+	 * blocked by its rate limit could be dispatched,
+	 * or a negative number if no requests are blocked
+	 * by rate limits.
+	 */
+	double nextRefillDelay(double now)
+	{
+		double delay = -1;
+		for (ConnectionQueue::iterator it = m_queue.begin();
+			it != m_queue.end(); ++it) {
+			Stream& stream = getStream(*it);
+			refill(stream, now);
+			if (stream.rate == 0 || stream.tokens >= 0)
+				continue;
+			double wait = -stream.tokens / stream.rate;
+			if (delay < 0 || wait < delay)
+				delay = wait;
+		}
+		return delay;
+	}
+
+	unsigned slotsInUse() const
+	{
+		return m_slotsInUse;
+	}
+
+private:
+
+	struct Stream {
+		SendPriority priority;
+		/** rate limit in bytes/sec (0 for unlimited) */
+		uint64_t rate;
+		/** token bucket level (bytes); may go negative */
+		double tokens;
+		/** time of last token bucket update */
+		double lastRefill;
+		/** virtual start/finish times of queued request */
+		double start;
+		double finish;
+		/** size of queued request (bytes) */
+		uint64_t bytes;
+		/** virtual finish time of previous request */
+		double lastFinish;
+		/** true if stream has a request in the queue */
+		bool queued;
+		/** true if stream is holding a send slot */
+		bool sending;
+	};
+
+	typedef std::unordered_map<size_t, Stream> StreamMap;
+	typedef std::deque<size_t> ConnectionQueue;
+
+	SendScheduler() : m_slotsInUse(0), m_virtualTime(0) {}
+
+	/*
+	 * disable copy constructor and assignment operator
+	 * to prevent copies of the singleton instance
+	 */
+	SendScheduler(SendScheduler const&);
+	void operator=(SendScheduler const&);
+
+	Stream& getStream(size_t connectionID)
+	{
+		StreamMap::iterator it = m_streams.find(connectionID);
+		assert(it != m_streams.end());
+		return it->second;
+	}
+
+	const Stream& getStream(size_t connectionID) const
+	{
+		StreamMap::const_iterator it = m_streams.find(connectionID);
+		assert(it != m_streams.end());
+		return it->second;
+	}
+
+	static uint64_t burstSize(const Stream& stream)
+	{
+		if (stream.rate == 0)
+			return 0;
+		return std::max(MIN_RATE_BURST,
+			(uint64_t)(stream.rate * RATE_BURST_SECONDS));
+	}
+
+	static void refill(Stream& stream, double now)
+	{
+		if (stream.rate == 0)
+			return;
+		stream.tokens = std::min((double)burstSize(stream),
+			stream.tokens + (now - stream.lastRefill) * stream.rate);
+		stream.lastRefill = now;
+	}
+
+	/** per-stream scheduling state */
+	StreamMap m_streams;
+	/** streams waiting for a send slot */
+	ConnectionQueue m_queue;
+	/** number of chunks currently in flight */
+	unsigned m_slotsInUse;
+	/** virtual time (start time of last dispatched request) */
+	double m_virtualTime;
+};
+
+#endif
@@ -0,0 +1,364 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <string>
+#include <set>
+#include <algorithm>
+#include <sstream>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <event2/buffer.h>
+
+namespace opt {
+	/**
+	 * Directory for spool files. Spooling to disk is
+	 * disabled if this is empty.
+	 */
+	static std::string spoolDir;
+}
+
+/**
+ * Amount of stream data (bytes) that a connection may
+ * hold in memory before overflow data is spilled to its
+ * spool file.
+ */
+static const size_t SPOOL_THRESHOLD = 4 * 1024 * 1024;
+
+/**
+ * Max bytes to map from a spool file in one go, when
+ * replaying spooled data to a client.
+ */
+static const size_t SPOOL_READ_SIZE = 1 * 1024 * 1024;
+
+/**
+ * Max number of buffer segments to write with a
+ * single pwritev() call.
+ */
+static const int SPOOL_MAX_IOVECS = 64;
+
+/**
+ * Spool data that has been read is given back to the
+ * file system in blocks of this size (bytes).
+ */
+static const off_t SPOOL_PUNCH_SIZE = SPOOL_READ_SIZE;
+
+/**
+ * An open spool file. Reference counted, because memory
+ * mappings of the file that we have handed to libevent
+ * may outlive the Spool object that created them.
+ */
+struct SpoolFile
+{
+	int fd;
+	unsigned refs;
+	/** file offset of next byte to be read */
+	off_t readOffset;
+	/** the file has no disk space before this offset */
+	off_t punched;
+	/** start offsets of the regions that are mapped */
+	std::multiset<off_t> mapped;
+};
+
+/** A region of a spool file that is mapped into memory. */
+struct SpoolMapping
+{
+	SpoolFile* file;
+	void* addr;
+	size_t len;
+	/** file offset of 'addr' */
+	off_t offset;
+};
+
+/**
+ * Give the disk space of data that has been read, and is
+ * no longer mapped, back to the file system, in whole
+ * SPOOL_PUNCH_SIZE blocks. This keeps a spool from growing
+ * to the size of the stream while a slow consumer keeps
+ * reading from it. (Not every file system can punch
+ * holes; there, the space only comes back once the spool
+ * has been drained.)
+ */
+static inline void punch_spool_file(SpoolFile* file)
+{
+	off_t end = file->readOffset;
+	if (!file->mapped.empty())
+		end = std::min(end, *file->mapped.begin());
+	end -= end % SPOOL_PUNCH_SIZE;
+	if (end <= file->punched)
+		return;
+	fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		file->punched, end - file->punched);
+	file->punched = end;
+}
+
+static inline void release_spool_file(SpoolFile* file)
+{
+	assert(file != NULL);
+	assert(file->refs > 0);
+	if (--file->refs > 0)
+		return;
+	if (close(file->fd) < 0)
+		perror("close");
+	delete file;
+}
+
+/**
+ * Callback invoked by libevent when it no longer needs
+ * a mapped region of a spool file.
+ */
+static inline void unmap_spool_region(const void*, size_t, void* arg)
+{
+	assert(arg != NULL);
+	SpoolMapping* mapping = (SpoolMapping*)arg;
+	if (munmap(mapping->addr, mapping->len) < 0)
+		perror("munmap");
+	SpoolFile* file = mapping->file;
+	file->mapped.erase(file->mapped.find(mapping->offset));
+	if (file->refs > 1)
+		punch_spool_file(file);
+	release_spool_file(file);
+	delete mapping;
+}
+
+/**
+ * A FIFO of stream data backed by a temporary file.
+ *
+ * The 'mpih init' daemon spills data to a spool when the
+ * local client at the other end of a stream can't keep up
+ * with MPI (e.g. a slow consumer behind 'mpih recv').
+ * Data is appended with large sequential writes, and read
+ * back in order by mapping regions of the file into memory
+ * and handing them to libevent without copying. Disk
+ * space is given back as the data is read (see
+ * punch_spool_file()).
+ *
+ * Spooling only helps once the consumer is connected: the
+ * sender of a stream still waits for 'mpih recv' to
+ * start, because the receiving daemon doesn't take data
+ * for a stream that has no client yet.
+ *
+ * The file is unlinked as soon as it is created, so that
+ * it disappears when the daemon exits, even on a crash.
+ */
+class Spool
+{
+public:
+
+	Spool(const std::string& dir, size_t connectionID) :
+		m_file(new SpoolFile), m_readOffset(0), m_writeOffset(0)
+	{
+		std::ostringstream name;
+		name << connectionID;
+		assert(name);
+		open(dir, name.str());
+	}
+
+	/**
+	 * Create a spool file that isn't tied to a client
+	 * connection. 'name' must be unique within the daemon.
+	 */
+	Spool(const std::string& dir, const std::string& name) :
+		m_file(new SpoolFile), m_readOffset(0), m_writeOffset(0)
+	{
+		open(dir, name);
+	}
+
+	~Spool()
+	{
+		release_spool_file(m_file);
+	}
+
+	/** Number of bytes currently held in the spool */
+	size_t size() const
+	{
+		return m_writeOffset - m_readOffset;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	/** the spool file (owned by us) */
+	int fd() const
+	{
+		return m_file->fd;
+	}
+
+	/** Append a block of data to the end of the spool */
+	void append(const void* data, size_t len)
+	{
+		reclaim();
+		const char* p = (const char*)data;
+		while (len > 0) {
+			ssize_t n = pwrite(m_file->fd, p, len, m_writeOffset);
+			if (n < 0) {
+				perror("write spool file");
+				exit(EXIT_FAILURE);
+			}
+			p += n;
+			len -= n;
+			m_writeOffset += n;
+		}
+	}
+
+	/** Move the entire contents of 'buffer' to the end of the spool */
+	void append(struct evbuffer* buffer)
+	{
+		assert(buffer != NULL);
+		reclaim();
+		struct evbuffer_iovec vec[SPOOL_MAX_IOVECS];
+		while (evbuffer_get_length(buffer) > 0) {
+			int count = evbuffer_peek(buffer, -1, NULL,
+				vec, SPOOL_MAX_IOVECS);
+			assert(count > 0);
+			if (count > SPOOL_MAX_IOVECS)
+				count = SPOOL_MAX_IOVECS;
+			ssize_t n = pwritev(m_file->fd, (struct iovec*)vec,
+				count, m_writeOffset);
+			if (n < 0) {
+				perror("write spool file");
+				exit(EXIT_FAILURE);
+			}
+			m_writeOffset += n;
+			evbuffer_drain(buffer, n);
+		}
+	}
+
+	/**
+	 * Move up to 'max' bytes from the front of the spool
+	 * to the end of 'dest'. The data is not copied;
+	 * 'dest' holds a reference to a mapped region of
+	 * the spool file instead.
+	 *
+	 * @return number of bytes moved
+	 */
+	size_t read(struct evbuffer* dest, size_t max)
+	{
+		assert(dest != NULL);
+		size_t len = std::min(max, size());
+		if (len == 0)
+			return 0;
+
+		static const off_t pageSize = sysconf(_SC_PAGESIZE);
+		off_t mapOffset = m_readOffset & ~(pageSize - 1);
+		size_t skip = m_readOffset - mapOffset;
+
+		SpoolMapping* mapping = new SpoolMapping;
+		mapping->file = m_file;
+		mapping->offset = mapOffset;
+		mapping->len = skip + len;
+		mapping->addr = mmap(NULL, mapping->len, PROT_READ,
+			MAP_SHARED, m_file->fd, mapOffset);
+		if (mapping->addr == MAP_FAILED) {
+			perror("mmap spool file");
+			exit(EXIT_FAILURE);
+		}
+		madvise(mapping->addr, mapping->len, MADV_SEQUENTIAL);
+		m_file->refs++;
+		m_file->mapped.insert(mapOffset);
+
+		int result = evbuffer_add_reference(dest,
+			(char*)mapping->addr + skip, len,
+			unmap_spool_region, mapping);
+		assert(result == 0);
+
+		m_readOffset += len;
+		consumed();
+
+		return len;
+	}
+
+	/**
+	 * Copy up to 'max' bytes from the front of the spool
+	 * into 'dest'.
+	 *
+	 * @return number of bytes copied
+	 */
+	size_t read(void* dest, size_t max)
+	{
+		assert(dest != NULL);
+		size_t len = std::min(max, size());
+		char* p = (char*)dest;
+		size_t remaining = len;
+		while (remaining > 0) {
+			ssize_t n = pread(m_file->fd, p, remaining, m_readOffset);
+			if (n <= 0) {
+				perror("read spool file");
+				exit(EXIT_FAILURE);
+			}
+			p += n;
+			remaining -= n;
+			m_readOffset += n;
+		}
+		consumed();
+		return len;
+	}
+
+private:
+
+	void open(const std::string& dir, const std::string& name)
+	{
+		std::ostringstream path;
+		path << dir << "/spool." << getpid() << "." << name;
+		assert(path);
+
+		int fd = ::open(path.str().c_str(),
+			O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd < 0) {
+			perror("open spool file");
+			exit(EXIT_FAILURE);
+		}
+		if (unlink(path.str().c_str()) < 0)
+			perror("unlink spool file");
+
+		m_file->fd = fd;
+		m_file->refs = 1;
+		m_file->readOffset = 0;
+		m_file->punched = 0;
+	}
+
+	/** Free disk space behind data that has been read */
+	void consumed()
+	{
+		m_file->readOffset = m_readOffset;
+		punch_spool_file(m_file);
+		reclaim();
+	}
+
+	/**
+	 * Release disk space once the spool has been fully
+	 * drained. We can't truncate the file while libevent
+	 * still holds mappings of it, so in that case we just
+	 * keep appending at the current offset.
+	 */
+	void reclaim()
+	{
+		if (!empty() || m_file->refs > 1)
+			return;
+		if (ftruncate(m_file->fd, 0) < 0)
+			perror("ftruncate spool file");
+		m_readOffset = 0;
+		m_writeOffset = 0;
+		m_file->readOffset = 0;
+		m_file->punched = 0;
+	}
+
+	/* disable copy constructor and assignment operator */
+	Spool(const Spool&);
+	void operator=(const Spool&);
+
+	/** temporary file holding spooled data */
+	SpoolFile* m_file;
+	/** file offset of next byte to be read */
+	off_t m_readOffset;
+	/** file offset where next byte will be written */
+	off_t m_writeOffset;
+};
+
+#endif
@@ -3,15 +3,43 @@
 
 #include "Command/init/log.h"
 #include "Command/init/mpi.h"
+#include "Command/init/FdReserve.h"
 #include "IO/SocketUtil.h"
+#include "IO/BinaryHeader.h"
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define MAX_HEADER_SIZE 256
 #define MAX_BUFFER_SIZE 16384
 
+/**
+ * Max input from an 'mpih send' client that the daemon
+ * will buffer before applying backpressure (bytes).
+ * Does not apply to 'mpih send --detach'.
+ */
+#define SEND_HIGH_WATERMARK (4*1024*1024)
+
+/**
+ * Max connections accepted per wakeup of the listener,
+ * so that a burst of new clients doesn't hold up the
+ * streams that are already running
+ */
+static const int ACCEPT_BATCH = 64;
+
+/**
+ * Kernel buffer size for client sockets (bytes), so that
+ * a client and the daemon can get further ahead of each
+ * other between wakeups (not in low-footprint mode)
+ */
+static const int CLIENT_SOCKET_BUFFER_SIZE = 1024 * 1024;
+
+/** libevent handler for the listening socket (NULL with io_uring) */
+static struct event* g_listener_event = NULL;
+
 /**
  * Becomes true if a client has issued
  * 'mpih finalize'. If true, the daemon will wait
@@ -22,6 +50,226 @@
  */
 static bool g_finalize_pending = false;
 
+// forward declarations
+static inline void init_read_handler(struct bufferevent *bev, void *arg);
+static inline void init_write_handler(struct bufferevent *bev, void *arg);
+static inline void init_event_handler(struct bufferevent *bev,
+	short error, void *arg);
+static inline void start_mux_session(Connection& connection);
+
+/** Options that may follow <RANK> in a SEND/RECV header */
+struct StreamOptions
+{
+	/** MPI tag for the stream ("TAG <n>") */
+	int tag;
+	/** priority class of a SEND stream ("PRIORITY <n>") */
+	SendPriority priority;
+	/** max rate of a SEND stream, bytes/sec ("RATE <n>") */
+	uint64_t rate;
+	/** 'mpih send --detach' ("DETACH") */
+	bool detached;
+	/** client will hand us a file descriptor for the data ("FD") */
+	bool passFd;
+	/** client will hand us a shared-memory ring for the data ("SHM") */
+	bool shm;
+	/** stripe number, for a striped transfer ("STRIPE <n>") */
+	int stripe;
+	/**
+	 * part of the file to send, for a stripe of a striped
+	 * SEND ("RANGE <offset> <length>"); -1 if not given
+	 */
+	off_t rangeOffset;
+	uint64_t rangeLength;
+	/**
+	 * named pipe to create and serve the data through, for
+	 * 'mpih mkfifo' ("FIFO <path>"); empty otherwise
+	 */
+	std::string fifoPath;
+	/** <RANK> is a rank of the remote job ("REMOTE") */
+	bool remote;
+
+	StreamOptions() : tag(MPI_DEFAULT_TAG),
+		priority(PRIORITY_NORMAL), rate(0), detached(false),
+		passFd(false), shm(false), stripe(-1), rangeOffset(-1),
+		rangeLength(0), remote(false) {}
+};
+
+/**
+ * Check the rank and options of a SEND or RECV header,
+ * whether it came as a text line or a binary request.
+ *
+ * A STRIPE must come with a file descriptor ("FD"); for
+ * SEND, it also needs the RANGE of the file to send.
+ *
+ * @return true if the header is well-formed
+ */
+static inline bool check_stream_header(Connection& connection,
+	XferDir dir, int rank, const StreamOptions& options)
+{
+	if (options.remote && mpi::remoteComm == MPI_COMM_NULL) {
+		log_f(connection.id(), "error: REMOTE %s, but we aren't "
+			"connected to another job", dir == SEND ? "SEND" : "RECV");
+		return false;
+	}
+	if (rank < 0 || rank >= (options.remote ? mpi::remoteSize :
+		mpi::numProc)) {
+		log_f(connection.id(), "error: malformed %s header, "
+			"expected valid MPI rank", dir == SEND ? "SEND" : "RECV");
+		return false;
+	}
+	if (options.tag < 0 || options.tag > MPI_MAX_USER_TAG) {
+		log_f(connection.id(), "error: MPI tag must be "
+			"between 0 and %d", MPI_MAX_USER_TAG);
+		return false;
+	}
+	if ((unsigned)options.priority >= NUM_PRIORITIES) {
+		log_f(connection.id(), "error: invalid priority class");
+		return false;
+	}
+	if (options.stripe < -1 || options.stripe >= MPI_MAX_STRIPES) {
+		log_f(connection.id(), "error: stripe must be "
+			"between 0 and %d", MPI_MAX_STRIPES - 1);
+		return false;
+	}
+	if (options.passFd && options.shm) {
+		log_f(connection.id(), "error: a %s header can't offer both "
+			"FD and SHM", dir == SEND ? "SEND" : "RECV");
+		return false;
+	}
+	if (options.stripe >= 0 && (!options.passFd ||
+		(dir == SEND) != (options.rangeOffset >= 0))) {
+		log_f(connection.id(), "error: a %s stripe must come with "
+			"%s", dir == SEND ? "SEND" : "RECV", dir == SEND ?
+			"a file range and descriptor" : "a file descriptor");
+		return false;
+	}
+	if (!options.fifoPath.empty() && (options.passFd || options.shm ||
+		options.detached || options.stripe >= 0 ||
+		connection.mux != NULL)) {
+		log_f(connection.id(), "error: a FIFO stream can't use FD, "
+			"SHM, DETACH, STRIPE, or a multiplexed connection");
+		return false;
+	}
+	if (options.stripe < 0 && options.rangeOffset >= 0) {
+		log_f(connection.id(), "error: a file range is only "
+			"allowed for a stripe");
+		return false;
+	}
+	if (options.stripe > 0 &&
+		stripe_tag(options.tag, options.stripe) > mpi::tagUB) {
+		log_f(connection.id(), "error: MPI tag for stripe %d "
+			"exceeds MPI_TAG_UB (%d)", options.stripe, mpi::tagUB);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Parse the remainder of a SEND or RECV header line:
+ *
+ *    SEND <RANK> [REMOTE] [TAG <n>] [PRIORITY <n>] [RATE <n>]
+ *        [DETACH] [STRIPE <n> RANGE <offset> <length>]
+ *        [FD|SHM|FIFO <path>]
+ *    RECV <RANK> [REMOTE] [TAG <n>] [STRIPE <n>]
+ *        [FD|SHM|FIFO <path>]
+ *
+ * REMOTE means that <RANK> is a rank of the job that we
+ * are connected to (see handle_accept()).
+ *
+ * FIFO takes the rest of the line as an absolute path
+ * (which may contain spaces).
+ *
+ * @return true if the header is well-formed
+ */
+static inline bool parse_stream_header(Connection& connection,
+	std::stringstream& ss, XferDir dir, int& rank,
+	StreamOptions& options)
+{
+	ss >> rank;
+	if (ss.fail()) {
+		log_f(connection.id(), "error: malformed %s header, "
+			"expected valid MPI rank", dir == SEND ? "SEND" : "RECV");
+		return false;
+	}
+
+	std::string option;
+	while (ss >> option) {
+		if (option == "REMOTE") {
+			options.remote = true;
+		} else if (option == "TAG") {
+			ss >> options.tag;
+			if (ss.fail())
+				options.tag = -1;
+		} else if (option == "PRIORITY" && dir == SEND) {
+			int priority;
+			ss >> priority;
+			options.priority = (SendPriority)(ss.fail() ? -1 : priority);
+		} else if (option == "RATE" && dir == SEND) {
+			ss >> options.rate;
+			if (ss.fail()) {
+				log_f(connection.id(), "error: invalid rate limit");
+				return false;
+			}
+		} else if (option == "DETACH" && dir == SEND) {
+			options.detached = true;
+		} else if (option == "STRIPE") {
+			ss >> options.stripe;
+			if (ss.fail() || options.stripe < 0)
+				options.stripe = MPI_MAX_STRIPES;
+		} else if (option == "RANGE" && dir == SEND) {
+			ss >> options.rangeOffset >> options.rangeLength;
+			if (ss.fail() || options.rangeOffset < 0) {
+				log_f(connection.id(), "error: invalid file range");
+				return false;
+			}
+		} else if (option == "FD" && !options.shm) {
+			options.passFd = true;
+		} else if (option == "SHM" && !options.passFd) {
+			options.shm = true;
+		} else if (option == "FIFO") {
+			std::getline(ss >> std::ws, options.fifoPath);
+			if (options.fifoPath.empty() ||
+				options.fifoPath[0] != '/') {
+				log_f(connection.id(), "error: FIFO needs an "
+					"absolute path");
+				return false;
+			}
+		} else {
+			log_f(connection.id(), "error: unrecognized %s header "
+				"option '%s'", dir == SEND ? "SEND" : "RECV",
+				option.c_str());
+			return false;
+		}
+	}
+
+	return check_stream_header(connection, dir, rank, options);
+}
+
+/**
+ * Reply to the client's last request, in the form it used:
+ * a text line (e.g. "NOFD", "0") or a binary reply.
+ */
+static inline void send_reply(Connection& connection, HeaderReply code,
+	int value = 0)
+{
+	static const char* const REPLY_TEXT[] = {
+		"OK", "FD", "NOFD", "SHM", "NOSHM"
+	};
+	struct bufferevent* client = connection.control != NULL ?
+		connection.control : connection.bev;
+	struct evbuffer* output = bufferevent_get_output(client);
+	if (connection.binary) {
+		char reply[BINARY_REPLY_SIZE];
+		encode_binary_reply(reply, code, value);
+		evbuffer_add(output, reply, sizeof(reply));
+	} else if (code == REPLY_VALUE) {
+		evbuffer_add_printf(output, "%d\n", value);
+	} else {
+		evbuffer_add_printf(output, "%s\n", REPLY_TEXT[code]);
+	}
+}
+
 static inline char* read_header(Connection& connection)
 {
 	struct bufferevent* bev = connection.bev;
@@ -42,20 +290,817 @@ static inline char* read_header(Connection& connection)
 	return line;
 }
 
+/**
+ * Start moving data for a SEND/RECV stream, once the
+ * header has been parsed (and the client has handed us
+ * a file descriptor for the data, if it offered one).
+ */
+static inline void start_stream(Connection& connection)
+{
+	assert(connection.bev != NULL);
+
+	if (connection.channel.m_xferDir == SEND) {
+		/*
+		 * Detached clients exit as soon as the daemon has
+		 * taken all of their input, so we don't limit the
+		 * amount of buffered input for them (unless we are
+		 * reading straight from a file).
+		 */
+		bool unlimited = connection.detached && connection.pump == NULL;
+		bufferevent_setwatermark(connection.bev, EV_READ,
+			buffer_limit(SEND_LOW_WATERMARK),
+			unlimited ? 0 : buffer_limit(SEND_HIGH_WATERMARK));
+		if (connection.detached)
+			connection.spool_input();
+	}
+
+	MPIChannelManager& manager = MPIChannelManager::getInstance();
+	ChannelRequestResult result = manager.requestChannel(
+		connection.id(), connection.channel);
+
+	if (result == QUEUED) {
+		connection.state = WAITING_FOR_MPI_CHANNEL;
+		connection.schedule_event(update_mpi_status, 1000);
+		return;
+	}
+
+	assert(result == GRANTED);
+	connection.holding_mpi_channel = true;
+
+	if (connection.channel.m_xferDir == SEND) {
+		mpi_start_send(connection);
+	} else {
+		connection.state = MPI_READY_TO_RECV_CHUNK_SIZE;
+		mpi_recv_chunk_size(connection);
+	}
+}
+
+/**
+ * Called when the client of a shared-memory ring stream
+ * has published input (SEND) or released space (RECV).
+ */
 static inline void
-process_next_header(Connection& connection)
+shm_doorbell_handler(evutil_socket_t fd, short event, void *arg)
 {
-	connection.clear();
-	connection.state = READING_HEADER;
+	assert(arg != NULL);
+	Connection& connection = *(Connection*)arg;
+
+	ShmRing::clearBell(fd);
+
+	if (opt::verbose >= 3)
+		log_f(connection.id(), "doorbell rung by client");
+
+	if (connection.state == MPI_READY_TO_SEND_CHUNK_SIZE &&
+		connection.inputReady())
+		mpi_send_chunk_size(connection);
+	else if (connection.state == MPI_READY_TO_RECV_CHUNK)
+		mpi_recv_chunk(connection);
+}
+
+/**
+ * Move the data of a SEND/RECV stream through the shared-
+ * memory ring described by 'fds', instead of the client
+ * socket. MPI chunks are sent from, or received into, the
+ * ring directly, so the ring must be able to hold a whole
+ * chunk.
+ *
+ * @return false if we can't use the ring
+ */
+static inline bool attach_ring(Connection& connection, const int* fds)
+{
+	ShmRing* ring = ShmRing::attach(fds);
+	if (ring == NULL) {
+		log_f(connection.id(), "client sent an invalid "
+			"shared-memory ring");
+		return false;
+	}
+	if (ring->size() < max_chunk_size()) {
+		log_f(connection.id(), "shared-memory ring is too small "
+			"(%lu bytes, need %lu)", ring->size(), max_chunk_size());
+		delete ring;
+		return false;
+	}
+
+	/* we read from the ring for SEND, write to it for RECV */
+	int bell = connection.channel.m_xferDir == SEND ?
+		ring->readerBell() : ring->writerBell();
+	connection.ring = ring;
+	connection.doorbell = event_new(connection.getBase(), bell,
+		EV_READ|EV_PERSIST, shm_doorbell_handler, &connection);
+	assert(connection.doorbell != NULL);
+	event_add(connection.doorbell, NULL);
+	return true;
+}
+
+/**
+ * Switch the data side of a connection to the file
+ * descriptor 'fd' handed over by the client.
+ *
+ * Regular files that we send are mapped into memory
+ * (MappedFile), and MPI chunks are sent from the mapping;
+ * received chunks are written straight to regular files
+ * (FileSink). Otherwise, regular files are read/written
+ * through a FilePump.
+ * Pipes are re-opened in non-blocking mode, so that we
+ * don't change the flags of the client's own descriptor.
+ * Sockets, terminals, etc. are not accepted (the client
+ * doesn't offer them).
+ *
+ * @return false if we can't use 'fd' (the connection
+ * is left unchanged)
+ */
+static inline bool attach_fd(Connection& connection, int fd)
+{
+	struct event_base* base = connection.getBase();
+	XferDir dir = connection.channel.m_xferDir;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		log_f(connection.id(), "fstat: %s", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	if (S_ISREG(st.st_mode) && dir == SEND) {
+		connection.mapped = MappedFile::open(fd, opt::lowFootprint ?
+			LOW_FOOTPRINT_MAPPED_WINDOW : MAPPED_FILE_WINDOW,
+			connection.range_offset, connection.range_length);
+		if (connection.mapped != NULL) {
+			/* we already have all of the input */
+			connection.eof = true;
+			/* (the client socket stays open until we are done) */
+			return true;
+		}
+		if (connection.range_offset >= 0) {
+			/* a FilePump can only read from the file offset */
+			log_f(connection.id(), "can't map client file: %s",
+				strerror(errno));
+			close(fd);
+			return false;
+		}
+		if (opt::verbose >= 2)
+			log_f(connection.id(), "can't map client file (%s); "
+				"reading it instead", strerror(errno));
+	}
+
+	if (S_ISREG(st.st_mode) && dir == RECV) {
+		connection.sink = FileSink::open(fd);
+		if (connection.sink != NULL)
+			return true;
+	}
+
+	/* stripes must be written at the sender's file offsets */
+	if (connection.striped) {
+		log_f(connection.id(), "client sent unsupported file type "
+			"for a stripe");
+		close(fd);
+		return false;
+	}
+
+	struct bufferevent* bev = NULL;
+	if (S_ISREG(st.st_mode)) {
+		connection.pump = new FilePump(base, fd, dir);
+		bev = connection.pump->bev();
+	} else if (S_ISFIFO(st.st_mode)) {
+		std::ostringstream path;
+		path << "/proc/self/fd/" << fd;
+		int flags = (dir == SEND ? O_RDONLY : O_WRONLY) |
+			O_NONBLOCK | O_CLOEXEC;
+		int pipe = open(path.str().c_str(), flags);
+		if (pipe < 0)
+			log_f(connection.id(), "reopen pipe from client: %s",
+				strerror(errno));
+		close(fd);
+		if (pipe < 0)
+			return false;
+		bev = bufferevent_socket_new(base, pipe,
+			BEV_OPT_CLOSE_ON_FREE);
+		assert(bev != NULL);
+	} else {
+		log_f(connection.id(), "client sent unsupported file type");
+		close(fd);
+		return false;
+	}
+
+	/* keep the client socket, but only for signalling the client */
+	connection.control = connection.bev;
+	bufferevent_setcb(connection.control, NULL, NULL, NULL, NULL);
+	connection.bev = bev;
+
+	bufferevent_setcb(bev, init_read_handler,
+		init_write_handler, init_event_handler, &connection);
+	bufferevent_setwatermark(bev, EV_READ, 0, 0);
+	bufferevent_enable(bev, dir == SEND ? EV_READ : EV_WRITE);
+	return true;
+}
+
+/** Called when a same-node copy has finished */
+static inline void local_copy_done(void* arg)
+{
+	assert(arg != NULL);
+	Connection& connection = *(Connection*)arg;
+	assert(connection.state == LOCAL_COPYING);
+
+	connection.bytes_transferred = connection.copy->bytesCopied();
+	int error = connection.copy->error();
+	if (error != 0)
+		log_f(connection.id(), "error copying to rank %d on our node "
+			"(after %lu bytes): %s", connection.rank,
+			connection.bytes_transferred,
+			strerror(error));
+	else if (opt::verbose)
+		log_f(connection.id(), "copied %lu bytes to rank %d on the "
+			"same node", connection.bytes_transferred, connection.rank);
+
+	/* (leave the client's file offset after the data) */
+	if (connection.mapped != NULL)
+		connection.mapped->skip(connection.bytes_transferred);
+	delete connection.copy;
+	connection.copy = NULL;
+	mpi_send_local_done(connection,
+		error != 0 ? LOCAL_COPY_FAILED : LOCAL_COPIED);
+}
+
+/**
+ * Open the output of the receiving client of a same-node
+ * copy, which its daemon has told us where to find. We
+ * open it through /proc, which gives us a description of
+ * our own, so that we can make a pipe non-blocking.
+ *
+ * @return -1 on error (with errno set)
+ */
+static inline int open_local_output(const uint64_t* reply)
+{
+	std::ostringstream path;
+	path << "/proc/" << reply[LOCAL_PID] << "/fd/" << reply[LOCAL_FD];
+	int out = open(path.str().c_str(), O_WRONLY|O_NONBLOCK|O_CLOEXEC|
+		(reply[LOCAL_APPEND] ? O_APPEND : 0));
+	struct stat st;
+	if (out >= 0 && !reply[LOCAL_APPEND] && fstat(out, &st) == 0 &&
+		S_ISREG(st.st_mode) &&
+		lseek(out, reply[LOCAL_OFFSET], SEEK_SET) < 0) {
+		int saved = errno;
+		close(out);
+		errno = saved;
+		return -1;
+	}
+	return out;
+}
+
+/**
+ * Open our own description of the input of a SEND stream,
+ * for a same-node copy: the mapped file from the next byte
+ * to send, or the pipe that 'bev' reads (once we have
+ * copied what it has already read).
+ *
+ * @return -1 on error (with errno set)
+ */
+static inline int open_local_input(Connection& connection)
+{
+	if (connection.mapped == NULL)
+		return fcntl(connection.pipe_fd(), F_DUPFD_CLOEXEC, 0);
+
+	std::ostringstream path;
+	path << "/proc/self/fd/" << connection.mapped->fd();
+	int in = open(path.str().c_str(), O_RDONLY|O_CLOEXEC);
+	if (in >= 0 && lseek(in, connection.mapped->offset(),
+		SEEK_SET) < 0) {
+		int saved = errno;
+		close(in);
+		errno = saved;
+		return -1;
+	}
+	return in;
+}
+
+/**
+ * Copy the data of a SEND stream straight into the output
+ * of the receiving client, once its daemon (on our node)
+ * has accepted our offer. If we can't, we tell the
+ * receiver, and send through MPI after all.
+ */
+static inline void start_local_copy(Connection& connection)
+{
+	int out = open_local_output(connection.local_reply);
+	int in = out < 0 ? -1 : open_local_input(connection);
+	if (in < 0) {
+		log_f(connection.id(), "can't set up copy to rank %d on our "
+			"node (%s); sending through MPI", connection.rank,
+			strerror(errno));
+		if (out >= 0)
+			close(out);
+		mpi_send_local_done(connection, LOCAL_NOT_COPIED);
+		return;
+	}
+
+	/* data that we have already read from a pipe goes first */
+	struct evbuffer* head = NULL;
+	if (connection.mapped == NULL) {
+		bufferevent_disable(connection.bev, EV_READ);
+		head = bufferevent_get_input(connection.bev);
+	}
+
+	if (opt::verbose >= 2)
+		log_f(connection.id(), "copying stream to rank %d on the "
+			"same node", connection.rank);
+	connection.state = LOCAL_COPYING;
+	connection.copy = new LocalCopy(connection.getBase(), in, out,
+		head, connection.mapped != NULL ? connection.mapped->remaining() :
+		UINT64_MAX, local_copy_done, &connection);
+	connection.copy->start();
+}
+
+/** Called when the client socket has a file descriptor for us */
+static inline void
+init_fd_handler(evutil_socket_t, short event, void *arg)
+{
+	assert(arg != NULL);
+	Connection& connection = *(Connection*)arg;
+	assert(connection.state == WAITING_FOR_FD);
+
+	/* (the descriptor is lost if we have no slot for it) */
+	FdReserve& reserve = FdReserve::getInstance();
+	if (!reserve.fill()) {
+		connection.schedule_event(init_fd_handler, ACCEPT_BACKOFF);
+		return;
+	}
+	reserve.release(1);
+	int fd = UnixSocket::recv_fd(connection.socket);
+	reserve.fill();
+	if (fd < 0) {
+		log_f(connection.id(), "error: expected file descriptor "
+			"from client");
+		close_connection(connection);
+		return;
+	}
+
+	struct bufferevent* client = connection.bev;
+	if (attach_fd(connection, fd)) {
+		if (opt::verbose >= 2)
+			log_f(connection.id(), "doing I/O on file descriptor "
+				"handed over by client");
+		send_reply(connection, REPLY_OK);
+		/* (for a mapping/sink, we only watch the socket for EOF) */
+		if (connection.mapped != NULL || connection.sink != NULL)
+			bufferevent_enable(client, EV_READ);
+	} else {
+		/* client falls back to streaming through the socket */
+		send_reply(connection, REPLY_NOFD);
+		bufferevent_enable(client, EV_READ);
+	}
+	start_stream(connection);
+}
+
+/** Called when the client socket has a shared-memory ring for us */
+static inline void
+init_shm_handler(evutil_socket_t, short event, void *arg)
+{
+	assert(arg != NULL);
+	Connection& connection = *(Connection*)arg;
+	assert(connection.state == WAITING_FOR_FD);
+
+	FdReserve& reserve = FdReserve::getInstance();
+	if (!reserve.fill()) {
+		connection.schedule_event(init_shm_handler, ACCEPT_BACKOFF);
+		return;
+	}
+	reserve.release(ShmRing::NUM_FDS);
+	int fds[ShmRing::NUM_FDS];
+	bool received = UnixSocket::recv_fds(connection.socket, fds,
+		ShmRing::NUM_FDS);
+	reserve.fill();
+	if (!received) {
+		log_f(connection.id(), "error: expected shared-memory ring "
+			"from client");
+		close_connection(connection);
+		return;
+	}
 
 	struct bufferevent* bev = connection.bev;
-	assert(bev != NULL);
+	if (attach_ring(connection, fds)) {
+		if (opt::verbose >= 2)
+			log_f(connection.id(), "moving data through "
+				"shared-memory ring (%lu bytes)",
+				connection.ring->size());
+		send_reply(connection, REPLY_OK);
+	} else {
+		send_reply(connection, REPLY_NOSHM);
+	}
+	/* (for a ring, we only watch the socket for EOF) */
+	bufferevent_enable(bev, EV_READ);
+	start_stream(connection);
+}
+
+/**
+ * Ask the client to hand over a file descriptor for the
+ * data of a SEND/RECV stream ("FD" header option), or the
+ * memfd and doorbells of a shared-memory ring ("SHM"):
+ *
+ *    client: SEND 1 FD             client: SEND 1 SHM
+ *    daemon: FD                    daemon: SHM
+ *    client: <file descriptor>     client: <ring descriptors>
+ *    daemon: OK                    daemon: OK
+ *
+ * The daemon may answer either message with NOFD/NOSHM
+ * instead, in which case the data goes through the socket
+ * as usual.
+ */
+static inline void request_fd(Connection& connection, bool ring)
+{
+	struct bufferevent* bev = connection.bev;
+
+	/*
+	 * The io_uring reactor owns all reads on its sockets,
+	 * a detached client can't wait for ring space, and a
+	 * multiplexed stream has no socket of its own. When we
+	 * are short of descriptors (see FdReserve), the socket
+	 * will do too.
+	 */
+	if (IOURingReactor::getInstance().active() ||
+		(ring && connection.detached) || connection.mux != NULL ||
+		!FdReserve::getInstance().fill()) {
+		send_reply(connection, ring ? REPLY_NOSHM : REPLY_NOFD);
+		start_stream(connection);
+		return;
+	}
+
+	/*
+	 * The descriptor arrives as ancillary data, which is lost
+	 * if libevent reads the socket, so we must stop reading
+	 * before telling the client to go ahead.
+	 */
+	bufferevent_disable(bev, EV_READ);
+	connection.state = WAITING_FOR_FD;
+	send_reply(connection, ring ? REPLY_SHM : REPLY_FD);
+
+	if (connection.next_event != NULL)
+		event_free(connection.next_event);
+	connection.next_event = event_new(connection.getBase(),
+		connection.socket, EV_READ,
+		ring ? init_shm_handler : init_fd_handler, &connection);
+	assert(connection.next_event != NULL);
+	event_add(connection.next_event, NULL);
+}
+
+/** How often we check for the reader of a FIFO RECV stream (microseconds) */
+static const size_t FIFO_POLL_INTERVAL = 100000;
+
+/**
+ * Start the stream of a FIFO, once our end of the pipe
+ * ('fd') is open and ready
+ */
+static inline void
+fifo_ready_handler(evutil_socket_t fd, short event, void *arg)
+{
+	assert(arg != NULL);
+	Connection& connection = *(Connection*)arg;
+	assert(connection.state == WAITING_FOR_FD);
+
+	if (!attach_fd(connection, fd)) {
+		close_connection(connection);
+		return;
+	}
+	/* the client has had its OK, and is gone */
+	connection.release_control();
+
+	if (opt::verbose >= 2)
+		log_f(connection.id(), "serving named pipe '%s'",
+			connection.fifo_path.c_str());
+	start_stream(connection);
+}
+
+/**
+ * Open our end of the named pipe of a FIFO stream, and
+ * start the stream. A pipe can only be opened for writing
+ * without blocking once it has a reader, so for RECV we
+ * keep trying until the reader shows up. For SEND, we
+ * can open the pipe right away, but reading it returns
+ * EOF until a writer shows up; it only becomes readable
+ * once a writer has written to it or closed it, so we
+ * wait for that before we start the stream (which may
+ * read the pipe straight away, for a same-node copy).
+ */
+static inline void
+fifo_open_handler(evutil_socket_t unused, short event, void *arg)
+{
+	assert(arg != NULL);
+	Connection& connection = *(Connection*)arg;
+	assert(connection.state == WAITING_FOR_FD);
+
+	int flags = (connection.channel.m_xferDir == SEND ? O_RDONLY :
+		O_WRONLY) | O_NONBLOCK | O_CLOEXEC;
+	int fd = open(connection.fifo_path.c_str(), flags);
+	if (fd < 0 && errno == ENXIO) {
+		connection.schedule_event(fifo_open_handler,
+			FIFO_POLL_INTERVAL);
+		return;
+	}
+	if (fd < 0) {
+		log_f(connection.id(), "error: can't open named pipe "
+			"'%s': %s", connection.fifo_path.c_str(), strerror(errno));
+		close_connection(connection);
+		return;
+	}
+
+	if (connection.channel.m_xferDir == RECV) {
+		fifo_ready_handler(fd, EV_WRITE, &connection);
+		return;
+	}
+	if (connection.next_event != NULL)
+		event_free(connection.next_event);
+	connection.next_event = event_new(connection.getBase(), fd,
+		EV_READ, fifo_ready_handler, &connection);
+	assert(connection.next_event != NULL);
+	event_add(connection.next_event, NULL);
+}
+
+/**
+ * Create the named pipe at 'path' for 'mpih mkfifo'
+ * ("FIFO <path>"), and serve the stream data through it
+ * ourselves: for SEND we read what is written to the
+ * pipe, for RECV we write the received data into it. The
+ * client just waits for our "OK", which means that the
+ * pipe exists, and then exits.
+ */
+static inline void open_fifo(Connection& connection,
+	const std::string& path)
+{
+	/* (see request_fd()) */
+	if (IOURingReactor::getInstance().active()) {
+		log_f(connection.id(), "error: FIFO streams are not "
+			"supported with io_uring");
+		close_connection(connection);
+		return;
+	}
+
+	/*
+	 * (we remove the pipe when the stream is done, so it
+	 * must be ours: an existing file or pipe is an error)
+	 */
+	if (mkfifo(path.c_str(), 0666) < 0) {
+		log_f(connection.id(), "error: can't create named pipe "
+			"'%s': %s", path.c_str(), strerror(errno));
+		close_connection(connection);
+		return;
+	}
+	connection.fifo_path = path;
+	send_reply(connection, REPLY_OK);
+
+	/* from here on, the client socket only carries our OK */
+	bufferevent_disable(connection.bev, EV_READ);
+	bufferevent_setcb(connection.bev, NULL, NULL, NULL, NULL);
+	connection.state = WAITING_FOR_FD;
+	fifo_open_handler(-1, 0, &connection);
+}
+
+/** A client request, parsed from a text header line or a binary request */
+struct HeaderRequest
+{
+	HeaderOpcode opcode;
+	/** peer rank (SEND/RECV) */
+	int rank;
+	/** stream options (SEND/RECV) */
+	StreamOptions options;
+	/** MPI port name (CONNECT) */
+	std::string port;
+
+	HeaderRequest() : opcode(OP_NONE), rank(0) {}
+};
+
+static inline void handle_rank(Connection& connection, HeaderRequest&)
+{
+	send_reply(connection, REPLY_VALUE, mpi::rank);
+}
+
+static inline void handle_size(Connection& connection, HeaderRequest&)
+{
+	send_reply(connection, REPLY_VALUE, mpi::numProc);
+}
+
+static inline void handle_stream(Connection& connection,
+	HeaderRequest& request)
+{
+	XferDir dir = request.opcode == OP_SEND ? SEND : RECV;
+	const StreamOptions& options = request.options;
+
+	connection.clear();
+	connection.rank = request.rank;
+	connection.channel = { dir, request.rank, options.stripe > 0 ?
+		stripe_tag(options.tag, options.stripe) : options.tag,
+		options.remote };
+	connection.range_offset = options.rangeOffset;
+	connection.range_length = options.rangeLength;
+	connection.striped = options.stripe >= 0;
+	/* (detached and rate-limited sends stay with MPI) */
+	connection.local_peer = !opt::noLocalCopy && !options.remote &&
+		mpi::sameNode[request.rank] && options.stripe < 0 &&
+		!options.detached && options.rate == 0;
+	if (dir == SEND) {
+		connection.detached = options.detached;
+		SendScheduler::getInstance().addStream(connection.id(),
+			options.priority, options.rate, monotonic_time());
+	}
+
+	if (options.passFd || options.shm)
+		request_fd(connection, options.shm);
+	else if (!options.fifoPath.empty())
+		open_fifo(connection, options.fifoPath);
+	else
+		start_stream(connection);
+}
+
+static inline void handle_mux(Connection& connection, HeaderRequest&)
+{
+	if (connection.mux != NULL) {
+		log_f(connection.id(), "error: can't multiplex a "
+			"multiplexed stream");
+		close_connection(connection);
+		return;
+	}
+
+	// hand the socket over to a MuxSession
+	start_mux_session(connection);
+}
+
+static inline void handle_wait(Connection& connection, HeaderRequest&)
+{
+	if (opt::verbose)
+		log_f(connection.id(), "waiting for detached sends "
+			"to complete...");
+
+	connection.state = WAITING_FOR_DETACHED_SENDS;
+
+	evutil_socket_t socket = bufferevent_getfd(connection.bev);
+
+	update_mpi_status(socket, 0, &connection);
+}
+
+static inline void handle_finalize(Connection& connection, HeaderRequest&)
+{
+	if (opt::verbose)
+		log_f(connection.id(), "preparing to shut down daemon...");
+
+	g_finalize_pending = true;
+	connection.state = MPI_FINALIZE;
+
+	evutil_socket_t socket = bufferevent_getfd(connection.bev);
+
+	update_mpi_status(socket, 0, &connection);
+}
 
+/**
+ * @return false (after logging why) if 'connection' can't
+ * connect us to another job: we can only be connected to
+ * one, only through a client socket of its own, and only
+ * while we aren't serving any other client (see
+ * join_remote_job())
+ */
+static inline bool can_join_remote_job(Connection& connection)
+{
+	if (mpi::remoteComm != MPI_COMM_NULL) {
+		log_f(connection.id(), "error: already connected to "
+			"another job");
+		return false;
+	}
+	if (connection.mux != NULL) {
+		log_f(connection.id(), "error: can't connect to another "
+			"job over a multiplexed stream");
+		return false;
+	}
+	if (g_connections.size() > 1) {
+		log_f(connection.id(), "error: can't connect to another "
+			"job while serving other clients (%lu)",
+			g_connections.size() - 1);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Build the intercommunicator to the daemons of another
+ * job, and reply with its number of ranks. This is
+ * collective over the daemons of both jobs (with
+ * MPI_COMM_WORLD's error handler set to return), and
+ * blocks the event loop until they have all joined in.
+ * MPI is initialized single-threaded, so this can't move
+ * to another thread; instead can_join_remote_job() makes
+ * sure that there are no other clients to stall.
+ */
+static inline void join_remote_job(Connection& connection,
+	const char* port, bool accept)
+{
+	MPI_Comm comm;
+	int err = accept ?
+		MPI_Comm_accept(port, MPI_INFO_NULL, 0, MPI_COMM_WORLD, &comm) :
+		MPI_Comm_connect(port, MPI_INFO_NULL, 0, MPI_COMM_WORLD, &comm);
+	if (err != MPI_SUCCESS) {
+		char message[MPI_MAX_ERROR_STRING];
+		int len;
+		MPI_Error_string(err, message, &len);
+		log_f(connection.id(), "error: can't %s other job: %s",
+			accept ? "accept" : "connect to", message);
+		close_connection(connection);
+		return;
+	}
+
+	mpi::remoteComm = comm;
+	MPI_Comm_remote_size(comm, &mpi::remoteSize);
+	if (opt::verbose)
+		log_f(connection.id(), "connected to another job "
+			"(%d ranks)", mpi::remoteSize);
+	send_reply(connection, REPLY_VALUE, mpi::remoteSize);
+}
+
+/**
+ * 'mpih open-port': wait for another job to connect to
+ * us. Rank 0 opens the MPI port, and sends its name to
+ * the client ("PORT <name>") before we block, so that
+ * the client can hand it to the other job.
+ */
+static inline void handle_accept(Connection& connection, HeaderRequest&)
+{
+	if (!can_join_remote_job(connection)) {
+		close_connection(connection);
+		return;
+	}
+
+	MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+	char port[MPI_MAX_PORT_NAME] = "";
+	if (mpi::rank == 0) {
+		if (MPI_Open_port(MPI_INFO_NULL, port) != MPI_SUCCESS) {
+			log_f(connection.id(), "error: can't open MPI port");
+			MPI_Comm_set_errhandler(MPI_COMM_WORLD,
+				MPI_ERRORS_ARE_FATAL);
+			close_connection(connection);
+			return;
+		}
+		if (opt::verbose)
+			log_f(connection.id(), "opened MPI port '%s'", port);
+		evbuffer_add_printf(bufferevent_get_output(connection.bev),
+			"PORT %s\n", port);
+		connection.flush_reply(connection.bev);
+	}
+
+	join_remote_job(connection, port, true);
+
+	if (mpi::rank == 0)
+		MPI_Close_port(port);
+	MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_ARE_FATAL);
+}
+
+/** 'mpih connect-port': connect to a job in 'mpih open-port' */
+static inline void handle_connect(Connection& connection,
+	HeaderRequest& request)
+{
+	if (!can_join_remote_job(connection)) {
+		close_connection(connection);
+		return;
+	}
+
+	if (opt::verbose)
+		log_f(connection.id(), "connecting to MPI port '%s'",
+			request.port.c_str());
+
+	MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+	join_remote_job(connection, request.port.c_str(), false);
+	MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_ARE_FATAL);
+}
+
+typedef void (*HeaderHandler)(Connection&, HeaderRequest&);
+
+/** A client command: its name in text headers, and its handler */
+struct HeaderCommand
+{
+	const char* name;
+	HeaderHandler handler;
+};
+
+/** Client commands, indexed by HeaderOpcode */
+static const HeaderCommand HEADER_COMMANDS[NUM_OPCODES] = {
+	{ NULL, NULL },
+	{ "RANK", handle_rank },
+	{ "SIZE", handle_size },
+	{ "SEND", handle_stream },
+	{ "RECV", handle_stream },
+	{ "MUX", handle_mux },
+	{ "WAIT", handle_wait },
+	{ "FINALIZE", handle_finalize },
+	{ "ACCEPT", handle_accept },
+	{ "CONNECT", handle_connect }
+};
+
+/**
+ * Parse the next text header line of the client.
+ * @return false if there is no complete, valid request
+ */
+static inline bool read_text_request(Connection& connection,
+	HeaderRequest& request)
+{
 	char* header = read_header(connection);
 
 	// haven't fully received header line yet
 	if (header == NULL)
-		return;
+		return false;
 
 	if (g_finalize_pending) {
 		log_f(connection.id(), "error, a client has attempted to issue commands "
@@ -73,101 +1118,126 @@ process_next_header(Connection& connection)
 
 	// empty or all-whitespace header line
 	if (command.empty())
-		return;
-
-	struct evbuffer* output = bufferevent_get_output(bev);
-	assert(output != NULL);
+		return false;
 
-	if (command == "RANK") {
-
-		evbuffer_add_printf(output, "%d\n", mpi::rank);
-
-	} else if (command == "SIZE") {
-		
-		evbuffer_add_printf(output, "%d\n", mpi::numProc);		
-		
-	} else if (command == "SEND") {
-
-		int rank;
-		ss >> rank;
-		if (ss.fail() || !ss.eof()) {
-			log_f(connection.id(), "error: malformed SEND header, "
-				"expected 'SEND <RANK>'");
-			return;
+	for (int op = OP_NONE + 1; op < NUM_OPCODES; ++op) {
+		if (command == HEADER_COMMANDS[op].name) {
+			request.opcode = (HeaderOpcode)op;
+			break;
 		}
+	}
 
-		MPIChannelManager& manager = MPIChannelManager::getInstance();
+	if (request.opcode == OP_SEND || request.opcode == OP_RECV)
+		return parse_stream_header(connection, ss,
+			request.opcode == OP_SEND ? SEND : RECV,
+			request.rank, request.options);
 
-		connection.clear();
-		connection.rank = rank;
-		connection.channel = { SEND, rank, 0 };
-		ChannelRequestResult result = manager.requestChannel(
-			connection.id(), connection.channel);
+	if (request.opcode == OP_NONE) {
+		log_f(connection.id(), "error: unrecognized header command '%s'",
+			command.c_str());
+		return false;
+	}
 
-		if (result == QUEUED) {
-			connection.state = WAITING_FOR_MPI_CHANNEL;
-			connection.schedule_event(update_mpi_status, 1000);
-			return;
+	if (request.opcode == OP_CONNECT) {
+		std::getline(ss >> std::ws, request.port);
+		if (request.port.empty()) {
+			log_f(connection.id(), "error: CONNECT needs an "
+				"MPI port name");
+			return false;
 		}
+	}
 
-		assert(result == GRANTED);
-		assert(connection.bev != NULL);
-		bufferevent_setwatermark(connection.bev, EV_READ, 1*1024*1024, 0);
-		connection.holding_mpi_channel = true;
-		connection.state = MPI_READY_TO_SEND_CHUNK_SIZE;
-
-		struct evbuffer* input = bufferevent_get_input(bev);
-		assert(input != NULL);
-
-		if (evbuffer_get_length(input) > 0)
-			mpi_send_chunk_size(connection);
-
-	} else if (command == "RECV") {
+	return true;
+}
 
-		int rank;
-		ss >> rank;
-		if (ss.fail() || !ss.eof()) {
-			log_f(connection.id(), "error: malformed RECV header, "
-				"expected 'RECV <RANK>'");
-			return;
-		}
+/**
+ * Decode the next binary request of the client.
+ * @return false if there is no complete, valid request
+ */
+static inline bool read_binary_request(Connection& connection,
+	HeaderRequest& request)
+{
+	struct evbuffer* input = bufferevent_get_input(connection.bev);
+	if (evbuffer_get_length(input) < BINARY_REQUEST_SIZE)
+		return false;
 
-		MPIChannelManager& manager = MPIChannelManager::getInstance();
+	char buf[BINARY_REQUEST_SIZE];
+	evbuffer_remove(input, buf, sizeof(buf));
+	BinaryRequest binary = decode_binary_request(buf);
 
-		connection.clear();
-		connection.rank = rank;
-		connection.channel = { RECV, rank, 0 };
-		ChannelRequestResult result = manager.requestChannel(
-			connection.id(), connection.channel);
+	/* (ACCEPT and CONNECT take a port name, so they are text only) */
+	if (binary.version != BINARY_HEADER_VERSION ||
+		binary.opcode == OP_NONE || binary.opcode >= OP_ACCEPT) {
+		log_f(connection.id(), "error: unsupported binary request "
+			"(version %u, opcode %u)", binary.version, binary.opcode);
+		close_connection(connection);
+		return false;
+	}
+	request.opcode = (HeaderOpcode)binary.opcode;
 
-		if (result == QUEUED) {
-			connection.state = WAITING_FOR_MPI_CHANNEL;
-			connection.schedule_event(update_mpi_status, 1000);
-			return;
-		}
+	if (g_finalize_pending) {
+		log_f(connection.id(), "error, a client has attempted to issue commands "
+			"after 'mpih finalize' has been called!: '%s'",
+			HEADER_COMMANDS[request.opcode].name);
+		exit(EXIT_FAILURE);
+	}
 
-		assert(result == GRANTED);
-		connection.holding_mpi_channel = true;
-		connection.state = MPI_READY_TO_RECV_CHUNK_SIZE;
+	if (opt::verbose)
+		log_f(connection.id(), "received binary %s request",
+			HEADER_COMMANDS[request.opcode].name);
 
-		mpi_recv_chunk_size(connection);
+	if (request.opcode != OP_SEND && request.opcode != OP_RECV)
+		return true;
 
-	} else if (command == "FINALIZE") {
+	StreamOptions& options = request.options;
+	request.rank = binary.rank;
+	options.tag = binary.tag;
+	if (request.opcode == OP_SEND)
+		options.priority = (SendPriority)binary.priority;
+	options.rate = binary.rate;
+	options.detached = binary.flags & BINARY_FLAG_DETACH;
+	options.passFd = binary.flags & BINARY_FLAG_FD;
+	options.shm = binary.flags & BINARY_FLAG_SHM;
+	options.stripe = binary.stripe;
+	if (binary.flags & BINARY_FLAG_RANGE) {
+		options.rangeOffset = binary.rangeOffset;
+		options.rangeLength = binary.rangeLength;
+	}
+	XferDir dir = request.opcode == OP_SEND ? SEND : RECV;
+	if (dir == RECV && (options.detached || options.rate > 0 ||
+		options.rangeOffset >= 0)) {
+		log_f(connection.id(), "error: SEND-only option in binary "
+			"RECV request");
+		return false;
+	}
+	return check_stream_header(connection, dir, request.rank, options);
+}
 
-		if (opt::verbose)
-			log_f(connection.id(), "preparing to shut down daemon...");
+/**
+ * Read the client's next request, which is either a text
+ * header line or a binary request (see IO/BinaryHeader.h),
+ * and dispatch it to the handler of its command.
+ */
+static inline void
+process_next_header(Connection& connection)
+{
+	connection.clear();
+	connection.state = READING_HEADER;
 
-		g_finalize_pending = true;
-		connection.state = MPI_FINALIZE;
+	struct bufferevent* bev = connection.bev;
+	assert(bev != NULL);
 
-		evutil_socket_t socket = bufferevent_getfd(bev);
+	unsigned char first;
+	if (evbuffer_copyout(bufferevent_get_input(bev), &first, 1) < 1)
+		return;
 
-		update_mpi_status(socket, 0, &connection);
+	HeaderRequest request;
+	connection.binary = first == BINARY_HEADER_MAGIC;
+	if (connection.binary ? !read_binary_request(connection, request) :
+		!read_text_request(connection, request))
+		return;
 
-	} else {
-		log_f(connection.id(), "error: unrecognized header command '%s'",
-			command.c_str());
-	}
+	HEADER_COMMANDS[request.opcode].handler(connection, request);
 }
 
 static inline void
@@ -176,12 +1246,16 @@ init_write_handler(struct bufferevent *unused, void *arg)
 	assert(arg != NULL);
 	Connection& connection = *(Connection*)arg;
 
-	assert(connection.bytesQueued() == 0);
-
 	if (opt::verbose >= 3)
 		log_f(connection.id(), "client socket ready for writing");
 
-	if (connection.state == FLUSHING_SOCKET)
+	if (connection.spool != NULL && !connection.spool->empty()) {
+		connection.refill_from_spool();
+		return;
+	}
+
+	if (connection.state == FLUSHING_SOCKET &&
+		connection.bytesQueued() == 0)
 		close_connection(connection);
 }
 
@@ -195,9 +1269,14 @@ init_read_handler(struct bufferevent *bev, void *arg)
 		log_f(connection.id(), "%lu bytes available on "
 			"client socket", connection.bytesReady());
 
+	if (connection.detached)
+		connection.spool_input();
+
 	if (connection.state == READING_HEADER)
 		process_next_header(connection);
-	else if (connection.state == MPI_READY_TO_SEND_CHUNK_SIZE)
+	else if (connection.state == MPI_READY_TO_SEND_CHUNK_SIZE &&
+		connection.bytesToSend() > 0)
+		/* (a FilePump's pair may call us with nothing to read) */
 		mpi_send_chunk_size(connection);
 }
 
@@ -217,6 +1296,17 @@ init_event_handler(struct bufferevent *bev, short error, void *arg)
 		// client has closed socket
 		connection.eof = true;
 
+		// client handed us its input; let it exit now
+		if (connection.channel.m_xferDir == SEND)
+			connection.release_control();
+
+		// nobody is left to make room in the ring
+		if (connection.ring != NULL &&
+			connection.state == MPI_READY_TO_RECV_CHUNK) {
+			close_connection(connection);
+			return;
+		}
+
 		// we may still have pending MPI sends
 		if (connection.state == MPI_READY_TO_SEND_CHUNK_SIZE) {
 			mpi_send_chunk_size(connection);
@@ -234,19 +1324,14 @@ init_event_handler(struct bufferevent *bev, short error, void *arg)
 	}
 }
 
-static inline void
-init_accept_handler(evutil_socket_t listener, short event, void *arg)
+/**
+ * Start tracking a client connection whose stream data
+ * goes through 'bev'. 'fd' is the client socket (-1 for a
+ * stream of a multiplexed connection).
+ */
+static inline Connection*
+add_connection(struct bufferevent* bev, evutil_socket_t fd)
 {
-	// main state object for libevent
-	struct event_base *base = (event_base*)arg;
-
-	// connect to client (or die)
-	evutil_socket_t fd = UnixSocket::accept(listener, false);
-
-	// create buffer and associate with new connection
-	struct bufferevent* bev = bufferevent_socket_new(base, fd, 0);
-	assert(bev != NULL);
-
 	// track state of connection in global map
 	Connection* connection = new Connection();
 	g_connections.push_back(connection);
@@ -264,6 +1349,83 @@ init_accept_handler(evutil_socket_t listener, short event, void *arg)
 	bufferevent_setwatermark(bev, EV_READ, 0, 0);
 	// enable callbacks
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	return connection;
+}
+
+/** Set up a Connection for a newly accepted client socket */
+static inline void
+init_new_connection(struct event_base* base, evutil_socket_t fd)
+{
+	if (!opt::lowFootprint)
+		UnixSocket::set_buffer_size(fd, CLIENT_SOCKET_BUFFER_SIZE);
+
+	// create buffer and associate with new connection
+	IOURingReactor& reactor = IOURingReactor::getInstance();
+	struct bufferevent* bev = reactor.active() ?
+		reactor.newBufferevent(base, fd) :
+		bufferevent_socket_new(base, fd, 0);
+	assert(bev != NULL);
+
+	add_connection(bev, fd);
+}
+
+// forward declaration
+static inline void pause_accepting(struct event_base* base,
+	const char* reason);
+
+static inline void
+resume_accepting(evutil_socket_t, short, void* arg)
+{
+	struct event_base* base = (event_base*)arg;
+	if (!FdReserve::getInstance().fill()) {
+		pause_accepting(base, "still short of descriptors");
+		return;
+	}
+	assert(g_listener_event != NULL);
+	event_add(g_listener_event, NULL);
+}
+
+/**
+ * Leave new clients in the backlog until finished
+ * connections have freed up some descriptors, rather
+ * than spin on accept() errors.
+ */
+static inline void pause_accepting(struct event_base* base,
+	const char* reason)
+{
+	if (opt::verbose)
+		fprintf(g_log, "accept: %s; pausing for %ld ms\n", reason,
+			ACCEPT_BACKOFF / 1000);
+	assert(g_listener_event != NULL);
+	event_del(g_listener_event);
+	struct timeval delay = { 0, ACCEPT_BACKOFF };
+	event_base_once(base, -1, EV_TIMEOUT, resume_accepting, base,
+		&delay);
+}
+
+static inline void
+init_accept_handler(evutil_socket_t listener, short event, void *arg)
+{
+	// main state object for libevent
+	struct event_base *base = (event_base*)arg;
+
+	for (int i = 0; i < ACCEPT_BATCH; ++i) {
+		evutil_socket_t fd = UnixSocket::accept(listener, false);
+		if (fd >= 0) {
+			init_new_connection(base, fd);
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		if (UnixSocket::out_of_resources(errno)) {
+			/* (down to our reserve, which is for the streams we have) */
+			FdReserve::getInstance().release();
+			pause_accepting(base, strerror(errno));
+			return;
+		}
+		/* (e.g. the client gave up while in the backlog) */
+		fprintf(g_log, "accept: %s\n", strerror(errno));
+	}
 }
 
 #endif
@@ -0,0 +1,53 @@
+#ifndef _FOOTPRINT_H_
+#define _FOOTPRINT_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <malloc.h>
+
+namespace opt {
+	/**
+	 * -m,--low-footprint: keep per-connection buffers
+	 * small, and poll idle MPI requests less often, for
+	 * nodes that run hundreds of ranks
+	 */
+	static int lowFootprint;
+}
+
+/**
+ * Max bytes that a connection buffers in each direction,
+ * and max size of an MPI chunk, in low-footprint mode
+ */
+static const size_t LOW_FOOTPRINT_BUFFER_SIZE = 256 * 1024;
+
+/** Size of the mapped part of a file in low-footprint mode */
+static const size_t LOW_FOOTPRINT_MAPPED_WINDOW = 4 * 1024 * 1024;
+
+/**
+ * Max interval between polls of an MPI request that isn't
+ * making progress, in low-footprint mode (microseconds)
+ */
+static const size_t LOW_FOOTPRINT_MAX_POLL_INTERVAL = 20000;
+
+/** 'size' (bytes), capped in low-footprint mode */
+static inline size_t buffer_limit(size_t size)
+{
+	return opt::lowFootprint ?
+		std::min(size, LOW_FOOTPRINT_BUFFER_SIZE) : size;
+}
+
+/**
+ * Have malloc() hand freed chunk buffers back to the
+ * kernel, rather than keep them for reuse, and use a
+ * single arena for any threads that MPI starts.
+ */
+static inline void init_low_footprint()
+{
+	if (!opt::lowFootprint)
+		return;
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_MMAP_THRESHOLD, LOW_FOOTPRINT_BUFFER_SIZE / 2);
+	mallopt(M_TRIM_THRESHOLD, LOW_FOOTPRINT_BUFFER_SIZE);
+}
+
+#endif
@@ -5,19 +5,332 @@
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <vector>
 #include <cassert>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define MPI_DEFAULT_TAG 0
 
+/**
+ * Max MPI tag that clients may use for their streams.
+ * (MPI guarantees that tags up to 32767 are valid; we
+ * keep the upper half for internal use.)
+ */
+#define MPI_MAX_USER_TAG 16383
+
+/** max size of a single MPI data message (bytes) */
+static const size_t MPI_MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+
+/**
+ * Max number of stripes in a striped transfer ('mpih send
+ * --parallel'). Stripe 'n' of a stream with tag 't' uses
+ * MPI tag t + n * (MPI_MAX_USER_TAG + 1), which must not
+ * exceed the MPI_TAG_UB of the MPI implementation.
+ */
+static const int MPI_MAX_STRIPES = 16;
+
 namespace mpi {
 	int rank;
 	int numProc;
+	/** largest MPI tag supported by the MPI implementation */
+	int tagUB = 32767;
+	/** true for the ranks that run on our node (including us) */
+	std::vector<bool> sameNode;
+	/**
+	 * communicator for the answers and end messages of
+	 * same-node copies (see LOCAL_COPY_MARKER), so that
+	 * they can't be mistaken for stream data
+	 */
+	MPI_Comm localComm = MPI_COMM_NULL;
+	/**
+	 * intercommunicator to the daemons of the job that we
+	 * are connected to ('mpih open-port'/'connect-port'),
+	 * for REMOTE streams; MPI_COMM_NULL if there is none
+	 */
+	MPI_Comm remoteComm = MPI_COMM_NULL;
+	/** number of ranks in the remote job */
+	int remoteSize;
+}
+
+/**
+ * Find out which ranks share our node, so that their
+ * streams can bypass MPI (see LOCAL_COPY_MARKER). This is
+ * collective over MPI_COMM_WORLD.
+ */
+static inline void init_local_peers()
+{
+	MPI_Comm node;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED,
+		mpi::rank, MPI_INFO_NULL, &node);
+	int nodeSize;
+	MPI_Comm_size(node, &nodeSize);
+	std::vector<int> ranks(nodeSize);
+	MPI_Allgather(&mpi::rank, 1, MPI_INT, ranks.data(), 1, MPI_INT,
+		node);
+	MPI_Comm_free(&node);
+
+	mpi::sameNode.assign(mpi::numProc, false);
+	for (int i = 0; i < nodeSize; ++i)
+		mpi::sameNode[ranks[i]] = true;
+	MPI_Comm_dup(MPI_COMM_WORLD, &mpi::localComm);
+}
+
+/**
+ * MPI tag (on mpi::localComm) of the message that ends a
+ * same-node copy of the stream with tag 'tag'. This keeps
+ * it apart from the answer to an offer in the opposite
+ * direction, which uses 'tag' itself.
+ */
+static inline int local_done_tag(int tag)
+{
+	return tag + MPI_MAX_USER_TAG + 1;
+}
+
+/** MPI tag for stripe 'stripe' of a stream with tag 'tag' */
+static inline int stripe_tag(int tag, int stripe)
+{
+	return tag + stripe * (MPI_MAX_USER_TAG + 1);
 }
 
 // forward declaration
 static inline void update_mpi_status(
 	evutil_socket_t socket, short event, void* arg);
 
+/**
+ * Timer that drives the RMA transport (--transport rma):
+ * one RMATransport::progress() call per poll interval
+ * serves every connection, rather than one call each time
+ * a connection polls its requests. Pending only while RMA
+ * requests are pending.
+ */
+static struct event* g_rma_progress_event = NULL;
+/** progress() calls in a row that didn't move any messages */
+static unsigned g_rma_idle_polls = 0;
+
+static inline void rma_progress_handler(evutil_socket_t, short, void*)
+{
+	RMATransport& rma = RMATransport::getInstance();
+	g_rma_idle_polls = rma.progress() ? 0 : g_rma_idle_polls + 1;
+	if (!rma.pending() || evtimer_pending(g_rma_progress_event, NULL))
+		return;
+	size_t interval = mpi_poll_interval(g_rma_idle_polls);
+	struct timeval time = { (long)(interval / 1000000),
+		(long)(interval % 1000000) };
+	evtimer_add(g_rma_progress_event, &time);
+}
+
+/** Create the timer that drives the RMA transport */
+static inline void init_rma_progress(struct event_base* base)
+{
+	assert(g_rma_progress_event == NULL);
+	g_rma_progress_event = evtimer_new(base, rma_progress_handler, NULL);
+	assert(g_rma_progress_event != NULL);
+}
+
+/**
+ * Run the RMA transport once the current pass of the
+ * event loop is over, for a newly posted request (however
+ * many are posted in the same pass)
+ */
+static inline void schedule_rma_progress()
+{
+	assert(g_rma_progress_event != NULL);
+	g_rma_idle_polls = 0;
+	event_active(g_rma_progress_event, EV_TIMEOUT, 0);
+}
+
+/** Largest data chunk supported by the current transport */
+static inline size_t max_chunk_size()
+{
+	if (opt::transport == TRANSPORT_RMA)
+		return std::min(buffer_limit(MPI_MAX_CHUNK_SIZE),
+			RMATransport::getInstance().maxMessageSize());
+	return buffer_limit(MPI_MAX_CHUNK_SIZE);
+}
+
+/**
+ * Post a non-blocking send on 'channel' using the current
+ * transport (always MPI for the remote job)
+ */
+static inline void transport_isend(void* buf, int count,
+	MPI_Datatype type, const MPIChannel& channel,
+	MPI_Request* request)
+{
+	if (channel.m_remote)
+		MPI_Isend(buf, count, type, channel.m_peerRank,
+			channel.m_mpiTag, mpi::remoteComm, request);
+	else if (opt::transport == TRANSPORT_RMA) {
+		RMATransport::getInstance().isend(buf, count, type,
+			channel.m_peerRank, channel.m_mpiTag, request);
+		schedule_rma_progress();
+	}
+	else
+		MPI_Isend(buf, count, type, channel.m_peerRank,
+			channel.m_mpiTag, MPI_COMM_WORLD, request);
+}
+
+/**
+ * Post a non-blocking receive on 'channel' using the
+ * current transport (always MPI for the remote job)
+ */
+static inline void transport_irecv(void* buf, int count,
+	MPI_Datatype type, const MPIChannel& channel,
+	MPI_Request* request)
+{
+	if (channel.m_remote)
+		MPI_Irecv(buf, count, type, channel.m_peerRank,
+			channel.m_mpiTag, mpi::remoteComm, request);
+	else if (opt::transport == TRANSPORT_RMA) {
+		RMATransport::getInstance().irecv(buf, count, type,
+			channel.m_peerRank, channel.m_mpiTag, request);
+		schedule_rma_progress();
+	}
+	else
+		MPI_Irecv(buf, count, type, channel.m_peerRank,
+			channel.m_mpiTag, MPI_COMM_WORLD, request);
+}
+
+/**
+ * Start sending the data of a SEND stream, once we hold
+ * its MPI channel. If we know the size of the stream up
+ * front (a mapped file), we announce it first, so that
+ * the receiver can allocate space for it.
+ */
+static inline void mpi_start_send(Connection& connection)
+{
+	/*
+	 * (MPI would send a small file without waiting for the
+	 * receiver, and so should we)
+	 */
+	if (connection.local_peer && (connection.pipe_fd() >= 0 ||
+		(connection.mapped != NULL &&
+		 connection.mapped->remaining() >= LOCAL_COPY_MIN_SIZE))) {
+		mpi_offer_local_copy(connection);
+		return;
+	}
+
+	if (connection.mapped == NULL) {
+		connection.state = MPI_READY_TO_SEND_CHUNK_SIZE;
+		if (connection.eof || connection.inputReady())
+			mpi_send_chunk_size(connection);
+		return;
+	}
+
+	connection.stream_extent[0] = connection.mapped->remaining();
+	connection.stream_extent[1] = connection.mapped->offset();
+	connection.chunk_size = STREAM_SIZE_MARKER;
+	connection.state = MPI_SENDING_STREAM_SIZE;
+
+	if (opt::verbose >= 2)
+		log_f(connection.id(), "announcing stream size (%lu bytes) "
+			"to rank %d", connection.stream_extent[0], connection.rank);
+
+	// (MPI doesn't let messages on the same channel overtake)
+	transport_isend((void*)&connection.chunk_size, 1, MPI_INT,
+		connection.channel,
+		&connection.chunk_size_request_id);
+	transport_isend((void*)connection.stream_extent, 2, MPI_UINT64_T,
+		connection.channel,
+		&connection.chunk_request_id);
+
+	update_mpi_status(bufferevent_getfd(connection.bev), 0,
+		(void*)&connection);
+}
+
+/**
+ * Offer the receiver of a SEND stream on our node to copy
+ * the data straight into its client's output (see
+ * LOCAL_COPY_MARKER), and post a receive for its answer.
+ * We go on reading a pipe in the meantime, so that the
+ * client doesn't wait for the receiver any longer than it
+ * would have otherwise.
+ */
+static inline void mpi_offer_local_copy(Connection& connection)
+{
+	connection.chunk_size = LOCAL_COPY_MARKER;
+	connection.state = MPI_SENDING_LOCAL_OFFER;
+
+	if (opt::verbose >= 2)
+		log_f(connection.id(), "offering rank %d a same-node copy",
+			connection.rank);
+
+	transport_isend((void*)&connection.chunk_size, 1, MPI_INT,
+		connection.channel,
+		&connection.chunk_size_request_id);
+	MPI_Irecv((void*)connection.local_reply, LOCAL_REPLY_SIZE,
+		MPI_UINT64_T, connection.rank, connection.channel.m_mpiTag,
+		mpi::localComm, &connection.chunk_request_id);
+
+	update_mpi_status(bufferevent_getfd(connection.bev), 0,
+		(void*)&connection);
+}
+
+/**
+ * Answer a same-node copy offer of the sender of a RECV
+ * stream: accept it if we write the client's output to a
+ * file or pipe directly (rather than to the client socket
+ * or a ring), and wait for the sender to finish.
+ */
+static inline void mpi_answer_local_copy(Connection& connection)
+{
+	uint64_t* reply = connection.local_reply;
+	memset(reply, 0, sizeof(connection.local_reply));
+	int fd = !connection.local_peer ? -1 : connection.sink != NULL ?
+		connection.sink->fd() : connection.pipe_fd();
+	bool accept = fd >= 0;
+	if (accept) {
+		int flags = fcntl(fd, F_GETFL);
+		reply[LOCAL_PID] = getpid();
+		reply[LOCAL_FD] = fd;
+		reply[LOCAL_OFFSET] = connection.sink != NULL ?
+			connection.sink->offset() : 0;
+		reply[LOCAL_APPEND] = flags >= 0 && (flags & O_APPEND);
+	}
+
+	if (opt::verbose >= 2)
+		log_f(connection.id(), "%s same-node copy from rank %d",
+			accept ? "accepting" : "declining", connection.rank);
+
+	connection.clear_mpi_state();
+	MPI_Isend((void*)reply, LOCAL_REPLY_SIZE, MPI_UINT64_T,
+		connection.rank, connection.channel.m_mpiTag, mpi::localComm,
+		&connection.chunk_size_request_id);
+	if (accept) {
+		connection.state = MPI_WAITING_FOR_LOCAL_COPY;
+		MPI_Irecv((void*)connection.local_done, 2, MPI_UINT64_T,
+			connection.rank,
+			local_done_tag(connection.channel.m_mpiTag),
+			mpi::localComm, &connection.chunk_request_id);
+	} else {
+		connection.state = MPI_SENDING_LOCAL_REPLY;
+	}
+
+	update_mpi_status(bufferevent_getfd(connection.bev), 0,
+		(void*)&connection);
+}
+
+/**
+ * Tell the receiver how a same-node copy has ended: if we
+ * couldn't start it (LOCAL_NOT_COPIED), we send through
+ * MPI instead.
+ */
+static inline void mpi_send_local_done(Connection& connection,
+	LocalCopyResult result)
+{
+	connection.local_done[0] = result;
+	connection.local_done[1] = connection.bytes_transferred;
+	connection.state = MPI_SENDING_LOCAL_DONE;
+
+	MPI_Isend((void*)connection.local_done, 2, MPI_UINT64_T,
+		connection.rank, local_done_tag(connection.channel.m_mpiTag),
+		mpi::localComm, &connection.chunk_request_id);
+
+	update_mpi_status(bufferevent_getfd(connection.bev), 0,
+		(void*)&connection);
+}
+
 static inline void mpi_send_chunk_size(Connection& connection)
 {
 	assert(connection.state == MPI_READY_TO_SEND_CHUNK_SIZE);
@@ -27,10 +340,18 @@ static inline void mpi_send_chunk_size(Connection& connection)
 
 	evutil_socket_t socket = bufferevent_getfd(bev);
 
-	struct evbuffer* input = bufferevent_get_input(bev);
-	assert(input != NULL);
+	SendScheduler& scheduler = SendScheduler::getInstance();
+
+	uint64_t chunk_size;
+	if (connection.holding_send_slot) {
+		// size was fixed when we queued for the send slot
+		chunk_size = connection.chunk_size;
+	} else {
+		chunk_size = std::min(connection.bytesToSend(),
+			scheduler.maxChunkSize(connection.id(),
+				max_chunk_size()));
+	}
 
-	uint64_t chunk_size = evbuffer_get_length(input);
 	if (connection.eof && chunk_size == 0) {
 		if (opt::verbose) {
 			log_f(connection.id(), "send to rank %d complete "
@@ -40,6 +361,14 @@ static inline void mpi_send_chunk_size(Connection& connection)
 				connection.rank);
 		}
 		connection.state = MPI_SENDING_EOF;
+	} else if (!connection.holding_send_slot) {
+		// wait for our turn to send
+		assert(chunk_size > 0);
+		connection.chunk_size = chunk_size;
+		connection.state = WAITING_FOR_SEND_SLOT;
+		scheduler.enqueue(connection.id(), chunk_size);
+		run_send_scheduler(connection.getBase());
+		return;
 	} else {
 		assert(chunk_size > 0);
 		connection.state = MPI_SENDING_CHUNK_SIZE;
@@ -51,14 +380,32 @@ static inline void mpi_send_chunk_size(Connection& connection)
 			connection.chunk_index, connection.chunk_size, connection.rank);
 
 	// send chunk size in advance of data chunk
-	MPI_Isend((void*)&connection.chunk_size, 1, MPI_INT,
-		connection.rank, MPI_DEFAULT_TAG, MPI_COMM_WORLD,
+	transport_isend((void*)&connection.chunk_size, 1, MPI_INT,
+		connection.channel,
 		&connection.chunk_size_request_id);
 
-	// check if MPI_Isend has completed
+	// check if send has completed
 	update_mpi_status(socket, 0, (void*)&connection);
 }
 
+/**
+ * Abort a SEND stream whose input we can't read any more:
+ * tell the receiver (see STREAM_ERROR_MARKER), and close
+ * the stream once it has the message, as for EOF.
+ */
+static inline void mpi_send_stream_error(Connection& connection)
+{
+	connection.chunk_size = STREAM_ERROR_MARKER;
+	connection.state = MPI_SENDING_EOF;
+
+	transport_isend((void*)&connection.chunk_size, 1, MPI_INT,
+		connection.channel,
+		&connection.chunk_size_request_id);
+
+	update_mpi_status(bufferevent_getfd(connection.bev), 0,
+		(void*)&connection);
+}
+
 static inline void mpi_send_chunk(Connection& connection)
 {
 	assert(connection.state == MPI_READY_TO_SEND_CHUNK);
@@ -71,31 +418,38 @@ static inline void mpi_send_chunk(Connection& connection)
 
 	evutil_socket_t socket = bufferevent_getfd(bev);
 
-	struct evbuffer* input = bufferevent_get_input(bev);
-	assert(input != NULL);
-
 	// sanity check (we've already sent the chunk size to the receiver)
-	assert(connection.chunk_size <= evbuffer_get_length(input));
+	assert(connection.chunk_size <= connection.bytesToSend());
 
 	connection.state = MPI_SENDING_CHUNK;
-	connection.chunk_buffer = (char*)malloc(connection.chunk_size);
-	assert(connection.chunk_buffer != NULL);
+	if (connection.ring != NULL) {
+		// send straight from the client's shared-memory ring
+		// (released when the send completes)
+		connection.chunk_buffer = connection.ring->readPtr();
+		connection.chunk_borrowed = true;
+	} else if (connection.mapped != NULL) {
+		// send straight from the page cache
+		connection.chunk_buffer = (char*)connection.mapped->readPtr();
+		connection.chunk_borrowed = true;
+	} else {
+		connection.chunk_buffer = (char*)malloc(connection.chunk_size);
+		assert(connection.chunk_buffer != NULL);
 
-	// move data chunk from libevent buffer to MPI buffer
-	int bytesRemoved = evbuffer_remove(input,
-		(void*)connection.chunk_buffer, connection.chunk_size);
-	assert(bytesRemoved == connection.chunk_size);
+		// move data chunk from libevent buffer (or spool) to MPI buffer
+		connection.remove_input(connection.chunk_buffer,
+			connection.chunk_size);
+	}
 
 	if (opt::verbose >= 2)
 		log_f(connection.id(), "sending chunk #%lu to rank %d (%d bytes)",
 			connection.chunk_index, connection.rank, connection.chunk_size);
 
 	// send message body
-	MPI_Isend((void*)connection.chunk_buffer, connection.chunk_size,
-		MPI_BYTE, connection.rank, MPI_DEFAULT_TAG,
-		MPI_COMM_WORLD, &connection.chunk_request_id);
+	transport_isend((void*)connection.chunk_buffer,
+		connection.chunk_size, MPI_BYTE, connection.channel,
+		&connection.chunk_request_id);
 
-	// check if MPI_Isend's have completed
+	// check if sends have completed
 	update_mpi_status(socket, 0, (void*)&connection);
 }
 
@@ -115,13 +469,24 @@ static inline void mpi_recv_chunk_size(Connection& connection)
 			connection.chunk_index, connection.rank);
 
 	// send message size in advance of message body
-	MPI_Irecv((void*)&connection.chunk_size, 1, MPI_INT,
-		connection.rank, MPI_DEFAULT_TAG, MPI_COMM_WORLD,
+	transport_irecv((void*)&connection.chunk_size, 1, MPI_INT,
+		connection.channel,
 		&connection.chunk_size_request_id);
 
 	update_mpi_status(socket, 0, (void*)&connection);
 }
 
+/** Receive the stream size that follows a STREAM_SIZE_MARKER */
+static inline void mpi_recv_stream_size(Connection& connection)
+{
+	connection.state = MPI_RECVING_STREAM_SIZE;
+	transport_irecv((void*)connection.stream_extent, 2, MPI_UINT64_T,
+		connection.channel,
+		&connection.chunk_request_id);
+	update_mpi_status(bufferevent_getfd(connection.bev), 0,
+		(void*)&connection);
+}
+
 static inline void mpi_recv_chunk(Connection& connection)
 {
 	assert(connection.state == MPI_READY_TO_RECV_CHUNK);
@@ -131,22 +496,81 @@ static inline void mpi_recv_chunk(Connection& connection)
 
 	evutil_socket_t socket = bufferevent_getfd(bev);
 
-	connection.state = MPI_RECVING_CHUNK;
-	connection.chunk_buffer = (char*)malloc(connection.chunk_size);
 	assert(connection.chunk_size > 0);
+	if (connection.ring != NULL) {
+		// receive straight into the client's shared-memory ring,
+		// once the client has made room (it rings our doorbell)
+		if (!connection.ring->armWriter(connection.chunk_size)) {
+			// nobody is left to make room
+			if (connection.eof)
+				close_connection(connection);
+			return;
+		}
+		connection.chunk_buffer = connection.ring->writePtr();
+		connection.chunk_borrowed = true;
+	} else {
+		connection.chunk_buffer = (char*)malloc(connection.chunk_size);
+	}
+	connection.state = MPI_RECVING_CHUNK;
 	assert(connection.chunk_buffer != NULL);
 
 	if (opt::verbose >= 2)
 		log_f(connection.id(), "receiving chunk #%lu from rank %d (%d bytes)",
 			connection.chunk_index, connection.rank, connection.chunk_size);
 
-	MPI_Irecv((void*)connection.chunk_buffer, connection.chunk_size,
-			MPI_BYTE, connection.rank, MPI_DEFAULT_TAG,
-			MPI_COMM_WORLD, &connection.chunk_request_id);
+	transport_irecv((void*)connection.chunk_buffer,
+		connection.chunk_size, MPI_BYTE, connection.channel,
+		&connection.chunk_request_id);
 
 	update_mpi_status(socket, 0, (void*)&connection);
 }
 
+/** timer for retrying rate-limited sends */
+static struct event* g_send_scheduler_event = NULL;
+
+static inline void send_scheduler_timer_handler(
+	evutil_socket_t, short, void* arg)
+{
+	assert(arg != NULL);
+	run_send_scheduler((struct event_base*)arg);
+}
+
+/**
+ * Hand out free MPI send slots to queued SEND streams,
+ * in the order chosen by the SendScheduler.
+ */
+static inline void run_send_scheduler(struct event_base* base)
+{
+	assert(base != NULL);
+	SendScheduler& scheduler = SendScheduler::getInstance();
+
+	size_t connectionID;
+	while (scheduler.dispatch(connectionID, monotonic_time())) {
+		Connection* connection = find_connection(connectionID);
+		assert(connection != NULL);
+		assert(connection->state == WAITING_FOR_SEND_SLOT);
+		connection->holding_send_slot = true;
+		connection->state = MPI_READY_TO_SEND_CHUNK_SIZE;
+		mpi_send_chunk_size(*connection);
+	}
+
+	// wake up again when a rate-limited stream may proceed
+	double delay = scheduler.nextRefillDelay(monotonic_time());
+	if (delay >= 0) {
+		if (g_send_scheduler_event == NULL) {
+			g_send_scheduler_event = evtimer_new(base,
+				send_scheduler_timer_handler, base);
+			assert(g_send_scheduler_event != NULL);
+		}
+		if (!evtimer_pending(g_send_scheduler_event, NULL)) {
+			struct timeval time;
+			time.tv_sec = (long)delay;
+			time.tv_usec = (long)((delay - time.tv_sec) * 1e6) + 1;
+			evtimer_add(g_send_scheduler_event, &time);
+		}
+	}
+}
+
 static inline void update_mpi_status(
 	evutil_socket_t socket, short event, void* arg)
 {
@@ -163,6 +587,12 @@ static inline void update_mpi_status(
 	} else if (connection.state == MPI_FINALIZE) {
 		connection.update_mpi_finalize_state();
 		return;
+	} else if (connection.state == WAITING_FOR_DETACHED_SENDS) {
+		connection.update_wait_state();
+		return;
+	} else if (connection.state == MPI_SENDING_STREAM_SIZE) {
+		connection.update_mpi_send_stream_size_state();
+		return;
 	} else if (connection.state == MPI_SENDING_CHUNK_SIZE) {
 		connection.update_mpi_send_chunk_size_state();
 		return;
@@ -175,9 +605,24 @@ static inline void update_mpi_status(
 	} else if (connection.state == MPI_RECVING_CHUNK_SIZE) {
 		connection.update_mpi_recv_chunk_size_state();
 		return;
+	} else if (connection.state == MPI_RECVING_STREAM_SIZE) {
+		connection.update_mpi_recv_stream_size_state();
+		return;
 	} else if (connection.state == MPI_RECVING_CHUNK) {
 		connection.update_mpi_recv_chunk_state();
 		return;
+	} else if (connection.state == MPI_SENDING_LOCAL_OFFER) {
+		connection.update_mpi_send_local_offer_state();
+		return;
+	} else if (connection.state == MPI_SENDING_LOCAL_DONE) {
+		connection.update_mpi_send_local_done_state();
+		return;
+	} else if (connection.state == MPI_SENDING_LOCAL_REPLY) {
+		connection.update_mpi_send_local_reply_state();
+		return;
+	} else if (connection.state == MPI_WAITING_FOR_LOCAL_COPY) {
+		connection.update_mpi_local_copy_state();
+		return;
 	} else {
 		log_f(connection.id(), "illegal MPI state (%d) in timer event handler!",
 			connection.state);
@@ -0,0 +1,159 @@
+#ifndef _MKFIFO_H_
+#define _MKFIFO_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <climits>
+#include <unistd.h>
+
+static const char MKFIFO_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] mkfifo (--send <rank>|--recv <rank>) <path>\n"
+"\n"
+"Description:\n"
+"\n"
+"   Create a named pipe at <path> that the daemon serves\n"
+"   itself, so that an unmodified program can stream to\n"
+"   or from another MPI rank by writing to or reading\n"
+"   from a file:\n"
+"\n"
+"      " PROGRAM_NAME " mkfifo --send 3 /tmp/out; tool > /tmp/out\n"
+"      " PROGRAM_NAME " mkfifo --recv 2 /tmp/in; tool < /tmp/in\n"
+"\n"
+"   No mpih process stays on the data path. Each pipe\n"
+"   carries one stream: data written until the writer\n"
+"   closes the pipe (--send), or the data of one 'mpih\n"
+"   send' from <rank> (--recv). <path> must not exist\n"
+"   yet, and the daemon removes the pipe when the stream\n"
+"   is complete.\n"
+"\n"
+"Options:\n"
+"\n"
+"   --send RANK        stream data written to the pipe\n"
+"                      to RANK\n"
+"   --recv RANK        stream data from RANK into the pipe\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n"
+"   -t,--tag N         MPI tag for the stream [0]\n";
+
+static const char mkfifo_shortopts[] = "ht:v";
+
+enum { OPT_SEND = 1, OPT_RECV };
+
+static const struct option mkfifo_longopts[] = {
+	{ "help",     no_argument, NULL, 'h' },
+	{ "recv",     required_argument, NULL, OPT_RECV },
+	{ "send",     required_argument, NULL, OPT_SEND },
+	{ "tag",      required_argument, NULL, 't' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * 'path' as an absolute path, since the daemon doesn't
+ * share our working directory
+ */
+static inline std::string absolute_path(const std::string& path)
+{
+	if (!path.empty() && path[0] == '/')
+		return path;
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		exit(EXIT_FAILURE);
+	}
+	return std::string(cwd) + "/" + path;
+}
+
+int cmd_mkfifo(int argc, char** argv)
+{
+	int rank = -1;
+	std::string dir;
+
+	for (int c; (c = getopt_long(argc, argv,
+		mkfifo_shortopts, mkfifo_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(MKFIFO_USAGE_MESSAGE);
+		  case 'h':
+			std::cout << MKFIFO_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case OPT_SEND:
+		  case OPT_RECV:
+			if (!dir.empty()) {
+				std::cerr << "error: only one of --send and "
+					"--recv may be given" << std::endl;
+				die(MKFIFO_USAGE_MESSAGE);
+			}
+			dir = c == OPT_SEND ? "SEND" : "RECV";
+			arg >> rank;
+			break;
+		  case 't':
+			arg >> opt::tag;
+			break;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi mkfifo: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(MKFIFO_USAGE_MESSAGE);
+		}
+	}
+
+	if (dir.empty()) {
+		std::cerr << "error: one of --send and --recv is required"
+			<< std::endl;
+		die(MKFIFO_USAGE_MESSAGE);
+	}
+	if (argc - optind != 1) {
+		std::cerr << "error: expected a single <path> argument"
+			<< std::endl;
+		die(MKFIFO_USAGE_MESSAGE);
+	}
+	std::string path = absolute_path(argv[optind]);
+
+	// command for 'mpi init' daemon (FIFO takes the rest of the line)
+	std::ostringstream header;
+	header << dir << " " << rank;
+	if (opt::tag != 0)
+		header << " TAG " << opt::tag;
+	header << " FIFO " << path << "\n";
+
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
+	write_all(socket, header.str());
+
+	// the daemon answers once the pipe exists
+	char reply[3];
+	ssize_t n;
+	size_t len = 0;
+	while (len < sizeof(reply) && (n = read(socket, reply + len,
+		sizeof(reply) - len)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		len += n;
+	}
+	close(socket);
+	if (len != sizeof(reply) || memcmp(reply, "OK\n", len) != 0) {
+		std::cerr << "error: daemon could not create named pipe '"
+			<< path << "' (see daemon log)" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (opt::verbose)
+		std::cerr << "daemon is serving " << path << std::endl;
+
+	return 0;
+}
+
+#endif
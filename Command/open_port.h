@@ -0,0 +1,122 @@
+#ifndef _OPEN_PORT_H_
+#define _OPEN_PORT_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "Command/client/remote.h"
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <unistd.h>
+
+static const char OPEN_PORT_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] open-port [--file <path>]\n"
+"\n"
+"Description:\n"
+"\n"
+"   Wait for another MPI job to connect to this one with\n"
+"   '" PROGRAM_NAME " connect-port', so that the two jobs can\n"
+"   stream to each other directly:\n"
+"\n"
+"      job 1: " PROGRAM_NAME " open-port --file /shared/port\n"
+"             " PROGRAM_NAME " send --remote 0 < data\n"
+"      job 2: " PROGRAM_NAME " connect-port --file /shared/port\n"
+"             " PROGRAM_NAME " recv --remote 0 > data\n"
+"\n"
+"   Every rank of the job must run this command. Rank 0\n"
+"   opens an MPI port and writes its name to STDOUT (or\n"
+"   --file). Once the jobs are connected, each rank prints\n"
+"   the number of ranks in the other job, and 'mpih send\n"
+"   --remote' and 'mpih recv --remote' address them.\n"
+"\n"
+"   Connect the jobs before starting any streams: the\n"
+"   daemon refuses while it is serving other clients.\n"
+"\n"
+"   The daemon doesn't move any data until the other job\n"
+"   has connected, and doesn't shut down until the other\n"
+"   job has finalized too. With Open MPI, start both jobs\n"
+"   with 'mpirun --ompi-server file:<uri>', for a shared\n"
+"   'ompi-server -r <uri>'.\n"
+"\n"
+"Options:\n"
+"\n"
+"   -f,--file PATH     write the port name to PATH (rank 0)\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n";
+
+static const char open_port_shortopts[] = "f:hv";
+
+static const struct option open_port_longopts[] = {
+	{ "file",     required_argument, NULL, 'f' },
+	{ "help",     no_argument, NULL, 'h' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * Hand the port name to the other job: write it to
+ * --file, all at once (via a rename), so that 'mpih
+ * connect-port --file' never reads part of it
+ */
+static inline void publish_port(const std::string& port)
+{
+	if (opt::portFile.empty()) {
+		std::cout << port << std::endl;
+		return;
+	}
+
+	std::ostringstream tmpPath;
+	tmpPath << opt::portFile << ".tmp." << getpid();
+	std::ofstream out(tmpPath.str().c_str());
+	out << port << std::endl;
+	out.close();
+	if (!out || rename(tmpPath.str().c_str(),
+		opt::portFile.c_str()) < 0) {
+		perror(opt::portFile.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt::verbose)
+		std::cerr << "wrote MPI port name to " << opt::portFile
+			<< std::endl;
+}
+
+int cmd_open_port(int argc, char** argv)
+{
+	for (int c; (c = getopt_long(argc, argv,
+		open_port_shortopts, open_port_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(OPEN_PORT_USAGE_MESSAGE);
+		  case 'f':
+			arg >> opt::portFile;
+			break;
+		  case 'h':
+			std::cout << OPEN_PORT_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi open-port: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(OPEN_PORT_USAGE_MESSAGE);
+		}
+	}
+
+	if (argc - optind != 0)
+		die(OPEN_PORT_USAGE_MESSAGE);
+
+	std::cout << join_remote_job("ACCEPT", publish_port)
+		<< std::endl;
+
+	return 0;
+}
+
+#endif
@@ -53,7 +53,7 @@ int query_rank()
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
 	// send command to 'mpi init' daemon
-	evbuffer_add_printf(bufferevent_get_output(bev), "RANK\n");
+	send_binary_request(bev, OP_RANK);
 
 	event_base_dispatch(base);
 	bufferevent_free(bev);
@@ -5,7 +5,11 @@
 #include "Options/CommonOptions.h"
 #include "IO/IOUtil.h"
 #include "IO/SocketUtil.h"
-#include "Command/client/event_handlers.h"
+#include "Command/client/handoff.h"
+#include "Command/client/shm.h"
+#include "Command/client/FdCopier.h"
+#include "Command/client/stripe.h"
+#include "Command/client/remote.h"
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
@@ -25,39 +29,95 @@ static const char RECV_USAGE_MESSAGE[] =
 "\n"
 "Options:\n"
 "\n"
+"   -o,--output FILE   write data to FILE instead of STDOUT.\n"
+"                      If the sender is sending a file, the\n"
+"                      daemon allocates space for all of it\n"
+"                      up front.\n"
+"   -P,--parallel N    receive a file sent with 'mpih send\n"
+"                      --parallel N' (requires --output)\n"
+"   -m,--shm           take data from the daemon through a\n"
+"                      shared-memory ring, rather than the\n"
+"                      socket or our file descriptor\n"
+"   -R,--remote        <rank> is a rank of the job that we\n"
+"                      are connected to (see 'mpih help\n"
+"                      open-port')\n"
 "   -s,--socket PATH   connect to 'mpi init' daemon\n"
-"                      through Unix socket at PATH\n";
+"                      through Unix socket at PATH\n"
+"   -S,--via-socket    copy data from the daemon through the\n"
+"                      socket. By default, if STDOUT is a\n"
+"                      file or pipe, the daemon writes to\n"
+"                      it directly.\n"
+"   -t,--tag N         MPI tag of stream to receive [0]\n";
 
-static const char recv_shortopts[] = "hv";
+namespace opt {
+	/** -o,--output: output file (STDOUT if empty) */
+	static std::string outputPath;
+}
+
+static const char recv_shortopts[] = "hmo:P:RSt:v";
 
 static const struct option recv_longopts[] = {
 	{ "help",     no_argument, NULL, 'h' },
+	{ "shm",      no_argument, NULL, 'm' },
+	{ "output",   required_argument, NULL, 'o' },
+	{ "parallel", required_argument, NULL, 'P' },
+	{ "remote",   no_argument, NULL, 'R' },
+	{ "tag",      required_argument, NULL, 't' },
+	{ "via-socket", no_argument, NULL, 'S' },
 	{ "verbose",  no_argument, NULL, 'v' },
 	{ NULL, 0, NULL, 0 }
 };
 
-static inline void
-recv_read_handler(struct bufferevent* bev, void* arg)
+/** State of an 'mpih recv' that streams through the daemon socket */
+struct RecvState
 {
-	struct event_base* base = bufferevent_get_base(bev);
-	assert(base != NULL);
-
-	struct evbuffer* input = bufferevent_get_input(bev);
-	assert(input != NULL);
+	/** moves data from the socket to the output */
+	FdCopier* copier;
+	/** fires when the socket has data */
+	struct event* read_event;
+	/** fires when the output has room again */
+	struct event* write_event;
+	struct event_base* base;
+};
 
-	size_t bytes_ready = evbuffer_get_length(input);
-	assert(bytes_ready > 0);
+/** Move the next block of data from the socket to the output */
+static inline void recv_data(RecvState& state)
+{
+	ssize_t n = state.copier->copy();
 
-	int n = evbuffer_write(input, STDOUT_FILENO);
+	if (n < 0 && errno == EAGAIN) {
+		// output is full; stop reading until it drains
+		if (opt::verbose >= 3)
+			fprintf(stderr, "output is full, waiting\n");
+		event_del(state.read_event);
+		event_add(state.write_event, NULL);
+		return;
+	}
 
 	if (n < 0) {
-		perror("evbuffer_write");
-		bufferevent_free(bev);
-		event_base_free(base);
+		perror("recv");
 		exit(EXIT_FAILURE);
 	}
 
-	assert(n == bytes_ready);
+	// EOF
+	if (n == 0)
+		event_base_loopexit(state.base, NULL);
+}
+
+static inline void
+recv_read_handler(evutil_socket_t socket, short event, void* arg)
+{
+	assert(arg != NULL);
+	recv_data(*(RecvState*)arg);
+}
+
+static inline void
+recv_write_handler(evutil_socket_t fd, short event, void* arg)
+{
+	assert(arg != NULL);
+	RecvState& state = *(RecvState*)arg;
+	event_add(state.read_event, NULL);
+	recv_data(state);
 }
 
 int cmd_recv(int argc, char** argv)
@@ -71,6 +131,26 @@ int cmd_recv(int argc, char** argv)
 		  case 'h':
 			std::cout << RECV_USAGE_MESSAGE;
 			return EXIT_SUCCESS;
+		  case 'm':
+			opt::shm = 1;
+			break;
+		  case 'o':
+			arg >> opt::outputPath;
+			break;
+		  case 'P':
+			arg >> opt::parallel;
+			if (opt::parallel < 1 || opt::parallel > MAX_STRIPES)
+				arg.setstate(std::ios::failbit);
+			break;
+		  case 'R':
+			opt::remote = 1;
+			break;
+		  case 'S':
+			opt::viaSocket = 1;
+			break;
+		  case 't':
+			arg >> opt::tag;
+			break;
 		  case 'v':
 			arg >> opt::verbose;
 			break;
@@ -98,34 +178,98 @@ int cmd_recv(int argc, char** argv)
 		std::cerr << "Connecting to 'mpih init' process..."
 			<< std::endl;
 
-	int socket = UnixSocket::connect(opt::socketPath.c_str());
+	if (opt::parallel > 1 && (opt::outputPath.empty() ||
+		opt::shm || opt::viaSocket)) {
+		std::cerr << "error: --parallel needs --output, and can't "
+			"be used with --shm or --via-socket" << std::endl;
+		die(RECV_USAGE_MESSAGE);
+	}
 
-	if (opt::verbose)
-		std::cerr << "Connected." << std::endl;
+	int out = STDOUT_FILENO;
+	if (!opt::outputPath.empty()) {
+		out = open(opt::outputPath.c_str(),
+			O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+		if (out < 0) {
+			perror(opt::outputPath.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	struct event_base* base = event_base_new();
-	assert(base != NULL);
+	// command for 'mpi init' daemon
+	std::ostringstream header;
+	header << "RECV " << rank;
+	if (opt::remote)
+		header << " REMOTE";
+	if (opt::tag != 0)
+		header << " TAG " << opt::tag;
+
+	if (opt::parallel > 1) {
+		// let the daemon write the stripes where they belong
+		recv_striped(out, header.str());
+		if (close(out) < 0) {
+			perror(opt::outputPath.c_str());
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
 
-	struct bufferevent* bev = bufferevent_socket_new(base,
-		socket, BEV_OPT_CLOSE_ON_FREE);
-	assert(bev != NULL);
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
 
-	bufferevent_setcb(bev, recv_read_handler, NULL,
-		client_event_handler, NULL);
-	bufferevent_setwatermark(bev, EV_READ, 0, MAX_BUFFER_SIZE);
-	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	if (opt::verbose)
+		std::cerr << "Connected." << std::endl;
 
-	struct evbuffer* output = bufferevent_get_output(bev);
-	assert(output != NULL);
+	bool header_sent = false;
+	if (opt::shm) {
+		// take our output from a shared-memory ring
+		ShmRing* ring = hand_off_ring(socket, header.str());
+		if (ring != NULL) {
+			shm_recv(*ring, socket, out);
+			delete ring;
+			close(socket);
+			return 0;
+		}
+		header_sent = true;
+	} else if (can_hand_off(out)) {
+		// let the daemon write our output directly
+		if (hand_off_fd(socket, header.str(), out)) {
+			if (opt::verbose)
+				std::cerr << "daemon is writing output directly"
+					<< std::endl;
+			wait_for_daemon(socket);
+			close(socket);
+			return 0;
+		}
+		header_sent = true;
+	}
 
 	// send command to 'mpi init' daemon
-	evbuffer_add_printf(output, "RECV %d\n", rank);
+	if (!header_sent)
+		write_all(socket, header.str() + "\n");
+
+	RecvState state;
+	state.base = event_base_new();
+	assert(state.base != NULL);
+	state.copier = new FdCopier(socket, out);
+	state.read_event = event_new(state.base, socket,
+		EV_READ|EV_PERSIST, recv_read_handler, &state);
+	state.write_event = event_new(state.base, out,
+		EV_WRITE, recv_write_handler, &state);
+	assert(state.read_event != NULL && state.write_event != NULL);
+	event_add(state.read_event, NULL);
 
 	// start libevent loop
-	event_base_dispatch(base);
+	event_base_dispatch(state.base);
 
+	event_free(state.read_event);
+	event_free(state.write_event);
+	delete state.copier;
+	close(socket);
+	if (out != STDOUT_FILENO && close(out) < 0) {
+		perror(opt::outputPath.c_str());
+		exit(EXIT_FAILURE);
+	}
 	fclose(stdout);
-	event_base_free(base);
+	event_base_free(state.base);
 
 	return 0;
 }
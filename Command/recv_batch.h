@@ -0,0 +1,246 @@
+#ifndef _RECV_BATCH_H_
+#define _RECV_BATCH_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include "Command/client/batch.h"
+#include <getopt.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char RECV_BATCH_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] recv-batch <rank>\n"
+"\n"
+"Description:\n"
+"\n"
+"   Receive the files that <rank> of the current MPI job\n"
+"   sends with 'mpih send-batch', creating each one under\n"
+"   the name given by the sender (and any directories\n"
+"   leading up to it).\n"
+"\n"
+"Options:\n"
+"\n"
+"   -C,--directory DIR create the files under DIR [.]\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n"
+"   -t,--tag N         MPI tag of stream to receive [0]\n"
+"   -v,--verbose       print the names of the files to\n"
+"                      STDERR as they are received\n";
+
+namespace opt {
+	/** -C,--directory: where 'mpih recv-batch' creates files */
+	static std::string batchDir = ".";
+}
+
+static const char recv_batch_shortopts[] = "C:ht:v";
+
+static const struct option recv_batch_longopts[] = {
+	{ "directory", required_argument, NULL, 'C' },
+	{ "help",     no_argument, NULL, 'h' },
+	{ "tag",      required_argument, NULL, 't' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/** size of the read buffer of 'mpih recv-batch' (bytes) */
+static const size_t BATCH_BUFFER_SIZE = 1024 * 1024;
+
+/** Buffered reader for the batch stream from the daemon */
+class BatchReader
+{
+public:
+
+	BatchReader(int socket) :
+		m_socket(socket), m_buffer(BATCH_BUFFER_SIZE), m_start(0),
+		m_end(0) {}
+
+	/**
+	 * Read the next frame header into 'size' and 'name'.
+	 *
+	 * @return false at the end of the stream
+	 */
+	bool readHeader(uint64_t& size, std::string& name)
+	{
+		std::string line;
+		while (true) {
+			if (m_start == m_end && !fill()) {
+				if (line.empty())
+					return false;
+				truncated();
+			}
+			char* start = &m_buffer[m_start];
+			char* end = &m_buffer[m_end];
+			char* newline = std::find(start, end, '\n');
+			line.append(start, newline);
+			m_start += newline - start;
+			if (line.size() >= BATCH_MAX_HEADER_SIZE) {
+				std::cerr << "error: batch header too long" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			if (newline != end) {
+				m_start++;
+				break;
+			}
+		}
+
+		std::istringstream fields(line);
+		fields >> size;
+		if (fields.fail() || fields.get() != ' ') {
+			std::cerr << "error: invalid batch header: `" << line
+				<< "'" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::getline(fields, name);
+		if (!valid_batch_name(name)) {
+			std::cerr << "error: refusing to create `" << name
+				<< "'" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		return true;
+	}
+
+	/** Copy the next 'size' bytes of the stream to 'fd' */
+	void readData(uint64_t size, int fd, const std::string& path)
+	{
+		while (size > 0) {
+			if (m_start == m_end && !fill())
+				truncated();
+			size_t len = std::min((uint64_t)(m_end - m_start), size);
+			if (!write_fully(fd, &m_buffer[m_start], len)) {
+				perror(path.c_str());
+				exit(EXIT_FAILURE);
+			}
+			m_start += len;
+			size -= len;
+		}
+	}
+
+private:
+
+	/** @return false at EOF */
+	bool fill()
+	{
+		ssize_t n;
+		do {
+			n = read(m_socket, &m_buffer[0], m_buffer.size());
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			perror("recv-batch");
+			exit(EXIT_FAILURE);
+		}
+		m_start = 0;
+		m_end = n;
+		return n > 0;
+	}
+
+	static bool write_fully(int fd, const char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = write(fd, data, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				return false;
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	static void truncated()
+	{
+		std::cerr << "error: batch stream ended in the middle "
+			"of a file" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int m_socket;
+	std::vector<char> m_buffer;
+	/** unread bytes in 'm_buffer' */
+	size_t m_start;
+	size_t m_end;
+};
+
+int cmd_recv_batch(int argc, char** argv)
+{
+	for (int c; (c = getopt_long(argc, argv,
+		recv_batch_shortopts, recv_batch_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(RECV_BATCH_USAGE_MESSAGE);
+		  case 'C':
+			arg >> opt::batchDir;
+			break;
+		  case 'h':
+			std::cout << RECV_BATCH_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 't':
+			arg >> opt::tag;
+			break;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi recv-batch: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(RECV_BATCH_USAGE_MESSAGE);
+		}
+	}
+
+	if (argc - optind != 1) {
+		std::cerr << "error: missing <rank> argument"
+			<< std::endl;
+		die(RECV_BATCH_USAGE_MESSAGE);
+	}
+
+	int rank;
+	std::stringstream ss(argv[optind++]);
+	ss >> rank;
+	if (ss.fail() || !ss.eof())
+		die(RECV_BATCH_USAGE_MESSAGE);
+
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
+
+	std::ostringstream header;
+	header << "RECV " << rank;
+	if (opt::tag != 0)
+		header << " TAG " << opt::tag;
+	write_all(socket, header.str() + "\n");
+
+	BatchReader reader(socket);
+	uint64_t size;
+	std::string name;
+	while (reader.readHeader(size, name)) {
+		std::string path = opt::batchDir + "/" + name;
+		int fd = -1;
+		if (make_parent_dirs(path))
+			fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+				0666);
+		if (fd < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		reader.readData(size, fd, path);
+		if (close(fd) < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (opt::verbose)
+			std::cerr << name << std::endl;
+	}
+
+	close(socket);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef _RECV_DIR_H_
+#define _RECV_DIR_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include "Command/client/FdCopier.h"
+#include "Command/client/stripe.h"
+#include "Command/client/dirindex.h"
+#include <getopt.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static const char RECV_DIR_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] recv-dir <rank> <dir>\n"
+"\n"
+"Description:\n"
+"\n"
+"   Receive a directory tree sent by <rank> of the current\n"
+"   MPI job with 'mpih send-dir', into directory <dir>\n"
+"   (which is created if needed). The chunks of large\n"
+"   files are written in place as they arrive, over as\n"
+"   many streams as the sender uses.\n"
+"\n"
+"Options:\n"
+"\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n"
+"   -t,--tag N         MPI tag of the transfer [0]\n"
+"   -v,--verbose       print the names of the entries to\n"
+"                      STDERR as they are created\n";
+
+static const char recv_dir_shortopts[] = "ht:v";
+
+static const struct option recv_dir_longopts[] = {
+	{ "help",     no_argument, NULL, 'h' },
+	{ "tag",      required_argument, NULL, 't' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/** Read exactly 'len' bytes from blocking socket 's' (or die) */
+static inline void recv_dir_read(int s, char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(s, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("recv-dir");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) {
+			fprintf(stderr, "error: directory stream ended early\n");
+			exit(EXIT_FAILURE);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/** Read the index at the start of lane 0 (or die) */
+static inline void recv_dir_index(int s, DirIndex& index)
+{
+	std::string length(8, '\0');
+	recv_dir_read(s, &length[0], length.size());
+	uint64_t size;
+	DirIndexDecoder(length).get(size, 8);
+	if (size > DIR_MAX_INDEX_SIZE) {
+		fprintf(stderr, "error: directory index too large\n");
+		exit(EXIT_FAILURE);
+	}
+	std::string encoded(size, '\0');
+	recv_dir_read(s, &encoded[0], encoded.size());
+	if (!decode_dir_index(encoded, index, MAX_STRIPES)) {
+		fprintf(stderr, "error: invalid directory index\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Receive the chunks of one lane, one stream after another.
+ * Runs in a child process, one per lane.
+ */
+static inline void recv_dir_lane(const std::string& top,
+	const DirIndex& index, const std::vector<DirChunk>& chunks,
+	const std::string& header, int lane)
+{
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		std::string path = top + "/" +
+			index.entries[chunks[i].entry].name;
+		int fd = open(path.c_str(), O_WRONLY|O_CLOEXEC);
+		if (fd < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		int s = recv_stripe(fd, header, lane);
+		close(fd);
+		wait_for_daemon(s);
+		close(s);
+	}
+}
+
+/** Copy the next 'size' bytes of lane 0 into file 'path' */
+static inline void recv_dir_packed(int s, const std::string& path,
+	uint64_t size)
+{
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	FdCopier copier(s, fd);
+	while (size > 0) {
+		ssize_t n = copier.copy(std::min(size, (uint64_t)FD_COPY_SIZE));
+		if (n < 0 && errno == EAGAIN) {
+			// splice() from the socket doesn't block
+			struct pollfd pfd = { s, POLLIN, 0 };
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) {
+			fprintf(stderr, "error: directory stream ended early\n");
+			exit(EXIT_FAILURE);
+		}
+		size -= n;
+	}
+	if (close(fd) < 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Set the permissions and modification time of 'entry' */
+static inline void recv_dir_set_attrs(const std::string& top,
+	const DirEntry& entry)
+{
+	std::string path = top + "/" + entry.name;
+	if (entry.type != DIR_ENTRY_LINK && chmod(path.c_str(), entry.mode) < 0)
+		perror(path.c_str());
+	struct timespec times[2];
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = entry.mtime_sec;
+	times[1].tv_nsec = entry.mtime_nsec;
+	if (utimensat(AT_FDCWD, path.c_str(), times,
+		AT_SYMLINK_NOFOLLOW) < 0)
+		perror(path.c_str());
+}
+
+int cmd_recv_dir(int argc, char** argv)
+{
+	for (int c; (c = getopt_long(argc, argv,
+		recv_dir_shortopts, recv_dir_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(RECV_DIR_USAGE_MESSAGE);
+		  case 'h':
+			std::cout << RECV_DIR_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 't':
+			arg >> opt::tag;
+			break;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi recv-dir: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(RECV_DIR_USAGE_MESSAGE);
+		}
+	}
+
+	if (argc - optind != 2)
+		die(RECV_DIR_USAGE_MESSAGE);
+
+	int rank;
+	std::stringstream ss(argv[optind++]);
+	ss >> rank;
+	if (ss.fail() || !ss.eof())
+		die(RECV_DIR_USAGE_MESSAGE);
+
+	std::string top = argv[optind++];
+	if ((!make_parent_dirs(top) || mkdir(top.c_str(), 0777) < 0) &&
+		errno != EEXIST) {
+		perror(top.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::ostringstream header;
+	header << "RECV " << rank;
+	if (opt::tag != 0)
+		header << " TAG " << opt::tag;
+
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
+	write_all(socket, header.str() + "\n");
+
+	DirIndex index;
+	recv_dir_index(socket, index);
+
+	// create the tree, with room for the chunks of large files
+	for (size_t i = 0; i < index.entries.size(); ++i) {
+		const DirEntry& entry = index.entries[i];
+		std::string path = top + "/" + entry.name;
+		if (entry.type == DIR_ENTRY_DIR) {
+			if (mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
+				perror(path.c_str());
+				exit(EXIT_FAILURE);
+			}
+		} else if (entry.type == DIR_ENTRY_FILE &&
+			!dir_entry_packed(index, entry)) {
+			int fd = open(path.c_str(),
+				O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+			if (fd < 0 || ftruncate(fd, entry.size) < 0) {
+				perror(path.c_str());
+				exit(EXIT_FAILURE);
+			}
+			close(fd);
+		}
+	}
+
+	// receive the chunks of large files in parallel
+	std::vector<std::vector<DirChunk> > lanes = dir_chunks(index);
+	std::vector<pid_t> children;
+	for (size_t i = 1; i < lanes.size(); ++i) {
+		if (lanes[i].empty())
+			continue;
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			recv_dir_lane(top, index, lanes[i], header.str(), i);
+			_exit(EXIT_SUCCESS);
+		}
+		children.push_back(pid);
+	}
+
+	// meanwhile, unpack the small files
+	for (size_t i = 0; i < index.entries.size(); ++i) {
+		const DirEntry& entry = index.entries[i];
+		if (!dir_entry_packed(index, entry))
+			continue;
+		recv_dir_packed(socket, top + "/" + entry.name, entry.size);
+		if (opt::verbose)
+			std::cerr << entry.name << std::endl;
+	}
+	close(socket);
+
+	int exitStatus = EXIT_SUCCESS;
+	for (size_t i = 0; i < children.size(); ++i) {
+		int status;
+		if (waitpid(children[i], &status, 0) < 0 ||
+			!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exitStatus = EXIT_FAILURE;
+	}
+	if (exitStatus != EXIT_SUCCESS)
+		return exitStatus;
+
+	/*
+	 * Create symlinks last, so that no file of the tree
+	 * can be written through one.
+	 */
+	for (size_t i = 0; i < index.entries.size(); ++i) {
+		const DirEntry& entry = index.entries[i];
+		if (entry.type != DIR_ENTRY_LINK)
+			continue;
+		std::string path = top + "/" + entry.name;
+		unlink(path.c_str());
+		if (symlink(entry.target.c_str(), path.c_str()) < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// children first, so that setting their times doesn't
+	// change those of their parent directories
+	for (size_t i = index.entries.size(); i-- > 0;)
+		recv_dir_set_attrs(top, index.entries[i]);
+
+	if (opt::verbose)
+		std::cerr << "received " << index.entries.size()
+			<< " entries" << std::endl;
+
+	return 0;
+}
+
+#endif
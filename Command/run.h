@@ -4,8 +4,6 @@
 #include "config.h"
 #include "Command/init.h"
 #include "Command/finalize.h"
-#include "Command/rank.h"
-#include "Command/size.h"
 #include "Options/CommonOptions.h"
 #include <stdlib.h>
 #include <string>
@@ -13,6 +11,8 @@
 #include <iostream>
 #include <sstream>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -45,12 +45,30 @@ static const char RUN_USAGE_MESSAGE[] =
 "   commands in order to communicate with the daemon, but is\n"
 "   rarely needed by the user.\n"
 "\n"
+"   If an 'mpih recv' client can't keep up with incoming data,\n"
+"   the daemon spills the excess data to temp files in the same\n"
+"   directory as MPIH_SOCKET.\n"
+"\n"
 "   After <script> complete successfully, 'mpih finalize' will\n"
 "   automatically be invoked to shut down the MPI process.\n"
 "\n"
 "Options:\n"
 "\n"
+"   -b,--backlog N    max number of clients waiting to\n"
+"                     connect to the daemon; see\n"
+"                     'mpih help init'\n"
 "   -l,--log PATH     log file for daemon\n"
+"   -L,--no-local-copy\n"
+"                     daemon sends streams between ranks on\n"
+"                     the same node through MPI too; see\n"
+"                     'mpih help init'\n"
+"   -m,--low-footprint\n"
+"                     daemon uses less memory per connection;\n"
+"                     see 'mpih help init'\n"
+"   -t,--transport T  transport for daemon ('p2p' or 'rma');\n"
+"                     see 'mpih help init'\n"
+"   -U,--io-uring     daemon does client socket I/O with\n"
+"                     io_uring; see 'mpih help init'\n"
 "   -v,--verbose      show progress messages\n"
 "   -V,--log-verbose  verbose level for daemon log\n";
 
@@ -58,16 +76,44 @@ namespace opt {
 	static int logVerbose = 1;
 }
 
-static const char run_shortopts[] = "hl:vV";
+static const char run_shortopts[] = "b:hl:Lmt:UvV";
 
 static const struct option run_longopts[] = {
+	{ "backlog", required_argument, NULL, 'b' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "log", required_argument, NULL, 'l' },
+	{ "no-local-copy", no_argument, NULL, 'L' },
+	{ "low-footprint", no_argument, NULL, 'm' },
+	{ "transport", required_argument, NULL, 't' },
+	{ "io-uring", no_argument, NULL, 'U' },
 	{ "verbose", no_argument, NULL, 'v' },
 	{ "log-verbose", no_argument, NULL, 'V' },
 	{ NULL, 0, NULL, 0 }
 };
 
+/**
+ * Wait for the daemon to write "<rank> <size>\n" to the
+ * readiness pipe (see opt::readyFd in Command/init.h).
+ *
+ * @return false if the daemon exited (closing the pipe)
+ * without doing so
+ */
+static inline bool wait_for_daemon(int fd, int& rank, int& size)
+{
+	std::string msg;
+	char buf[64];
+	while (msg.find('\n') == std::string::npos) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		msg.append(buf, n);
+	}
+	std::istringstream in(msg);
+	return (in >> rank >> size) && rank >= 0 && size > 0;
+}
+
 static inline int cmd_run(int argc, char** argv)
 {
 	/* parse command line options */
@@ -77,12 +123,33 @@ static inline int cmd_run(int argc, char** argv)
 		switch (c) {
 		  case '?':
 			die(RUN_USAGE_MESSAGE);
+		  case 'b':
+			arg >> opt::listenBacklog;
+			if (opt::listenBacklog <= 0)
+				arg.setstate(std::ios::failbit);
+			break;
 		  case 'h':
 			std::cout << RUN_USAGE_MESSAGE;
 			return EXIT_SUCCESS;
 		  case 'l':
 			arg >> opt::logPath;
 			break;
+		  case 'L':
+			opt::noLocalCopy = 1;
+			break;
+		  case 'm':
+			opt::lowFootprint = 1;
+			break;
+		  case 't': {
+			std::string transport;
+			arg >> transport;
+			if (!parse_transport(transport, opt::transport))
+				arg.setstate(std::ios::failbit);
+			break;
+		  }
+		  case 'U':
+			opt::ioUring = 1;
+			break;
 		  case 'v':
 			opt::verbose++;
 			break;
@@ -117,6 +184,7 @@ static inline int cmd_run(int argc, char** argv)
 
 	/* pid file path for 'mpih init' daemon */
 	opt::pidPath.append(tmpdir);
+	opt::pidPath.append("/");
 	opt::pidPath.append("mpih.pid");
 	std::string pidStr("MPIH_PIDFILE=");
 	pidStr.append(opt::pidPath);
@@ -134,9 +202,23 @@ static inline int cmd_run(int argc, char** argv)
 		std::cerr << "setting daemon log path to "
 			<< opt::logPath << std::endl;
 
+	/* spill data for slow clients to temp dir */
+	opt::spoolDir = tmpdir;
+
 	/* free memory allocated for string */
 	free(tmpdir);
 
+	/*
+	 * the daemon tells us when it is ready, along with our
+	 * rank and the job size, through a pipe (rather than
+	 * us polling for the PID file, and then querying it)
+	 */
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		exit(EXIT_FAILURE);
+	}
+
 	/* fork an 'mpih init' daemon */
 	int pid = fork();
 
@@ -148,6 +230,8 @@ static inline int cmd_run(int argc, char** argv)
 	if (pid == 0) {
 		/* set verbose level for daemon log */
 		opt::verbose = opt::logVerbose;
+		close(ready[0]);
+		opt::readyFd = ready[1];
 		/* invoke 'mpih init' with no args */
 		char* empty_argv[1] = { NULL };
 		cmd_init(0, empty_argv);
@@ -159,36 +243,20 @@ static inline int cmd_run(int argc, char** argv)
 		std::cerr << "waiting for MPIH daemon to start..."
 			<< std::endl;
 
-	struct timespec wait_time;
-	wait_time.tv_sec = 0;
-	/* 200,000,000 nanosecs == 200 millisec */
-	wait_time.tv_nsec = 200000000;
-
-	while(true) {
-		if (access(opt::pidPath.c_str(), R_OK) == 0)
-			break;
-		assert(errno == ENOENT);
-		nanosleep(&wait_time, NULL);
+	close(ready[1]);
+	int rank, size;
+	if (!wait_for_daemon(ready[0], rank, size)) {
+		std::cerr << "error: 'mpih init' daemon failed to start "
+			"(see " << opt::logPath << ")" << std::endl;
+		exit(EXIT_FAILURE);
 	}
-
-	/* query daemon for rank and set MPIH_RANK */
+	close(ready[0]);
 
 	if (opt::verbose)
-		std::cerr << "querying daemon for MPI rank..." << std::endl;
-	int rank = query_rank();
-	if (opt::verbose)
-		std::cerr << "our MPI rank is " << rank << std::endl;
+		std::cerr << "our MPI rank is " << rank
+			<< ", number of MPI ranks is " << size << std::endl;
 	std::ostringstream rankStr;
 	rankStr << "MPIH_RANK=" << rank;
-
-	/* query daemon for num ranks and set MPIH_SIZE */
-
-	if (opt::verbose)
-		std::cerr << "querying daemon for number of MPI ranks..."
-			<< std::endl;
-	int size = query_size();
-	if (opt::verbose)
-		std::cerr << "number of MPI ranks is " << size << std::endl;
 	std::ostringstream sizeStr;
 	sizeStr << "MPIH_SIZE=" << size;
 
@@ -5,8 +5,14 @@
 #include "Options/CommonOptions.h"
 #include "IO/IOUtil.h"
 #include "IO/SocketUtil.h"
-#include "Command/client/event_handlers.h"
+#include "Command/client/handoff.h"
+#include "Command/client/shm.h"
+#include "Command/client/FdCopier.h"
+#include "Command/client/stripe.h"
+#include "Command/client/remote.h"
 #include <getopt.h>
+#include <deque>
+#include <vector>
 #include <iostream>
 #include <sstream>
 #include <event2/event.h>
@@ -14,6 +20,7 @@
 #include <event2/bufferevent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <csignal>
 
 static const char SEND_USAGE_MESSAGE[] =
 "Usage: " PROGRAM_NAME " [--socket <path>] send <rank> [file1]...\n"
@@ -26,64 +33,166 @@ static const char SEND_USAGE_MESSAGE[] =
 "\n"
 "Options:\n"
 "\n"
+"   -d,--detach        exit as soon as all data has been\n"
+"                      handed to the daemon, leaving the\n"
+"                      daemon to complete the transfer\n"
+"                      (see 'mpih wait')\n"
+"   -m,--shm           pass data to the daemon through a\n"
+"                      shared-memory ring, rather than the\n"
+"                      socket or our file descriptor\n"
+"   -P,--parallel N    split a single regular file into N\n"
+"                      stripes, sent concurrently as\n"
+"                      separate streams [1]. The receiver\n"
+"                      must use 'mpih recv --parallel N\n"
+"                      --output FILE'.\n"
+"   -p,--priority P    priority class of this stream, when\n"
+"                      competing with other sends for MPI:\n"
+"                      'low', 'normal', or 'high' [normal]\n"
+"   -r,--rate N        limit stream to N bytes/sec; N may\n"
+"                      have a K, M, or G suffix (e.g. 10M).\n"
+"                      With --parallel, the limit is shared\n"
+"                      by the stripes.\n"
+"   -R,--remote        <rank> is a rank of the job that we\n"
+"                      are connected to (see 'mpih help\n"
+"                      open-port')\n"
 "   -s,--socket PATH   connect to 'mpi init' daemon\n"
-"                      through Unix socket at PATH\n";
+"                      through Unix socket at PATH\n"
+"   -S,--via-socket    copy data to the daemon through the\n"
+"                      socket. By default, if the input is\n"
+"                      a single file or pipe, the daemon\n"
+"                      reads it directly.\n"
+"   -t,--tag N         MPI tag for this stream [0]; use\n"
+"                      distinct tags for concurrent streams\n"
+"                      to the same rank. The receiver must\n"
+"                      use the same tag.\n";
 
-static const char send_shortopts[] = "hv";
+namespace opt {
+	/** -d,--detach: don't wait for daemon to send data */
+	static int detach;
+	/** -p,--priority: priority class for MPI sends */
+	static int priority = 1;
+	/** -r,--rate: max bytes/sec (0 for unlimited) */
+	static uint64_t rate;
+}
+
+static const char send_shortopts[] = "dhmP:p:Rr:St:v";
 
 static const struct option send_longopts[] = {
+	{ "detach",   no_argument, NULL, 'd' },
 	{ "help",     no_argument, NULL, 'h' },
+	{ "shm",      no_argument, NULL, 'm' },
+	{ "parallel", required_argument, NULL, 'P' },
+	{ "priority", required_argument, NULL, 'p' },
+	{ "remote",   no_argument, NULL, 'R' },
+	{ "rate",     required_argument, NULL, 'r' },
+	{ "via-socket", no_argument, NULL, 'S' },
+	{ "tag",      required_argument, NULL, 't' },
 	{ "verbose",  no_argument, NULL, 'v' },
 	{ NULL, 0, NULL, 0 }
 };
 
-static inline void
-send_write_handler(struct bufferevent* bev, void* arg)
+/**
+ * Number of input files after the current one that we
+ * ask the kernel to start reading ahead
+ */
+static const size_t SEND_PREFETCH_FILES = 2;
+
+/** Amount of each upcoming input file to read ahead (bytes) */
+static const off_t SEND_PREFETCH_SIZE = 8 * 1024 * 1024;
+
+/** State of an 'mpih send' that streams through the daemon socket */
+struct SendState
 {
-	assert(arg != NULL);
-	std::vector<FILE*>& input_files = *(std::vector<FILE*>*)arg;
+	/** remaining input files (current file first) */
+	std::deque<int> input_files;
+	/** moves data from the current input file to the socket */
+	FdCopier* copier;
+	struct event_base* base;
 
-	struct event_base* base = bufferevent_get_base(bev);
-	assert(base != NULL);
+	SendState() : copier(NULL), base(NULL) {}
+};
 
-	struct evbuffer* output = bufferevent_get_output(bev);
-	assert(output != NULL);
+/**
+ * Open each of 'paths' (or die), so that a missing file
+ * is reported before we start sending anything, and tell
+ * the kernel that we will read them sequentially.
+ */
+static inline std::deque<int> open_input_files(
+	const std::vector<const char*>& paths)
+{
+	std::deque<int> files;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		int fd = open(paths[i], O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			perror(paths[i]);
+			exit(EXIT_FAILURE);
+		}
+		/* (fails harmlessly for pipes etc.) */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		files.push_back(fd);
+	}
+	return files;
+}
 
-	FILE* file = input_files.back();
-	assert(file != NULL);
+/**
+ * Ask the kernel to start reading the beginning of the
+ * next few input files, so that their data is in the
+ * page cache by the time we get to them, and the socket
+ * doesn't sit idle between files.
+ */
+static inline void prefetch_input(const std::deque<int>& files)
+{
+	for (size_t i = 1; i < files.size() && i <= SEND_PREFETCH_FILES; ++i)
+		posix_fadvise(files[i], 0, SEND_PREFETCH_SIZE,
+			POSIX_FADV_WILLNEED);
+}
+
+static inline void
+send_write_handler(evutil_socket_t socket, short event, void* arg)
+{
+	assert(arg != NULL);
+	SendState& state = *(SendState*)arg;
 
-	const int READ_SIZE = 1 * 1024 * 1024;
-	char buffer[READ_SIZE];
+	assert(!state.input_files.empty());
+	int file = state.input_files.front();
 
 	if (opt::verbose >= 3)
 		fprintf(stderr, "daemon socket ready for writing\n");
 
-	int n = fread(buffer, 1, READ_SIZE, file);
+	if (state.copier == NULL) {
+		state.copier = new FdCopier(file, socket);
+		prefetch_input(state.input_files);
+	}
+
+	ssize_t n = state.copier->copy();
+
+	// socket is full; wait until it is writable again
+	if (n < 0 && errno == EAGAIN)
+		return;
 
 	if (n < 0) {
-		perror("fread");
-		bufferevent_free(bev);
-		event_base_free(base);
+		if (errno == EPIPE || errno == ECONNRESET)
+			fprintf(stderr, "error: lost connection to daemon\n");
+		else
+			perror("send");
 		exit(EXIT_FAILURE);
 	}
 
 	if (n > 0) {
-		if (opt::verbose >= 3) {
-			fprintf(stderr, "read %d bytes from input\n", n);
-			fprintf(stderr, "writing %d bytes to daemon socket\n", n);
-		}
-		evbuffer_add(output, buffer, n);
+		if (opt::verbose >= 3)
+			fprintf(stderr, "wrote %ld bytes to daemon socket\n",
+				(long)n);
+		return;
 	}
 
 	// EOF
-	if (n == 0) {
-		fclose(file);
-		input_files.pop_back();
-		if (input_files.empty()) {
-			assert(evbuffer_get_length(output) == 0);
-			event_base_loopexit(base, NULL);
-		}
-	}
+	delete state.copier;
+	state.copier = NULL;
+	if (file != STDIN_FILENO)
+		close(file);
+	state.input_files.pop_front();
+	if (state.input_files.empty())
+		event_base_loopexit(state.base, NULL);
 }
 
 int cmd_send(int argc, char** argv)
@@ -94,9 +203,49 @@ int cmd_send(int argc, char** argv)
 		switch (c) {
 		  case '?':
 			die(SEND_USAGE_MESSAGE);
+		  case 'd':
+			opt::detach = 1;
+			break;
 		  case 'h':
 			std::cout << SEND_USAGE_MESSAGE;
 			return EXIT_SUCCESS;
+		  case 'm':
+			opt::shm = 1;
+			break;
+		  case 'P':
+			arg >> opt::parallel;
+			if (opt::parallel < 1 || opt::parallel > MAX_STRIPES)
+				arg.setstate(std::ios::failbit);
+			break;
+		  case 'p': {
+			std::string priority;
+			arg >> priority;
+			if (priority == "low")
+				opt::priority = 0;
+			else if (priority == "normal")
+				opt::priority = 1;
+			else if (priority == "high")
+				opt::priority = 2;
+			else
+				arg.setstate(std::ios::failbit);
+			break;
+		  }
+		  case 'R':
+			opt::remote = 1;
+			break;
+		  case 'r': {
+			std::string rate;
+			arg >> rate;
+			if (!parse_size(rate, opt::rate))
+				arg.setstate(std::ios::failbit);
+			break;
+		  }
+		  case 'S':
+			opt::viaSocket = 1;
+			break;
+		  case 't':
+			arg >> opt::tag;
+			break;
 		  case 'v':
 			opt::verbose++;
 			break;
@@ -120,48 +269,115 @@ int cmd_send(int argc, char** argv)
 	if (ss.fail() || !ss.eof())
 		die(SEND_USAGE_MESSAGE);
 
+	if (opt::parallel > 1 && (argc - optind != 1 ||
+		opt::shm || opt::viaSocket)) {
+		std::cerr << "error: --parallel needs a single file "
+			"argument, and can't be used with --shm or "
+			"--via-socket" << std::endl;
+		die(SEND_USAGE_MESSAGE);
+	}
+	if (opt::parallel > 1 && opt::rate != 0)
+		opt::rate = std::max((uint64_t)1, opt::rate / opt::parallel);
+
 	if (opt::verbose)
 		std::cerr << "connecting to daemon..."
 			<< std::endl;
 
-	int socket = UnixSocket::connect(opt::socketPath.c_str());
-
-	std::vector<FILE *> input_files;
+	SendState state;
+	std::deque<int>& input_files = state.input_files;
 
 	if (argc - optind == 0) {
-		input_files.push_back(stdin);
+		input_files.push_back(STDIN_FILENO);
 	} else {
-		for (int i = argc - 1; i >= optind; --i) {
-			FILE* file = fopen(argv[optind], "rb");
-			if (file == NULL)
-				perror("fopen");
-			input_files.push_back(file);
-		}
+		input_files = open_input_files(std::vector<const char*>(
+			argv + optind, argv + argc));
 	}
 
-	struct event_base* base = event_base_new();
-	assert(base != NULL);
+	// command for 'mpi init' daemon
+	std::ostringstream header;
+	header << "SEND " << rank;
+	if (opt::remote)
+		header << " REMOTE";
+	if (opt::tag != 0)
+		header << " TAG " << opt::tag;
+	if (opt::priority != 1)
+		header << " PRIORITY " << opt::priority;
+	if (opt::rate != 0)
+		header << " RATE " << opt::rate;
+	if (opt::detach)
+		header << " DETACH";
 
-	struct bufferevent* bev = bufferevent_socket_new(base,
-		socket, BEV_OPT_CLOSE_ON_FREE);
-	assert(bev != NULL);
+	if (opt::parallel > 1) {
+		// let the daemon send stripes of the file concurrently
+		int file = input_files.front();
+		struct stat st;
+		if (fstat(file, &st) < 0 || !S_ISREG(st.st_mode)) {
+			std::cerr << "error: --parallel needs a regular file"
+				<< std::endl;
+			exit(EXIT_FAILURE);
+		}
+		send_striped(file, header.str(), opt::detach);
+		close(file);
+		return 0;
+	}
 
-	bufferevent_setcb(bev, NULL, send_write_handler,
-		client_event_handler, (void*)&input_files);
-	bufferevent_setwatermark(bev, EV_READ, 0, MAX_BUFFER_SIZE);
-	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
 
-	struct evbuffer* output = bufferevent_get_output(bev);
-	assert(output != NULL);
+	bool header_sent = false;
+	if (opt::shm) {
+		// move our input through a shared-memory ring
+		ShmRing* ring = hand_off_ring(socket, header.str());
+		if (ring != NULL) {
+			shm_send(*ring, socket, std::vector<int>(
+				input_files.begin(), input_files.end()));
+			delete ring;
+			close(socket);
+			for (size_t i = 0; i < input_files.size(); ++i)
+				if (input_files[i] != STDIN_FILENO)
+					close(input_files[i]);
+			return 0;
+		}
+		header_sent = true;
+	} else if (input_files.size() == 1 &&
+		can_hand_off(input_files.front())) {
+		// let the daemon read our input directly
+		int file = input_files.front();
+		if (hand_off_fd(socket, header.str(), file)) {
+			if (opt::verbose)
+				std::cerr << "daemon is reading input directly"
+					<< std::endl;
+			if (!opt::detach)
+				wait_for_daemon(socket);
+			close(socket);
+			if (file != STDIN_FILENO)
+				close(file);
+			return 0;
+		}
+		header_sent = true;
+	}
 
 	// send command to 'mpi init' daemon
-	evbuffer_add_printf(output, "SEND %d\n", rank);
+	if (!header_sent)
+		write_all(socket, header.str() + "\n");
+
+	// a daemon that goes away shows up as EPIPE
+	signal(SIGPIPE, SIG_IGN);
+	evutil_make_socket_nonblocking(socket);
+
+	state.base = event_base_new();
+	assert(state.base != NULL);
+
+	struct event* ev = event_new(state.base, socket,
+		EV_WRITE|EV_PERSIST, send_write_handler, &state);
+	assert(ev != NULL);
+	event_add(ev, NULL);
 
 	// start libevent loop
-	event_base_dispatch(base);
+	event_base_dispatch(state.base);
 
-	bufferevent_free(bev);
-	event_base_free(base);
+	event_free(ev);
+	event_base_free(state.base);
+	close(socket);
 
 	return 0;
 }
@@ -0,0 +1,299 @@
+#ifndef _SEND_BATCH_H_
+#define _SEND_BATCH_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include "Command/client/mux.h"
+#include "Command/client/batch.h"
+#include <getopt.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char SEND_BATCH_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] send-batch [manifest]\n"
+"\n"
+"Description:\n"
+"\n"
+"   Send many files to other ranks of the current MPI job,\n"
+"   using a single stream per destination rank, and a\n"
+"   single connection to the daemon. Each line\n"
+"   of the manifest (or STDIN, if no manifest is given)\n"
+"   names a file to send, as tab-separated fields:\n"
+"\n"
+"      <rank>  <path>  [<name>]\n"
+"\n"
+"   <name> is the relative path that 'mpih recv-batch'\n"
+"   creates on the receiving side (default: the last\n"
+"   component of <path>). Blank lines and lines starting\n"
+"   with '#' are ignored.\n"
+"\n"
+"Options:\n"
+"\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n"
+"   -t,--tag N         MPI tag for the streams [0]. The\n"
+"                      receivers must use the same tag.\n";
+
+static const char send_batch_shortopts[] = "ht:v";
+
+static const struct option send_batch_longopts[] = {
+	{ "help",     no_argument, NULL, 'h' },
+	{ "tag",      required_argument, NULL, 't' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/** A file listed in the manifest */
+struct BatchFile
+{
+	std::string path;
+	/** name of the file on the receiving side */
+	std::string name;
+};
+
+/** Stream that carries the files for one destination rank */
+struct BatchStream
+{
+	/** stream number on the multiplexed daemon connection */
+	uint32_t id;
+	/** files still to be sent (current file first) */
+	std::deque<BatchFile> files;
+	/** frame header of the current file */
+	std::string header;
+	/** bytes of 'header' sent so far */
+	size_t header_pos;
+	/** current file (-1 between files) */
+	int fd;
+	/** bytes of the current file still to be sent */
+	uint64_t remaining;
+
+	BatchStream() : id(0), header_pos(0), fd(-1), remaining(0) {}
+};
+
+/**
+ * Read the manifest from 'in', grouping the files by
+ * destination rank (in the order listed).
+ */
+static inline std::map<int, std::deque<BatchFile> >
+read_batch_manifest(std::istream& in)
+{
+	std::map<int, std::deque<BatchFile> > files;
+	std::string line;
+	for (unsigned lineNum = 1; getline(in, line); ++lineNum) {
+		if (line.empty() || line[0] == '#')
+			continue;
+		std::istringstream fields(line);
+		std::string rankField;
+		BatchFile file;
+		std::getline(fields, rankField, '\t');
+		std::getline(fields, file.path, '\t');
+		std::getline(fields, file.name, '\t');
+		std::istringstream rankStream(rankField);
+		int rank;
+		rankStream >> rank;
+		if (file.name.empty())
+			file.name = file.path.substr(file.path.rfind('/') + 1);
+		if (rankStream.fail() || !rankStream.eof() || rank < 0 ||
+			file.path.empty() || !valid_batch_name(file.name)) {
+			std::cerr << "error: invalid manifest line " << lineNum
+				<< ": `" << line << "'" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		files[rank].push_back(file);
+	}
+	return files;
+}
+
+/** Open the next file of 'stream' and queue its frame header */
+static inline void start_batch_file(BatchStream& stream)
+{
+	const BatchFile& file = stream.files.front();
+	stream.fd = open(file.path.c_str(), O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (stream.fd < 0 || fstat(stream.fd, &st) < 0) {
+		perror(file.path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (!S_ISREG(st.st_mode)) {
+		std::cerr << "error: `" << file.path << "' is not a "
+			"regular file" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (opt::verbose >= 2)
+		std::cerr << "sending `" << file.path << "' ("
+			<< st.st_size << " bytes)" << std::endl;
+	stream.header = batch_header(st.st_size, file.name);
+	stream.header_pos = 0;
+	stream.remaining = st.st_size;
+}
+
+/**
+ * Pack the frame headers and data of the next files of
+ * 'stream' into 'buf', up to 'len' bytes.
+ *
+ * @return number of bytes packed (0 once all files are sent)
+ */
+static inline size_t fill_batch_buffer(BatchStream& stream,
+	char* buf, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		if (stream.fd < 0) {
+			if (stream.files.empty())
+				break;
+			start_batch_file(stream);
+		}
+		if (stream.header_pos < stream.header.size()) {
+			size_t n = std::min(len - pos,
+				stream.header.size() - stream.header_pos);
+			memcpy(buf + pos, stream.header.data() + stream.header_pos, n);
+			stream.header_pos += n;
+			pos += n;
+		} else if (stream.remaining > 0) {
+			ssize_t n = read(stream.fd, buf + pos,
+				std::min(stream.remaining, (uint64_t)(len - pos)));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror(stream.files.front().path.c_str());
+				exit(EXIT_FAILURE);
+			}
+			if (n == 0) {
+				std::cerr << "error: `" << stream.files.front().path
+					<< "' shrank while it was being sent" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			stream.remaining -= n;
+			pos += n;
+		} else {
+			// done with this file
+			close(stream.fd);
+			stream.fd = -1;
+			stream.files.pop_front();
+		}
+	}
+	return pos;
+}
+
+int cmd_send_batch(int argc, char** argv)
+{
+	for (int c; (c = getopt_long(argc, argv,
+		send_batch_shortopts, send_batch_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(SEND_BATCH_USAGE_MESSAGE);
+		  case 'h':
+			std::cout << SEND_BATCH_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 't':
+			arg >> opt::tag;
+			break;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi send-batch: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(SEND_BATCH_USAGE_MESSAGE);
+		}
+	}
+
+	if (argc - optind > 1)
+		die(SEND_BATCH_USAGE_MESSAGE);
+
+	std::map<int, std::deque<BatchFile> > files;
+	if (argc - optind == 1) {
+		std::ifstream manifest(argv[optind]);
+		if (!manifest) {
+			perror(argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+		files = read_batch_manifest(manifest);
+	} else {
+		files = read_batch_manifest(std::cin);
+	}
+
+	// a daemon that goes away shows up as EPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	// one stream per destination, all over one connection
+	MuxClient mux;
+	if (!mux.connect(opt::socketPath))
+		exit(EXIT_FAILURE);
+	std::deque<BatchStream> streams(files.size());
+	std::map<int, std::deque<BatchFile> >::iterator it = files.begin();
+	for (size_t i = 0; it != files.end(); ++it, ++i) {
+		BatchStream& stream = streams[i];
+		stream.files.swap(it->second);
+
+		std::ostringstream header;
+		header << "SEND " << it->first;
+		if (opt::tag != 0)
+			header << " TAG " << opt::tag;
+		stream.id = mux.open(header.str());
+		if (stream.id == 0)
+			exit(EXIT_FAILURE);
+
+		if (opt::verbose)
+			std::cerr << "sending " << stream.files.size()
+				<< " files to rank " << it->first << std::endl;
+	}
+
+	/*
+	 * Take turns sending a frame's worth of files on each
+	 * stream that has credit. Once every stream is waiting
+	 * for credit, wait for the daemon to grant more.
+	 */
+	std::vector<char> buf(MUX_MAX_PAYLOAD);
+	std::vector<bool> done(streams.size(), false);
+	size_t open = streams.size();
+	while (open > 0) {
+		bool progress = false;
+		for (size_t i = 0; i < streams.size(); ++i) {
+			BatchStream& stream = streams[i];
+			uint64_t credit = mux.credit(stream.id);
+			if (done[i] || credit == 0)
+				continue;
+			size_t n = fill_batch_buffer(stream, buf.data(),
+				std::min(credit, (uint64_t)buf.size()));
+			if (n > 0) {
+				if (!mux.write(stream.id, buf.data(), n))
+					exit(EXIT_FAILURE);
+			} else {
+				if (!mux.end(stream.id))
+					exit(EXIT_FAILURE);
+				done[i] = true;
+				--open;
+			}
+			progress = true;
+		}
+		if (!progress && !mux.readFrame())
+			exit(EXIT_FAILURE);
+	}
+
+	// wait until the daemon has taken all of the data
+	for (size_t i = 0; i < streams.size(); ++i)
+		while (!mux.ended(streams[i].id))
+			if (!mux.readFrame())
+				exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef _SEND_DIR_H_
+#define _SEND_DIR_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/handoff.h"
+#include "Command/client/FdCopier.h"
+#include "Command/client/stripe.h"
+#include "Command/client/dirindex.h"
+#include <getopt.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static const char SEND_DIR_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] send-dir <rank> <dir>\n"
+"\n"
+"Description:\n"
+"\n"
+"   Send directory tree <dir> to <rank> of the current MPI\n"
+"   job, which receives it with 'mpih recv-dir'. Directories,\n"
+"   regular files and symlinks are sent, with their\n"
+"   permissions and modification times.\n"
+"\n"
+"   Small files are packed into a single stream. Large files\n"
+"   are split into chunks, which are sent over several\n"
+"   streams at once and written in place by the receiver.\n"
+"\n"
+"Options:\n"
+"\n"
+"   -P,--parallel N    number of streams to use, between 1\n"
+"                      and 16 [4]\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n"
+"   -t,--tag N         MPI tag for the transfer [0]. The\n"
+"                      receiver must use the same tag.\n";
+
+static const char send_dir_shortopts[] = "hP:t:v";
+
+static const struct option send_dir_longopts[] = {
+	{ "help",     no_argument, NULL, 'h' },
+	{ "parallel", required_argument, NULL, 'P' },
+	{ "tag",      required_argument, NULL, 't' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/** default number of streams for 'mpih send-dir' */
+static const int SEND_DIR_DEFAULT_LANES = 4;
+
+/** number of upcoming small files to read ahead */
+static const size_t SEND_DIR_PREFETCH_FILES = 16;
+
+/**
+ * Send the chunks of one lane, one stream after another.
+ * Runs in a child process, one per lane.
+ */
+static inline void send_dir_lane(const std::string& top,
+	const DirIndex& index, const std::vector<DirChunk>& chunks,
+	const std::string& header, int lane)
+{
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		const DirChunk& chunk = chunks[i];
+		std::string path = top + "/" + index.entries[chunk.entry].name;
+		int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		int s = send_stripe(fd, header, lane, chunk.offset, chunk.length);
+		close(fd);
+		wait_for_daemon(s);
+		close(s);
+	}
+}
+
+/**
+ * Ask the kernel to read the small files that follow
+ * entry 'i' ahead, while we are sending the current one.
+ */
+static inline void prefetch_packed(const std::string& top,
+	const DirIndex& index, size_t i)
+{
+	size_t count = 0;
+	for (++i; i < index.entries.size() &&
+		count < SEND_DIR_PREFETCH_FILES; ++i) {
+		const DirEntry& entry = index.entries[i];
+		if (!dir_entry_packed(index, entry) || entry.size == 0)
+			continue;
+		std::string path = top + "/" + entry.name;
+		int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, entry.size, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+		count++;
+	}
+}
+
+/** Send the index and the small files over lane 0 */
+static inline void send_dir_packed(const std::string& top,
+	const DirIndex& index, const std::string& header)
+{
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
+	write_all(socket, header + "\n");
+
+	std::string encoded = encode_dir_index(index);
+	std::string length;
+	put_le(length, encoded.size(), 8);
+	write_all(socket, length + encoded);
+
+	size_t packed = 0;
+	for (size_t i = 0; i < index.entries.size(); ++i) {
+		const DirEntry& entry = index.entries[i];
+		if (!dir_entry_packed(index, entry))
+			continue;
+		if (packed++ % SEND_DIR_PREFETCH_FILES == 0)
+			prefetch_packed(top, index, i);
+		std::string path = top + "/" + entry.name;
+		int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		FdCopier copier(fd, socket);
+		for (uint64_t remaining = entry.size; remaining > 0;) {
+			ssize_t n = copier.copy(std::min(remaining,
+				(uint64_t)FD_COPY_SIZE));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				if (errno == EPIPE || errno == ECONNRESET)
+					fprintf(stderr, "error: lost connection to daemon\n");
+				else
+					perror(path.c_str());
+				exit(EXIT_FAILURE);
+			}
+			if (n == 0) {
+				std::cerr << "error: `" << path << "' shrank while it "
+					"was being sent" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			remaining -= n;
+		}
+		close(fd);
+	}
+	close(socket);
+}
+
+int cmd_send_dir(int argc, char** argv)
+{
+	opt::parallel = SEND_DIR_DEFAULT_LANES;
+
+	for (int c; (c = getopt_long(argc, argv,
+		send_dir_shortopts, send_dir_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(SEND_DIR_USAGE_MESSAGE);
+		  case 'h':
+			std::cout << SEND_DIR_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 'P':
+			arg >> opt::parallel;
+			break;
+		  case 't':
+			arg >> opt::tag;
+			break;
+		  case 'v':
+			opt::verbose++;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi send-dir: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(SEND_DIR_USAGE_MESSAGE);
+		}
+	}
+
+	if (argc - optind != 2)
+		die(SEND_DIR_USAGE_MESSAGE);
+
+	if (opt::parallel < 1 || opt::parallel > MAX_STRIPES) {
+		std::cerr << "error: --parallel must be between 1 and "
+			<< MAX_STRIPES << std::endl;
+		die(SEND_DIR_USAGE_MESSAGE);
+	}
+
+	int rank;
+	std::stringstream ss(argv[optind++]);
+	ss >> rank;
+	if (ss.fail() || !ss.eof())
+		die(SEND_DIR_USAGE_MESSAGE);
+
+	std::string top = argv[optind++];
+	DirIndex index;
+	index.lanes = opt::parallel;
+	if (!walk_dir(top, "", index)) {
+		perror(top.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt::verbose)
+		std::cerr << "sending " << index.entries.size()
+			<< " entries over " << index.lanes << " streams"
+			<< std::endl;
+
+	std::ostringstream header;
+	header << "SEND " << rank;
+	if (opt::tag != 0)
+		header << " TAG " << opt::tag;
+
+	// send the chunks of large files in parallel
+	std::vector<std::vector<DirChunk> > lanes = dir_chunks(index);
+	std::vector<pid_t> children;
+	for (size_t i = 1; i < lanes.size(); ++i) {
+		if (lanes[i].empty())
+			continue;
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			send_dir_lane(top, index, lanes[i], header.str(), i);
+			_exit(EXIT_SUCCESS);
+		}
+		children.push_back(pid);
+	}
+
+	send_dir_packed(top, index, header.str());
+
+	int exitStatus = EXIT_SUCCESS;
+	for (size_t i = 0; i < children.size(); ++i) {
+		int status;
+		if (waitpid(children[i], &status, 0) < 0 ||
+			!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exitStatus = EXIT_FAILURE;
+	}
+
+	return exitStatus;
+}
+
+#endif
@@ -52,7 +52,7 @@ static inline int query_size()
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
 	// send command to 'mpi init' daemon
-	evbuffer_add_printf(bufferevent_get_output(bev), "SIZE\n");
+	send_binary_request(bev, OP_SIZE);
 
 	event_base_dispatch(base);
 	bufferevent_free(bev);
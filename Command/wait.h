@@ -0,0 +1,99 @@
+#ifndef _MPIH_WAIT_H_
+#define _MPIH_WAIT_H_
+
+#include "config.h"
+#include "Options/CommonOptions.h"
+#include "IO/IOUtil.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/event_handlers.h"
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+static const char WAIT_USAGE_MESSAGE[] =
+"Usage: " PROGRAM_NAME " [--socket <path>] wait\n"
+"\n"
+"Description:\n"
+"\n"
+"   Wait for all 'mpih send --detach' transfers\n"
+"   from the current MPI rank to complete.\n"
+"\n"
+"Options:\n"
+"\n"
+"   -s,--socket PATH   connect to 'mpi init' daemon\n"
+"                      through Unix socket at PATH\n";
+
+static const char wait_shortopts[] = "hv";
+
+static const struct option wait_longopts[] = {
+	{ "help",     no_argument, NULL, 'h' },
+	{ "verbose",  no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * Block until the daemon reports that all detached
+ * sends have completed. The daemon signals this by
+ * closing the connection.
+ */
+static inline void wait_for_detached_sends()
+{
+	int socket = UnixSocket::connect(opt::socketPath.c_str());
+
+	if (opt::verbose)
+		std::cerr << "Connected." << std::endl;
+
+	struct event_base* base = event_base_new();
+	assert(base != NULL);
+
+	struct bufferevent* bev = bufferevent_socket_new(base,
+		socket, BEV_OPT_CLOSE_ON_FREE);
+	assert(bev != NULL);
+
+	bufferevent_setcb(bev, NULL, NULL,
+		client_event_handler, NULL);
+	bufferevent_setwatermark(bev, EV_READ, 0, 0);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	// send command to 'mpi init' daemon
+	send_binary_request(bev, OP_WAIT);
+
+	event_base_dispatch(base);
+	event_base_free(base);
+}
+
+int cmd_wait(int argc, char** argv)
+{
+	for (int c; (c = getopt_long(argc, argv,
+		wait_shortopts, wait_longopts, NULL)) != -1;) {
+		std::istringstream arg(optarg != NULL ? optarg : "");
+		switch (c) {
+		  case '?':
+			die(WAIT_USAGE_MESSAGE);
+		  case 'h':
+			std::cout << WAIT_USAGE_MESSAGE;
+			return EXIT_SUCCESS;
+		  case 'v':
+			arg >> opt::verbose;
+			break;
+		}
+		if (optarg != NULL && (!arg.eof() || arg.fail())) {
+			std::cerr << "mpi wait: invalid option: `-"
+				<< (char)c << optarg << "'\n";
+			die(WAIT_USAGE_MESSAGE);
+		}
+	}
+
+	if (opt::verbose)
+		std::cerr << "Connecting to 'mpih init' process..."
+			<< std::endl;
+
+	wait_for_detached_sends();
+
+	return 0;
+}
+
+#endif
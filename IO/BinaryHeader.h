@@ -0,0 +1,178 @@
+#ifndef _BINARY_HEADER_H_
+#define _BINARY_HEADER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Besides text header lines ("RANK\n", "SEND 1 TAG 2\n"),
+ * the daemon accepts fixed-size binary requests. A binary
+ * request starts with BINARY_HEADER_MAGIC, which can't
+ * start a text header, so both kinds of clients can talk
+ * to the same daemon:
+ *
+ *    offset  size  field
+ *         0     1  magic (BINARY_HEADER_MAGIC)
+ *         1     1  version (BINARY_HEADER_VERSION)
+ *         2     1  opcode (HeaderOpcode)
+ *         3     1  flags (BINARY_FLAG_*)
+ *         4     1  priority class (SEND; 1 = normal)
+ *         5     3  reserved (0)
+ *         8     4  rank (SEND/RECV)
+ *        12     4  MPI tag
+ *        16     4  stripe number, or -1
+ *        20     4  reserved (0)
+ *        24     8  max rate, bytes/sec (SEND; 0 = unlimited)
+ *        32     8  offset of the file range (SEND stripe)
+ *        40     8  length of the file range (SEND stripe)
+ *
+ * Integers are little-endian. The daemon answers a binary
+ * request with binary replies:
+ *
+ *    offset  size  field
+ *         0     1  magic (BINARY_HEADER_MAGIC)
+ *         1     1  reply code (HeaderReply)
+ *         2     2  reserved (0)
+ *         4     4  value (REPLY_VALUE, e.g. our rank)
+ *
+ * and with the text reply (e.g. "NOFD\n", "0\n") otherwise.
+ * Stream data follows the request just as it follows a
+ * text header line.
+ */
+
+static const unsigned char BINARY_HEADER_MAGIC = 0xb1;
+static const unsigned char BINARY_HEADER_VERSION = 1;
+
+/** size of a binary request (bytes) */
+static const size_t BINARY_REQUEST_SIZE = 48;
+
+/** size of a binary reply (bytes) */
+static const size_t BINARY_REPLY_SIZE = 8;
+
+enum HeaderOpcode {
+	OP_NONE = 0,
+	OP_RANK,
+	OP_SIZE,
+	OP_SEND,
+	OP_RECV,
+	OP_MUX,
+	OP_WAIT,
+	OP_FINALIZE,
+	/* (text only: 'mpih open-port'/'connect-port') */
+	OP_ACCEPT,
+	OP_CONNECT,
+	NUM_OPCODES
+};
+
+/** 'mpih send --detach' ("DETACH") */
+static const unsigned char BINARY_FLAG_DETACH = 1 << 0;
+/** client will hand over a file descriptor ("FD") */
+static const unsigned char BINARY_FLAG_FD = 1 << 1;
+/** client will hand over a shared-memory ring ("SHM") */
+static const unsigned char BINARY_FLAG_SHM = 1 << 2;
+/** the request has a file range ("RANGE <offset> <length>") */
+static const unsigned char BINARY_FLAG_RANGE = 1 << 3;
+
+enum HeaderReply {
+	REPLY_OK = 0,
+	REPLY_FD,
+	REPLY_NOFD,
+	REPLY_SHM,
+	REPLY_NOSHM,
+	REPLY_VALUE
+};
+
+/** A binary request, decoded */
+struct BinaryRequest
+{
+	unsigned char version;
+	unsigned char opcode;
+	unsigned char flags;
+	unsigned char priority;
+	int32_t rank;
+	int32_t tag;
+	int32_t stripe;
+	uint64_t rate;
+	int64_t rangeOffset;
+	uint64_t rangeLength;
+
+	BinaryRequest() : version(BINARY_HEADER_VERSION), opcode(OP_NONE),
+		flags(0), priority(1), rank(0), tag(0), stripe(-1), rate(0),
+		rangeOffset(0), rangeLength(0) {}
+};
+
+static inline void put_header_le(char* p, uint64_t value, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		p[i] = (char)(value >> (8 * i));
+}
+
+static inline uint64_t get_header_le(const char* p, size_t size)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; ++i)
+		value |= (uint64_t)(unsigned char)p[i] << (8 * i);
+	return value;
+}
+
+/** Write 'request' to 'buf' (BINARY_REQUEST_SIZE bytes) */
+static inline void encode_binary_request(char* buf,
+	const BinaryRequest& request)
+{
+	memset(buf, 0, BINARY_REQUEST_SIZE);
+	buf[0] = (char)BINARY_HEADER_MAGIC;
+	buf[1] = (char)request.version;
+	buf[2] = (char)request.opcode;
+	buf[3] = (char)request.flags;
+	buf[4] = (char)request.priority;
+	put_header_le(buf + 8, (uint32_t)request.rank, 4);
+	put_header_le(buf + 12, (uint32_t)request.tag, 4);
+	put_header_le(buf + 16, (uint32_t)request.stripe, 4);
+	put_header_le(buf + 24, request.rate, 8);
+	put_header_le(buf + 32, (uint64_t)request.rangeOffset, 8);
+	put_header_le(buf + 40, request.rangeLength, 8);
+}
+
+/** Decode the request in 'buf' (BINARY_REQUEST_SIZE bytes) */
+static inline BinaryRequest decode_binary_request(const char* buf)
+{
+	BinaryRequest request;
+	request.version = (unsigned char)buf[1];
+	request.opcode = (unsigned char)buf[2];
+	request.flags = (unsigned char)buf[3];
+	request.priority = (unsigned char)buf[4];
+	request.rank = (int32_t)get_header_le(buf + 8, 4);
+	request.tag = (int32_t)get_header_le(buf + 12, 4);
+	request.stripe = (int32_t)get_header_le(buf + 16, 4);
+	request.rate = get_header_le(buf + 24, 8);
+	request.rangeOffset = (int64_t)get_header_le(buf + 32, 8);
+	request.rangeLength = get_header_le(buf + 40, 8);
+	return request;
+}
+
+/** Write a reply to 'buf' (BINARY_REPLY_SIZE bytes) */
+static inline void encode_binary_reply(char* buf, HeaderReply code,
+	int32_t value)
+{
+	memset(buf, 0, BINARY_REPLY_SIZE);
+	buf[0] = (char)BINARY_HEADER_MAGIC;
+	buf[1] = (char)code;
+	put_header_le(buf + 4, (uint32_t)value, 4);
+}
+
+/**
+ * Decode the reply in 'buf' (BINARY_REPLY_SIZE bytes).
+ * @return false if it is not a binary reply
+ */
+static inline bool decode_binary_reply(const char* buf,
+	HeaderReply& code, int32_t& value)
+{
+	if ((unsigned char)buf[0] != BINARY_HEADER_MAGIC)
+		return false;
+	code = (HeaderReply)(unsigned char)buf[1];
+	value = (int32_t)get_header_le(buf + 4, 4);
+	return true;
+}
+
+#endif
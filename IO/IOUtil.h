@@ -4,6 +4,9 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <cctype>
+#include <stdint.h>
 
 /** Print an error message and exit if stream is not good. */
 static inline void assert_good(const std::ios& stream,
@@ -16,6 +19,29 @@ static inline void assert_good(const std::ios& stream,
 	}
 }
 
+/**
+ * Parse a byte count with an optional K, M, or G
+ * suffix (powers of 1024), e.g. "10M".
+ * @return true on success
+ */
+static inline bool parse_size(const std::string& str, uint64_t& size)
+{
+	std::istringstream in(str);
+	in >> size;
+	if (in.fail())
+		return false;
+	char suffix;
+	if (!(in >> suffix))
+		return true;
+	switch (toupper(suffix)) {
+	  case 'K': size <<= 10; break;
+	  case 'M': size <<= 20; break;
+	  case 'G': size <<= 30; break;
+	  default: return false;
+	}
+	return in.peek() == EOF;
+}
+
 static inline void die(const char* msg) {
 	std::cerr << msg;
 	exit(EXIT_FAILURE);
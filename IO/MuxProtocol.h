@@ -0,0 +1,93 @@
+#ifndef _MUX_PROTOCOL_H_
+#define _MUX_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * A client can carry many SEND/RECV/RANK/... streams over
+ * one daemon connection, by starting it with a "MUX"
+ * header:
+ *
+ *    client: MUX
+ *    daemon: OK
+ *
+ * after which both sides only exchange frames:
+ *
+ *    <type: u8> <stream: u32> <length: u32> <payload>
+ *
+ * (integers are little-endian). Each logical stream
+ * carries exactly what a client connection of its own
+ * would: a header line (e.g. "SEND 1 TAG 2"), then data.
+ *
+ *    OPEN    client starts stream <stream> (no payload)
+ *    DATA    stream bytes
+ *    END     no more DATA from this side. The daemon sends
+ *            it once it is done with the stream (as it would
+ *            close a connection of its own), after which the
+ *            client may reuse the stream number.
+ *    CREDIT  lets the other side send <u32 payload> more
+ *            bytes of DATA on the stream
+ *
+ * Each side may send MUX_WINDOW bytes of DATA on a new
+ * stream before it is granted more CREDIT. Descriptor
+ * passing ("FD"/"SHM") is not available on multiplexed
+ * streams.
+ */
+
+enum MuxFrameType {
+	MUX_OPEN = 1,
+	MUX_DATA,
+	MUX_END,
+	MUX_CREDIT
+};
+
+/** size of a frame header (bytes) */
+static const size_t MUX_HEADER_SIZE = 9;
+
+/** max payload of a frame (bytes) */
+static const uint32_t MUX_MAX_PAYLOAD = 256 * 1024;
+
+/** DATA each side may send on a new stream, before CREDIT (bytes) */
+static const uint32_t MUX_WINDOW = 4 * 1024 * 1024;
+
+struct MuxFrameHeader
+{
+	uint8_t type;
+	uint32_t stream;
+	uint32_t length;
+};
+
+static inline void put_mux_u32(char* p, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = (char)(value >> (8 * i));
+}
+
+static inline uint32_t get_mux_u32(const char* p)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i)
+		value |= (uint32_t)(unsigned char)p[i] << (8 * i);
+	return value;
+}
+
+/** Write the header of a frame to 'buf' (MUX_HEADER_SIZE bytes) */
+static inline void encode_mux_header(char* buf, uint8_t type,
+	uint32_t stream, uint32_t length)
+{
+	buf[0] = (char)type;
+	put_mux_u32(buf + 1, stream);
+	put_mux_u32(buf + 5, length);
+}
+
+static inline MuxFrameHeader decode_mux_header(const char* buf)
+{
+	MuxFrameHeader header;
+	header.type = (uint8_t)buf[0];
+	header.stream = get_mux_u32(buf + 1);
+	header.length = get_mux_u32(buf + 5);
+	return header;
+}
+
+#endif
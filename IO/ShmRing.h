@@ -0,0 +1,325 @@
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+/** identifies a mapping as an ShmRing ("mpihring") */
+static const uint64_t SHM_RING_MAGIC = 0x676e69726869706dULL;
+
+/**
+ * Shared state at the start of an ShmRing. The producer
+ * and consumer each write to their own cache line.
+ */
+struct ShmRingHeader
+{
+	uint64_t magic;
+	/** capacity of the data area (bytes) */
+	uint64_t size;
+	/** total bytes published by the producer */
+	alignas(64) std::atomic<uint64_t> head;
+	/** bytes the consumer is waiting for (0 if not waiting) */
+	std::atomic<uint64_t> readerWaiting;
+	/** total bytes released by the consumer */
+	alignas(64) std::atomic<uint64_t> tail;
+	/** free bytes the producer is waiting for (0 if not waiting) */
+	std::atomic<uint64_t> writerWaiting;
+};
+
+/**
+ * A single-producer/single-consumer byte ring in a memfd,
+ * shared between an mpih client and the daemon.
+ *
+ * The data area is mapped twice, back to back, so that
+ * any run of up to size() bytes starting in the ring is
+ * contiguous in memory. This lets the daemon post MPI
+ * sends/receives directly on ring memory, and lets the
+ * client read()/write() its input/output straight into
+ * the ring.
+ *
+ * Each side sleeps on an eventfd "doorbell", which the
+ * other side only rings when the sleeper has asked for it
+ * with armReader()/armWriter(), so a busy stream costs no
+ * wakeup syscalls.
+ */
+class ShmRing
+{
+public:
+
+	/** descriptors that are passed between processes */
+	enum { MEM_FD = 0, READER_BELL, WRITER_BELL, NUM_FDS };
+
+	/**
+	 * Create a new ring holding 'size' bytes (a multiple
+	 * of the page size).
+	 *
+	 * @return NULL on failure (with errno set)
+	 */
+	static ShmRing* create(size_t size)
+	{
+		int fds[NUM_FDS] = { -1, -1, -1 };
+		if (size == 0 || size % pageSize() != 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+		fds[MEM_FD] = memfd_create("mpih-ring", MFD_CLOEXEC);
+		fds[READER_BELL] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+		fds[WRITER_BELL] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+		if (fds[MEM_FD] < 0 || fds[READER_BELL] < 0 ||
+			fds[WRITER_BELL] < 0 ||
+			ftruncate(fds[MEM_FD], pageSize() + size) < 0) {
+			closeAll(fds);
+			return NULL;
+		}
+		ShmRing* ring = map(fds, size);
+		if (ring == NULL)
+			return NULL;
+		ring->m_header->magic = SHM_RING_MAGIC;
+		ring->m_header->size = size;
+		return ring;
+	}
+
+	/**
+	 * Map a ring created by another process. Takes
+	 * ownership of 'fds' (closed on failure).
+	 *
+	 * @return NULL if 'fds' don't describe a valid ring
+	 */
+	static ShmRing* attach(const int* fds)
+	{
+		struct stat st;
+		if (fstat(fds[MEM_FD], &st) < 0 ||
+			(size_t)st.st_size <= pageSize() ||
+			(st.st_size - pageSize()) % pageSize() != 0) {
+			closeAll(fds);
+			return NULL;
+		}
+		size_t size = st.st_size - pageSize();
+		ShmRing* ring = map(fds, size);
+		if (ring == NULL)
+			return NULL;
+		if (ring->m_header->magic != SHM_RING_MAGIC ||
+			ring->m_header->size != size) {
+			delete ring;
+			return NULL;
+		}
+		return ring;
+	}
+
+	~ShmRing()
+	{
+		munmap(m_base, pageSize() + 2 * m_size);
+		closeAll(m_fds);
+	}
+
+	/** descriptors to pass to the other process (NUM_FDS) */
+	const int* fds() const
+	{
+		return m_fds;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	/** doorbell that wakes the consumer */
+	int readerBell() const
+	{
+		return m_fds[READER_BELL];
+	}
+
+	/** doorbell that wakes the producer */
+	int writerBell() const
+	{
+		return m_fds[WRITER_BELL];
+	}
+
+	/** Consume the rings of doorbell 'fd' */
+	static void clearBell(int fd)
+	{
+		eventfd_t value;
+		eventfd_read(fd, &value);
+	}
+
+	/*
+	 * consumer side
+	 */
+
+	/** bytes published but not yet released */
+	size_t readable() const
+	{
+		return m_header->head.load() -
+			m_header->tail.load(std::memory_order_relaxed);
+	}
+
+	/** start of the readable bytes (contiguous) */
+	char* readPtr() const
+	{
+		return m_data + m_header->tail.load(
+			std::memory_order_relaxed) % m_size;
+	}
+
+	/** Give the first 'len' readable bytes back to the producer */
+	void release(size_t len)
+	{
+		assert(len <= readable());
+		m_header->tail.store(m_header->tail.load(
+			std::memory_order_relaxed) + len);
+		ring(m_header->writerWaiting, m_fds[WRITER_BELL], writable());
+	}
+
+	/**
+	 * Ask the producer to ring the reader doorbell once
+	 * at least 'len' bytes are readable.
+	 *
+	 * @return true if 'len' bytes are already readable (no
+	 * need to wait for the doorbell)
+	 */
+	bool armReader(size_t len = 1)
+	{
+		assert(len > 0 && len <= m_size);
+		return arm(m_header->readerWaiting, len, true);
+	}
+
+	/*
+	 * producer side
+	 */
+
+	/** free space in the ring (bytes) */
+	size_t writable() const
+	{
+		return m_size - (m_header->head.load(
+			std::memory_order_relaxed) - m_header->tail.load());
+	}
+
+	/** start of the free space (contiguous) */
+	char* writePtr() const
+	{
+		return m_data + m_header->head.load(
+			std::memory_order_relaxed) % m_size;
+	}
+
+	/** Make the first 'len' bytes at writePtr() readable */
+	void publish(size_t len)
+	{
+		assert(len <= writable());
+		m_header->head.store(m_header->head.load(
+			std::memory_order_relaxed) + len);
+		ring(m_header->readerWaiting, m_fds[READER_BELL], readable());
+	}
+
+	/**
+	 * Ask the consumer to ring the writer doorbell once
+	 * at least 'len' bytes are free.
+	 *
+	 * @return true if 'len' bytes are already writable (no
+	 * need to wait for the doorbell)
+	 */
+	bool armWriter(size_t len)
+	{
+		assert(len > 0 && len <= m_size);
+		return arm(m_header->writerWaiting, len, false);
+	}
+
+private:
+
+	ShmRing(const int* fds, char* base, size_t size) :
+		m_base(base), m_size(size)
+	{
+		for (int i = 0; i < NUM_FDS; ++i)
+			m_fds[i] = fds[i];
+		m_header = (ShmRingHeader*)base;
+		m_data = base + pageSize();
+	}
+
+	static size_t pageSize()
+	{
+		return sysconf(_SC_PAGESIZE);
+	}
+
+	static void closeAll(const int* fds)
+	{
+		for (int i = 0; i < NUM_FDS; ++i)
+			if (fds[i] >= 0)
+				close(fds[i]);
+	}
+
+	/** Map the header page, followed by the data area twice */
+	static ShmRing* map(const int* fds, size_t size)
+	{
+		size_t header = pageSize();
+		char* base = (char*)mmap(NULL, header + 2 * size, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			closeAll(fds);
+			return NULL;
+		}
+		int prot = PROT_READ|PROT_WRITE;
+		int flags = MAP_SHARED|MAP_FIXED;
+		if (mmap(base, header, prot, flags, fds[MEM_FD], 0)
+				== MAP_FAILED ||
+			mmap(base + header, size, prot, flags, fds[MEM_FD],
+				header) == MAP_FAILED ||
+			mmap(base + header + size, size, prot, flags,
+				fds[MEM_FD], header) == MAP_FAILED) {
+			int saved = errno;
+			munmap(base, header + 2 * size);
+			closeAll(fds);
+			errno = saved;
+			return NULL;
+		}
+		return new ShmRing(fds, base, size);
+	}
+
+	/**
+	 * Set a waiting flag, then check whether we still need
+	 * to wait. Pairs with ring(): the seq_cst store/load
+	 * order guarantees that either we see the other side's
+	 * update, or it sees our flag.
+	 */
+	bool arm(std::atomic<uint64_t>& waiting, size_t len, bool reader)
+	{
+		waiting.store(len);
+		bool ready = reader ? readable() >= len : writable() >= len;
+		if (ready)
+			waiting.store(0, std::memory_order_relaxed);
+		return ready;
+	}
+
+	/**
+	 * Ring a doorbell if the other side is waiting for no
+	 * more than 'available' bytes
+	 */
+	static void ring(std::atomic<uint64_t>& waiting, int bell,
+		size_t available)
+	{
+		uint64_t wanted = waiting.load();
+		if (wanted != 0 && wanted <= available &&
+			waiting.exchange(0) != 0)
+			eventfd_write(bell, 1);
+	}
+
+	/* disable copy constructor and assignment operator */
+	ShmRing(const ShmRing&);
+	void operator=(const ShmRing&);
+
+	/** memfd and doorbells */
+	int m_fds[NUM_FDS];
+	/** start of our mapping */
+	char* m_base;
+	/** capacity of the data area (bytes) */
+	size_t m_size;
+	ShmRingHeader* m_header;
+	/** first of the two mappings of the data area */
+	char* m_data;
+};
+
+#endif
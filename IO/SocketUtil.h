@@ -3,8 +3,22 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 #include <event2/event.h>
 
+/**
+ * How long a listener stops accepting connections after
+ * running out of file descriptors (microseconds). Pending
+ * clients wait in the listen backlog meanwhile.
+ */
+static const long ACCEPT_BACKOFF = 100000;
+
 namespace UnixSocket
 {
 	static inline int open(bool blocking = true)
@@ -19,11 +33,14 @@ namespace UnixSocket
 		return s;
 	}
 
+	/**
+	 * @param backlog max number of connections waiting to
+	 * be accepted (the kernel caps this at
+	 * /proc/sys/net/core/somaxconn)
+	 */
 	static inline int listen(const char* socketPath,
-		bool blocking = true)
+		bool blocking = true, int backlog = SOMAXCONN)
 	{
-		const int MAX_CONNECTIONS = 16;
-
 		int s = open(blocking);
 
 		struct sockaddr_un local;
@@ -37,7 +54,7 @@ namespace UnixSocket
 			exit(EXIT_FAILURE);
 		}
 
-		if (::listen(s, MAX_CONNECTIONS) == -1) {
+		if (::listen(s, backlog) == -1) {
 			perror("listen");
 			exit(EXIT_FAILURE);
 		}
@@ -63,20 +80,144 @@ namespace UnixSocket
 		return s;
 	}
 
+	/**
+	 * Accept a connection on 'socket_fd', if there is one.
+	 * The new socket is close-on-exec.
+	 *
+	 * @return -1 on error (with errno set), e.g. EAGAIN if
+	 * a non-blocking 'socket_fd' has no connection waiting
+	 */
 	static inline int accept(int socket_fd, bool blocking = true)
 	{
 		int s;
-		struct sockaddr_un remote;
-		socklen_t t = sizeof(remote);
-		if ((s = accept(socket_fd, (struct sockaddr *)&remote,
-			 &t)) == -1) {
-			perror("accept");
-			exit(EXIT_FAILURE);
-		}
-		if (!blocking)
-			evutil_make_socket_nonblocking(s);
+		int flags = SOCK_CLOEXEC | (blocking ? 0 : SOCK_NONBLOCK);
+		while ((s = accept4(socket_fd, NULL, NULL, flags)) == -1 &&
+			errno == EINTR)
+			;
 		return s;
 	}
+
+	/**
+	 * True if accept() failed for lack of file descriptors
+	 * or memory, rather than because of the client (which
+	 * will still be waiting when we try again)
+	 */
+	static inline bool out_of_resources(int error)
+	{
+		return error == EMFILE || error == ENFILE ||
+			error == ENOBUFS || error == ENOMEM;
+	}
+
+	/**
+	 * Set the kernel buffer sizes of 'socket' (bytes). The
+	 * kernel caps these at /proc/sys/net/core/{w,r}mem_max.
+	 */
+	static inline void set_buffer_size(int socket, int size)
+	{
+		setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+
+	/**
+	 * Pass copies of the 'count' file descriptors in 'fds'
+	 * to the process at the other end of 'socket'
+	 * (SCM_RIGHTS). The descriptors travel with a single
+	 * dummy data byte.
+	 *
+	 * @return false on error (with errno set)
+	 */
+	static inline bool send_fds(int socket, const int* fds, int count)
+	{
+		char byte = 0;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+
+		std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control[0];
+		msg.msg_controllen = control.size();
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+		return sendmsg(socket, &msg, MSG_NOSIGNAL) == 1;
+	}
+
+	/** Pass a copy of file descriptor 'fd' (see send_fds()) */
+	static inline bool send_fd(int socket, int fd)
+	{
+		return send_fds(socket, &fd, 1);
+	}
+
+	/**
+	 * Receive exactly 'count' file descriptors sent with
+	 * send_fds(), and store them in 'fds'.
+	 *
+	 * @return false if the peer closed the socket or sent
+	 * a different number of descriptors, or more than fit
+	 * (any that did arrive are closed)
+	 */
+	static inline bool recv_fds(int socket, int* fds, int count)
+	{
+		char byte;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+
+		std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control[0];
+		msg.msg_controllen = control.size();
+
+		if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1)
+			return false;
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS)
+			return false;
+
+		/*
+		 * (CMSG_SPACE() padding may leave room for more
+		 * descriptors than we asked for, so a misbehaving
+		 * peer can't be trusted to fill exactly 'count')
+		 */
+		int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const unsigned char* data = CMSG_DATA(cmsg);
+		if (received != count || (msg.msg_flags & MSG_CTRUNC)) {
+			for (int i = 0; i < received; ++i) {
+				int fd;
+				memcpy(&fd, data + i * sizeof(int), sizeof(int));
+				close(fd);
+			}
+			return false;
+		}
+		memcpy(fds, data, count * sizeof(int));
+		return true;
+	}
+
+	/**
+	 * Receive a file descriptor sent with send_fd().
+	 *
+	 * @return the new descriptor, or -1 if the peer closed
+	 * the socket or sent data without a descriptor
+	 */
+	static inline int recv_fd(int socket)
+	{
+		int fd;
+		return recv_fds(socket, &fd, 1) ? fd : -1;
+	}
 }
 
 #endif
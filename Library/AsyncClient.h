@@ -0,0 +1,468 @@
+#ifndef _ASYNC_CLIENT_H_
+#define _ASYNC_CLIENT_H_
+
+/*
+ * Asynchronous client API for C++20 coroutines: one thread
+ * drives many SEND/RECV streams through the daemon, with
+ * a libevent loop like the one in cmd_send().
+ *
+ *    AsyncTask fan_in(AsyncClient& client, int rank)
+ *    {
+ *        AsyncStream stream = client.recv(rank);
+ *        std::string_view data;
+ *        while (!(data = co_await stream.read()).empty())
+ *            consume(data);
+ *    }
+ *
+ *    AsyncEventLoop loop;
+ *    AsyncClient client(loop);
+ *    for (int rank = 1; rank < client.size(); ++rank)
+ *        fan_in(client, rank);
+ *    loop.run();
+ *
+ * A coroutine runs until its first co_await that has to
+ * wait for a socket, then resumes from loop.run(), which
+ * returns once all coroutines have finished. Each stream
+ * has its own non-blocking daemon connection. Errors set
+ * errno (see AsyncStream::error()) rather than throw or
+ * exit.
+ *
+ * This header needs -std=c++20; the rest of mpih doesn't.
+ */
+
+#include "Env/env.h"
+#include "IO/BinaryHeader.h"
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event2/event.h>
+
+/**
+ * Return type of a coroutine that the loop drives. It
+ * starts as soon as it is called, and its frame goes away
+ * when it finishes; nothing waits for its result.
+ */
+struct AsyncTask
+{
+	struct promise_type
+	{
+		AsyncTask get_return_object() { return AsyncTask(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/** The libevent loop that resumes coroutines */
+class AsyncEventLoop
+{
+public:
+
+	AsyncEventLoop() : m_base(event_base_new()) {}
+
+	~AsyncEventLoop()
+	{
+		event_base_free(m_base);
+	}
+
+	struct event_base* base()
+	{
+		return m_base;
+	}
+
+	/** Run until no coroutine is waiting for a socket */
+	void run()
+	{
+		event_base_dispatch(m_base);
+	}
+
+private:
+
+	/* disable copy constructor and assignment operator */
+	AsyncEventLoop(const AsyncEventLoop&);
+	void operator=(const AsyncEventLoop&);
+
+	struct event_base* m_base;
+};
+
+/**
+ * A SEND or RECV stream, driven by co_await. A stream is
+ * moveable, but must not move while a read or write on it
+ * is suspended.
+ */
+class AsyncStream
+{
+public:
+
+	/** Awaitable for read(): the next received data */
+	class ReadOp
+	{
+	public:
+
+		explicit ReadOp(AsyncStream& stream) : m_stream(stream),
+			m_len(-1) {}
+
+		bool await_ready()
+		{
+			return tryRead();
+		}
+
+		void await_suspend(std::coroutine_handle<> coroutine)
+		{
+			m_coroutine = coroutine;
+			m_stream.waitFor(EV_READ, onReady, this);
+		}
+
+		/**
+		 * @return the data, which stays valid until the next
+		 * read(); empty at the end of the stream or on error
+		 */
+		std::string_view await_resume()
+		{
+			return std::string_view(m_stream.m_buffer.data(),
+				m_len > 0 ? m_len : 0);
+		}
+
+	private:
+
+		/** @return false if the socket has nothing for us yet */
+		bool tryRead()
+		{
+			m_len = m_stream.readSome();
+			return m_len >= 0 || errno != EAGAIN;
+		}
+
+		static void onReady(evutil_socket_t, short, void* arg)
+		{
+			ReadOp& op = *(ReadOp*)arg;
+			if (op.tryRead())
+				op.m_coroutine.resume();
+			else
+				op.m_stream.waitFor(EV_READ, onReady, arg);
+		}
+
+		AsyncStream& m_stream;
+		std::coroutine_handle<> m_coroutine;
+		ssize_t m_len;
+	};
+
+	/** Awaitable for write(): send all of the data */
+	class WriteOp
+	{
+	public:
+
+		WriteOp(AsyncStream& stream, std::string_view data) :
+			m_stream(stream), m_data(data), m_ok(true) {}
+
+		bool await_ready()
+		{
+			return tryWrite();
+		}
+
+		void await_suspend(std::coroutine_handle<> coroutine)
+		{
+			m_coroutine = coroutine;
+			m_stream.waitFor(EV_WRITE, onReady, this);
+		}
+
+		/** @return false on error (see AsyncStream::error()) */
+		bool await_resume()
+		{
+			return m_ok;
+		}
+
+	private:
+
+		/** @return false if the socket is full, with data left */
+		bool tryWrite()
+		{
+			while (!m_data.empty()) {
+				ssize_t n = m_stream.writeSome(m_data);
+				if (n < 0 && errno == EAGAIN)
+					return false;
+				if (n < 0) {
+					m_ok = false;
+					return true;
+				}
+				m_data.remove_prefix(n);
+			}
+			return true;
+		}
+
+		static void onReady(evutil_socket_t, short, void* arg)
+		{
+			WriteOp& op = *(WriteOp*)arg;
+			if (op.tryWrite())
+				op.m_coroutine.resume();
+			else
+				op.m_stream.waitFor(EV_WRITE, onReady, arg);
+		}
+
+		AsyncStream& m_stream;
+		std::coroutine_handle<> m_coroutine;
+		std::string_view m_data;
+		bool m_ok;
+	};
+
+	AsyncStream() : m_base(NULL), m_socket(-1), m_error(0) {}
+
+	AsyncStream(AsyncStream&& other) : m_base(other.m_base),
+		m_socket(other.m_socket), m_error(other.m_error),
+		m_buffer(std::move(other.m_buffer))
+	{
+		other.m_socket = -1;
+	}
+
+	AsyncStream& operator=(AsyncStream&& other)
+	{
+		std::swap(m_base, other.m_base);
+		std::swap(m_socket, other.m_socket);
+		std::swap(m_error, other.m_error);
+		std::swap(m_buffer, other.m_buffer);
+		return *this;
+	}
+
+	~AsyncStream()
+	{
+		close();
+	}
+
+	/** false if the stream couldn't be opened (see error()) */
+	bool valid() const
+	{
+		return m_socket >= 0;
+	}
+
+	/** errno of the last failed operation (0 if none) */
+	int error() const
+	{
+		return m_error;
+	}
+
+	/** co_await: receive the next data (RECV) */
+	ReadOp read()
+	{
+		return ReadOp(*this);
+	}
+
+	/** co_await: send all of 'data', which must stay valid until then */
+	WriteOp write(std::string_view data)
+	{
+		return WriteOp(*this, data);
+	}
+
+	/**
+	 * End the stream. For SEND, this marks the end of the
+	 * data, which the daemon goes on to send in the
+	 * background (as for 'mpih send').
+	 */
+	void close()
+	{
+		if (m_socket >= 0)
+			::close(m_socket);
+		m_socket = -1;
+	}
+
+private:
+
+	friend class AsyncClient;
+
+	/** amount of data a read() may return (bytes) */
+	static const size_t READ_SIZE = 256 * 1024;
+
+	AsyncStream(struct event_base* base, int socket) : m_base(base),
+		m_socket(socket), m_error(0), m_buffer(READ_SIZE) {}
+
+	/** Call 'callback' once the socket is ready for 'what' */
+	void waitFor(short what, event_callback_fn callback, void* arg)
+	{
+		if (event_base_once(m_base, m_socket, what, callback, arg,
+			NULL) < 0) {
+			/* (let the operation see the error) */
+			struct timeval now = { 0, 0 };
+			event_base_once(m_base, -1, EV_TIMEOUT, callback, arg,
+				&now);
+		}
+	}
+
+	ssize_t readSome()
+	{
+		if (m_socket < 0)
+			return fail(EBADF);
+		ssize_t n;
+		while ((n = ::read(m_socket, m_buffer.data(),
+			m_buffer.size())) < 0 && errno == EINTR)
+			;
+		return n < 0 && errno != EAGAIN ? fail(errno) : n;
+	}
+
+	ssize_t writeSome(std::string_view data)
+	{
+		if (m_socket < 0)
+			return fail(EBADF);
+		ssize_t n;
+		while ((n = send(m_socket, data.data(), data.size(),
+			MSG_NOSIGNAL)) < 0 && errno == EINTR)
+			;
+		return n < 0 && errno != EAGAIN ? fail(errno) : n;
+	}
+
+	ssize_t fail(int error)
+	{
+		m_error = errno = error;
+		return -1;
+	}
+
+	/* disable copy constructor and assignment operator */
+	AsyncStream(const AsyncStream&);
+	void operator=(const AsyncStream&);
+
+	struct event_base* m_base;
+	int m_socket;
+	int m_error;
+	/** received data */
+	std::vector<char> m_buffer;
+};
+
+/** Opens streams through the daemon, for an AsyncEventLoop */
+class AsyncClient
+{
+public:
+
+	/**
+	 * Use the daemon listening on 'socketPath' (NULL for
+	 * $MPIH_SOCKET, as set by 'mpih run')
+	 */
+	AsyncClient(AsyncEventLoop& loop, const char* socketPath = NULL) :
+		m_loop(loop), m_rank(-1), m_size(-1)
+	{
+		if (socketPath == NULL)
+			socketPath = getenv(MPIH_SOCKET);
+		if (socketPath != NULL)
+			m_socketPath = socketPath;
+	}
+
+	/** MPI rank of the daemon (-1 on error) */
+	int rank()
+	{
+		if (m_rank < 0)
+			query(OP_RANK, m_rank);
+		return m_rank;
+	}
+
+	/** Number of MPI processes in the job (-1 on error) */
+	int size()
+	{
+		if (m_size < 0)
+			query(OP_SIZE, m_size);
+		return m_size;
+	}
+
+	/** Start a stream to 'rank' (check valid()) */
+	AsyncStream send(int rank, int tag = 0)
+	{
+		return open(OP_SEND, rank, tag);
+	}
+
+	/** Start receiving the stream from 'rank' (check valid()) */
+	AsyncStream recv(int rank, int tag = 0)
+	{
+		return open(OP_RECV, rank, tag);
+	}
+
+private:
+
+	/**
+	 * Connect to the daemon. This blocks, but only until
+	 * the daemon's accept queue has room.
+	 */
+	int connectDaemon()
+	{
+		struct sockaddr_un remote;
+		if (m_socketPath.empty() ||
+			m_socketPath.size() >= sizeof(remote.sun_path)) {
+			errno = m_socketPath.empty() ? ENOENT : ENAMETOOLONG;
+			return -1;
+		}
+		int s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (s < 0)
+			return -1;
+		memset(&remote, 0, sizeof(remote));
+		remote.sun_family = AF_UNIX;
+		strcpy(remote.sun_path, m_socketPath.c_str());
+		if (connect(s, (struct sockaddr*)&remote, sizeof(remote)) < 0) {
+			int saved = errno;
+			::close(s);
+			errno = saved;
+			return -1;
+		}
+		return s;
+	}
+
+	/** Send a whole binary request on blocking socket 's' */
+	static bool sendRequest(int s, const BinaryRequest& request)
+	{
+		char buf[BINARY_REQUEST_SIZE];
+		encode_binary_request(buf, request);
+		return ::send(s, buf, sizeof(buf), MSG_NOSIGNAL) ==
+			(ssize_t)sizeof(buf);
+	}
+
+	/** Ask the daemon for its RANK/SIZE, blocking */
+	void query(HeaderOpcode opcode, int& value)
+	{
+		int s = connectDaemon();
+		if (s < 0)
+			return;
+		BinaryRequest request;
+		request.opcode = opcode;
+		char reply[BINARY_REPLY_SIZE];
+		HeaderReply code;
+		int32_t result;
+		if (sendRequest(s, request) && ::recv(s, reply, sizeof(reply),
+			MSG_WAITALL) == (ssize_t)sizeof(reply) &&
+			decode_binary_reply(reply, code, result) &&
+			code == REPLY_VALUE)
+			value = result;
+		::close(s);
+	}
+
+	AsyncStream open(HeaderOpcode opcode, int rank, int tag)
+	{
+		BinaryRequest request;
+		request.opcode = opcode;
+		request.rank = rank;
+		request.tag = tag;
+		int s = connectDaemon();
+		if (s >= 0 && !sendRequest(s, request)) {
+			int saved = errno;
+			::close(s);
+			errno = saved;
+			s = -1;
+		}
+		if (s < 0) {
+			AsyncStream failed;
+			failed.m_error = errno;
+			return failed;
+		}
+		evutil_make_socket_nonblocking(s);
+		return AsyncStream(m_loop.base(), s);
+	}
+
+	AsyncEventLoop& m_loop;
+	std::string m_socketPath;
+	int m_rank;
+	int m_size;
+};
+
+#endif
@@ -0,0 +1,444 @@
+/*
+ * libmpih (see Library/mpih.h).
+ *
+ * Streams speak the daemon's binary request protocol (see
+ * IO/BinaryHeader.h) and offer a shared-memory ring for
+ * the data, like 'mpih send --shm' and 'mpih recv --shm'
+ * (see Command/client/shm.h). If the daemon refuses the
+ * ring, the data goes through the socket, and loans are
+ * served from a private buffer instead.
+ *
+ * Unlike the client commands, nothing here may exit() or
+ * print: errors go back to the caller through errno.
+ */
+#include "Library/mpih.h"
+#include "Env/env.h"
+#include "IO/BinaryHeader.h"
+#include "IO/ShmRing.h"
+#include "IO/SocketUtil.h"
+#include "Command/client/shm.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Size of the buffer that backs loans for streams that go
+ * through the socket (bytes)
+ */
+static const size_t SOCKET_BUFFER_SIZE = 256 * 1024;
+
+struct mpih_client
+{
+	std::string socketPath;
+	int rank;
+	int size;
+};
+
+struct mpih_stream
+{
+	/** connection to the daemon, for this stream only */
+	int socket;
+	/** true for SEND, false for RECV */
+	bool sending;
+	/** shared-memory ring (NULL if data goes through 'socket') */
+	ShmRing* ring;
+	/** loans for socket streams */
+	std::vector<char> buffer;
+	/** received bytes in 'buffer' not yet returned (RECV) */
+	size_t bufferStart;
+	size_t bufferEnd;
+	/** true once the daemon has closed the socket (RECV) */
+	bool eof;
+
+	mpih_stream() : socket(-1), sending(false), ring(NULL),
+		bufferStart(0), bufferEnd(0), eof(false) {}
+
+	~mpih_stream()
+	{
+		delete ring;
+		if (socket >= 0)
+			close(socket);
+	}
+};
+
+/** Connect to the daemon socket at 'path' (-1 on error) */
+static int connect_daemon(const std::string& path)
+{
+	struct sockaddr_un remote;
+	if (path.size() >= sizeof(remote.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return -1;
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	strcpy(remote.sun_path, path.c_str());
+	if (connect(s, (struct sockaddr*)&remote, sizeof(remote)) < 0) {
+		int saved = errno;
+		close(s);
+		errno = saved;
+		return -1;
+	}
+	return s;
+}
+
+static bool write_all(int s, const char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(s, data, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool read_all(int s, char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(s, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0)
+			errno = ECONNRESET;
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+/** Wait for the daemon's next binary reply on 's' */
+static bool read_reply(int s, HeaderReply& code, int32_t& value)
+{
+	char reply[BINARY_REPLY_SIZE];
+	if (!read_all(s, reply, sizeof(reply)))
+		return false;
+	if (!decode_binary_reply(reply, code, value)) {
+		errno = EPROTO;
+		return false;
+	}
+	return true;
+}
+
+/** Send 'request' on 's' and wait for a REPLY_VALUE */
+static bool query(int s, HeaderOpcode opcode, int& value)
+{
+	BinaryRequest request;
+	request.opcode = opcode;
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+
+	HeaderReply code;
+	int32_t result;
+	if (!write_all(s, buf, sizeof(buf)) || !read_reply(s, code, result))
+		return false;
+	if (code != REPLY_VALUE) {
+		errno = EPROTO;
+		return false;
+	}
+	value = result;
+	return true;
+}
+
+/**
+ * Sleep until 'bell' is rung, or the daemon closes
+ * socket 's' (see wait_for_bell() in Command/client/shm.h).
+ *
+ * @return false if the daemon has closed the socket, or
+ * on error (errno is 0 for the former)
+ */
+static bool wait_bell(int bell, int s)
+{
+	struct pollfd fds[2];
+	fds[0].fd = bell;
+	fds[0].events = POLLIN;
+	fds[1].fd = s;
+	fds[1].events = POLLIN;
+	while (poll(fds, 2, -1) < 0)
+		if (errno != EINTR)
+			return false;
+	if (fds[0].revents & POLLIN)
+		ShmRing::clearBell(bell);
+	errno = 0;
+	return fds[1].revents == 0;
+}
+
+/**
+ * Start a SEND/RECV stream, offering the daemon a shared-
+ * memory ring for its data (see request_fd() in
+ * Command/init/event_handlers.h).
+ */
+static mpih_stream* open_stream(mpih_client* client, HeaderOpcode opcode,
+	int rank, int tag)
+{
+	if (client == NULL || rank < 0 || rank >= client->size || tag < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mpih_stream* stream = new mpih_stream();
+	stream->sending = opcode == OP_SEND;
+	stream->socket = connect_daemon(client->socketPath);
+	stream->ring = ShmRing::create(SHM_RING_SIZE);
+	if (stream->socket < 0 || stream->ring == NULL) {
+		int saved = errno;
+		delete stream;
+		errno = saved;
+		return NULL;
+	}
+
+	BinaryRequest request;
+	request.opcode = opcode;
+	request.rank = rank;
+	request.tag = tag;
+	request.flags = BINARY_FLAG_SHM;
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+
+	HeaderReply code;
+	int32_t value;
+	bool ok = write_all(stream->socket, buf, sizeof(buf)) &&
+		read_reply(stream->socket, code, value);
+	if (ok && code == REPLY_SHM)
+		ok = UnixSocket::send_fds(stream->socket, stream->ring->fds(),
+			ShmRing::NUM_FDS) && read_reply(stream->socket, code, value);
+	if (ok && code != REPLY_OK && code != REPLY_NOSHM) {
+		errno = EPROTO;
+		ok = false;
+	}
+	if (!ok) {
+		int saved = errno;
+		delete stream;
+		errno = saved;
+		return NULL;
+	}
+
+	if (code == REPLY_NOSHM) {
+		delete stream->ring;
+		stream->ring = NULL;
+		stream->buffer.resize(SOCKET_BUFFER_SIZE);
+	}
+	return stream;
+}
+
+extern "C" {
+
+mpih_client* mpih_connect(const char* socket_path)
+{
+	if (socket_path == NULL)
+		socket_path = getenv(MPIH_SOCKET);
+	if (socket_path == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	int s = connect_daemon(socket_path);
+	if (s < 0)
+		return NULL;
+	mpih_client* client = new mpih_client();
+	client->socketPath = socket_path;
+	bool ok = query(s, OP_RANK, client->rank) &&
+		query(s, OP_SIZE, client->size);
+	int saved = errno;
+	close(s);
+	if (!ok) {
+		delete client;
+		errno = saved;
+		return NULL;
+	}
+	return client;
+}
+
+void mpih_disconnect(mpih_client* client)
+{
+	delete client;
+}
+
+int mpih_rank(const mpih_client* client)
+{
+	return client->rank;
+}
+
+int mpih_size(const mpih_client* client)
+{
+	return client->size;
+}
+
+mpih_stream* mpih_send_open(mpih_client* client, int rank, int tag)
+{
+	return open_stream(client, OP_SEND, rank, tag);
+}
+
+mpih_stream* mpih_recv_open(mpih_client* client, int rank, int tag)
+{
+	return open_stream(client, OP_RECV, rank, tag);
+}
+
+int mpih_write_loan(mpih_stream* stream, void** data, size_t* len)
+{
+	if (!stream->sending) {
+		errno = EBADF;
+		return -1;
+	}
+	if (stream->ring == NULL) {
+		*data = stream->buffer.data();
+		*len = stream->buffer.size();
+		return 0;
+	}
+	ShmRing& ring = *stream->ring;
+	while (!ring.armWriter(1)) {
+		if (!wait_bell(ring.writerBell(), stream->socket)) {
+			if (errno == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+	}
+	*data = ring.writePtr();
+	*len = ring.writable();
+	return 0;
+}
+
+int mpih_write_return(mpih_stream* stream, size_t len)
+{
+	if (!stream->sending) {
+		errno = EBADF;
+		return -1;
+	}
+	if (stream->ring == NULL) {
+		if (len > stream->buffer.size()) {
+			errno = EINVAL;
+			return -1;
+		}
+		return write_all(stream->socket, stream->buffer.data(), len) ?
+			0 : -1;
+	}
+	if (len > stream->ring->writable()) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len > 0)
+		stream->ring->publish(len);
+	return 0;
+}
+
+ssize_t mpih_write(mpih_stream* stream, const void* data, size_t len)
+{
+	if (stream->sending && stream->ring == NULL)
+		return write_all(stream->socket, (const char*)data, len) ?
+			(ssize_t)len : -1;
+
+	const char* p = (const char*)data;
+	size_t remaining = len;
+	while (remaining > 0) {
+		void* loan;
+		size_t n;
+		if (mpih_write_loan(stream, &loan, &n) < 0)
+			return -1;
+		n = std::min(n, remaining);
+		memcpy(loan, p, n);
+		mpih_write_return(stream, n);
+		p += n;
+		remaining -= n;
+	}
+	return len;
+}
+
+int mpih_read_loan(mpih_stream* stream, const void** data, size_t* len)
+{
+	if (stream->sending) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (stream->ring == NULL) {
+		while (stream->bufferStart == stream->bufferEnd &&
+			!stream->eof) {
+			ssize_t n = read(stream->socket, stream->buffer.data(),
+				stream->buffer.size());
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				return -1;
+			stream->bufferStart = 0;
+			stream->bufferEnd = n;
+			stream->eof = n == 0;
+		}
+		*data = stream->buffer.data() + stream->bufferStart;
+		*len = stream->bufferEnd - stream->bufferStart;
+		return 0;
+	}
+
+	ShmRing& ring = *stream->ring;
+	while (ring.readable() == 0) {
+		/* the daemon publishes all data before closing */
+		if (stream->eof)
+			break;
+		if (!ring.armReader() &&
+			!wait_bell(ring.readerBell(), stream->socket)) {
+			if (errno != 0)
+				return -1;
+			stream->eof = true;
+		}
+	}
+	*data = ring.readPtr();
+	*len = ring.readable();
+	return 0;
+}
+
+int mpih_read_return(mpih_stream* stream, size_t len)
+{
+	if (stream->sending) {
+		errno = EBADF;
+		return -1;
+	}
+	size_t lent = stream->ring != NULL ? stream->ring->readable() :
+		stream->bufferEnd - stream->bufferStart;
+	if (len > lent) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (stream->ring != NULL) {
+		if (len > 0)
+			stream->ring->release(len);
+	} else {
+		stream->bufferStart += len;
+	}
+	return 0;
+}
+
+ssize_t mpih_read(mpih_stream* stream, void* data, size_t len)
+{
+	const void* loan;
+	size_t n;
+	if (len == 0)
+		return 0;
+	if (mpih_read_loan(stream, &loan, &n) < 0)
+		return -1;
+	n = std::min(n, len);
+	memcpy(data, loan, n);
+	mpih_read_return(stream, n);
+	return n;
+}
+
+int mpih_close(mpih_stream* stream)
+{
+	/* closing the socket ends a SEND (or abandons a RECV) */
+	delete stream;
+	return 0;
+}
+
+}
@@ -0,0 +1,134 @@
+#ifndef _MPIH_H_
+#define _MPIH_H_
+
+/*
+ * libmpih: stream data through the 'mpih init' daemon
+ * from C or C++, without running 'mpih send'/'mpih recv'
+ * as subprocesses.
+ *
+ *    mpih_client* client = mpih_connect(NULL);
+ *    mpih_stream* stream = mpih_send_open(client, 1, 0);
+ *    mpih_write(stream, data, len);
+ *    mpih_close(stream);
+ *    mpih_disconnect(client);
+ *
+ * Stream data moves through a shared-memory ring when the
+ * daemon accepts one (see IO/ShmRing.h), and through the
+ * daemon socket otherwise. The loan calls hand out the
+ * ring memory itself, so that a producer can generate its
+ * data in place, or a consumer can use the received data
+ * where it lies, without copying it:
+ *
+ *    void* buf;
+ *    size_t len;
+ *    mpih_write_loan(stream, &buf, &len);
+ *    len = produce(buf, len);
+ *    mpih_write_return(stream, len);
+ *
+ * All calls block. On error, they return NULL or -1 with
+ * errno set, and never print anything or exit. A client
+ * and its streams must not be used by several threads at
+ * once.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A connection to the daemon of an 'mpih run' job */
+typedef struct mpih_client mpih_client;
+
+/** A SEND or RECV stream */
+typedef struct mpih_stream mpih_stream;
+
+/**
+ * Connect to the daemon listening on 'socket_path' (NULL
+ * for $MPIH_SOCKET, as set by 'mpih run').
+ *
+ * @return NULL on error
+ */
+mpih_client* mpih_connect(const char* socket_path);
+
+/** Close a client; its streams must have been closed first */
+void mpih_disconnect(mpih_client* client);
+
+/** MPI rank of the daemon */
+int mpih_rank(const mpih_client* client);
+
+/** Number of MPI processes in the job */
+int mpih_size(const mpih_client* client);
+
+/**
+ * Start a stream to 'rank', with MPI tag 'tag' (0 if the
+ * receiver doesn't use one, like 'mpih recv <rank>').
+ *
+ * @return NULL on error
+ */
+mpih_stream* mpih_send_open(mpih_client* client, int rank, int tag);
+
+/** Start receiving the stream from 'rank' with MPI tag 'tag' */
+mpih_stream* mpih_recv_open(mpih_client* client, int rank, int tag);
+
+/**
+ * Send all 'len' bytes at 'data'.
+ *
+ * @return 'len', or -1 on error
+ */
+ssize_t mpih_write(mpih_stream* stream, const void* data, size_t len);
+
+/**
+ * Receive up to 'len' bytes into 'data'.
+ *
+ * @return the number of bytes received, 0 at the end of
+ * the stream, or -1 on error
+ */
+ssize_t mpih_read(mpih_stream* stream, void* data, size_t len);
+
+/**
+ * Borrow the next '*len' (at least 1) bytes of the
+ * stream's buffer, to fill in place. Waits for the daemon
+ * to free some space, if needed.
+ *
+ * @return 0, or -1 on error
+ */
+int mpih_write_loan(mpih_stream* stream, void** data, size_t* len);
+
+/**
+ * Send the first 'len' bytes of the last loan (which may
+ * be fewer than were lent), and end the loan.
+ */
+int mpih_write_return(mpih_stream* stream, size_t len);
+
+/**
+ * Borrow the next '*len' received bytes, where they lie.
+ * Waits for data, if needed; '*len' is 0 at the end of the
+ * stream.
+ *
+ * @return 0, or -1 on error
+ */
+int mpih_read_loan(mpih_stream* stream, const void** data, size_t* len);
+
+/**
+ * Give back the first 'len' bytes of the last loan (which
+ * may be fewer than were lent); the next loan starts
+ * after them.
+ */
+int mpih_read_return(mpih_stream* stream, size_t len);
+
+/**
+ * End a stream. For SEND, this marks the end of the data,
+ * which the daemon goes on to send in the background (as
+ * for 'mpih send'). For RECV, unread data is discarded.
+ *
+ * @return 0, or -1 on error
+ */
+int mpih_close(mpih_stream* stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
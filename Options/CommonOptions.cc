@@ -5,4 +5,8 @@ namespace opt {
     int help = 0;
     int verbose = 0;
     std::string socketPath;
+    int tag = 0;
+    int shm = 0;
+    int remote = 0;
+    std::string portFile;
 }
\ No newline at end of file
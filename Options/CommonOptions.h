@@ -14,6 +14,29 @@ namespace opt {
 	extern std::string socketPath;
 	/** --verbose: verbose output on stderr */
 	extern int verbose;
+	/**
+	 * -t,--tag: MPI tag for the stream of an
+	 * 'mpih send' or 'mpih recv' command
+	 */
+	extern int tag;
+	/**
+	 * -m,--shm: move the data of an 'mpih send' or 'mpih
+	 * recv' through a shared-memory ring, rather than
+	 * handing our input/output file descriptor to the
+	 * daemon or copying the data through the daemon socket
+	 */
+	extern int shm;
+	/**
+	 * -R,--remote: the rank of an 'mpih send' or 'mpih
+	 * recv' is a rank of the job that we are connected to
+	 * (see 'mpih open-port'), rather than of our own job
+	 */
+	extern int remote;
+	/**
+	 * -f,--file: file for the MPI port name of 'mpih
+	 * open-port' and 'mpih connect-port'
+	 */
+	extern std::string portFile;
 }
 
 #endif
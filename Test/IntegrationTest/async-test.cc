@@ -0,0 +1,88 @@
+/*
+ * Fan streams in and out with the coroutine client API
+ * (see Library/AsyncClient.h and async-test.sh):
+ *
+ *    async-test <streams> <bytes per stream>
+ *
+ * Each of two ranks sends <streams> concurrent streams to
+ * the other (tags 1 to <streams>) and receives as many,
+ * all from a single thread, and checks every byte.
+ */
+#include "Library/AsyncClient.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/** Byte 'i' of the stream with tag 'tag' */
+static char pattern(size_t i, int tag)
+{
+	return (char)(i * 31 + i / 4096 + tag);
+}
+
+static int g_failures = 0;
+
+static AsyncTask send_stream(AsyncClient& client, int rank, int tag,
+	size_t bytes)
+{
+	AsyncStream stream = client.send(rank, tag);
+	std::vector<char> buf(64 * 1024 + tag);
+	for (size_t sent = 0; stream.valid() && sent < bytes;) {
+		size_t len = std::min(buf.size(), bytes - sent);
+		for (size_t i = 0; i < len; ++i)
+			buf[i] = pattern(sent + i, tag);
+		if (!co_await stream.write(std::string_view(buf.data(), len)))
+			break;
+		sent += len;
+	}
+	if (stream.error() != 0) {
+		fprintf(stderr, "send (tag %d): %s\n", tag,
+			strerror(stream.error()));
+		++g_failures;
+	}
+}
+
+static AsyncTask recv_stream(AsyncClient& client, int rank, int tag,
+	size_t bytes)
+{
+	AsyncStream stream = client.recv(rank, tag);
+	size_t received = 0;
+	bool same = true;
+	std::string_view data;
+	while (stream.valid() && !(data = co_await stream.read()).empty()) {
+		for (size_t i = 0; i < data.size(); ++i)
+			same = same && data[i] == pattern(received + i, tag);
+		received += data.size();
+	}
+	if (stream.error() != 0 || received != bytes || !same) {
+		fprintf(stderr, "recv (tag %d): %s, %lu of %lu bytes%s\n",
+			tag, strerror(stream.error()), (unsigned long)received,
+			(unsigned long)bytes, same ? "" : ", data differs");
+		++g_failures;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <streams> <bytes per stream>\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+	int streams = atoi(argv[1]);
+	size_t bytes = strtoul(argv[2], NULL, 10);
+
+	AsyncEventLoop loop;
+	AsyncClient client(loop);
+	if (client.size() != 2) {
+		fprintf(stderr, "error: must be run with 2 processes\n");
+		return EXIT_FAILURE;
+	}
+	int peer = 1 - client.rank();
+	for (int tag = 1; tag <= streams; ++tag) {
+		send_stream(client, peer, tag, bytes);
+		recv_stream(client, peer, tag, bytes);
+	}
+	loop.run();
+
+	return g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,47 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 3 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <async-test> <streams> <bytes>"
+		stderr "Example: $(basename $0) ./async-test 64 1048576"
+	fi
+	exit 1
+fi
+
+async_test=$1; shift
+streams=$1; shift
+bytes=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Each rank drives all of its streams, both ways, from one
+# thread (see async-test.cc).
+if ! $async_test $streams $bytes; then
+	stderr "FAILED: concurrent streams on rank $MPIH_RANK!"
+	exit 1
+fi
+if [ $MPIH_RANK -eq 0 ]; then
+	stderr "PASSED!"
+fi
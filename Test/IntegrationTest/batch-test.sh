@@ -0,0 +1,85 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Many small files, one large file and a file in a
+# subdirectory go over a single batch stream (tag 1), and
+# must be recreated with the same names and contents.
+# Rank 0 also sends a few files to itself, so that two
+# streams share the connection to the daemon.
+
+# md5sum of every file under directory $1, and their names
+tree_md5sum() {
+	(cd $1 && find . -type f | sort | xargs md5sum) | md5sum | cut -d' ' -f1
+}
+
+if [ $MPIH_RANK -eq 0 ]; then
+	rm -rf batch.in
+	mkdir -p batch.in/sub
+	for i in $(seq 1 200); do
+		head -c $((i * 37)) /dev/urandom > batch.in/small.$i
+		echo -e "1\tbatch.in/small.$i"
+	done > batch.manifest
+	: > batch.in/empty
+	echo -e "1\tbatch.in/empty" >> batch.manifest
+	dd if=/dev/urandom of=batch.in/sub/large.bin count=1 bs=$size 2>/dev/null
+	echo -e "# comment\n\n1\tbatch.in/sub/large.bin\tsub/large.bin" \
+		>> batch.manifest
+	rm -rf batch.self.in batch.self.out
+	mkdir -p batch.self.in
+	for i in $(seq 1 5); do
+		head -c $((i * 1000)) /dev/urandom > batch.self.in/self.$i
+		echo -e "0\tbatch.self.in/self.$i"
+	done >> batch.manifest
+	tree_md5sum batch.in | mpih send --tag 4 1
+	mpih recv-batch --tag 1 -C batch.self.out 0 &
+	recv_pid=$!
+	mpih send-batch --tag 1 batch.manifest
+	wait $recv_pid
+	if [ "$(tree_md5sum batch.self.out)" != "$(tree_md5sum batch.self.in)" ]; then
+		stderr "FAILED: batch of files sent to self differs!"
+		exit 1
+	fi
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	rm -rf batch.out
+	mpih recv-batch --tag 1 -C batch.out 0
+	md5sum=$(tree_md5sum batch.out)
+	if [ "$md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: batch of files differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
@@ -0,0 +1,88 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <libmpih_builtin.so> <size>"
+		stderr "Example: $(basename $0) ./libmpih_builtin.so 16M"
+	fi
+	exit 1
+fi
+
+builtin=$1; shift
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Load the mpih builtin, and play ping-pong with many small
+# messages, which all go over the shell's own connection to
+# the daemon. A large tagged file and a command that the
+# builtin hands to the regular mpih must still arrive intact.
+enable -f "$builtin" mpih
+if [ "$(type -t mpih)" != "builtin" ]; then
+	stderr "FAILED: mpih builtin not loaded!"
+	exit 1
+fi
+if [ "$(mpih rank)" -ne $MPIH_RANK -o "$(mpih size)" -ne $MPIH_SIZE ]; then
+	stderr "FAILED: wrong rank or size from builtin!"
+	exit 1
+fi
+
+peer=$((1 - MPIH_RANK))
+for i in $(seq 1 100); do
+	if [ $MPIH_RANK -eq 0 ]; then
+		echo "ping $i" | mpih send $peer
+		reply=$(mpih recv $peer)
+		expected="pong $i"
+	else
+		reply=$(mpih recv $peer)
+		echo "pong $i" | mpih send $peer
+		expected="ping $i"
+	fi
+	if [ "$reply" != "$expected" ]; then
+		stderr "FAILED: got '$reply' instead of '$expected'!"
+		exit 1
+	fi
+done
+
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=builtin.in count=1 bs=$size 2>/dev/null
+	md5sum < builtin.in | mpih send --tag=5 1
+	mpih send -t 6 1 < builtin.in
+	mpih send --detach --tag 7 1 < builtin.in
+else
+	correct_md5sum=$(mpih recv --tag 5 0)
+	md5sum=$(mpih recv --tag 6 0 | md5sum)
+	if [ "$md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: tagged file differs!"
+		exit 1
+	fi
+	rm -f builtin.out
+	mpih recv --tag 7 --output builtin.out 0
+	if [ "$(md5sum < builtin.out)" != "$correct_md5sum" ]; then
+		stderr "FAILED: file received by the regular mpih differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
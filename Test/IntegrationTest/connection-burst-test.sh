@@ -0,0 +1,75 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <streams>"
+		stderr "Example: $(basename $0) 1000"
+	fi
+	exit 1
+fi
+
+streams=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Each rank starts all of its clients at once, one stream
+# per tag. Run under a low descriptor limit (see
+# CMakeLists.txt), the daemons run out of descriptors
+# mid-burst, and must leave the remaining clients in the
+# listen backlog until earlier streams have finished.
+
+out_dir=burst.$MPIH_RANK
+rm -rf $out_dir
+mkdir $out_dir
+
+pids=()
+for ((tag = 0; tag < streams; ++tag)); do
+	if [ $MPIH_RANK -eq 0 ]; then
+		echo "stream $tag" | mpih send --tag $tag 1 &
+	else
+		mpih recv --tag $tag 0 > $out_dir/$tag &
+	fi
+	pids+=($!)
+done
+
+failed=0
+for pid in "${pids[@]}"; do
+	wait $pid || failed=$((failed + 1))
+done
+if [ $failed -ne 0 ]; then
+	stderr "FAILED: $failed of $streams clients on rank $MPIH_RANK failed!"
+	exit 1
+fi
+
+if [ $MPIH_RANK -eq 1 ]; then
+	for ((tag = 0; tag < streams; ++tag)); do
+		if [ "$(cat $out_dir/$tag)" != "stream $tag" ]; then
+			stderr "FAILED: wrong data for stream $tag!"
+			exit 1
+		fi
+	done
+	stderr "PASSED!"
+fi
@@ -0,0 +1,111 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# launch the two jobs
+#------------------------------------------------------------
+
+# Without 'mpih run', we start a 2-rank job that runs
+# 'mpih open-port' and a 3-rank job that connects to it,
+# both running this script.
+if [ -z "${MPIH_RANK:-}" ]; then
+	if [ $# -lt 3 ]; then
+		stderr "Usage: $(basename $0) <size> <mpiexec> <numproc flag> [<mpiexec flag>...]"
+		stderr "Example: $(basename $0) 1M mpirun -np"
+		exit 1
+	fi
+	size=$1; mpiexec=$2; np_flag=$3; shift 3
+
+	dir=$(mktemp -d)
+	server_pid=
+	cleanup() {
+		if [ -n "$server_pid" ]; then
+			kill $server_pid 2>/dev/null || true
+		fi
+		rm -rf "$dir"
+	}
+	trap cleanup EXIT
+
+	# Open MPI jobs can only connect through an ompi-server
+	server=()
+	if command -v ompi-server >/dev/null; then
+		ompi-server --no-daemonize -r "$dir/uri" &
+		server_pid=$!
+		for i in $(seq 1 100); do
+			[ -s "$dir/uri" ] && break
+			sleep 0.1
+		done
+		server=(--ompi-server "file:$dir/uri")
+	fi
+
+	"$mpiexec" "${server[@]}" $np_flag 2 "$@" \
+		mpih run "$0" accept $size "$dir" &
+	accept_pid=$!
+	if ! "$mpiexec" "${server[@]}" $np_flag 3 "$@" \
+		mpih run "$0" connect $size "$dir"; then
+		kill $accept_pid 2>/dev/null || true
+		exit 1
+	fi
+	wait $accept_pid
+	exit 0
+fi
+
+role=$1; size=$2; dir=$3
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for $role rank $MPIH_RANK: $MPIH_LOG"
+
+# Each rank of the connecting job streams random data to
+# a rank of the accepting job, which streams it straight
+# back, while the accepting job also streams between its
+# own ranks.
+if [ $role = accept ]; then
+	remote_size=$(mpih open-port --file "$dir/port")
+	if [ "$remote_size" -ne 3 ]; then
+		stderr "FAILED: expected 3 remote ranks, got '$remote_size'"
+		exit 1
+	fi
+	if [ $MPIH_RANK -eq 0 ]; then
+		echo "local stream" | mpih send --tag 1 1 &
+	fi
+	for ((peer = MPIH_RANK; peer < remote_size; peer += MPIH_SIZE)); do
+		mpih recv --remote --tag $peer $peer |
+			mpih send --remote --tag $peer $peer &
+	done
+	if [ $MPIH_RANK -eq 1 ]; then
+		local_data=$(mpih recv --tag 1 0)
+		if [ "$local_data" != "local stream" ]; then
+			stderr "FAILED: local stream received '$local_data'"
+			exit 1
+		fi
+	fi
+	wait
+else
+	remote_size=$(mpih connect-port --file "$dir/port")
+	if [ "$remote_size" -ne 2 ]; then
+		stderr "FAILED: expected 2 remote ranks, got '$remote_size'"
+		exit 1
+	fi
+	peer=$((MPIH_RANK % remote_size))
+	data="$dir/data.$MPIH_RANK"
+	dd if=/dev/urandom of="$data" count=1 bs=$size 2>/dev/null
+	mpih send --remote --tag $MPIH_RANK $peer < "$data" &
+	mpih recv --remote --tag $MPIH_RANK $peer > "$data.echo"
+	wait
+	if ! cmp -s "$data" "$data.echo"; then
+		stderr "FAILED: data echoed by remote rank $peer differs!"
+		exit 1
+	fi
+fi
+
+stderr "PASSED"
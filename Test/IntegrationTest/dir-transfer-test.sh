@@ -0,0 +1,74 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# A tree of small files, large files (sent in chunks over
+# several streams), an empty directory and a symlink is
+# sent with 'mpih send-dir' (tag 1), and must arrive intact.
+
+# md5sum of every file under directory $1, and their names
+tree_md5sum() {
+	(cd $1 && find . -type f | sort | xargs md5sum) | md5sum | cut -d' ' -f1
+}
+
+if [ $MPIH_RANK -eq 0 ]; then
+	rm -rf dir.in
+	mkdir -p dir.in/a/b dir.in/empty
+	for i in $(seq 1 100); do
+		head -c $((i * 53)) /dev/urandom > dir.in/a/small.$i
+	done
+	dd if=/dev/urandom of=dir.in/a/b/large.bin count=3 bs=$size 2>/dev/null
+	dd if=/dev/urandom of=dir.in/large.bin count=1 bs=$size 2>/dev/null
+	ln -s a/b/large.bin dir.in/link
+	chmod 0750 dir.in/a/b
+	tree_md5sum dir.in | mpih send --tag 4 1
+	mpih send-dir --tag 1 --parallel 4 1 dir.in
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	rm -rf dir.out
+	mpih recv-dir --tag 1 0 dir.out
+	md5sum=$(tree_md5sum dir.out)
+	if [ "$md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: directory tree differs!"
+		exit 1
+	fi
+	if [ ! -d dir.out/empty ] ||
+		[ "$(readlink dir.out/link)" != a/b/large.bin ] ||
+		[ "$(stat -c %a dir.out/a/b)" != 750 ]; then
+		stderr "FAILED: directory, symlink or mode missing!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
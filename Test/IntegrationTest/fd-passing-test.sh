@@ -0,0 +1,70 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# The same data goes over three streams. 'mpih send' and
+# 'mpih recv' hand a regular file (tag 1) and a pipe
+# (tag 2) to the daemon, and copy through the daemon
+# socket for tag 3.
+
+data_file=fd.$MPIH_RANK.bin
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	md5sum $data_file | cut -d' ' -f1 | mpih send --tag 4 1
+	mpih send --tag 1 1 $data_file
+	cat $data_file | mpih send --tag 2 1
+	mpih send --via-socket --tag 3 1 < $data_file
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	mpih recv --tag 1 0 > fd.1.out
+	file_md5sum=$(md5sum fd.1.out | cut -d' ' -f1)
+	pipe_md5sum=$(mpih recv --tag 2 0 | md5sum | cut -d' ' -f1)
+	socket_md5sum=$(mpih recv --via-socket --tag 3 0 | md5sum | cut -d' ' -f1)
+
+	if [ "$file_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data sent through regular files differs!"
+		exit 1
+	fi
+	if [ "$pipe_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data sent through pipes differs!"
+		exit 1
+	fi
+	if [ "$socket_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data sent through daemon socket differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
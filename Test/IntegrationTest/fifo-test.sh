@@ -0,0 +1,90 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+# wait up to 5 seconds for the daemon to remove pipe $1
+wait_for_removal() {
+	for i in $(seq 1 50); do
+		[ -e "$1" ] || return 0
+		sleep 0.1
+	done
+	stderr "FAILED: named pipe $1 was not removed!"
+	exit 1
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Rank 0 streams a file to rank 1 by writing it to a named
+# pipe, and rank 1 streams it back into a named pipe on
+# rank 0. Only plain 'cat' touches the pipes.
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=fifo.in count=1 bs=$size 2>/dev/null
+	md5sum < fifo.in | mpih send --tag 3 1
+	rm -f fifo.send fifo.recv
+	mpih mkfifo --send 1 --tag 1 fifo.send
+	mpih mkfifo --recv 1 --tag 2 fifo.recv
+	if [ ! -p fifo.send -o ! -p fifo.recv ]; then
+		stderr "FAILED: named pipes not created!"
+		exit 1
+	fi
+	cat fifo.in > fifo.send
+	cat fifo.recv > fifo.out
+	if ! cmp -s fifo.in fifo.out; then
+		stderr "FAILED: data from named pipe differs!"
+		exit 1
+	fi
+	wait_for_removal fifo.send
+	wait_for_removal fifo.recv
+
+	# a pipe that isn't ours is never taken over (or removed)
+	rm -f fifo.exists
+	mkfifo fifo.exists
+	if mpih mkfifo --send 1 --tag 4 fifo.exists 2>/dev/null; then
+		stderr "FAILED: mkfifo accepted an existing pipe!"
+		exit 1
+	fi
+	if [ ! -p fifo.exists ]; then
+		stderr "FAILED: mkfifo removed an existing pipe!"
+		exit 1
+	fi
+	rm -f fifo.exists
+else
+	correct_md5sum=$(mpih recv --tag 3 0)
+	mpih recv --tag 1 0 > fifo.copy
+	if [ "$(md5sum < fifo.copy)" != "$correct_md5sum" ]; then
+		stderr "FAILED: data written to named pipe differs!"
+		exit 1
+	fi
+	mpih send --tag 2 0 < fifo.copy
+	stderr "PASSED!"
+fi
@@ -0,0 +1,128 @@
+/*
+ * Stream STDIN to a rank, or a stream from a rank to
+ * STDOUT, through libmpih (see libmpih-test.sh):
+ *
+ *    libmpih-test send|recv <rank> <tag> [copy|loan]
+ *
+ * 'copy' uses mpih_write()/mpih_read(); 'loan' reads and
+ * writes straight into/out of the stream's buffer.
+ */
+#include "Library/mpih.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void fail(const char* what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void write_stdout(const char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			fail("write");
+		data += n;
+		len -= n;
+	}
+}
+
+static void send_copy(mpih_stream* stream)
+{
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			fail("read");
+		if (mpih_write(stream, buf, n) != n)
+			fail("mpih_write");
+	}
+}
+
+static void send_loan(mpih_stream* stream)
+{
+	while (1) {
+		void* buf;
+		size_t len;
+		if (mpih_write_loan(stream, &buf, &len) < 0)
+			fail("mpih_write_loan");
+		ssize_t n = read(STDIN_FILENO, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			fail("read");
+		if (mpih_write_return(stream, n) < 0)
+			fail("mpih_write_return");
+		if (n == 0)
+			break;
+	}
+}
+
+static void recv_copy(mpih_stream* stream)
+{
+	char buf[65536];
+	ssize_t n;
+	while ((n = mpih_read(stream, buf, sizeof(buf))) != 0) {
+		if (n < 0)
+			fail("mpih_read");
+		write_stdout(buf, n);
+	}
+}
+
+static void recv_loan(mpih_stream* stream)
+{
+	while (1) {
+		const void* buf;
+		size_t len;
+		if (mpih_read_loan(stream, &buf, &len) < 0)
+			fail("mpih_read_loan");
+		if (len == 0)
+			break;
+		write_stdout((const char*)buf, len);
+		if (mpih_read_return(stream, len) < 0)
+			fail("mpih_read_return");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s send|recv <rank> <tag> "
+			"[copy|loan]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	int sending = strcmp(argv[1], "send") == 0;
+	int rank = atoi(argv[2]);
+	int tag = atoi(argv[3]);
+	int loan = argc > 4 && strcmp(argv[4], "loan") == 0;
+
+	mpih_client* client = mpih_connect(NULL);
+	if (client == NULL)
+		fail("mpih_connect");
+	if (mpih_rank(client) != atoi(getenv("MPIH_RANK")) ||
+		mpih_size(client) != atoi(getenv("MPIH_SIZE"))) {
+		fprintf(stderr, "wrong rank/size from daemon\n");
+		return EXIT_FAILURE;
+	}
+
+	mpih_stream* stream = sending ? mpih_send_open(client, rank, tag) :
+		mpih_recv_open(client, rank, tag);
+	if (stream == NULL)
+		fail(sending ? "mpih_send_open" : "mpih_recv_open");
+	if (sending)
+		loan ? send_loan(stream) : send_copy(stream);
+	else
+		loan ? recv_loan(stream) : recv_copy(stream);
+	if (mpih_close(stream) < 0)
+		fail("mpih_close");
+	mpih_disconnect(client);
+	return EXIT_SUCCESS;
+}
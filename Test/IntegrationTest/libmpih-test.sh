@@ -0,0 +1,70 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <libmpih-test> <size>"
+		stderr "Example: $(basename $0) ./libmpih-test 16M"
+	fi
+	exit 1
+fi
+
+libmpih_test=$1; shift
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Streams written and read through libmpih must interoperate
+# with 'mpih send' and 'mpih recv', whether the library
+# copies the data or lends out its buffers. Rank 0 also
+# sends a file to itself through the library.
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=libmpih.in count=1 bs=$size 2>/dev/null
+	md5sum < libmpih.in | mpih send --tag 4 1
+	$libmpih_test send 1 1 copy < libmpih.in
+	$libmpih_test send 1 2 loan < libmpih.in
+	mpih send --tag 3 1 < libmpih.in
+	$libmpih_test recv 0 5 loan > libmpih.self.out &
+	recv_pid=$!
+	$libmpih_test send 0 5 copy < libmpih.in
+	wait $recv_pid
+	if ! cmp -s libmpih.in libmpih.self.out; then
+		stderr "FAILED: stream sent to self differs!"
+		exit 1
+	fi
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	for tag in 1 2 3; do
+		case $tag in
+			1) md5sum=$(mpih recv --tag 1 0 | md5sum) ;;
+			2) md5sum=$($libmpih_test recv 0 2 loan | md5sum) ;;
+			3) md5sum=$($libmpih_test recv 0 3 copy | md5sum) ;;
+		esac
+		if [ "$md5sum" != "$correct_md5sum" ]; then
+			stderr "FAILED: stream with tag $tag differs!"
+			exit 1
+		fi
+	done
+	stderr "PASSED!"
+fi
@@ -0,0 +1,88 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Both ranks run on this node, so the sending daemon copies
+# streams straight from the sending client's file or
+# pipe into the receiving client's: file to file
+# (tag 1), pipe to pipe (tag 2), and file to a file that
+# the receiver goes on writing to (tag 3). A receiver
+# that streams through the daemon socket (tag 4) declines
+# the copy, and the data goes through MPI instead.
+
+data_file=local.$MPIH_RANK.bin
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	md5sum $data_file | cut -d' ' -f1 | mpih send --tag 5 1
+	mpih send --tag 1 1 $data_file
+	cat $data_file | mpih send --tag 2 1
+	mpih send --tag 3 1 $data_file
+	mpih send --tag 4 1 $data_file
+
+	# (the md5sum and tags 1-3)
+	copies=$(grep -c 'bytes to rank 1 on the same node' $MPIH_LOG || true)
+	if [ "$copies" -ne 4 ]; then
+		stderr "FAILED: expected 4 same-node copies, got $copies!"
+		exit 1
+	fi
+else
+	correct_md5sum=$(mpih recv --tag 5 0)
+	mpih recv --tag 1 0 > local.1.out
+	file_md5sum=$(md5sum local.1.out | cut -d' ' -f1)
+	pipe_md5sum=$(mpih recv --tag 2 0 | md5sum | cut -d' ' -f1)
+	{ mpih recv --tag 3 0; echo "end of stream"; } > local.3.out
+	socket_md5sum=$(mpih recv --via-socket --tag 4 0 | md5sum | cut -d' ' -f1)
+
+	if [ "$file_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data copied between regular files differs!"
+		exit 1
+	fi
+	if [ "$pipe_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data copied between pipes differs!"
+		exit 1
+	fi
+	if [ "$(tail -c 14 local.3.out)" != "end of stream" ] ||
+		[ "$(head -c $size local.3.out | md5sum | cut -d' ' -f1)" \
+			!= "$correct_md5sum" ]; then
+		stderr "FAILED: copy left the wrong file offset!"
+		exit 1
+	fi
+	if [ "$socket_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data sent through MPI differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
@@ -0,0 +1,57 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Three files of different sizes go over a single stream
+# (tag 1), which must deliver them back to back, in the
+# order given.
+
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=multi.a.bin count=1 bs=$size 2>/dev/null
+	dd if=/dev/urandom of=multi.b.bin count=1 bs=1000 2>/dev/null
+	dd if=/dev/urandom of=multi.c.bin count=1 bs=$size 2>/dev/null
+	cat multi.a.bin multi.b.bin multi.c.bin | md5sum | cut -d' ' -f1 \
+		| mpih send --tag 4 1
+	mpih send --tag 1 1 multi.a.bin multi.b.bin multi.c.bin
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	md5sum=$(mpih recv --tag 1 0 | md5sum | cut -d' ' -f1)
+	if [ "$md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data from multiple files differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
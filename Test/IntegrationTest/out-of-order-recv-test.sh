@@ -0,0 +1,65 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Rank 0 starts a bulk transfer on tag 1 before sending a
+# short message on tag 2. Rank 1 receives the streams in
+# the opposite order, so the bulk data must be held by the
+# receiving daemon until its 'mpih recv' shows up.
+
+data_file=ooo.$MPIH_RANK.bin
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	md5sum $data_file | cut -d' ' -f1 | mpih send --tag 3 1
+	mpih send --tag 1 1 $data_file &
+	sleep 1
+	echo "second message" | mpih send --tag 2 1
+	wait
+else
+	correct_md5sum=$(mpih recv --tag 3 0)
+	msg=$(mpih recv --tag 2 0)
+	md5sum=$(mpih recv --tag 1 0 | md5sum | cut -d' ' -f1)
+
+	if [ "$msg" != "second message" ]; then
+		stderr "FAILED: received message '$msg'"
+		exit 1
+	fi
+	if [ "$md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: bulk data differs from sent data!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
@@ -0,0 +1,118 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# A high priority control message is sent while a low
+# priority bulk transfer to the same rank is under way, and
+# must arrive well before the bulk transfer ends. A third,
+# rate-limited stream must not finish faster than its rate
+# allows.
+
+# (the rate keeps the bulk transfer going for about 2s)
+bulk_rate=$(($(numfmt --from=iec $size) / 2))
+
+if [ $MPIH_RANK -eq 0 ]; then
+	data_file=$(mktemp priority.XXXXXX)
+	trap 'rm -f $data_file' EXIT
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	{
+		md5sum < $data_file
+		head -c 2M $data_file | md5sum
+	} | cut -d' ' -f1 | mpih send --tag 4 1
+
+	mpih send --tag 1 --priority low --rate $bulk_rate 1 $data_file &
+	# wait until the receiver has part of the bulk data
+	mpih recv --tag 5 1 > /dev/null
+	echo "control message" | mpih send --tag 2 --priority high 1 &
+	head -c 2M $data_file | mpih send --tag 3 --rate 2M 1 &
+	wait
+else
+	out_dir=$(mktemp -d priority.XXXXXX)
+	trap 'rm -rf $out_dir' EXIT
+	checksums=($(mpih recv --tag 4 0))
+	correct_md5sum=${checksums[0]}
+	correct_limited_md5sum=${checksums[1]}
+
+	(
+		mpih recv --tag 1 0 | {
+			dd bs=64K count=16 iflag=fullblock 2>/dev/null
+			echo started | mpih send --tag 5 0
+			cat
+		} | md5sum | cut -d' ' -f1 > $out_dir/bulk_md5sum
+		date +%s%N > $out_dir/bulk_end
+	) &
+	bulk_pid=$!
+
+	control_msg=$(mpih recv --tag 2 0)
+	control_end=$(date +%s%N)
+
+	start=$(date +%s%N)
+	limited_md5sum=$(mpih recv --tag 3 0 | md5sum | cut -d' ' -f1)
+	end=$(date +%s%N)
+	elapsed_ms=$((($end - $start) / 1000000))
+
+	wait $bulk_pid
+	bulk_md5sum=$(cat $out_dir/bulk_md5sum)
+	bulk_end=$(cat $out_dir/bulk_end)
+
+	if [ "$bulk_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: bulk data differs from sent data!"
+		exit 1
+	fi
+	if [ "$control_msg" != "control message" ]; then
+		stderr "FAILED: received control message '$control_msg'"
+		exit 1
+	fi
+	# the control message must not wait for the bulk data
+	lead_ms=$((($bulk_end - $control_end) / 1000000))
+	stderr "control message arrived ${lead_ms}ms before bulk data"
+	if [ $lead_ms -lt 500 ]; then
+		stderr "FAILED: control message arrived only ${lead_ms}ms" \
+			"before the end of the bulk transfer"
+		exit 1
+	fi
+	if [ "$limited_md5sum" != "$correct_limited_md5sum" ]; then
+		stderr "FAILED: rate-limited data differs from sent data!"
+		exit 1
+	fi
+	# 2M at 2M/sec should take about a second; allow
+	# for data sent before we started the clock
+	if [ $elapsed_ms -lt 500 ]; then
+		stderr "FAILED: rate-limited stream took only ${elapsed_ms}ms"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
@@ -0,0 +1,68 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# The same data goes over three streams, each received
+# with 'mpih recv --output'. The daemon sends the regular
+# file (tag 1) straight from the page cache and announces
+# its size, so the receiving daemon writes it to the
+# output file with space allocated up front. The size of
+# piped data (tag 2) is not known in advance, and tag 3
+# goes through both daemon sockets.
+
+data_file=output.$MPIH_RANK.bin
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	md5sum $data_file | cut -d' ' -f1 | mpih send --tag 4 1
+	mpih send --tag 1 1 $data_file
+	cat $data_file | mpih send --tag 2 1
+	mpih send --via-socket --tag 3 1 < $data_file
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	for tag in 1 2 3; do
+		opts=
+		if [ $tag -eq 3 ]; then
+			opts=--via-socket
+		fi
+		mpih recv $opts --tag $tag --output output.$tag.out 0
+		md5sum=$(md5sum output.$tag.out | cut -d' ' -f1)
+		if [ "$md5sum" != "$correct_md5sum" ]; then
+			stderr "FAILED: data received on tag $tag differs!"
+			exit 1
+		fi
+	done
+	stderr "PASSED!"
+fi
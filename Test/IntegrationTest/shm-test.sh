@@ -0,0 +1,62 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# Stream data through shared-memory rings on both ends,
+# from a pipe (tag 1) and from a regular file (tag 2).
+
+data_file=shm.$MPIH_RANK.bin
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	md5sum $data_file | cut -d' ' -f1 | mpih send --tag 3 1
+	cat $data_file | mpih send --shm --tag 1 1
+	mpih send --shm --tag 2 1 $data_file
+else
+	correct_md5sum=$(mpih recv --tag 3 0)
+	pipe_md5sum=$(mpih recv --shm --tag 1 0 | md5sum | cut -d' ' -f1)
+	mpih recv --shm --tag 2 0 > shm.1.out
+	file_md5sum=$(md5sum shm.1.out | cut -d' ' -f1)
+
+	if [ "$pipe_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data sent from pipe differs!"
+		exit 1
+	fi
+	if [ "$file_md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: data sent from file differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
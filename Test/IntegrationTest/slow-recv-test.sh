@@ -0,0 +1,59 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# The receiver starts reading only after a delay, so that
+# the daemon must spool incoming data to disk.
+
+# (other tests run this script at the same time, in the
+# same directory)
+if [ $MPIH_RANK -eq 0 ]; then
+	data_file=$(mktemp slow-recv.XXXXXX)
+	trap 'rm -f $data_file' EXIT
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	md5sum < $data_file | cut -d' ' -f1 | mpih send --tag 1 1
+	mpih send 1 $data_file
+else
+	correct_md5sum=$(mpih recv --tag 1 0)
+	my_md5sum=$(mpih recv 0 | (sleep 2; md5sum) | cut -d' ' -f1)
+
+	if [ "$my_md5sum" == "$correct_md5sum" ]; then
+		stderr "PASSED: received data identical to sent data!"
+	else
+		stderr "FAILED: received data differs from sent data!"
+		exit 1
+	fi
+fi
@@ -0,0 +1,39 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# 'mpih run' gets MPIH_RANK and MPIH_SIZE from the daemon's
+# readiness message, rather than by querying the daemon.
+rank=$(mpih rank)
+size=$(mpih size)
+if [ "$rank" -ne "$MPIH_RANK" ] || [ "$size" -ne "$MPIH_SIZE" ]; then
+	stderr "FAILED: MPIH_RANK/MPIH_SIZE ($MPIH_RANK/$MPIH_SIZE)" \
+		"differ from daemon ($rank/$size)!"
+	exit 1
+fi
+
+# The daemon still creates the PID file, next to its socket.
+if [ "$(dirname "$MPIH_PIDFILE")" != "$(dirname "$MPIH_SOCKET")" ]; then
+	stderr "FAILED: PID file $MPIH_PIDFILE is not in the daemon's" \
+		"temp dir!"
+	exit 1
+fi
+if ! kill -0 "$(cat "$MPIH_PIDFILE")"; then
+	stderr "FAILED: PID file doesn't name a running daemon!"
+	exit 1
+fi
+
+stderr "PASSED!"
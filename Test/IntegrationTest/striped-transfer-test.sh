@@ -0,0 +1,61 @@
+#!/bin/bash
+set -eu -o pipefail
+
+#------------------------------------------------------------
+# helper functions
+#------------------------------------------------------------
+
+stderr() {
+	echo "$@" >&2
+}
+
+#------------------------------------------------------------
+# argument checking
+#------------------------------------------------------------
+
+if [ "$MPIH_SIZE" -ne 2 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "error: this MPI script must be run with exactly 2 processes"
+	fi
+	exit 1
+fi
+if [ $# -lt 1 ]; then
+	if [ "$MPIH_RANK" -eq 0 ]; then
+		stderr "Usage: $(basename $0) <size>"
+		stderr "Example: $(basename $0) 16M"
+	fi
+	exit 1
+fi
+
+size=$1; shift
+
+#------------------------------------------------------------
+# test
+#------------------------------------------------------------
+
+stderr "log for rank $MPIH_RANK: $MPIH_LOG"
+
+# A file of <size> bytes goes over 4 stripes (tag 1),
+# and a file that is too small to fill more than one
+# stripe goes over 4 stripes on tag 2.
+
+data_file=striped.$MPIH_RANK.bin
+small_file=striped-small.$MPIH_RANK.bin
+if [ $MPIH_RANK -eq 0 ]; then
+	dd if=/dev/urandom of=$data_file count=1 bs=$size 2>/dev/null
+	dd if=/dev/urandom of=$small_file count=1 bs=1000 2>/dev/null
+	cat $data_file $small_file | md5sum | cut -d' ' -f1 \
+		| mpih send --tag 4 1
+	mpih send --parallel 4 --tag 1 1 $data_file
+	mpih send --parallel 4 --tag 2 1 $small_file
+else
+	correct_md5sum=$(mpih recv --tag 4 0)
+	mpih recv --parallel 4 --tag 1 --output striped.1.out 0
+	mpih recv --parallel 4 --tag 2 --output striped.2.out 0
+	md5sum=$(cat striped.1.out striped.2.out | md5sum | cut -d' ' -f1)
+	if [ "$md5sum" != "$correct_md5sum" ]; then
+		stderr "FAILED: striped data differs!"
+		exit 1
+	fi
+	stderr "PASSED!"
+fi
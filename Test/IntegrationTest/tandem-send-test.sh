@@ -35,10 +35,10 @@ n=$1; shift
 
 stderr "log for rank $MPIH_RANK: $MPIH_LOG"
 
-data_file=data.txt
+data_file=data.$MPIH_RANK.txt
 recv1_file=recv1.txt
 recv2_file=recv2.txt
-seq 1 $n > data.txt
+seq 1 $n > $data_file
 
 if [ $MPIH_RANK -eq 0 ]; then
 	mpih send 1 $data_file
@@ -35,17 +35,22 @@ size=$1; shift
 
 echo "rank $MPIH_RANK log: $MPIH_LOG"
 
-data_file=random.bin
+# (other tests run this script at the same time, in the
+# same directory)
 if [ $MPIH_RANK -eq 0 ]; then
+	data_file=$(mktemp transfer.XXXXXX)
+	trap 'rm -f $data_file' EXIT
 	dd if=/dev/urandom count=1 bs=$size > $data_file 2>/dev/null
-	mpih send 1 random.bin
+	md5sum < $data_file | cut -d' ' -f1 | mpih send --tag 1 1
+	mpih send 1 $data_file
 else
+	correct_md5sum=$(mpih recv --tag 1 0)
 	my_md5sum=$(mpih recv 0 | md5sum | cut -d' ' -f1)
-	correct_md5sum=$(md5sum $data_file | cut -d' ' -f1)
 
 	if [ "$my_md5sum" == "$correct_md5sum" ]; then
 		stderr "PASSED: received data identical to sent data!"
 	else
 		stderr "FAILED: received data differs from sent data!"
+		exit 1
 	fi
 fi
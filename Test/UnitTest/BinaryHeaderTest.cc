@@ -0,0 +1,54 @@
+#include "IO/BinaryHeader.h"
+#include <gtest/gtest.h>
+
+TEST(BinaryHeader, RequestRoundTrip)
+{
+	BinaryRequest request;
+	request.opcode = OP_SEND;
+	request.flags = BINARY_FLAG_FD | BINARY_FLAG_RANGE;
+	request.priority = 2;
+	request.rank = 3;
+	request.tag = 12345;
+	request.stripe = 7;
+	request.rate = 1ULL << 40;
+	request.rangeOffset = 1LL << 33;
+	request.rangeLength = 4096;
+
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+	EXPECT_EQ(BINARY_HEADER_MAGIC, (unsigned char)buf[0]);
+
+	BinaryRequest decoded = decode_binary_request(buf);
+	EXPECT_EQ(BINARY_HEADER_VERSION, decoded.version);
+	EXPECT_EQ(OP_SEND, decoded.opcode);
+	EXPECT_EQ(request.flags, decoded.flags);
+	EXPECT_EQ(2, decoded.priority);
+	EXPECT_EQ(3, decoded.rank);
+	EXPECT_EQ(12345, decoded.tag);
+	EXPECT_EQ(7, decoded.stripe);
+	EXPECT_EQ(request.rate, decoded.rate);
+	EXPECT_EQ(request.rangeOffset, decoded.rangeOffset);
+	EXPECT_EQ(4096u, decoded.rangeLength);
+}
+
+TEST(BinaryHeader, NoStripe)
+{
+	BinaryRequest request;
+	char buf[BINARY_REQUEST_SIZE];
+	encode_binary_request(buf, request);
+	EXPECT_EQ(-1, decode_binary_request(buf).stripe);
+}
+
+TEST(BinaryHeader, Reply)
+{
+	char buf[BINARY_REPLY_SIZE];
+	encode_binary_reply(buf, REPLY_VALUE, -5);
+	HeaderReply code;
+	int32_t value;
+	ASSERT_TRUE(decode_binary_reply(buf, code, value));
+	EXPECT_EQ(REPLY_VALUE, code);
+	EXPECT_EQ(-5, value);
+
+	// a text reply is not a binary one
+	EXPECT_FALSE(decode_binary_reply("NOFD\n\0\0\0", code, value));
+}
@@ -0,0 +1,96 @@
+#include "Command/client/dirindex.h"
+#include <gtest/gtest.h>
+#include <string>
+
+static DirEntry entry(char type, const std::string& name,
+	uint64_t size = 0)
+{
+	DirEntry e;
+	e.type = type;
+	e.name = name;
+	e.size = size;
+	e.mode = 0644;
+	e.mtime_sec = 1234567890;
+	e.mtime_nsec = 42;
+	return e;
+}
+
+TEST(DirIndex, RoundTrip)
+{
+	DirIndex index;
+	index.lanes = 3;
+	index.entries.push_back(entry(DIR_ENTRY_DIR, "sub"));
+	index.entries.push_back(entry(DIR_ENTRY_FILE, "sub/a", 1000));
+	DirEntry link = entry(DIR_ENTRY_LINK, "b");
+	link.target = "sub/a";
+	index.entries.push_back(link);
+
+	DirIndex decoded;
+	ASSERT_TRUE(decode_dir_index(encode_dir_index(index), decoded, 16));
+	ASSERT_EQ(3u, decoded.lanes);
+	ASSERT_EQ(3u, decoded.entries.size());
+	for (size_t i = 0; i < 3; ++i) {
+		EXPECT_EQ(index.entries[i].type, decoded.entries[i].type);
+		EXPECT_EQ(index.entries[i].name, decoded.entries[i].name);
+		EXPECT_EQ(index.entries[i].size, decoded.entries[i].size);
+		EXPECT_EQ(index.entries[i].mode, decoded.entries[i].mode);
+		EXPECT_EQ(index.entries[i].mtime_sec, decoded.entries[i].mtime_sec);
+		EXPECT_EQ(index.entries[i].mtime_nsec, decoded.entries[i].mtime_nsec);
+	}
+	EXPECT_EQ("sub/a", decoded.entries[2].target);
+}
+
+TEST(DirIndex, RejectsBadIndex)
+{
+	DirIndex index, decoded;
+	index.entries.push_back(entry(DIR_ENTRY_FILE, "a", 10));
+	std::string encoded = encode_dir_index(index);
+
+	EXPECT_FALSE(decode_dir_index(encoded.substr(0, encoded.size() - 1),
+		decoded, 16));
+	EXPECT_FALSE(decode_dir_index(encoded + "x", decoded, 16));
+	EXPECT_FALSE(decode_dir_index("garbage", decoded, 16));
+
+	index.lanes = 17;
+	EXPECT_FALSE(decode_dir_index(encode_dir_index(index), decoded, 16));
+
+	index.lanes = 1;
+	index.entries[0].name = "../a";
+	EXPECT_FALSE(decode_dir_index(encode_dir_index(index), decoded, 16));
+	index.entries[0].name = "/a";
+	EXPECT_FALSE(decode_dir_index(encode_dir_index(index), decoded, 16));
+}
+
+TEST(DirIndex, DealsChunksToLanes)
+{
+	DirIndex index;
+	index.lanes = 3;
+	index.entries.push_back(entry(DIR_ENTRY_FILE, "small", 100));
+	index.entries.push_back(entry(DIR_ENTRY_FILE, "large",
+		2 * DIR_CHUNK_SIZE + 1));
+	index.entries.push_back(entry(DIR_ENTRY_FILE, "medium",
+		DIR_LARGE_FILE_SIZE));
+
+	EXPECT_TRUE(dir_entry_packed(index, index.entries[0]));
+	EXPECT_FALSE(dir_entry_packed(index, index.entries[1]));
+
+	std::vector<std::vector<DirChunk> > lanes = dir_chunks(index);
+	ASSERT_EQ(3u, lanes.size());
+	EXPECT_TRUE(lanes[0].empty());
+	ASSERT_EQ(2u, lanes[1].size());
+	ASSERT_EQ(2u, lanes[2].size());
+
+	EXPECT_EQ(1u, lanes[1][0].entry);
+	EXPECT_EQ(0u, lanes[1][0].offset);
+	EXPECT_EQ(DIR_CHUNK_SIZE, lanes[1][0].length);
+	EXPECT_EQ(DIR_CHUNK_SIZE, lanes[2][0].offset);
+	EXPECT_EQ(2 * DIR_CHUNK_SIZE, lanes[1][1].offset);
+	EXPECT_EQ(1u, lanes[1][1].length);
+	EXPECT_EQ(2u, lanes[2][1].entry);
+	EXPECT_EQ(DIR_LARGE_FILE_SIZE, lanes[2][1].length);
+
+	// with a single lane, everything is packed
+	index.lanes = 1;
+	EXPECT_TRUE(dir_entry_packed(index, index.entries[1]));
+	EXPECT_TRUE(dir_chunks(index)[0].empty());
+}
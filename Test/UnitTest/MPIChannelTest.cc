@@ -31,3 +31,24 @@ TEST(MPIChannel, MPIChannelManager)
 	result = manager.requestChannel(connectionID2, channel);
 	ASSERT_EQ(GRANTED, result);
 }
+
+TEST(MPIChannel, RemoteChannel)
+{
+	MPIChannelManager& manager = MPIChannelManager::getInstance();
+
+	/* same rank and tag, but in our job and in the remote job */
+	MPIChannel local(RECV, 3, 7);
+	MPIChannel remote(RECV, 3, 7, true);
+	ASSERT_FALSE(local == remote);
+	ASSERT_EQ("(RECV,3,7,REMOTE)", remote.str());
+
+	/* streams on the two channels don't wait for each other */
+	ASSERT_EQ(GRANTED, manager.requestChannel(11, local));
+	ASSERT_EQ(GRANTED, manager.requestChannel(12, remote));
+	ASSERT_EQ(QUEUED, manager.requestChannel(13, remote));
+
+	manager.releaseChannel(11, local);
+	manager.releaseChannel(12, remote);
+	ASSERT_EQ(GRANTED, manager.requestChannel(13, remote));
+	manager.releaseChannel(13, remote);
+}
@@ -0,0 +1,113 @@
+#include "Command/init/MappedFile.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+/** Create a temp file holding 'data', open for reading */
+static int temp_file(const std::string& data)
+{
+	char path[] = "/tmp/MappedFileTest.XXXXXX";
+	int fd = mkstemp(path);
+	EXPECT_GE(fd, 0);
+	unlink(path);
+	EXPECT_EQ((ssize_t)data.size(), write(fd, data.data(), data.size()));
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+/** Read all of 'file', releasing 'step' bytes at a time */
+static std::string read_all(MappedFile& file, size_t step)
+{
+	std::string result;
+	while (file.readable() > 0) {
+		size_t len = std::min(step, file.readable());
+		result.append(file.readPtr(), len);
+		EXPECT_TRUE(file.release(len));
+	}
+	return result;
+}
+
+TEST(MappedFile, ReadsWholeFile)
+{
+	std::string data("hello, world");
+	MappedFile* file = MappedFile::open(temp_file(data));
+	ASSERT_TRUE(file != NULL);
+	ASSERT_EQ(data.size(), file->remaining());
+	ASSERT_EQ(data, read_all(*file, 5));
+	ASSERT_EQ(0u, file->remaining());
+	delete file;
+}
+
+TEST(MappedFile, CrossesWindows)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	std::string data;
+	for (size_t i = 0; i < 3 * page + 10; ++i)
+		data.push_back('a' + i % 26);
+	MappedFile* file = MappedFile::open(temp_file(data), page);
+	ASSERT_TRUE(file != NULL);
+	/* chunks stop at the end of each window */
+	ASSERT_EQ(page, file->readable());
+	ASSERT_EQ(data, read_all(*file, 1000));
+	delete file;
+}
+
+TEST(MappedFile, StartsAtFileOffset)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	std::string data(2 * page, 'x');
+	data.replace(page + 5, 3, "abc");
+	int fd = temp_file(data);
+	int fd2 = dup(fd);
+	lseek(fd, page + 5, SEEK_SET);
+
+	MappedFile* file = MappedFile::open(fd, page);
+	ASSERT_TRUE(file != NULL);
+	ASSERT_EQ(page - 5, file->remaining());
+	ASSERT_EQ(std::string("abc"), std::string(file->readPtr(), 3));
+	ASSERT_TRUE(file->release(3));
+
+	/* the shared file offset moves past what we sent */
+	delete file;
+	ASSERT_EQ((off_t)page + 8, lseek(fd2, 0, SEEK_CUR));
+	close(fd2);
+}
+
+TEST(MappedFile, EmptyFile)
+{
+	MappedFile* file = MappedFile::open(temp_file(""));
+	ASSERT_TRUE(file != NULL);
+	ASSERT_EQ(0u, file->readable());
+	ASSERT_EQ(0u, file->remaining());
+	delete file;
+}
+
+TEST(MappedFile, RejectsPipe)
+{
+	int fds[2];
+	ASSERT_EQ(0, pipe(fds));
+	ASSERT_TRUE(MappedFile::open(fds[0]) == NULL);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+TEST(MappedFile, StopsAtTruncation)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	std::string data(3 * page, 'x');
+	int fd = temp_file(data);
+	MappedFile* file = MappedFile::open(dup(fd), page);
+	ASSERT_TRUE(file != NULL);
+	ASSERT_TRUE(file->release(page / 2));
+
+	/* nothing more is read from the truncated file */
+	ASSERT_EQ(0, ftruncate(fd, page));
+	ASSERT_FALSE(file->release(page / 2));
+	ASSERT_EQ(ENODATA, errno);
+	ASSERT_EQ(0u, file->readable());
+	ASSERT_EQ(0u, file->remaining());
+	delete file;
+	close(fd);
+}
@@ -0,0 +1,23 @@
+#include "IO/MuxProtocol.h"
+#include <gtest/gtest.h>
+
+TEST(MuxProtocol, HeaderRoundTrip)
+{
+	char buf[MUX_HEADER_SIZE];
+	encode_mux_header(buf, MUX_CREDIT, 0xdeadbeef, MUX_MAX_PAYLOAD);
+	MuxFrameHeader header = decode_mux_header(buf);
+	EXPECT_EQ(MUX_CREDIT, header.type);
+	EXPECT_EQ(0xdeadbeefu, header.stream);
+	EXPECT_EQ(MUX_MAX_PAYLOAD, header.length);
+}
+
+TEST(MuxProtocol, LittleEndian)
+{
+	char buf[MUX_HEADER_SIZE];
+	encode_mux_header(buf, MUX_DATA, 0x01020304, 5);
+	EXPECT_EQ(MUX_DATA, buf[0]);
+	EXPECT_EQ(0x04, buf[1]);
+	EXPECT_EQ(0x01, buf[4]);
+	EXPECT_EQ(5, buf[5]);
+	EXPECT_EQ(0, buf[8]);
+}
@@ -0,0 +1,88 @@
+#include "Command/init/SendScheduler.h"
+#include <gtest/gtest.h>
+
+TEST(SendScheduler, WeightedFairQueueing)
+{
+	SendScheduler& scheduler = SendScheduler::getInstance();
+	size_t id;
+
+	/* a bulk stream and a small high priority message */
+	size_t bulk = 1, small = 2;
+	scheduler.addStream(bulk, PRIORITY_LOW, 0, 0);
+	scheduler.addStream(small, PRIORITY_HIGH, 0, 0);
+
+	scheduler.enqueue(bulk, 4*1024*1024);
+	scheduler.enqueue(small, 100);
+
+	/* small message should overtake the queued bulk data */
+	ASSERT_TRUE(scheduler.dispatch(id, 0));
+	ASSERT_EQ(small, id);
+	ASSERT_TRUE(scheduler.dispatch(id, 0));
+	ASSERT_EQ(bulk, id);
+	ASSERT_FALSE(scheduler.dispatch(id, 0));
+
+	scheduler.complete(small);
+	scheduler.complete(bulk);
+	ASSERT_EQ(0u, scheduler.slotsInUse());
+
+	scheduler.removeStream(bulk);
+	scheduler.removeStream(small);
+}
+
+TEST(SendScheduler, SlotLimit)
+{
+	SendScheduler& scheduler = SendScheduler::getInstance();
+	size_t id;
+
+	for (size_t i = 0; i <= MAX_SEND_SLOTS; ++i) {
+		scheduler.addStream(i, PRIORITY_NORMAL, 0, 0);
+		scheduler.enqueue(i, 1024);
+	}
+
+	for (size_t i = 0; i < MAX_SEND_SLOTS; ++i)
+		ASSERT_TRUE(scheduler.dispatch(id, 0));
+
+	/* all slots in use */
+	ASSERT_FALSE(scheduler.dispatch(id, 0));
+
+	/* removing a stream releases its slot */
+	scheduler.removeStream(0);
+	ASSERT_TRUE(scheduler.dispatch(id, 0));
+	ASSERT_EQ(MAX_SEND_SLOTS, scheduler.slotsInUse());
+
+	for (size_t i = 1; i <= MAX_SEND_SLOTS; ++i)
+		scheduler.removeStream(i);
+	ASSERT_EQ(0u, scheduler.slotsInUse());
+}
+
+TEST(SendScheduler, RateLimit)
+{
+	SendScheduler& scheduler = SendScheduler::getInstance();
+	size_t id;
+
+	/* 1000 bytes/sec, so bucket holds MIN_RATE_BURST bytes */
+	size_t stream = 1;
+	scheduler.addStream(stream, PRIORITY_NORMAL, 1000, 0);
+	ASSERT_EQ(MIN_RATE_BURST,
+		scheduler.maxChunkSize(stream, 1024*1024));
+
+	/* first chunk drains the bucket */
+	scheduler.enqueue(stream, MIN_RATE_BURST);
+	ASSERT_TRUE(scheduler.dispatch(id, 0));
+	scheduler.complete(stream);
+
+	/* second chunk puts the bucket into debt */
+	scheduler.enqueue(stream, MIN_RATE_BURST);
+	ASSERT_TRUE(scheduler.dispatch(id, 0));
+	scheduler.complete(stream);
+
+	/* third chunk must wait for the debt to be repaid */
+	scheduler.enqueue(stream, MIN_RATE_BURST);
+	ASSERT_FALSE(scheduler.dispatch(id, 1.0));
+	double delay = scheduler.nextRefillDelay(1.0);
+	ASSERT_NEAR(MIN_RATE_BURST / 1000.0 - 1.0, delay, 1e-6);
+	ASSERT_TRUE(scheduler.dispatch(id, 1.0 + delay));
+	ASSERT_EQ(stream, id);
+
+	scheduler.removeStream(stream);
+}
@@ -0,0 +1,113 @@
+#include "IO/ShmRing.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+
+/** Map a second view of 'ring', as the other process would */
+static ShmRing* attach_copy(const ShmRing& ring)
+{
+	int fds[ShmRing::NUM_FDS];
+	for (int i = 0; i < ShmRing::NUM_FDS; ++i)
+		fds[i] = dup(ring.fds()[i]);
+	return ShmRing::attach(fds);
+}
+
+/** Return true if doorbell 'fd' has been rung (and clear it) */
+static bool rung(int fd)
+{
+	eventfd_t value;
+	return eventfd_read(fd, &value) == 0;
+}
+
+TEST(ShmRing, CreateRejectsBadSize)
+{
+	ASSERT_TRUE(ShmRing::create(0) == NULL);
+	ASSERT_TRUE(ShmRing::create(sysconf(_SC_PAGESIZE) + 1) == NULL);
+}
+
+TEST(ShmRing, PublishAndRelease)
+{
+	const size_t size = sysconf(_SC_PAGESIZE);
+	ShmRing* producer = ShmRing::create(size);
+	ASSERT_TRUE(producer != NULL);
+	ShmRing* consumer = attach_copy(*producer);
+	ASSERT_TRUE(consumer != NULL);
+	ASSERT_EQ(size, consumer->size());
+
+	ASSERT_EQ(0u, consumer->readable());
+	ASSERT_EQ(size, producer->writable());
+
+	memcpy(producer->writePtr(), "hello", 5);
+	producer->publish(5);
+	ASSERT_EQ(5u, consumer->readable());
+	ASSERT_EQ(std::string("hello"),
+		std::string(consumer->readPtr(), 5));
+
+	consumer->release(5);
+	ASSERT_EQ(0u, consumer->readable());
+	ASSERT_EQ(size, producer->writable());
+
+	delete consumer;
+	delete producer;
+}
+
+TEST(ShmRing, WrapAround)
+{
+	const size_t size = sysconf(_SC_PAGESIZE);
+	ShmRing* producer = ShmRing::create(size);
+	ASSERT_TRUE(producer != NULL);
+	ShmRing* consumer = attach_copy(*producer);
+	ASSERT_TRUE(consumer != NULL);
+
+	/* move the read/write position near the end of the ring */
+	producer->publish(size - 3);
+	consumer->release(size - 3);
+
+	/* a run that crosses the end is still contiguous */
+	std::string data("wrapped around");
+	ASSERT_GE(producer->writable(), data.size());
+	memcpy(producer->writePtr(), data.data(), data.size());
+	producer->publish(data.size());
+	ASSERT_EQ(data.size(), consumer->readable());
+	ASSERT_EQ(data, std::string(consumer->readPtr(), data.size()));
+	consumer->release(data.size());
+
+	delete consumer;
+	delete producer;
+}
+
+TEST(ShmRing, Doorbells)
+{
+	const size_t size = sysconf(_SC_PAGESIZE);
+	ShmRing* producer = ShmRing::create(size);
+	ASSERT_TRUE(producer != NULL);
+	ShmRing* consumer = attach_copy(*producer);
+	ASSERT_TRUE(consumer != NULL);
+
+	/* no doorbell unless the consumer asks for one */
+	producer->publish(1);
+	ASSERT_FALSE(rung(consumer->readerBell()));
+	ASSERT_TRUE(consumer->armReader());
+	consumer->release(1);
+
+	/* consumer is woken once its batch is ready */
+	ASSERT_FALSE(consumer->armReader(10));
+	producer->publish(5);
+	ASSERT_FALSE(rung(consumer->readerBell()));
+	producer->publish(5);
+	ASSERT_TRUE(rung(consumer->readerBell()));
+	/* only once per arm */
+	producer->publish(1);
+	ASSERT_FALSE(rung(consumer->readerBell()));
+
+	/* producer is woken once there is room */
+	ASSERT_FALSE(producer->armWriter(size));
+	consumer->release(10);
+	ASSERT_FALSE(rung(producer->writerBell()));
+	consumer->release(1);
+	ASSERT_TRUE(rung(producer->writerBell()));
+
+	delete consumer;
+	delete producer;
+}
@@ -0,0 +1,61 @@
+#include "IO/SocketUtil.h"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/** Return true if 'fd' is an open file descriptor */
+static bool is_open(int fd)
+{
+	return fcntl(fd, F_GETFD) >= 0;
+}
+
+TEST(SocketUtil, PassFds)
+{
+	int s[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, s));
+
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	ASSERT_TRUE(UnixSocket::send_fds(s[0], pipe_fds, 2));
+
+	int received[2];
+	ASSERT_TRUE(UnixSocket::recv_fds(s[1], received, 2));
+	ASSERT_TRUE(is_open(received[0]));
+	ASSERT_TRUE(is_open(received[1]));
+
+	for (int i = 0; i < 2; ++i) {
+		close(pipe_fds[i]);
+		close(received[i]);
+	}
+	close(s[0]);
+	close(s[1]);
+}
+
+TEST(SocketUtil, RejectExtraFds)
+{
+	int s[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, s));
+
+	/* two descriptors fit in the padding of CMSG_SPACE(sizeof(int)) */
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	ASSERT_TRUE(UnixSocket::send_fds(s[0], pipe_fds, 2));
+	int first_free = dup(0);
+	close(first_free);
+
+	/* the descriptor after 'fd' must be left alone */
+	struct { int fd; int guard; } expected = { -1, 12345 };
+	ASSERT_EQ(-1, UnixSocket::recv_fds(s[1], &expected.fd, 1) ?
+		expected.fd : -1);
+	ASSERT_EQ(12345, expected.guard);
+
+	/* and any descriptors that did arrive are closed */
+	ASSERT_FALSE(is_open(first_free));
+	ASSERT_FALSE(is_open(first_free + 1));
+
+	for (int i = 0; i < 2; ++i)
+		close(pipe_fds[i]);
+	close(s[0]);
+	close(s[1]);
+}
@@ -0,0 +1,78 @@
+#include "Command/init/Spool.h"
+#include <gtest/gtest.h>
+#include <event2/buffer.h>
+#include <string>
+#include <sys/stat.h>
+
+TEST(Spool, AppendAndRead)
+{
+	Spool spool("/tmp", 0);
+	ASSERT_TRUE(spool.empty());
+
+	/* data should come back out in the order it went in */
+	spool.append("hello, ", 7);
+	struct evbuffer* input = evbuffer_new();
+	evbuffer_add(input, "world", 5);
+	spool.append(input);
+	ASSERT_EQ(0u, evbuffer_get_length(input));
+	ASSERT_EQ(12u, spool.size());
+
+	char buffer[8];
+	ASSERT_EQ(3u, spool.read(buffer, 3));
+	ASSERT_EQ(std::string("hel"), std::string(buffer, 3));
+
+	/* read remaining data via memory mapping */
+	struct evbuffer* output = evbuffer_new();
+	ASSERT_EQ(9u, spool.read(output, SPOOL_READ_SIZE));
+	ASSERT_TRUE(spool.empty());
+	std::string s((char*)evbuffer_pullup(output, -1),
+		evbuffer_get_length(output));
+	ASSERT_EQ(std::string("lo, world"), s);
+
+	/* mapped data must stay valid after the spool is reused */
+	spool.append("again", 5);
+	ASSERT_EQ(5u, spool.size());
+	ASSERT_EQ(std::string("lo, world"),
+		std::string((char*)evbuffer_pullup(output, -1), 9));
+
+	evbuffer_free(input);
+	evbuffer_free(output);
+}
+
+/** Disk space allocated to the spool file (bytes) */
+static off_t allocated(const Spool& spool)
+{
+	struct stat st;
+	EXPECT_EQ(0, fstat(spool.fd(), &st));
+	return (off_t)st.st_blocks * 512;
+}
+
+TEST(Spool, FreesSpaceAsDataIsRead)
+{
+	Spool spool("/tmp", 1);
+	std::string block(SPOOL_READ_SIZE, 'x');
+	for (int i = 0; i < 8; ++i)
+		spool.append(block.data(), block.size());
+	off_t full = allocated(spool);
+	ASSERT_GE(full, 8 * (off_t)SPOOL_READ_SIZE);
+
+	/*
+	 * a slow consumer: libevent still holds the last
+	 * mapping whenever we refill, so the spool is
+	 * never drained all at once
+	 */
+	struct evbuffer* output = evbuffer_new();
+	for (int i = 0; i < 6; ++i) {
+		ASSERT_EQ(SPOOL_READ_SIZE, spool.read(output, SPOOL_READ_SIZE));
+		evbuffer_drain(output, SPOOL_READ_SIZE / 2);
+	}
+	ASSERT_FALSE(spool.empty());
+	ASSERT_LE(allocated(spool), full - 2 * (off_t)SPOOL_READ_SIZE);
+
+	/* data that is still mapped stays intact */
+	ASSERT_EQ(6 * SPOOL_READ_SIZE / 2, evbuffer_get_length(output));
+	std::string s((char*)evbuffer_pullup(output, -1),
+		evbuffer_get_length(output));
+	ASSERT_EQ(std::string(s.size(), 'x'), s);
+	evbuffer_free(output);
+}